@@ -2,6 +2,7 @@
 
 #ifndef WIN32
 #include <sys/mman.h>
+#include <unistd.h>
 #else
 #include "windows_mman.h"
 #endif
@@ -14,6 +15,7 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 
@@ -28,33 +30,345 @@
 #define DATA_SECTION_SEPARATOR_SIZE (16)
 
 #define SHA1_KEY_LENGTH (27)
+#define EMPTY_RECORD_HASH (0x9e3779b97f4a7c15ULL)
+#define ALIAS_RECORD_HASH (0xc2b2ae3d27d4eb4fULL)
 
 #define MERGE_KEY_SIZE (57)
 
+/* How much of a frozen tree we read before telling the kernel it can drop
+ * those pages. */
+#define THAW_RELEASE_SIZE (1024 * 1024)
+
+/* Format 1 freezes its data as hashes of at most this many records. */
+#define FREEZE_DATA_BATCH_SIZE (1024)
+
+/* A 128-bit integer takes at most 19 bytes as a varint. */
+#define VARINT_MAX_LENGTH (19)
+
+/* The network stream of a format 2 freeze is indexed every this many
+ * networks. */
+#define NETWORK_INDEX_BLOCK_SIZE (1024)
+
+/* When thawing with several workers, each network goes in the subtree this
+ * many bits below the first empty record on its path. */
+#define THAW_SLOT_BITS (8)
+
+/* An insert journal starts with this magic string, a format version, the
+ * tree's IP version, and the token of the frozen tree it belongs to. */
+#define JOURNAL_MAGIC "MMDBWJNL"
+#define JOURNAL_MAGIC_LENGTH (8)
+#define JOURNAL_VERSION (1)
+#define JOURNAL_TOKEN_LENGTH (16)
+#define JOURNAL_HEADER_LENGTH (JOURNAL_MAGIC_LENGTH + 2 + JOURNAL_TOKEN_LENGTH)
+
+/* Exported ranges are collected in a buffer of this size before they are
+ * written. */
+#define EXPORT_BUFFER_SIZE (1024 * 1024)
+#define SEARCH_TREE_BUFFER_SIZE (64 * 1024)
+
+typedef enum {
+    JOURNAL_INSERT_NETWORK = 1,
+    JOURNAL_INSERT_RANGE = 2,
+    JOURNAL_REMOVE_NETWORK = 3,
+} journal_operation;
+
+typedef struct freeze_data_id_s {
+    const char *key;
+    uint32_t id;
+    UT_hash_handle hh;
+} freeze_data_id_s;
+
+/* Alias records point at fixed nodes. In a node dump they refer to their
+ * node by its position in the dump, so we keep track of where each fixed
+ * node is. There are only a few hundred fixed nodes in a tree, so a list is
+ * fine. */
+typedef struct frozen_fixed_node_s {
+    MMDBW_node_s *node;
+    uint64_t index;
+} frozen_fixed_node_s;
+
+typedef struct frozen_fixed_nodes_s {
+    frozen_fixed_node_s *items;
+    size_t count;
+    size_t capacity;
+} frozen_fixed_nodes_s;
+
+/* Alias records point at fixed nodes, so when cloning a tree we keep track of
+ * the copy of each fixed node. A fixed node always comes before the aliases
+ * that point at it in pre-order. */
+typedef struct cloned_fixed_node_s {
+    MMDBW_node_s *node;
+    MMDBW_node_s *copy;
+} cloned_fixed_node_s;
+
+typedef struct clone_args_s {
+    MMDBW_tree_s *tree;
+    MMDBW_tree_s *clone;
+    cloned_fixed_node_s *fixed_nodes;
+    size_t fixed_node_count;
+    size_t fixed_node_capacity;
+} clone_args_s;
+
+typedef struct merge_tree_args_s {
+    MMDBW_tree_s *tree;
+    MMDBW_tree_s *other;
+    MMDBW_merge_strategy merge_strategy;
+    // When stitching shards together, data from the other tree must not
+    // overlap data already in the tree.
+    bool stitching;
+} merge_tree_args_s;
+
+typedef struct diff_args_s {
+    MMDBW_tree_s *tree;
+    SV *callback;
+    AV *batch;
+    uint32_t batch_size;
+} diff_args_s;
+
+/* Records are collected into parallel arrays so that the callback is called
+ * once per batch rather than once per record. The prefix lengths and type
+ * names are shared read-only scalars. */
+typedef struct batch_iterator_args_s {
+    SV *callback;
+    uint32_t batch_size;
+    uint32_t count;
+    // A bit for each record type to include in the batches.
+    uint32_t type_mask;
+    AV *networks;
+    AV *prefix_lengths;
+    AV *types;
+    AV *node_numbers;
+    AV *keys;
+    AV *data;
+    SV *type_names[MMDBW_RECORD_TYPE_ALIAS + 1];
+    SV *prefix_length_values[129];
+} batch_iterator_args_s;
+
+/* Matching data records are removed, or are given new_key if it is not NULL,
+ * in a single walk of the tree. */
+typedef struct rewrite_data_args_s {
+    MMDBW_tree_s *tree;
+    HV *keys;
+    SV *predicate;
+    const char *new_key;
+    SV *error;
+    uint64_t rewritten;
+    // The records from the root to the current record. The nodes of the
+    // records above writable_depth have been made writable.
+    MMDBW_record_s *path[129];
+    bool is_right[128];
+    uint8_t writable_depth;
+} rewrite_data_args_s;
+
+/* Adjacent data records with the same key are coalesced into the range that
+ * is being built until a record that does not extend it is found. */
+typedef struct export_args_s {
+    MMDBW_tree_s *tree;
+    PerlIO *output_io;
+    bool jsonl;
+    SV *data_encoder;
+    HV *exported_keys;
+    bool has_range;
+    uint128_t range_start;
+    uint128_t range_end;
+    const char *range_key;
+    char *buffer;
+    size_t buffer_used;
+} export_args_s;
+
+typedef enum {
+    CURSOR_VISIT_LEFT,
+    CURSOR_DESCEND_LEFT,
+    CURSOR_VISIT_RIGHT,
+    CURSOR_DESCEND_RIGHT,
+} cursor_step_t;
+
+/* Subtracting another tree keeps the networks it does not cover, while
+ * intersecting with it keeps the networks it covers. */
+typedef struct restrict_tree_args_s {
+    MMDBW_tree_s *tree;
+    bool keep_covered;
+} restrict_tree_args_s;
+
+/* Each block of the network stream is indexed by the start address of its
+ * first network and the file offset of that network. Blocks are in address
+ * order, so we can binary search for the block to start thawing from. */
+typedef struct frozen_network_block_s {
+    uint128_t start;
+    uint64_t offset;
+} frozen_network_block_s;
+
+typedef struct frozen_network_blocks_s {
+    frozen_network_block_s *items;
+    size_t count;
+    size_t capacity;
+} frozen_network_blocks_s;
+
 typedef struct freeze_args_s {
     FILE *file;
     char *filename;
     HV *data_hash;
+    freeze_data_id_s *data_ids;
+    uint64_t offset;
+    uint64_t data_index_offset;
+    uint128_t previous_network;
+    uint64_t network_count;
+    frozen_network_blocks_s network_blocks;
+    uint64_t node_index;
+    frozen_fixed_nodes_s fixed_nodes;
 } freeze_args_s;
 
+/* A network passed to new_from_frozen_tree() in only_networks, as the first
+ * and last addresses it contains. */
+typedef struct thaw_only_network_s {
+    uint128_t first;
+    uint128_t last;
+    uint8_t prefix_length;
+} thaw_only_network_s;
+
+/* A journal entry as read back from the journal. The pointers point into the
+ * journal's buffer. */
+typedef struct journal_entry_s {
+    journal_operation operation;
+    uint8_t *bytes;
+    uint8_t *end_bytes;
+    uint8_t prefix_length;
+    MMDBW_merge_strategy merge_strategy;
+    char key[SHA1_KEY_LENGTH + 1];
+    uint8_t *data;
+    STRLEN data_size;
+} journal_entry_s;
+
+typedef struct frozen_mapping_s {
+    uint8_t *address;
+    size_t size;
+} frozen_mapping_s;
+
+typedef struct thaw_args_s {
+    MMDBW_tree_s *tree;
+    uint8_t *map;
+    uint8_t *buffer;
+    uint8_t *end;
+    uint8_t *released;
+    SV *frozen_sv;
+    SV *decoder;
+    uint8_t *data_table;
+    uint8_t *data_index;
+    const char **keys;
+    uint32_t data_count;
+    uint64_t node_index;
+    frozen_fixed_nodes_s fixed_nodes;
+} thaw_args_s;
+
 typedef struct thawed_network_s {
     MMDBW_network_s *network;
     MMDBW_record_s *record;
 } thawed_network_s;
 
+/* A network from a format 2 network stream. */
+typedef struct thaw_stream_entry_s {
+    uint128_t network;
+    uint8_t prefix_length;
+    uint32_t id;
+} thaw_stream_entry_s;
+
+/* A subtree that one worker builds when thawing with several workers. Its
+ * networks are a contiguous run of the network stream. */
+typedef struct thaw_slot_s {
+    uint8_t *buffer;
+    uint64_t count;
+    uint128_t previous_network;
+    uint128_t network;
+    uint8_t prefix_length;
+    MMDBW_record_s *record;
+} thaw_slot_s;
+
+/* A record built by a worker. Data records are referred to by their ID until
+ * they are attached to the tree. */
+typedef struct thaw_built_record_s {
+    MMDBW_record_type type;
+    uint32_t id;
+    MMDBW_node_s *node;
+} thaw_built_record_s;
+
+/* Workers only read the mapping and the thawed keys, and only write to their
+ * own slots' subtrees and reference counts. They must not call into Perl or
+ * touch the tree's data table. */
+typedef struct thaw_worker_s {
+    thaw_args_s *args;
+    uint8_t *stream_end;
+    thaw_slot_s *slots;
+    size_t slot_count;
+    uint32_t *reference_counts;
+    uint8_t *buffer;
+    uint64_t remaining;
+    thaw_stream_entry_s entry;
+    bool has_entry;
+} thaw_worker_s;
+
+typedef struct thaw_parallel_s {
+    thaw_slot_s *slots;
+    size_t slot_count;
+    size_t slot_capacity;
+    thaw_stream_entry_s *unslotted;
+    size_t unslotted_count;
+    size_t unslotted_capacity;
+    thaw_worker_s *workers;
+    uint32_t worker_count;
+} thaw_parallel_s;
+
+typedef struct search_tree_output_s {
+    PerlIO *output_io;
+    uint8_t record_size;
+    // If this is false, alias records are written as empty records.
+    bool aliases;
+    char *buffer;
+    size_t buffer_used;
+} search_tree_output_s;
+
 typedef struct encode_args_s {
     PerlIO *output_io;
     SV *root_data_type;
     SV *serializer;
     HV *data_pointer_cache;
+    HV *data_positions;
+    // When this is not NULL, data keys are looked up here rather than in the
+    // tree's data table.
+    HV *projected_data;
+    uint32_t node_count;
+    // Record values are checked against this record size. When writing
+    // several outputs, it is the smallest of their record sizes.
+    uint8_t record_size;
+    search_tree_output_s *outputs;
+    size_t output_count;
 } encode_args_s;
 
+typedef struct projection_args_s {
+    SV *projection;
+    // The projected key for each key in the tree, or undef if the projection
+    // removes the data.
+    HV *projected_keys;
+    HV *projected_data;
+    // The nodes whose records became identical, keyed by the node's address.
+    // The value is the projected key, or undef if the records are empty.
+    HV *merged_nodes;
+    uint32_t node_count;
+} projection_args_s;
+
+typedef struct write_order_args_s {
+    AV *keys;
+    AV *data;
+    HV *seen;
+} write_order_args_s;
+
 struct network {
     const char *const ipstr;
     const uint8_t prefix_length;
 };
 
 static void verify_ip(MMDBW_tree_s *tree, const char *ipstr);
+static bool
+is_in_shard(MMDBW_tree_s *tree, uint128_t first_ip, uint128_t last_ip);
 static int128_t ip_string_to_integer(const char *ipstr, int family);
 static int128_t ip_bytes_to_integer(uint8_t *bytes, int family);
 static void
@@ -73,6 +387,7 @@ static const char *increment_data_reference_count(MMDBW_tree_s *tree,
                                                   const char *const key);
 static void
 set_stored_data_in_tree(MMDBW_tree_s *tree, const char *const key, SV *data_sv);
+static bool data_is_in_tree(MMDBW_tree_s *tree, const char *const key);
 static void decrement_data_reference_count(MMDBW_tree_s *tree,
                                            const char *const key);
 static MMDBW_network_s resolve_network(MMDBW_tree_s *tree,
@@ -82,12 +397,106 @@ static MMDBW_status
 resolve_ip(int tree_ip_version, const char *const ipstr, uint8_t *bytes);
 static void free_network(MMDBW_network_s *network);
 static void alias_ipv4_networks(MMDBW_tree_s *tree);
+static MMDBW_data_table_s *new_data_table(void);
+static void clone_record(clone_args_s *args,
+                         MMDBW_record_s *record,
+                         MMDBW_record_s *copy);
+static void add_cloned_fixed_node(clone_args_s *args,
+                                  MMDBW_node_s *node,
+                                  MMDBW_node_s *copy);
+static const char *clone_data_reference(clone_args_s *args,
+                                        const char *const key);
+static MMDBW_status merge_records(merge_tree_args_s *args,
+                                  MMDBW_record_s *record,
+                                  MMDBW_record_s *other_record,
+                                  uint128_t network,
+                                  uint8_t depth);
+static MMDBW_status merge_data_record(merge_tree_args_s *args,
+                                      MMDBW_record_s *record,
+                                      const char *const other_key,
+                                      uint128_t network,
+                                      uint8_t depth);
+static void graft_subtree(merge_tree_args_s *args,
+                          MMDBW_record_s *record,
+                          MMDBW_record_s *other_record);
+static bool subtree_has_data(MMDBW_record_s *record);
+static void restrict_tree(MMDBW_tree_s *tree,
+                          MMDBW_tree_s *other,
+                          bool keep_covered,
+                          const char *const operation);
+static void diff_records(diff_args_s *args,
+                         MMDBW_record_s *record,
+                         MMDBW_record_s *other_record,
+                         uint128_t network,
+                         uint8_t depth);
+static void add_diff(diff_args_s *args,
+                     uint128_t network,
+                     uint8_t depth,
+                     const char *const key,
+                     const char *const other_key);
+static void flush_diff_batch(diff_args_s *args);
+static void add_batch_records(MMDBW_tree_s *tree,
+                              MMDBW_node_s *node,
+                              uint128_t network,
+                              uint8_t depth,
+                              void *void_args);
+static void add_batch_record(MMDBW_tree_s *tree,
+                             batch_iterator_args_s *args,
+                             MMDBW_node_s *node,
+                             MMDBW_record_s *record,
+                             uint128_t network,
+                             uint8_t depth);
+static void flush_record_batch(batch_iterator_args_s *args);
+static uint32_t record_type_mask(AV *types);
+static void export_record(export_args_s *args,
+                          MMDBW_record_s *record,
+                          uint128_t network,
+                          uint8_t depth);
+static void write_export_range(export_args_s *args);
+static void write_export(export_args_s *args, const char *bytes, size_t length);
+static void write_export_json_string(export_args_s *args, const char *string);
+static void write_export_csv_field(export_args_s *args,
+                                   const char *field,
+                                   size_t length);
+static void flush_export_buffer(export_args_s *args);
+static size_t format_address(MMDBW_tree_s *tree, uint128_t ip, char *dst);
+static size_t format_ipv4(uint32_t ip, char *dst);
+static size_t format_ipv6(uint128_t ip, char *dst);
+static void set_cursor_record(MMDBW_cursor_s *cursor,
+                              MMDBW_record_s *record,
+                              uint128_t network,
+                              uint8_t depth);
+static uint64_t node_hash(MMDBW_node_s *node);
+static uint64_t record_hash(MMDBW_record_s *record);
+static uint64_t mix_hash(uint64_t hash);
+static MMDBW_status restrict_record(restrict_tree_args_s *args,
+                                    MMDBW_record_s *record,
+                                    MMDBW_record_s *other_record,
+                                    uint128_t network,
+                                    uint8_t depth);
+static MMDBW_status clear_record(MMDBW_tree_s *tree,
+                                 MMDBW_record_s *record,
+                                 uint128_t network,
+                                 uint8_t depth);
+static MMDBW_status
+insert_record_at_depth(MMDBW_tree_s *tree,
+                       MMDBW_record_s *record,
+                       MMDBW_record_s *new_record,
+                       uint128_t network,
+                       uint8_t depth,
+                       MMDBW_merge_strategy merge_strategy);
 static MMDBW_status insert_reserved_networks_as_fixed_empty(MMDBW_tree_s *tree);
 static MMDBW_status
 insert_networks_as_fixed_empty(MMDBW_tree_s *tree,
                                struct network const *const networks,
                                const size_t num_networks);
 static MMDBW_status
+insert_record_for_range(MMDBW_tree_s *tree,
+                        uint128_t start_ip,
+                        uint128_t end_ip,
+                        const char *const key,
+                        MMDBW_merge_strategy merge_strategy);
+static MMDBW_status
 insert_record_for_network(MMDBW_tree_s *tree,
                           MMDBW_network_s *network,
                           MMDBW_record_s *new_record,
@@ -107,6 +516,8 @@ insert_record_into_current_record(MMDBW_tree_s *tree,
                                   MMDBW_network_s *network,
                                   MMDBW_record_s *new_record,
                                   MMDBW_merge_strategy merge_strategy);
+static void trim_identical_records(MMDBW_tree_s *tree,
+                                   MMDBW_record_s *current_record);
 static const char *maybe_merge_records(MMDBW_tree_s *tree,
                                        MMDBW_network_s *network,
                                        MMDBW_record_s *new_record,
@@ -135,6 +546,30 @@ static MMDBW_status find_record_for_network(MMDBW_tree_s *tree,
                                             MMDBW_record_s **record);
 static MMDBW_node_s *new_node_from_record(MMDBW_tree_s *tree,
                                           MMDBW_record_s *record);
+static void collect_networks_within(MMDBW_tree_s *tree,
+                                    AV *networks,
+                                    MMDBW_node_s *node,
+                                    uint128_t network,
+                                    uint8_t depth);
+static void add_network_within(MMDBW_tree_s *tree,
+                               AV *networks,
+                               uint128_t network,
+                               uint8_t prefix_length,
+                               const char *const key);
+static void index_record(MMDBW_tree_s *tree,
+                         MMDBW_key_index_s *index,
+                         MMDBW_record_s *record,
+                         uint128_t network,
+                         uint8_t depth);
+static void free_key_index(MMDBW_key_index_s *index);
+static void rewrite_matching_records(rewrite_data_args_s *args, uint8_t depth);
+static bool data_record_matches(rewrite_data_args_s *args,
+                                const char *const key);
+static MMDBW_node_s *writable_node(MMDBW_tree_s *tree, MMDBW_record_s *record);
+static void share_record_value(MMDBW_tree_s *tree, MMDBW_record_s *record);
+static void repoint_aliases(MMDBW_tree_s *tree,
+                            MMDBW_node_s *node,
+                            MMDBW_node_s *copy);
 static MMDBW_status free_node_and_subnodes(MMDBW_tree_s *tree,
                                            MMDBW_node_s *node,
                                            bool remove_alias_and_fixed_nodes);
@@ -159,7 +594,38 @@ static void freeze_data_record(MMDBW_tree_s *UNUSED(tree),
                                freeze_args_s *args);
 static void freeze_to_file(freeze_args_s *args, void *data, size_t size);
 static void freeze_data_to_file(freeze_args_s *args, MMDBW_tree_s *tree);
+static void freeze_data_batch(freeze_args_s *args, HV *batch);
 static SV *freeze_hash(HV *hash);
+static uint64_t collect_frozen_data(freeze_args_s *args,
+                                    MMDBW_record_s *record);
+static void freeze_data_table(freeze_args_s *args, MMDBW_tree_s *tree);
+static void freeze_network_stream(freeze_args_s *args,
+                                  MMDBW_tree_s *tree,
+                                  uint64_t network_count);
+static void freeze_stream_node(MMDBW_tree_s *tree,
+                               MMDBW_node_s *node,
+                               uint128_t network,
+                               uint8_t depth,
+                               void *void_args);
+static void freeze_stream_record(freeze_args_s *args,
+                                 uint128_t network,
+                                 uint8_t depth,
+                                 const char *key);
+static void freeze_network_index(freeze_args_s *args);
+static void freeze_node_dump(freeze_args_s *args, MMDBW_record_s *record);
+static void freeze_varint(freeze_args_s *args, uint128_t value);
+static size_t encode_varint(uint128_t value, uint8_t *bytes);
+static uint32_t frozen_data_id(freeze_args_s *args, const char *key);
+static void add_frozen_fixed_node(frozen_fixed_nodes_s *fixed_nodes,
+                                  MMDBW_node_s *node,
+                                  uint64_t index);
+static void add_frozen_network_block(frozen_network_blocks_s *blocks,
+                                     uint128_t start,
+                                     uint64_t offset);
+static void free_data_ids(freeze_args_s *args);
+static SV *new_sereal_object(const char *class);
+static SV *sereal_encode(SV *encoder, SV *data);
+static SV *sereal_decode(SV *decoder, SV *frozen);
 static uint8_t thaw_uint8(uint8_t **buffer);
 static thawed_network_s *thaw_network(MMDBW_tree_s *tree, uint8_t **buffer);
 static uint8_t *thaw_bytes(uint8_t **buffer, size_t size);
@@ -167,16 +633,150 @@ static uint128_t thaw_uint128(uint8_t **buffer);
 static STRLEN thaw_strlen(uint8_t **buffer);
 static const char *thaw_data_key(uint8_t **buffer);
 static HV *thaw_data_hash(SV *data_to_decode);
+static void unmap_frozen_tree(pTHX_ void *void_mapping);
+static SV *new_frozen_bytes_sv(void);
+static SV *frozen_bytes_sv(thaw_args_s *args, uint8_t *bytes, STRLEN size);
+static void release_consumed_pages(thaw_args_s *args);
+static void thaw_tree_v1(thaw_args_s *args);
+static void
+thaw_tree_v2(thaw_args_s *args, AV *only_networks, uint32_t workers);
+static MMDBW_status thaw_network_stream(thaw_args_s *args,
+                                        uint8_t *stream_end,
+                                        uint64_t count,
+                                        uint128_t previous_network,
+                                        thaw_only_network_s *only);
+static MMDBW_status insert_thawed_network(thaw_args_s *args,
+                                          uint128_t network,
+                                          uint8_t prefix_length,
+                                          uint32_t id);
+static MMDBW_status thaw_network_stream_in_parallel(thaw_args_s *args,
+                                                    uint8_t *stream_end,
+                                                    uint64_t count,
+                                                    uint32_t workers);
+static void find_thaw_slots(thaw_args_s *args,
+                            uint8_t *stream_end,
+                            uint64_t count,
+                            thaw_parallel_s *state);
+static bool find_thaw_slot(MMDBW_tree_s *tree,
+                           thaw_stream_entry_s *entry,
+                           thaw_slot_s *slot);
+static MMDBW_record_s *expand_to_thaw_slot(MMDBW_tree_s *tree,
+                                           thaw_slot_s *slot);
+static void run_thaw_workers(thaw_args_s *args,
+                             uint8_t *stream_end,
+                             thaw_parallel_s *state,
+                             uint32_t workers);
+static void *run_thaw_worker(void *void_worker);
+static void next_thaw_worker_entry(thaw_worker_s *worker);
+static thaw_built_record_s
+build_thaw_slot(thaw_worker_s *worker, uint8_t depth, uint128_t first);
+static void set_thawed_record(thaw_worker_s *worker,
+                              MMDBW_record_s *record,
+                              thaw_built_record_s *built);
+static void trim_thawed_slots(MMDBW_tree_s *tree,
+                              MMDBW_record_s *record,
+                              uint8_t depth,
+                              uint128_t first,
+                              thaw_slot_s *slots,
+                              size_t slot_count);
+static void free_thaw_parallel(pTHX_ void *void_state);
+static MMDBW_status thaw_only_networks(thaw_args_s *args,
+                                       uint8_t *stream_end,
+                                       uint64_t network_count,
+                                       uint8_t *network_index,
+                                       AV *only_networks);
+static thaw_only_network_s *resolve_only_networks(MMDBW_tree_s *tree,
+                                                  AV *only_networks,
+                                                  size_t *count);
+static int compare_only_networks(const void *a, const void *b);
+static uint128_t last_address_in_network(MMDBW_tree_s *tree,
+                                         uint128_t network,
+                                         uint8_t prefix_length);
+static void thaw_tree_v3(thaw_args_s *args);
+static void thaw_data_table(thaw_args_s *args);
+static void thaw_data_index(thaw_args_s *args);
+static uint8_t *thaw_data_record(thaw_args_s *args, uint32_t id);
+static void release_thawed_data(thaw_args_s *args);
+static void
+thaw_node_dump(thaw_args_s *args, MMDBW_record_s *record, uint8_t depth);
+static uint128_t thaw_varint(uint8_t **buffer, uint8_t *end);
+static void thaw_check_bounds(uint8_t *buffer, uint8_t *end, uint128_t size);
+static void journal_insert(MMDBW_tree_s *tree,
+                           journal_operation operation,
+                           uint8_t *bytes,
+                           uint8_t *end_bytes,
+                           uint8_t prefix_length,
+                           MMDBW_merge_strategy merge_strategy,
+                           const char *key,
+                           SV *data_sv);
+static void
+journal_write(MMDBW_journal_s *journal, void *buffer, size_t count);
+static bool read_journal_entry(MMDBW_tree_s *tree,
+                               uint8_t **buffer,
+                               uint8_t *end,
+                               journal_entry_s *entry);
+static bool read_journal_bytes(uint8_t **buffer,
+                               uint8_t *end,
+                               uint8_t **bytes,
+                               size_t size);
+static bool
+read_journal_varint(uint8_t **buffer, uint8_t *end, uint128_t *value);
+static void
+apply_journal_entry(MMDBW_tree_s *tree, journal_entry_s *entry, SV **decoder);
+static MMDBW_record_s *search_tree_root(MMDBW_tree_s *tree, bool ipv4_only);
+static HV *data_positions_hash(SV *data_positions);
+static void encode_node_for_outputs(MMDBW_tree_s *tree,
+                                    MMDBW_node_s *node,
+                                    uint128_t UNUSED(network),
+                                    uint8_t UNUSED(depth),
+                                    void *void_args);
+static size_t
+pack_node(uint8_t record_size, uint32_t left, uint32_t right, uint8_t *bytes);
+static void write_search_tree_output(search_tree_output_s *output,
+                                     const uint8_t *bytes,
+                                     size_t length);
+static void flush_search_tree_output(search_tree_output_s *output);
+static uint32_t max_value_for_record_size(uint8_t record_size);
 static void encode_node(MMDBW_tree_s *tree,
                         MMDBW_node_s *node,
                         uint128_t UNUSED(network),
                         uint8_t UNUSED(depth),
                         void *void_args);
+static void encode_records(MMDBW_tree_s *tree,
+                           MMDBW_node_s *node,
+                           MMDBW_record_s *left_record,
+                           MMDBW_record_s *right_record,
+                           encode_args_s *args);
+static MMDBW_record_s project_record(MMDBW_tree_s *tree,
+                                     projection_args_s *args,
+                                     MMDBW_record_s *record);
+static const char *projected_key(MMDBW_tree_s *tree,
+                                 projection_args_s *args,
+                                 const char *const key);
+static MMDBW_record_s projected_record(projection_args_s *args,
+                                       MMDBW_record_s *record);
+static void number_projected_nodes(projection_args_s *args,
+                                   MMDBW_record_s *record);
+static void encode_projected_nodes(MMDBW_tree_s *tree,
+                                   projection_args_s *projection_args,
+                                   encode_args_s *args,
+                                   MMDBW_record_s *record);
 static void
 check_record_sanity(MMDBW_node_s *node, MMDBW_record_s *record, char *side);
 static uint32_t record_value_as_number(MMDBW_tree_s *tree,
                                        MMDBW_record_s *record,
                                        encode_args_s *args);
+static uint32_t data_position_for_key(MMDBW_tree_s *tree,
+                                      const char *const key,
+                                      encode_args_s *args);
+static void collect_node_data(MMDBW_tree_s *tree,
+                              MMDBW_node_s *node,
+                              uint128_t UNUSED(network),
+                              uint8_t UNUSED(depth),
+                              void *void_args);
+static void collect_record_data(MMDBW_tree_s *tree,
+                                MMDBW_record_s *record,
+                                write_order_args_s *args);
 static void iterate_tree(MMDBW_tree_s *tree,
                          MMDBW_record_s *record,
                          uint128_t network,
@@ -191,6 +791,7 @@ static void store_in_merge_cache(MMDBW_tree_s *tree,
                                  char *merge_cache_key,
                                  const char *const new_key);
 static void *checked_malloc(size_t size);
+static void *checked_calloc(size_t count, size_t size);
 static void
 checked_fwrite(FILE *file, char *filename, void *buffer, size_t count);
 static void check_perlio_result(SSize_t result, SSize_t expected, char *op);
@@ -223,11 +824,15 @@ MMDBW_tree_s *new_tree(const uint8_t ip_version,
     tree->record_size = record_size;
     tree->merge_strategy = merge_strategy;
     tree->merge_cache = NULL;
-    tree->data_table = NULL;
+    tree->key_index = NULL;
+    tree->data_table = new_data_table();
     tree->root_record = (MMDBW_record_s){
         .type = MMDBW_RECORD_TYPE_EMPTY,
     };
     tree->node_count = 0;
+    tree->journal = NULL;
+    tree->shard_first_ip = 0;
+    tree->shard_prefix_length = 0;
 
     if (alias_ipv6) {
         alias_ipv4_networks(tree);
@@ -246,6 +851,150 @@ MMDBW_tree_s *new_tree(const uint8_t ip_version,
     return tree;
 }
 
+// Create a copy of a tree.
+//
+// The copy has its own nodes and data table, but the data SVs are shared
+// with the original tree. The copy does not have a journal.
+MMDBW_tree_s *clone_tree(MMDBW_tree_s *tree) {
+    MMDBW_tree_s *clone = checked_malloc(sizeof(MMDBW_tree_s));
+    clone->ip_version = tree->ip_version;
+    clone->record_size = tree->record_size;
+    clone->merge_strategy = tree->merge_strategy;
+    clone->merge_cache = NULL;
+    clone->key_index = NULL;
+    clone->data_table = new_data_table();
+    clone->node_count = tree->node_count;
+    clone->journal = NULL;
+    clone->shard_first_ip = tree->shard_first_ip;
+    clone->shard_prefix_length = tree->shard_prefix_length;
+
+    clone_args_s args = {
+        .tree = tree,
+        .clone = clone,
+        .fixed_nodes = NULL,
+        .fixed_node_count = 0,
+        .fixed_node_capacity = 0,
+    };
+    clone_record(&args, &tree->root_record, &clone->root_record);
+    free(args.fixed_nodes);
+
+    return clone;
+}
+
+// Create a snapshot of a tree.
+//
+// The snapshot shares all of its nodes and its data table with the original
+// tree. A node is only copied when one of the trees sharing it changes it, so
+// this takes constant time.
+MMDBW_tree_s *snapshot_tree(MMDBW_tree_s *tree) {
+    MMDBW_tree_s *snapshot = checked_malloc(sizeof(MMDBW_tree_s));
+    snapshot->ip_version = tree->ip_version;
+    snapshot->record_size = tree->record_size;
+    snapshot->merge_strategy = tree->merge_strategy;
+    snapshot->merge_cache = NULL;
+    snapshot->key_index = NULL;
+    snapshot->data_table = tree->data_table;
+    snapshot->data_table->tree_count++;
+    snapshot->root_record = tree->root_record;
+    snapshot->node_count = tree->node_count;
+    snapshot->journal = NULL;
+    snapshot->shard_first_ip = tree->shard_first_ip;
+    snapshot->shard_prefix_length = tree->shard_prefix_length;
+
+    if (tree->root_record.type == MMDBW_RECORD_TYPE_NODE ||
+        tree->root_record.type == MMDBW_RECORD_TYPE_FIXED_NODE) {
+        tree->root_record.value.node->reference_count++;
+    }
+
+    return snapshot;
+}
+
+static MMDBW_data_table_s *new_data_table(void) {
+    MMDBW_data_table_s *data_table = checked_malloc(sizeof(MMDBW_data_table_s));
+    data_table->entries = NULL;
+    data_table->tree_count = 1;
+
+    return data_table;
+}
+
+static void clone_record(clone_args_s *args,
+                         MMDBW_record_s *record,
+                         MMDBW_record_s *copy) {
+    copy->type = record->type;
+
+    switch (record->type) {
+        case MMDBW_RECORD_TYPE_EMPTY:
+        case MMDBW_RECORD_TYPE_FIXED_EMPTY:
+            break;
+        case MMDBW_RECORD_TYPE_DATA:
+            copy->value.key = clone_data_reference(args, record->value.key);
+            break;
+        case MMDBW_RECORD_TYPE_NODE:
+        case MMDBW_RECORD_TYPE_FIXED_NODE: {
+            MMDBW_node_s *node = record->value.node;
+            MMDBW_node_s *node_copy = new_node();
+            node_copy->number = node->number;
+            copy->value.node = node_copy;
+
+            if (record->type == MMDBW_RECORD_TYPE_FIXED_NODE) {
+                add_cloned_fixed_node(args, node, node_copy);
+            }
+
+            clone_record(args, &node->left_record, &node_copy->left_record);
+            clone_record(args, &node->right_record, &node_copy->right_record);
+            break;
+        }
+        case MMDBW_RECORD_TYPE_ALIAS: {
+            size_t i;
+            for (i = 0; i < args->fixed_node_count; i++) {
+                if (args->fixed_nodes[i].node == record->value.node) {
+                    break;
+                }
+            }
+            if (i == args->fixed_node_count) {
+                croak("Found an alias record before the node it points to "
+                      "when cloning the tree");
+            }
+            copy->value.node = args->fixed_nodes[i].copy;
+            break;
+        }
+    }
+}
+
+static void add_cloned_fixed_node(clone_args_s *args,
+                                  MMDBW_node_s *node,
+                                  MMDBW_node_s *copy) {
+    if (args->fixed_node_count == args->fixed_node_capacity) {
+        args->fixed_node_capacity =
+            args->fixed_node_capacity ? args->fixed_node_capacity * 2 : 256;
+        args->fixed_nodes =
+            realloc(args->fixed_nodes,
+                    sizeof(cloned_fixed_node_s) * args->fixed_node_capacity);
+        if (!args->fixed_nodes) {
+            abort();
+        }
+    }
+
+    args->fixed_nodes[args->fixed_node_count].node = node;
+    args->fixed_nodes[args->fixed_node_count].copy = copy;
+    args->fixed_node_count++;
+}
+
+/* The first reference to each data record adds it to the clone's data table,
+ * sharing the original tree's SV. */
+static const char *clone_data_reference(clone_args_s *args,
+                                        const char *const key) {
+    MMDBW_data_hash_s *data = NULL;
+    HASH_FIND(
+        hh, args->clone->data_table->entries, key, SHA1_KEY_LENGTH, data);
+    if (NULL != data) {
+        data->reference_count++;
+        return data->key;
+    }
+
+    return store_data_in_tree(args->clone, key, data_for_key(args->tree, key));
+}
+
 void insert_network(MMDBW_tree_s *tree,
                     const char *ipstr,
                     const uint8_t prefix_length,
@@ -256,14 +1005,41 @@ void insert_network(MMDBW_tree_s *tree,
 
     MMDBW_network_s network = resolve_network(tree, ipstr, prefix_length);
 
-    const char *const key =
-        store_data_in_tree(tree, SvPVbyte_nolen(key_sv), data);
+    uint128_t first_ip =
+        (uint128_t)ip_bytes_to_integer((uint8_t *)network.bytes,
+                                       tree->ip_version) &
+        ~last_address_in_network(tree, 0, network.prefix_length);
+    if (!is_in_shard(tree,
+                     first_ip,
+                     last_address_in_network(
+                         tree, first_ip, network.prefix_length))) {
+        free_network(&network);
+        croak("%s/%" PRIu8 " is not in this tree's shard",
+              ipstr,
+              prefix_length);
+    }
+
+    const char *key = SvPVbyte_nolen(key_sv);
+    const bool is_new_data = !data_is_in_tree(tree, key);
+
+    key = store_data_in_tree(tree, key, data);
     MMDBW_record_s new_record = {.type = MMDBW_RECORD_TYPE_DATA,
                                  .value = {.key = key}};
 
     MMDBW_status status = insert_record_for_network(
         tree, &network, &new_record, merge_strategy, false);
 
+    if (MMDBW_SUCCESS == status && NULL != tree->journal) {
+        journal_insert(tree,
+                       JOURNAL_INSERT_NETWORK,
+                       (uint8_t *)network.bytes,
+                       NULL,
+                       network.prefix_length,
+                       merge_strategy,
+                       key,
+                       is_new_data ? data : NULL);
+    }
+
     // The data's ref count gets incremented by the insert each time it is
     // inserted. As such, we need to decrement it here.
     decrement_data_reference_count(tree, key);
@@ -277,6 +1053,14 @@ void insert_network(MMDBW_tree_s *tree,
     }
 }
 
+static bool
+is_in_shard(MMDBW_tree_s *tree, uint128_t first_ip, uint128_t last_ip) {
+    uint128_t shard_last_ip = last_address_in_network(
+        tree, tree->shard_first_ip, tree->shard_prefix_length);
+
+    return first_ip >= tree->shard_first_ip && last_ip <= shard_last_ip;
+}
+
 static void verify_ip(MMDBW_tree_s *tree, const char *ipstr) {
     if (tree->ip_version == 4 && strchr(ipstr, ':')) {
         croak("You cannot insert an IPv6 address (%s) into an IPv4 tree.",
@@ -302,9 +1086,54 @@ void insert_range(MMDBW_tree_s *tree,
               end_ipstr);
     }
 
-    const char *const key =
-        store_data_in_tree(tree, SvPVbyte_nolen(key_sv), data_sv);
+    if (!is_in_shard(tree, start_ip, end_ip)) {
+        croak("The range %s - %s is not in this tree's shard",
+              start_ipstr,
+              end_ipstr);
+    }
+
+    const char *key = SvPVbyte_nolen(key_sv);
+    const bool is_new_data = !data_is_in_tree(tree, key);
+
+    key = store_data_in_tree(tree, key, data_sv);
+
+    MMDBW_status status =
+        insert_record_for_range(tree, start_ip, end_ip, key, merge_strategy);
+
+    if (MMDBW_SUCCESS == status && NULL != tree->journal) {
+        uint8_t start_bytes[tree->ip_version == 6 ? 16 : 4];
+        uint8_t end_bytes[tree->ip_version == 6 ? 16 : 4];
+        integer_to_ip_bytes(tree->ip_version, start_ip, start_bytes);
+        integer_to_ip_bytes(tree->ip_version, end_ip, end_bytes);
+
+        journal_insert(tree,
+                       JOURNAL_INSERT_RANGE,
+                       start_bytes,
+                       end_bytes,
+                       0,
+                       merge_strategy,
+                       key,
+                       is_new_data ? data_sv : NULL);
+    }
+
+    // store_data_in_tree starts at a reference count of 1, so we need to
+    // decrement in order to account for that.
+    decrement_data_reference_count(tree, key);
+
+    if (MMDBW_SUCCESS != status) {
+        croak("%s (when inserting %s - %s)",
+              status_error_message(status),
+              start_ipstr,
+              end_ipstr);
+    }
+}
 
+static MMDBW_status
+insert_record_for_range(MMDBW_tree_s *tree,
+                        uint128_t start_ip,
+                        uint128_t end_ip,
+                        const char *const key,
+                        MMDBW_merge_strategy merge_strategy) {
     uint8_t bytes[tree->ip_version == 6 ? 16 : 4];
 
     MMDBW_status status = MMDBW_SUCCESS;
@@ -342,16 +1171,8 @@ void insert_range(MMDBW_tree_s *tree,
             break;
         }
     }
-    // store_data_in_tree starts at a reference count of 1, so we need to
-    // decrement in order to account for that.
-    decrement_data_reference_count(tree, key);
 
-    if (MMDBW_SUCCESS != status) {
-        croak("%s (when inserting %s - %s)",
-              status_error_message(status),
-              start_ipstr,
-              end_ipstr);
-    }
+    return status;
 }
 
 static int128_t ip_string_to_integer(const char *ipstr, int family) {
@@ -437,96 +1258,692 @@ void remove_network(MMDBW_tree_s *tree,
     MMDBW_status status = insert_record_for_network(
         tree, &network, &new_record, MMDBW_MERGE_STRATEGY_NONE, false);
 
+    if (MMDBW_SUCCESS == status && NULL != tree->journal) {
+        journal_insert(tree,
+                       JOURNAL_REMOVE_NETWORK,
+                       (uint8_t *)network.bytes,
+                       NULL,
+                       network.prefix_length,
+                       MMDBW_MERGE_STRATEGY_NONE,
+                       NULL,
+                       NULL);
+    }
+
     free_network(&network);
     if (status != MMDBW_SUCCESS) {
         croak("Unable to remove network: %s", status_error_message(status));
     }
 }
 
-static const char *
-store_data_in_tree(MMDBW_tree_s *tree, const char *const key, SV *data_sv) {
-    const char *const new_key = increment_data_reference_count(tree, key);
-    set_stored_data_in_tree(tree, key, data_sv);
+// Merge another tree into this one.
+//
+// This gives the same result as inserting each of the other tree's networks
+// into this tree with the given merge strategy, but we walk both trees at
+// once. Where this tree is empty, we take the other tree's whole subtree
+// instead of inserting each of its networks.
+void merge_tree(MMDBW_tree_s *tree,
+                MMDBW_tree_s *other,
+                MMDBW_merge_strategy merge_strategy) {
+    if (tree->ip_version != other->ip_version) {
+        croak("You cannot merge an IPv%" PRIu8 " tree into an IPv%" PRIu8
+              " tree.",
+              other->ip_version,
+              tree->ip_version);
+    }
 
-    return new_key;
-}
+    // The merge is not journaled, so thawing the tree would not replay it.
+    if (NULL != tree->journal) {
+        croak("You cannot merge into a tree that has a journal.");
+    }
 
-static const char *increment_data_reference_count(MMDBW_tree_s *tree,
-                                                  const char *const key) {
-    MMDBW_data_hash_s *data = NULL;
-    HASH_FIND(hh, tree->data_table, key, SHA1_KEY_LENGTH, data);
+    if (merge_strategy == MMDBW_MERGE_STRATEGY_UNKNOWN) {
+        merge_strategy = tree->merge_strategy;
+    }
 
-    /* We allow this possibility as we need to create the record separately
-       from updating the data when thawing */
-    if (NULL == data) {
-        data = checked_malloc(sizeof(MMDBW_data_hash_s));
-        data->reference_count = 0;
+    merge_tree_args_s args = {
+        .tree = tree,
+        .other = other,
+        .merge_strategy = merge_strategy,
+        .stitching = false,
+    };
 
-        data->data_sv = NULL;
+    MMDBW_status status =
+        merge_records(&args, &tree->root_record, &other->root_record, 0, 0);
+    if (MMDBW_SUCCESS != status) {
+        croak("Unable to merge trees: %s", status_error_message(status));
+    }
+}
 
-        data->key = checked_malloc(SHA1_KEY_LENGTH + 1);
-        strcpy((char *)data->key, key);
+static MMDBW_status merge_records(merge_tree_args_s *args,
+                                  MMDBW_record_s *record,
+                                  MMDBW_record_s *other_record,
+                                  uint128_t network,
+                                  uint8_t depth) {
+    switch (other_record->type) {
+        case MMDBW_RECORD_TYPE_EMPTY:
+        case MMDBW_RECORD_TYPE_FIXED_EMPTY:
+        case MMDBW_RECORD_TYPE_ALIAS:
+            // There is nothing to merge. If this tree has aliases, it has
+            // its own alias records.
+            return MMDBW_SUCCESS;
+        case MMDBW_RECORD_TYPE_DATA:
+            return merge_data_record(
+                args, record, other_record->value.key, network, depth);
+        case MMDBW_RECORD_TYPE_NODE:
+        case MMDBW_RECORD_TYPE_FIXED_NODE:
+            break;
+    }
+
+    MMDBW_node_s *other_node = other_record->value.node;
+    MMDBW_node_s *node = NULL;
+    switch (record->type) {
+        case MMDBW_RECORD_TYPE_FIXED_EMPTY:
+            // Inserts into these records are ignored.
+            return MMDBW_SUCCESS;
+        case MMDBW_RECORD_TYPE_ALIAS:
+            // As with insert_network(), a network inside an aliased network
+            // cannot be inserted. Reserved networks are not inserted, so a
+            // subtree without data is fine.
+            return subtree_has_data(other_record)
+                       ? MMDBW_INSERT_INTO_ALIAS_NODE_ERROR
+                       : MMDBW_SUCCESS;
+        case MMDBW_RECORD_TYPE_EMPTY:
+            if (args->merge_strategy ==
+                MMDBW_MERGE_STRATEGY_ADD_ONLY_IF_PARENT_EXISTS) {
+                return MMDBW_SUCCESS;
+            }
+            // Below a node, there are no fixed nodes or aliases, so we can
+            // take the whole subtree.
+            if (other_record->type == MMDBW_RECORD_TYPE_NODE) {
+                graft_subtree(args, record, other_record);
+                return MMDBW_SUCCESS;
+            }
+            node = new_node_from_record(args->tree, record);
+            record->value.node = node;
+            record->type = MMDBW_RECORD_TYPE_NODE;
+            break;
+        case MMDBW_RECORD_TYPE_DATA:
+            if (args->stitching) {
+                return MMDBW_SHARD_OVERLAP_ERROR;
+            }
+            node = new_node_from_record(args->tree, record);
+            record->value.node = node;
+            record->type = MMDBW_RECORD_TYPE_NODE;
+            break;
+        case MMDBW_RECORD_TYPE_NODE:
+        case MMDBW_RECORD_TYPE_FIXED_NODE:
+            // The trees share this subtree, e.g., because one is a snapshot
+            // of the other.
+            if (record->value.node == other_node) {
+                return MMDBW_SUCCESS;
+            }
+            node = writable_node(args->tree, record);
+            break;
+    }
 
-        HASH_ADD_KEYPTR(hh, tree->data_table, data->key, SHA1_KEY_LENGTH, data);
+    MMDBW_status status = merge_records(
+        args, &node->left_record, &other_node->left_record, network, depth + 1);
+    if (MMDBW_SUCCESS != status) {
+        return status;
     }
-    data->reference_count++;
 
-    return data->key;
-}
+    status = merge_records(args,
+                           &node->right_record,
+                           &other_node->right_record,
+                           flip_network_bit(args->tree, network, depth),
+                           depth + 1);
+    if (MMDBW_SUCCESS != status) {
+        return status;
+    }
 
-static void set_stored_data_in_tree(MMDBW_tree_s *tree,
-                                    const char *const key,
-                                    SV *data_sv) {
-    MMDBW_data_hash_s *data = NULL;
-    HASH_FIND(hh, tree->data_table, key, SHA1_KEY_LENGTH, data);
+    trim_identical_records(args->tree, record);
 
-    if (NULL == data) {
-        croak("Attempt to set unknown data record in tree");
+    return MMDBW_SUCCESS;
+}
+
+// We insert the other tree's data record into this tree at the same depth,
+// so it is merged with or replaces whatever is in this tree there.
+static MMDBW_status merge_data_record(merge_tree_args_s *args,
+                                      MMDBW_record_s *record,
+                                      const char *const other_key,
+                                      uint128_t network,
+                                      uint8_t depth) {
+    MMDBW_tree_s *tree = args->tree;
+
+    if (args->stitching && (record->type == MMDBW_RECORD_TYPE_DATA ||
+                            record->type == MMDBW_RECORD_TYPE_NODE)) {
+        return MMDBW_SHARD_OVERLAP_ERROR;
     }
 
-    if (NULL != data->data_sv) {
+    const char *key = store_data_in_tree(
+        tree, other_key, data_for_key(args->other, other_key));
+    MMDBW_record_s new_record = {.type = MMDBW_RECORD_TYPE_DATA,
+                                 .value = {.key = key}};
+
+    MMDBW_status status = insert_record_at_depth(
+        tree, record, &new_record, network, depth, args->merge_strategy);
+
+    // As in insert_network(), the insert took its own references to the data.
+    decrement_data_reference_count(tree, key);
+
+    return status;
+}
+
+/* Trees sharing a data table can share nodes too. Otherwise, we copy the
+ * subtree and add its data to this tree's data table. */
+static void graft_subtree(merge_tree_args_s *args,
+                          MMDBW_record_s *record,
+                          MMDBW_record_s *other_record) {
+    if (args->tree->data_table == args->other->data_table) {
+        *record = *other_record;
+        share_record_value(args->tree, record);
         return;
     }
 
-    SvREFCNT_inc_simple_void_NN(data_sv);
-    data->data_sv = data_sv;
+    clone_args_s clone_args = {
+        .tree = args->other,
+        .clone = args->tree,
+        .fixed_nodes = NULL,
+        .fixed_node_count = 0,
+        .fixed_node_capacity = 0,
+    };
+    clone_record(&clone_args, other_record, record);
 }
 
-static void decrement_data_reference_count(MMDBW_tree_s *tree,
-                                           const char *const key) {
-    MMDBW_data_hash_s *data = NULL;
-    HASH_FIND(hh, tree->data_table, key, SHA1_KEY_LENGTH, data);
+static bool subtree_has_data(MMDBW_record_s *record) {
+    switch (record->type) {
+        case MMDBW_RECORD_TYPE_EMPTY:
+        case MMDBW_RECORD_TYPE_FIXED_EMPTY:
+        case MMDBW_RECORD_TYPE_ALIAS:
+            return false;
+        case MMDBW_RECORD_TYPE_DATA:
+            return true;
+        case MMDBW_RECORD_TYPE_NODE:
+        case MMDBW_RECORD_TYPE_FIXED_NODE:
+            break;
+    }
 
-    if (NULL == data) {
-        croak("Attempt to remove data that does not exist from tree");
+    return subtree_has_data(&record->value.node->left_record) ||
+           subtree_has_data(&record->value.node->right_record);
+}
+
+// Restrict the tree's networks to a shard of the address space. Shards are
+// built separately and then stitched together with stitch_shard().
+void set_shard(MMDBW_tree_s *tree,
+               const char *ipstr,
+               const uint8_t prefix_length) {
+    verify_ip(tree, ipstr);
+
+    MMDBW_network_s network = resolve_network(tree, ipstr, prefix_length);
+    tree->shard_first_ip =
+        (uint128_t)ip_bytes_to_integer((uint8_t *)network.bytes,
+                                       tree->ip_version) &
+        ~last_address_in_network(tree, 0, network.prefix_length);
+    tree->shard_prefix_length = network.prefix_length;
+    free_network(&network);
+}
+
+// Add a shard's networks to the tree.
+//
+// This walks both trees like merge_tree(), so the shard's subtrees are
+// copied in whole wherever the tree is empty. Data is added to the tree's
+// data table by key, so data used by several shards is only stored once. The
+// shard's data may not overlap any data already in the tree.
+void stitch_shard(MMDBW_tree_s *tree, MMDBW_tree_s *shard) {
+    if (tree->ip_version != shard->ip_version) {
+        croak("You cannot stitch an IPv%" PRIu8 " shard into an IPv%" PRIu8
+              " tree.",
+              shard->ip_version,
+              tree->ip_version);
     }
 
-    data->reference_count--;
-    if (0 == data->reference_count) {
-        HASH_DEL(tree->data_table, data);
-        SvREFCNT_dec(data->data_sv);
-        free((char *)data->key);
-        free(data);
+    if (NULL != tree->journal) {
+        croak("You cannot stitch a shard into a tree that has a journal.");
     }
-}
 
-static MMDBW_network_s resolve_network(MMDBW_tree_s *tree,
-                                       const char *const ipstr,
-                                       uint8_t prefix_length) {
-    uint8_t *bytes = checked_malloc(tree->ip_version == 6 ? 16 : 4);
+    merge_tree_args_s args = {
+        .tree = tree,
+        .other = shard,
+        .merge_strategy = MMDBW_MERGE_STRATEGY_NONE,
+        .stitching = true,
+    };
 
-    if (resolve_ip(tree->ip_version, ipstr, bytes) != MMDBW_SUCCESS) {
-        free(bytes);
-        croak("Invalid IP address: %s", ipstr);
+    MMDBW_status status =
+        merge_records(&args, &tree->root_record, &shard->root_record, 0, 0);
+    if (MMDBW_SUCCESS != status) {
+        croak("Unable to stitch shard: %s", status_error_message(status));
     }
+}
 
-    if (NULL == strchr(ipstr, ':')) {
-        // IPv4
-        if (prefix_length > 32) {
-            free(bytes);
-            croak("Prefix length greater than 32 on an IPv4 network (%s/%d)",
-                  ipstr,
-                  prefix_length);
+// Report every network whose data differs between the tree and the other
+// tree.
+//
+// The callback is called with an array reference of up to batch_size
+// changes. Each change is a [network, key, other_key] array reference, where
+// a key is undef if that tree has no data for the network. Subtrees with the
+// same hash in both trees are skipped without being walked.
+void diff_tree(MMDBW_tree_s *tree,
+               MMDBW_tree_s *other,
+               SV *callback,
+               uint32_t batch_size) {
+    if (tree->ip_version != other->ip_version) {
+        croak("You cannot diff an IPv%" PRIu8 " tree against an IPv%" PRIu8
+              " tree.",
+              tree->ip_version,
+              other->ip_version);
+    }
+
+    diff_args_s args = {
+        .tree = tree,
+        .callback = callback,
+        .batch = NULL,
+        .batch_size = batch_size,
+    };
+
+    diff_records(&args, &tree->root_record, &other->root_record, 0, 0);
+    flush_diff_batch(&args);
+}
+
+static void diff_records(diff_args_s *args,
+                         MMDBW_record_s *record,
+                         MMDBW_record_s *other_record,
+                         uint128_t network,
+                         uint8_t depth) {
+    // The networks an alias points at are diffed in the IPv4 subtree.
+    if (record->type == MMDBW_RECORD_TYPE_ALIAS ||
+        other_record->type == MMDBW_RECORD_TYPE_ALIAS) {
+        return;
+    }
+
+    bool is_node = record->type == MMDBW_RECORD_TYPE_NODE ||
+                   record->type == MMDBW_RECORD_TYPE_FIXED_NODE;
+    bool other_is_node = other_record->type == MMDBW_RECORD_TYPE_NODE ||
+                         other_record->type == MMDBW_RECORD_TYPE_FIXED_NODE;
+
+    if (!is_node && !other_is_node) {
+        const char *key = record->type == MMDBW_RECORD_TYPE_DATA
+                              ? record->value.key
+                              : NULL;
+        const char *other_key = other_record->type == MMDBW_RECORD_TYPE_DATA
+                                    ? other_record->value.key
+                                    : NULL;
+        if (key == other_key ||
+            (key != NULL && other_key != NULL && strcmp(key, other_key) == 0)) {
+            return;
+        }
+        add_diff(args, network, depth, key, other_key);
+        return;
+    }
+
+    if (is_node && other_is_node &&
+        node_hash(record->value.node) ==
+            node_hash(other_record->value.node)) {
+        return;
+    }
+
+    // If only one side is a node, we compare each of its records with the
+    // other side's record.
+    MMDBW_record_s *left = record;
+    MMDBW_record_s *right = record;
+    if (is_node) {
+        left = &record->value.node->left_record;
+        right = &record->value.node->right_record;
+    }
+
+    MMDBW_record_s *other_left = other_record;
+    MMDBW_record_s *other_right = other_record;
+    if (other_is_node) {
+        other_left = &other_record->value.node->left_record;
+        other_right = &other_record->value.node->right_record;
+    }
+
+    diff_records(args, left, other_left, network, depth + 1);
+    diff_records(args,
+                 right,
+                 other_right,
+                 flip_network_bit(args->tree, network, depth),
+                 depth + 1);
+}
+
+static void add_diff(diff_args_s *args,
+                     uint128_t network,
+                     uint8_t depth,
+                     const char *const key,
+                     const char *const other_key) {
+    char address[INET6_ADDRSTRLEN];
+    integer_to_ip_string(
+        args->tree->ip_version, network, address, INET6_ADDRSTRLEN);
+
+    AV *change = newAV();
+    av_push(change, newSVpvf("%s/%" PRIu8, address, depth));
+    av_push(change, NULL == key ? newSV(0) : newSVpv(key, 0));
+    av_push(change, NULL == other_key ? newSV(0) : newSVpv(other_key, 0));
+
+    // We start a new batch after each call so that the callback can keep the
+    // batch it was given.
+    if (NULL == args->batch) {
+        args->batch = newAV();
+    }
+    av_push(args->batch, newRV_noinc((SV *)change));
+
+    if ((uint32_t)(av_len(args->batch) + 1) >= args->batch_size) {
+        flush_diff_batch(args);
+    }
+}
+
+static void flush_diff_batch(diff_args_s *args) {
+    if (NULL == args->batch) {
+        return;
+    }
+
+    AV *batch = args->batch;
+    args->batch = NULL;
+
+    dSP;
+    ENTER;
+    SAVETMPS;
+
+    PUSHMARK(SP);
+    EXTEND(SP, 1);
+    mPUSHs(newRV_noinc((SV *)batch));
+    PUTBACK;
+
+    call_sv(args->callback, G_VOID | G_DISCARD);
+
+    FREETMPS;
+    LEAVE;
+}
+
+static uint64_t node_hash(MMDBW_node_s *node) {
+    if (node->hash != 0) {
+        return node->hash;
+    }
+
+    uint64_t hash = mix_hash(record_hash(&node->left_record) ^
+                             mix_hash(record_hash(&node->right_record) + 1));
+
+    // 0 means that the hash has not been computed.
+    node->hash = hash == 0 ? 1 : hash;
+
+    return node->hash;
+}
+
+static uint64_t record_hash(MMDBW_record_s *record) {
+    switch (record->type) {
+        case MMDBW_RECORD_TYPE_EMPTY:
+        case MMDBW_RECORD_TYPE_FIXED_EMPTY:
+            return EMPTY_RECORD_HASH;
+        case MMDBW_RECORD_TYPE_ALIAS:
+            return ALIAS_RECORD_HASH;
+        case MMDBW_RECORD_TYPE_NODE:
+        case MMDBW_RECORD_TYPE_FIXED_NODE:
+            return node_hash(record->value.node);
+        case MMDBW_RECORD_TYPE_DATA:
+            break;
+    }
+
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char *c = record->value.key; *c; c++) {
+        hash ^= (uint8_t)*c;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return mix_hash(hash);
+}
+
+// This is the splitmix64 finalizer.
+static uint64_t mix_hash(uint64_t hash) {
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+
+    return hash;
+}
+
+// Remove every network covered by the other tree from this tree.
+void subtract_tree(MMDBW_tree_s *tree, MMDBW_tree_s *other) {
+    restrict_tree(tree, other, false, "subtract");
+}
+
+// Remove every network not covered by the other tree from this tree.
+void intersect_tree(MMDBW_tree_s *tree, MMDBW_tree_s *other) {
+    restrict_tree(tree, other, true, "intersect");
+}
+
+static void restrict_tree(MMDBW_tree_s *tree,
+                          MMDBW_tree_s *other,
+                          bool keep_covered,
+                          const char *const operation) {
+    if (tree->ip_version != other->ip_version) {
+        croak("You cannot %s trees with different IP versions.", operation);
+    }
+
+    if (NULL != tree->journal) {
+        croak("You cannot %s a tree that has a journal.", operation);
+    }
+
+    restrict_tree_args_s args = {
+        .tree = tree,
+        .keep_covered = keep_covered,
+    };
+
+    MMDBW_status status =
+        restrict_record(&args, &tree->root_record, &other->root_record, 0, 0);
+    if (MMDBW_SUCCESS != status) {
+        croak("Unable to %s trees: %s",
+              operation,
+              status_error_message(status));
+    }
+}
+
+static MMDBW_status restrict_record(restrict_tree_args_s *args,
+                                    MMDBW_record_s *record,
+                                    MMDBW_record_s *other_record,
+                                    uint128_t network,
+                                    uint8_t depth) {
+    // There is nothing to remove from empty records, and we never change
+    // fixed empty records or aliases.
+    if (record->type == MMDBW_RECORD_TYPE_EMPTY ||
+        record->type == MMDBW_RECORD_TYPE_FIXED_EMPTY ||
+        record->type == MMDBW_RECORD_TYPE_ALIAS) {
+        return MMDBW_SUCCESS;
+    }
+
+    MMDBW_node_s *other_node = NULL;
+    switch (other_record->type) {
+        case MMDBW_RECORD_TYPE_EMPTY:
+        case MMDBW_RECORD_TYPE_FIXED_EMPTY:
+            // The other tree covers none of this network.
+            return args->keep_covered
+                       ? clear_record(args->tree, record, network, depth)
+                       : MMDBW_SUCCESS;
+        case MMDBW_RECORD_TYPE_DATA:
+            // The other tree covers all of this network.
+            return args->keep_covered
+                       ? MMDBW_SUCCESS
+                       : clear_record(args->tree, record, network, depth);
+        case MMDBW_RECORD_TYPE_NODE:
+        case MMDBW_RECORD_TYPE_FIXED_NODE:
+        case MMDBW_RECORD_TYPE_ALIAS:
+            // An alias covers what the IPv4 subtree it points at covers.
+            other_node = other_record->value.node;
+            break;
+    }
+
+    MMDBW_node_s *node = NULL;
+    if (record->type == MMDBW_RECORD_TYPE_DATA) {
+        node = new_node_from_record(args->tree, record);
+        record->value.node = node;
+        record->type = MMDBW_RECORD_TYPE_NODE;
+    } else if (record->value.node == other_node) {
+        // The trees share this subtree, so the other tree covers exactly
+        // the networks in it.
+        return args->keep_covered
+                   ? MMDBW_SUCCESS
+                   : clear_record(args->tree, record, network, depth);
+    } else {
+        node = writable_node(args->tree, record);
+    }
+
+    MMDBW_status status = restrict_record(
+        args, &node->left_record, &other_node->left_record, network, depth + 1);
+    if (MMDBW_SUCCESS != status) {
+        return status;
+    }
+
+    status = restrict_record(args,
+                             &node->right_record,
+                             &other_node->right_record,
+                             flip_network_bit(args->tree, network, depth),
+                             depth + 1);
+    if (MMDBW_SUCCESS != status) {
+        return status;
+    }
+
+    trim_identical_records(args->tree, record);
+
+    return MMDBW_SUCCESS;
+}
+
+// This removes the network in the same way as remove_network(), so fixed
+// empty records and aliases below the record are left in place.
+static MMDBW_status clear_record(MMDBW_tree_s *tree,
+                                 MMDBW_record_s *record,
+                                 uint128_t network,
+                                 uint8_t depth) {
+    MMDBW_record_s empty_record = {.type = MMDBW_RECORD_TYPE_EMPTY};
+
+    return insert_record_at_depth(tree,
+                                  record,
+                                  &empty_record,
+                                  network,
+                                  depth,
+                                  MMDBW_MERGE_STRATEGY_NONE);
+}
+
+// Insert a record for the network at the given depth, starting at the record
+// for that network rather than at the root of the tree.
+static MMDBW_status
+insert_record_at_depth(MMDBW_tree_s *tree,
+                       MMDBW_record_s *record,
+                       MMDBW_record_s *new_record,
+                       uint128_t network,
+                       uint8_t depth,
+                       MMDBW_merge_strategy merge_strategy) {
+    uint8_t bytes[tree->ip_version == 6 ? 16 : 4];
+    integer_to_ip_bytes(tree->ip_version, network, bytes);
+    MMDBW_network_s record_network = {
+        .bytes = bytes,
+        .prefix_length = depth,
+    };
+
+    return insert_record_into_next_node(tree,
+                                        record,
+                                        &record_network,
+                                        depth,
+                                        new_record,
+                                        merge_strategy,
+                                        false);
+}
+
+static bool data_is_in_tree(MMDBW_tree_s *tree, const char *const key) {
+    MMDBW_data_hash_s *data = NULL;
+    HASH_FIND(hh, tree->data_table->entries, key, SHA1_KEY_LENGTH, data);
+
+    return NULL != data;
+}
+
+static const char *
+store_data_in_tree(MMDBW_tree_s *tree, const char *const key, SV *data_sv) {
+    const char *const new_key = increment_data_reference_count(tree, key);
+    set_stored_data_in_tree(tree, key, data_sv);
+
+    return new_key;
+}
+
+static const char *increment_data_reference_count(MMDBW_tree_s *tree,
+                                                  const char *const key) {
+    MMDBW_data_hash_s *data = NULL;
+    HASH_FIND(hh, tree->data_table->entries, key, SHA1_KEY_LENGTH, data);
+
+    /* We allow this possibility as we need to create the record separately
+       from updating the data when thawing */
+    if (NULL == data) {
+        data = checked_malloc(sizeof(MMDBW_data_hash_s));
+        data->reference_count = 0;
+
+        data->data_sv = NULL;
+
+        data->key = checked_malloc(SHA1_KEY_LENGTH + 1);
+        strcpy((char *)data->key, key);
+
+        HASH_ADD_KEYPTR(hh,
+                        tree->data_table->entries,
+                        data->key,
+                        SHA1_KEY_LENGTH,
+                        data);
+    }
+    data->reference_count++;
+
+    return data->key;
+}
+
+static void set_stored_data_in_tree(MMDBW_tree_s *tree,
+                                    const char *const key,
+                                    SV *data_sv) {
+    MMDBW_data_hash_s *data = NULL;
+    HASH_FIND(hh, tree->data_table->entries, key, SHA1_KEY_LENGTH, data);
+
+    if (NULL == data) {
+        croak("Attempt to set unknown data record in tree");
+    }
+
+    if (NULL != data->data_sv) {
+        return;
+    }
+
+    SvREFCNT_inc_simple_void_NN(data_sv);
+    data->data_sv = data_sv;
+}
+
+static void decrement_data_reference_count(MMDBW_tree_s *tree,
+                                           const char *const key) {
+    MMDBW_data_hash_s *data = NULL;
+    HASH_FIND(hh, tree->data_table->entries, key, SHA1_KEY_LENGTH, data);
+
+    if (NULL == data) {
+        croak("Attempt to remove data that does not exist from tree");
+    }
+
+    data->reference_count--;
+    if (0 == data->reference_count) {
+        HASH_DEL(tree->data_table->entries, data);
+        SvREFCNT_dec(data->data_sv);
+        free((char *)data->key);
+        free(data);
+    }
+}
+
+static MMDBW_network_s resolve_network(MMDBW_tree_s *tree,
+                                       const char *const ipstr,
+                                       uint8_t prefix_length) {
+    uint8_t *bytes = checked_malloc(tree->ip_version == 6 ? 16 : 4);
+
+    if (resolve_ip(tree->ip_version, ipstr, bytes) != MMDBW_SUCCESS) {
+        free(bytes);
+        croak("Invalid IP address: %s", ipstr);
+    }
+
+    if (NULL == strchr(ipstr, ':')) {
+        // IPv4
+        if (prefix_length > 32) {
+            free(bytes);
+            croak("Prefix length greater than 32 on an IPv4 network (%s/%d)",
+                  ipstr,
+                  prefix_length);
         }
         if (tree->ip_version == 6) {
             // Inserting IPv4 network into an IPv6 tree
@@ -867,8 +2284,9 @@ insert_record_into_next_node(MMDBW_tree_s *tree,
         }
         case MMDBW_RECORD_TYPE_FIXED_NODE:
         case MMDBW_RECORD_TYPE_NODE: {
-            // We're a node already.
-            next_node = current_record->value.node;
+            // We're a node already. If a snapshot shares the node, we
+            // change our own copy of it.
+            next_node = writable_node(tree, current_record);
             break;
         }
     }
@@ -918,52 +2336,63 @@ insert_record_into_next_node(MMDBW_tree_s *tree,
 
     // We inserted the new record into the right and/or left record of the next
     // node. We now need to trim the tree upwards by merging identical records.
-    // Basically what we do here is take care of the case where the record
-    // we're at points at another node, and the records in that node are both
-    // the same. In that case, we delete the node we point at and take its
-    // value on ourselves.
-
-    if (next_node->left_record.type == next_node->right_record.type &&
-        // We don't allow merging into aliases or fixed nodes
-        current_record->type == MMDBW_RECORD_TYPE_NODE) {
-        switch (next_node->left_record.type) {
-            case MMDBW_RECORD_TYPE_EMPTY: {
-                MMDBW_status status =
-                    free_node_and_subnodes(tree, next_node, false);
-                if (status != MMDBW_SUCCESS) {
-                    return MMDBW_SUCCESS;
-                }
-                current_record->type = MMDBW_RECORD_TYPE_EMPTY;
-                break;
+    trim_identical_records(tree, current_record);
+
+    return MMDBW_SUCCESS;
+}
+
+// Basically what we do here is take care of the case where the record we're
+// at points at another node, and the records in that node are both the same.
+// In that case, we delete the node we point at and take its value on
+// ourselves.
+static void trim_identical_records(MMDBW_tree_s *tree,
+                                   MMDBW_record_s *current_record) {
+    // We don't allow merging into aliases or fixed nodes
+    if (current_record->type != MMDBW_RECORD_TYPE_NODE) {
+        return;
+    }
+
+    MMDBW_node_s *next_node = current_record->value.node;
+    if (next_node->left_record.type != next_node->right_record.type) {
+        return;
+    }
+
+    switch (next_node->left_record.type) {
+        case MMDBW_RECORD_TYPE_EMPTY: {
+            MMDBW_status status =
+                free_node_and_subnodes(tree, next_node, false);
+            if (status != MMDBW_SUCCESS) {
+                return;
             }
-            case MMDBW_RECORD_TYPE_DATA: {
-                // If the two keys are the same, the records can be merged.
-                // Otherwise, break.
-                if (strcmp(next_node->left_record.value.key,
-                           next_node->right_record.value.key)) {
-                    break;
-                }
-                const char *key = increment_data_reference_count(
-                    tree, next_node->left_record.value.key);
-                MMDBW_status status =
-                    free_node_and_subnodes(tree, next_node, false);
-                if (status != MMDBW_SUCCESS) {
-                    return MMDBW_SUCCESS;
-                }
-                current_record->type = MMDBW_RECORD_TYPE_DATA;
-                current_record->value.key = key;
+            current_record->type = MMDBW_RECORD_TYPE_EMPTY;
+            break;
+        }
+        case MMDBW_RECORD_TYPE_DATA: {
+            // If the two keys are the same, the records can be merged.
+            // Otherwise, break.
+            if (strcmp(next_node->left_record.value.key,
+                       next_node->right_record.value.key)) {
                 break;
             }
-            case MMDBW_RECORD_TYPE_ALIAS:
-            case MMDBW_RECORD_TYPE_FIXED_NODE:
-            case MMDBW_RECORD_TYPE_FIXED_EMPTY:
-            case MMDBW_RECORD_TYPE_NODE: {
-                // Do nothing in these cases. We don't trim immutable nodes.
-                break;
+            const char *key = increment_data_reference_count(
+                tree, next_node->left_record.value.key);
+            MMDBW_status status =
+                free_node_and_subnodes(tree, next_node, false);
+            if (status != MMDBW_SUCCESS) {
+                return;
             }
+            current_record->type = MMDBW_RECORD_TYPE_DATA;
+            current_record->value.key = key;
+            break;
+        }
+        case MMDBW_RECORD_TYPE_ALIAS:
+        case MMDBW_RECORD_TYPE_FIXED_NODE:
+        case MMDBW_RECORD_TYPE_FIXED_EMPTY:
+        case MMDBW_RECORD_TYPE_NODE: {
+            // Do nothing in these cases. We don't trim immutable nodes.
+            break;
         }
     }
-    return MMDBW_SUCCESS;
 }
 
 static MMDBW_status
@@ -1308,19 +2737,462 @@ static MMDBW_status find_record_for_network(MMDBW_tree_s *tree,
     return MMDBW_SUCCESS;
 }
 
-static MMDBW_node_s *new_node_from_record(MMDBW_tree_s *tree,
-                                          MMDBW_record_s *record) {
-    MMDBW_node_s *node = new_node();
-    if (record->type == MMDBW_RECORD_TYPE_DATA) {
-        /* We only need to increment the reference count once as we are
-           replacing the parent record */
-        increment_data_reference_count(tree, record->value.key);
+// Find the record for the network, following aliases, without walking the
+// rest of the tree.
+MMDBW_network_record_s record_for_network(MMDBW_tree_s *tree,
+                                          const char *ipstr,
+                                          uint8_t prefix_length) {
+    MMDBW_network_s network = resolve_network(tree, ipstr, prefix_length);
 
-        node->left_record.type = MMDBW_RECORD_TYPE_DATA;
-        node->left_record.value.key = record->value.key;
+    MMDBW_network_record_s found = {
+        .network = 0,
+        .prefix_length = network.prefix_length,
+        .record = &tree->root_record,
+        .depth = 0,
+        .node = NULL,
+        .node_network = 0,
+    };
 
-        node->right_record.type = MMDBW_RECORD_TYPE_DATA;
-        node->right_record.value.key = record->value.key;
+    for (uint8_t current_bit = 0; current_bit < network.prefix_length;
+         current_bit++) {
+        uint128_t node_network = found.network;
+        bool is_right = network_bit_value(&network, current_bit);
+        if (is_right) {
+            found.network =
+                flip_network_bit(tree, found.network, current_bit);
+        }
+
+        // Once we reach a record that is not a node, we only need the rest
+        // of the network's bits.
+        if (found.depth != current_bit ||
+            !(found.record->type == MMDBW_RECORD_TYPE_NODE ||
+              found.record->type == MMDBW_RECORD_TYPE_FIXED_NODE ||
+              found.record->type == MMDBW_RECORD_TYPE_ALIAS)) {
+            continue;
+        }
+
+        found.node = found.record->value.node;
+        found.node_network = node_network;
+        found.record =
+            is_right ? &found.node->right_record : &found.node->left_record;
+        found.depth = current_bit + 1;
+    }
+
+    free_network(&network);
+
+    return found;
+}
+
+// Returns an array of [network, data] array references for the data records
+// in the network, in network order. If the network is inside a larger data
+// record, the network itself is returned with that record's data.
+AV *networks_within(MMDBW_tree_s *tree,
+                    const char *ipstr,
+                    uint8_t prefix_length) {
+    MMDBW_network_record_s found =
+        record_for_network(tree, ipstr, prefix_length);
+
+    AV *networks = newAV();
+    MMDBW_record_s *record = found.record;
+    switch (record->type) {
+        case MMDBW_RECORD_TYPE_EMPTY:
+        case MMDBW_RECORD_TYPE_FIXED_EMPTY:
+            break;
+        case MMDBW_RECORD_TYPE_DATA:
+            add_network_within(tree,
+                               networks,
+                               found.network,
+                               found.prefix_length,
+                               record->value.key);
+            break;
+        case MMDBW_RECORD_TYPE_NODE:
+        case MMDBW_RECORD_TYPE_FIXED_NODE:
+        case MMDBW_RECORD_TYPE_ALIAS:
+            collect_networks_within(tree,
+                                    networks,
+                                    record->value.node,
+                                    found.network,
+                                    found.prefix_length);
+            break;
+    }
+
+    return networks;
+}
+
+static void collect_networks_within(MMDBW_tree_s *tree,
+                                    AV *networks,
+                                    MMDBW_node_s *node,
+                                    uint128_t network,
+                                    uint8_t depth) {
+    MMDBW_record_s *records[2] = {&node->left_record, &node->right_record};
+    uint128_t record_networks[2] = {
+        network, flip_network_bit(tree, network, depth)};
+
+    for (int i = 0; i < 2; i++) {
+        MMDBW_record_s *record = records[i];
+        // As with iterate(), the networks an alias points at are only
+        // returned once, in the IPv4 subtree.
+        if (record->type == MMDBW_RECORD_TYPE_DATA) {
+            add_network_within(tree,
+                               networks,
+                               record_networks[i],
+                               depth + 1,
+                               record->value.key);
+        } else if (record->type == MMDBW_RECORD_TYPE_NODE ||
+                   record->type == MMDBW_RECORD_TYPE_FIXED_NODE) {
+            collect_networks_within(tree,
+                                    networks,
+                                    record->value.node,
+                                    record_networks[i],
+                                    depth + 1);
+        }
+    }
+}
+
+static void add_network_within(MMDBW_tree_s *tree,
+                               AV *networks,
+                               uint128_t network,
+                               uint8_t prefix_length,
+                               const char *const key) {
+    char address[INET6_ADDRSTRLEN];
+    integer_to_ip_string(tree->ip_version, network, address, INET6_ADDRSTRLEN);
+
+    AV *entry = newAV();
+    av_push(entry, newSVpvf("%s/%" PRIu8, address, prefix_length));
+    av_push(entry, newSVsv(data_for_key(tree, key)));
+    av_push(networks, newRV_noinc((SV *)entry));
+}
+
+// Returns an array of the networks in CIDR notation whose data has the key,
+// in network order.
+AV *networks_for_data_key(MMDBW_tree_s *tree, const char *const key) {
+    MMDBW_key_index_entry_s *entry;
+    HASH_FIND_STR(current_key_index(tree)->entries, key, entry);
+
+    AV *networks = newAV();
+    if (NULL == entry) {
+        return networks;
+    }
+
+    av_extend(networks, entry->network_count);
+    for (size_t i = 0; i < entry->network_count; i++) {
+        char address[INET6_ADDRSTRLEN];
+        integer_to_ip_string(tree->ip_version,
+                             entry->networks[i].network,
+                             address,
+                             INET6_ADDRSTRLEN);
+        av_push(networks,
+                newSVpvf("%s/%" PRIu8,
+                         address,
+                         entry->networks[i].prefix_length));
+    }
+
+    return networks;
+}
+
+// Returns the tree's index of the networks for each data key, building it if
+// the tree has changed since it was last built.
+MMDBW_key_index_s *current_key_index(MMDBW_tree_s *tree) {
+    // Every change to the tree clears the cached hashes of the nodes above
+    // it, so checking for a change only rehashes the nodes that changed. The
+    // index itself is not updated in place. After any change it is rebuilt
+    // from a walk of the whole tree.
+    uint64_t root_hash = record_hash(&tree->root_record);
+
+    MMDBW_key_index_s *index = tree->key_index;
+    if (NULL != index && index->root_hash == root_hash) {
+        return index;
+    }
+
+    free_key_index(index);
+    index = checked_malloc(sizeof(MMDBW_key_index_s));
+    index->entries = NULL;
+    index->root_hash = root_hash;
+    tree->key_index = index;
+
+    index_record(tree, index, &tree->root_record, 0, 0);
+
+    return index;
+}
+
+static void index_record(MMDBW_tree_s *tree,
+                         MMDBW_key_index_s *index,
+                         MMDBW_record_s *record,
+                         uint128_t network,
+                         uint8_t depth) {
+    switch (record->type) {
+        case MMDBW_RECORD_TYPE_EMPTY:
+        case MMDBW_RECORD_TYPE_FIXED_EMPTY:
+        // As with iterate(), the networks an alias points at are only
+        // indexed once, in the IPv4 subtree.
+        case MMDBW_RECORD_TYPE_ALIAS:
+            return;
+        case MMDBW_RECORD_TYPE_NODE:
+        case MMDBW_RECORD_TYPE_FIXED_NODE:
+            index_record(tree,
+                         index,
+                         &record->value.node->left_record,
+                         network,
+                         depth + 1);
+            index_record(tree,
+                         index,
+                         &record->value.node->right_record,
+                         flip_network_bit(tree, network, depth),
+                         depth + 1);
+            return;
+        case MMDBW_RECORD_TYPE_DATA:
+            break;
+    }
+
+    MMDBW_key_index_entry_s *entry;
+    HASH_FIND_STR(index->entries, record->value.key, entry);
+    if (NULL == entry) {
+        // We copy the key as the tree's data table entry may be freed and
+        // added again while the tree's hash stays the same.
+        size_t key_length = strlen(record->value.key);
+        char *key = checked_malloc(key_length + 1);
+        memcpy(key, record->value.key, key_length + 1);
+
+        entry = checked_malloc(sizeof(MMDBW_key_index_entry_s));
+        entry->key = key;
+        entry->networks = NULL;
+        entry->network_count = 0;
+        entry->network_capacity = 0;
+        entry->address_count = 0;
+        HASH_ADD_KEYPTR(hh, index->entries, entry->key, key_length, entry);
+    }
+
+    if (entry->network_count == entry->network_capacity) {
+        entry->network_capacity =
+            entry->network_capacity == 0 ? 16 : entry->network_capacity * 2;
+        entry->networks =
+            realloc(entry->networks,
+                    entry->network_capacity * sizeof(MMDBW_indexed_network_s));
+        if (NULL == entry->networks) {
+            abort();
+        }
+    }
+
+    entry->networks[entry->network_count++] = (MMDBW_indexed_network_s){
+        .network = network, .prefix_length = depth};
+
+    // Only ::/0 has more addresses than fit in 128 bits.
+    uint8_t host_bits = (tree->ip_version == 6 ? 128 : 32) - depth;
+    uint128_t size =
+        host_bits == 128 ? ~(uint128_t)0 : (uint128_t)1 << host_bits;
+    entry->address_count = entry->address_count + size < entry->address_count
+                               ? ~(uint128_t)0
+                               : entry->address_count + size;
+}
+
+static void free_key_index(MMDBW_key_index_s *index) {
+    if (NULL == index) {
+        return;
+    }
+
+    MMDBW_key_index_entry_s *entry, *tmp;
+    HASH_ITER(hh, index->entries, entry, tmp) {
+        HASH_DEL(index->entries, entry);
+        free((void *)entry->key);
+        free(entry->networks);
+        free(entry);
+    }
+    free(index);
+}
+
+// Replace the data of every network whose data has old_key with new_data,
+// whose key is new_key. If the tree already has data with new_key, the
+// networks use that. The networks are found in one walk of the tree, and
+// networks that end up next to a network with the same data are merged on the
+// way back up. Returns the number of networks that were changed.
+uint64_t replace_data(MMDBW_tree_s *tree,
+                      const char *const old_key,
+                      const char *const new_key,
+                      SV *new_data) {
+    if (NULL != tree->journal) {
+        croak("You cannot replace data in a tree that has a journal.");
+    }
+
+    if (strcmp(old_key, new_key) == 0 ||
+        strlen(old_key) != SHA1_KEY_LENGTH || !data_is_in_tree(tree, old_key)) {
+        return 0;
+    }
+
+    HV *keys = (HV *)sv_2mortal((SV *)newHV());
+    (void)hv_store(keys, old_key, strlen(old_key), &PL_sv_yes, 0);
+
+    // We hold a reference to the new data so that it stays in the data table
+    // while its records are merged with their neighbors.
+    const char *key = store_data_in_tree(tree, new_key, new_data);
+
+    rewrite_data_args_s args = {
+        .tree = tree,
+        .keys = keys,
+        .predicate = NULL,
+        .new_key = key,
+        .error = NULL,
+        .rewritten = 0,
+        .path = {&tree->root_record},
+        .writable_depth = 0,
+    };
+
+    rewrite_matching_records(&args, 0);
+
+    decrement_data_reference_count(tree, key);
+
+    return args.rewritten;
+}
+
+// Remove every network whose data has a key in keys with a true value. If
+// predicate is not NULL, it is called with the data and key of each key that
+// is not in keys yet, and its result is stored in keys, so it is called once
+// per key. Networks are removed in one pass over the tree, and nodes that end
+// up with two empty records are removed on the way back up. Returns the
+// number of networks that were removed.
+uint64_t remove_data_records(MMDBW_tree_s *tree, HV *keys, SV *predicate) {
+    // The removal is not journaled, so thawing the tree would not replay it.
+    if (NULL != tree->journal) {
+        croak("You cannot remove data from a tree that has a journal.");
+    }
+
+    rewrite_data_args_s args = {
+        .tree = tree,
+        .keys = keys,
+        .predicate = predicate,
+        .new_key = NULL,
+        .error = NULL,
+        .rewritten = 0,
+        .path = {&tree->root_record},
+        .writable_depth = 0,
+    };
+
+    rewrite_matching_records(&args, 0);
+
+    // The predicate died. We stop at the first error so that the tree is
+    // still pruned, and then rethrow it.
+    if (NULL != args.error) {
+        croak_sv(args.error);
+    }
+
+    return args.rewritten;
+}
+
+static void rewrite_matching_records(rewrite_data_args_s *args, uint8_t depth) {
+    MMDBW_record_s *record = args->path[depth];
+
+    switch (record->type) {
+        case MMDBW_RECORD_TYPE_EMPTY:
+        case MMDBW_RECORD_TYPE_FIXED_EMPTY:
+        case MMDBW_RECORD_TYPE_ALIAS:
+            // The networks an alias points to are changed where they are in
+            // the tree.
+            return;
+        case MMDBW_RECORD_TYPE_DATA:
+            break;
+        case MMDBW_RECORD_TYPE_NODE:
+        case MMDBW_RECORD_TYPE_FIXED_NODE:
+            for (int is_right = 0; is_right <= 1; is_right++) {
+                if (NULL != args->error) {
+                    break;
+                }
+                // Nodes are only made writable when we find a record to
+                // change, so the subtrees we share with snapshots are not
+                // copied unless they change. When a node is copied, the
+                // records below it move, so we get the record from the path
+                // again.
+                MMDBW_node_s *node = args->path[depth]->value.node;
+                args->path[depth + 1] =
+                    is_right ? &node->right_record : &node->left_record;
+                args->is_right[depth] = is_right;
+                if (args->writable_depth > depth + 1) {
+                    args->writable_depth = depth + 1;
+                }
+                rewrite_matching_records(args, depth + 1);
+            }
+            if (args->writable_depth > depth) {
+                trim_identical_records(args->tree, args->path[depth]);
+            }
+            return;
+    }
+
+    if (!data_record_matches(args, record->value.key)) {
+        return;
+    }
+
+    for (uint8_t i = args->writable_depth; i < depth; i++) {
+        MMDBW_node_s *node = writable_node(args->tree, args->path[i]);
+        args->path[i + 1] =
+            args->is_right[i] ? &node->right_record : &node->left_record;
+    }
+    args->writable_depth = depth;
+
+    record = args->path[depth];
+    const char *old_key = record->value.key;
+    if (NULL == args->new_key) {
+        record->type = MMDBW_RECORD_TYPE_EMPTY;
+    } else {
+        record->value.key =
+            increment_data_reference_count(args->tree, args->new_key);
+    }
+    decrement_data_reference_count(args->tree, old_key);
+    args->rewritten++;
+}
+
+static bool data_record_matches(rewrite_data_args_s *args,
+                                const char *const key) {
+    size_t key_length = strlen(key);
+    SV **matches = hv_fetch(args->keys, key, key_length, 0);
+    if (NULL != matches) {
+        return SvTRUE(*matches);
+    }
+
+    if (NULL == args->predicate) {
+        return false;
+    }
+
+    dSP;
+    ENTER;
+    SAVETMPS;
+
+    PUSHMARK(SP);
+    EXTEND(SP, 2);
+    PUSHs(data_for_key(args->tree, key));
+    mPUSHs(newSVpvn(key, key_length));
+    PUTBACK;
+
+    int count = call_sv(args->predicate, G_SCALAR | G_EVAL);
+
+    SPAGAIN;
+
+    bool match = count == 1 && SvTRUE(POPs);
+
+    PUTBACK;
+    FREETMPS;
+    LEAVE;
+
+    if (SvTRUE(ERRSV)) {
+        args->error = sv_2mortal(newSVsv(ERRSV));
+        return false;
+    }
+
+    (void)hv_store(args->keys, key, key_length, boolSV(match), 0);
+
+    return match;
+}
+
+static MMDBW_node_s *new_node_from_record(MMDBW_tree_s *tree,
+                                          MMDBW_record_s *record) {
+    MMDBW_node_s *node = new_node();
+    if (record->type == MMDBW_RECORD_TYPE_DATA) {
+        /* We only need to increment the reference count once as we are
+           replacing the parent record */
+        increment_data_reference_count(tree, record->value.key);
+
+        node->left_record.type = MMDBW_RECORD_TYPE_DATA;
+        node->left_record.value.key = record->value.key;
+
+        node->right_record.type = MMDBW_RECORD_TYPE_DATA;
+        node->right_record.value.key = record->value.key;
     }
 
     return node;
@@ -1330,14 +3202,94 @@ MMDBW_node_s *new_node() {
     MMDBW_node_s *node = checked_malloc(sizeof(MMDBW_node_s));
 
     node->number = 0;
+    node->reference_count = 1;
+    node->hash = 0;
     node->left_record.type = node->right_record.type = MMDBW_RECORD_TYPE_EMPTY;
 
     return node;
 }
 
+/* A node can be shared by a tree and its snapshots. Before changing a node,
+ * we make sure that the record we reached it through is the only one
+ * pointing at it, copying the node if it is not. */
+static MMDBW_node_s *writable_node(MMDBW_tree_s *tree, MMDBW_record_s *record) {
+    MMDBW_node_s *node = record->value.node;
+    if (node->reference_count == 1) {
+        // The caller is about to change the node, so its hash will be stale.
+        // Every change to a node's subtree reaches it through here.
+        node->hash = 0;
+        return node;
+    }
+
+    MMDBW_node_s *copy = new_node();
+    copy->number = node->number;
+    copy->left_record = node->left_record;
+    copy->right_record = node->right_record;
+    share_record_value(tree, &copy->left_record);
+    share_record_value(tree, &copy->right_record);
+
+    node->reference_count--;
+    record->value.node = copy;
+
+    if (record->type == MMDBW_RECORD_TYPE_FIXED_NODE) {
+        repoint_aliases(tree, node, copy);
+    }
+
+    return copy;
+}
+
+static void share_record_value(MMDBW_tree_s *tree, MMDBW_record_s *record) {
+    if (record->type == MMDBW_RECORD_TYPE_DATA) {
+        increment_data_reference_count(tree, record->value.key);
+    } else if (record->type == MMDBW_RECORD_TYPE_NODE ||
+               record->type == MMDBW_RECORD_TYPE_FIXED_NODE) {
+        record->value.node->reference_count++;
+    }
+}
+
+/* When we copy the IPv4 root node of a tree with aliases, the tree's alias
+ * records have to point at the copy instead. The nodes above the alias
+ * records may be shared too, so we copy them as well. */
+static void repoint_aliases(MMDBW_tree_s *tree,
+                            MMDBW_node_s *node,
+                            MMDBW_node_s *copy) {
+    if (tree->ip_version != 6) {
+        return;
+    }
+
+    for (size_t i = 0; i < sizeof(ipv4_aliases) / sizeof(struct network); i++) {
+        MMDBW_network_s alias_network = resolve_network(
+            tree, ipv4_aliases[i].ipstr, ipv4_aliases[i].prefix_length);
+
+        MMDBW_record_s *record;
+        find_record_for_network(tree, &alias_network, &record);
+        if (record->type == MMDBW_RECORD_TYPE_ALIAS &&
+            record->value.node == node) {
+            record = &tree->root_record;
+            for (int current_bit = 0;
+                 current_bit < alias_network.prefix_length;
+                 current_bit++) {
+                MMDBW_node_s *next_node = writable_node(tree, record);
+                record = network_bit_value(&alias_network, current_bit)
+                             ? &next_node->right_record
+                             : &next_node->left_record;
+            }
+            record->value.node = copy;
+        }
+
+        free_network(&alias_network);
+    }
+}
+
 static MMDBW_status free_node_and_subnodes(MMDBW_tree_s *tree,
                                            MMDBW_node_s *node,
                                            bool remove_alias_and_fixed_nodes) {
+    // The node is still part of a snapshot.
+    if (node->reference_count > 1) {
+        node->reference_count--;
+        return MMDBW_SUCCESS;
+    }
+
     MMDBW_status status = free_record_value(
         tree, &(node->left_record), remove_alias_and_fixed_nodes);
     if (status != MMDBW_SUCCESS) {
@@ -1416,7 +3368,12 @@ static void assign_node_number(MMDBW_tree_s *tree,
 void freeze_tree(MMDBW_tree_s *tree,
                  char *filename,
                  char *frozen_params,
-                 size_t frozen_params_size) {
+                 size_t frozen_params_size,
+                 uint8_t format) {
+    if (format < 1 || format > 3) {
+        croak("Unknown freeze format: %" PRIu8, format);
+    }
+
     FILE *file = fopen(filename, "wb");
     if (!file) {
         croak("Could not open file %s: %s", filename, strerror(errno));
@@ -1425,17 +3382,41 @@ void freeze_tree(MMDBW_tree_s *tree,
     freeze_args_s args = {
         .file = file,
         .filename = filename,
+        .offset = 0,
+        .data_ids = NULL,
+        .previous_network = 0,
+        .network_count = 0,
+        .network_blocks = {.items = NULL, .count = 0, .capacity = 0},
+        .node_index = 0,
+        .fixed_nodes = {.items = NULL, .count = 0, .capacity = 0},
     };
 
     freeze_to_file(&args, &frozen_params_size, 4);
     freeze_to_file(&args, frozen_params, frozen_params_size);
 
-    freeze_search_tree(tree, &args);
+    if (format == 2) {
+        uint64_t network_count =
+            collect_frozen_data(&args, &tree->root_record);
+        freeze_data_table(&args, tree);
+        freeze_network_stream(&args, tree, network_count);
+        freeze_network_index(&args);
+        free_data_ids(&args);
+        freeze_to_file(&args, &args.data_index_offset, sizeof(uint64_t));
+    } else if (format == 3) {
+        collect_frozen_data(&args, &tree->root_record);
+        freeze_data_table(&args, tree);
+        freeze_node_dump(&args, &tree->root_record);
+        free_data_ids(&args);
+        free(args.fixed_nodes.items);
+        freeze_to_file(&args, &args.data_index_offset, sizeof(uint64_t));
+    } else {
+        freeze_search_tree(tree, &args);
 
-    freeze_to_file(&args, SEVENTEEN_NULLS, 17);
-    freeze_to_file(&args, FREEZE_SEPARATOR, FREEZE_SEPARATOR_LENGTH);
+        freeze_to_file(&args, SEVENTEEN_NULLS, 17);
+        freeze_to_file(&args, FREEZE_SEPARATOR, FREEZE_SEPARATOR_LENGTH);
 
-    freeze_data_to_file(&args, tree);
+        freeze_data_to_file(&args, tree);
+    }
 
     if (fclose(file) != 0) {
         croak("Could not close file %s: %s", filename, strerror(errno));
@@ -1500,28 +3481,49 @@ static void freeze_data_record(MMDBW_tree_s *UNUSED(tree),
 
 static void freeze_to_file(freeze_args_s *args, void *data, size_t size) {
     checked_fwrite(args->file, args->filename, data, size);
+    args->offset += size;
 }
 
+/* The data is written as a series of length-prefixed Sereal documents, each
+ * containing a hash of up to FREEZE_DATA_BATCH_SIZE records, so that we never
+ * hold more than one batch of encoded data in memory. Older versions wrote a
+ * single document for all of the data, which is just a series of one. */
 static void freeze_data_to_file(freeze_args_s *args, MMDBW_tree_s *tree) {
-    HV *data_hash = newHV();
+    HV *batch = newHV();
+    bool frozen_any = false;
 
     MMDBW_data_hash_s *item, *tmp;
-    HASH_ITER(hh, tree->data_table, item, tmp) {
+    HASH_ITER(hh, tree->data_table->entries, item, tmp) {
         SvREFCNT_inc_simple_void_NN(item->data_sv);
-        (void)hv_store(data_hash, item->key, SHA1_KEY_LENGTH, item->data_sv, 0);
+        (void)hv_store(batch, item->key, SHA1_KEY_LENGTH, item->data_sv, 0);
+
+        if (HvUSEDKEYS(batch) == FREEZE_DATA_BATCH_SIZE) {
+            freeze_data_batch(args, batch);
+            frozen_any = true;
+        }
+    }
+
+    /* We always write at least one document so that older versions can thaw
+     * a tree with no data. */
+    if (HvUSEDKEYS(batch) || !frozen_any) {
+        freeze_data_batch(args, batch);
     }
 
-    SV *frozen_data = freeze_hash(data_hash);
+    SvREFCNT_dec((SV *)batch);
+}
+
+/* When the batch is cleared, Perl decrements the ref count of each value,
+ * which undoes the increment in freeze_data_to_file. */
+static void freeze_data_batch(freeze_args_s *args, HV *batch) {
+    SV *frozen_data = freeze_hash(batch);
     STRLEN frozen_data_size;
     char *frozen_data_chars = SvPV(frozen_data, frozen_data_size);
 
-    checked_fwrite(
-        args->file, args->filename, &frozen_data_size, sizeof(STRLEN));
-    checked_fwrite(
-        args->file, args->filename, frozen_data_chars, frozen_data_size);
+    freeze_to_file(args, &frozen_data_size, sizeof(STRLEN));
+    freeze_to_file(args, frozen_data_chars, frozen_data_size);
 
     SvREFCNT_dec(frozen_data);
-    SvREFCNT_dec((SV *)data_hash);
+    hv_clear(batch);
 }
 
 static SV *freeze_hash(HV *hash) {
@@ -1561,431 +3563,3366 @@ static SV *freeze_hash(HV *hash) {
     return frozen;
 }
 
-MMDBW_tree_s *thaw_tree(char *filename,
-                        uint32_t initial_offset,
-                        uint8_t ip_version,
-                        uint8_t record_size,
-                        MMDBW_merge_strategy merge_strategy,
-                        const bool alias_ipv6,
-                        const bool remove_reserved_networks) {
-#ifdef WIN32
-    int fd = open(filename, O_RDONLY);
-#else
-    int fd = open(filename, O_RDONLY, 0);
-#endif
-    if (fd == -1) {
-        croak("Could not open file %s: %s", filename, strerror(errno));
+/* Give each distinct data key in the tree a data ID, in the order we find
+ * them, and return the number of data records.
+ *
+ * We cannot use the tree's data table for this. A snapshot shares the table,
+ * so it can have data that only the other tree uses, and the reference counts
+ * include the records of both trees. Aliases are not followed, as the records
+ * they point at are counted where they are. */
+static uint64_t collect_frozen_data(freeze_args_s *args,
+                                    MMDBW_record_s *record) {
+    switch (record->type) {
+        case MMDBW_RECORD_TYPE_EMPTY:
+        case MMDBW_RECORD_TYPE_FIXED_EMPTY:
+        case MMDBW_RECORD_TYPE_ALIAS:
+            return 0;
+        case MMDBW_RECORD_TYPE_NODE:
+        case MMDBW_RECORD_TYPE_FIXED_NODE:
+            return collect_frozen_data(args,
+                                       &record->value.node->left_record) +
+                   collect_frozen_data(args,
+                                       &record->value.node->right_record);
+        case MMDBW_RECORD_TYPE_DATA:
+            break;
     }
 
-    struct stat fileinfo;
-    if (fstat(fd, &fileinfo) == -1) {
-        close(fd);
-        croak("Could not stat file: %s: %s", filename, strerror(errno));
+    freeze_data_id_s *data_id = NULL;
+    HASH_FIND(
+        hh, args->data_ids, record->value.key, SHA1_KEY_LENGTH, data_id);
+    if (NULL == data_id) {
+        data_id = checked_malloc(sizeof(freeze_data_id_s));
+        data_id->key = record->value.key;
+        data_id->id = HASH_COUNT(args->data_ids);
+        HASH_ADD_KEYPTR(
+            hh, args->data_ids, data_id->key, SHA1_KEY_LENGTH, data_id);
     }
 
-    uint8_t *buffer =
-        (uint8_t *)mmap(NULL, fileinfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
-    close(fd);
-
-    buffer += initial_offset;
-
-    MMDBW_tree_s *tree = new_tree(ip_version,
-                                  record_size,
-                                  merge_strategy,
-                                  alias_ipv6,
-                                  remove_reserved_networks);
+    return 1;
+}
 
-    thawed_network_s *thawed;
-    while (NULL != (thawed = thaw_network(tree, &buffer))) {
-        // We should never need to merge when thawing a tree.
-        MMDBW_status status =
-            insert_record_for_network(tree,
-                                      thawed->network,
-                                      thawed->record,
-                                      MMDBW_MERGE_STRATEGY_NONE,
-                                      true);
-        free_network(thawed->network);
-        free(thawed->network);
-        if (thawed->record->type == MMDBW_RECORD_TYPE_DATA) {
-            free((char *)thawed->record->value.key);
-        }
-        free(thawed->record);
-        free(thawed);
-        if (status != MMDBW_SUCCESS) {
-            croak("Could not thaw tree: %s", status_error_message(status));
-        }
+/* The v2 format stores each distinct data record once, in a table of
+ * length-prefixed Sereal documents. A data record's ID is its position in
+ * this table, and the rest of the file refers to records by that ID rather
+ * than by their 27 byte key. Only the data collected by
+ * collect_frozen_data() is stored, in the order of its IDs.
+ *
+ * The table is followed by an index of the file offset of each record so
+ * that a reader can decode any record without parsing the ones before it.
+ * The offset of the index itself is the last thing in the file. */
+static void freeze_data_table(freeze_args_s *args, MMDBW_tree_s *tree) {
+    SV *encoder = new_sereal_object("Sereal::Encoder");
+
+    uint64_t data_count = HASH_COUNT(args->data_ids);
+    uint64_t *offsets = checked_malloc(sizeof(uint64_t) * (data_count + 1));
+
+    freeze_data_id_s *data_id, *tmp;
+    HASH_ITER(hh, args->data_ids, data_id, tmp) {
+        offsets[data_id->id] = args->offset;
+
+        SV *frozen = sereal_encode(encoder, data_for_key(tree, data_id->key));
+        STRLEN frozen_size;
+        char *frozen_chars = SvPV(frozen, frozen_size);
+
+        freeze_to_file(args, (char *)data_id->key, SHA1_KEY_LENGTH);
+        freeze_varint(args, frozen_size);
+        freeze_to_file(args, frozen_chars, frozen_size);
+
+        SvREFCNT_dec(frozen);
     }
 
-    STRLEN frozen_data_size = thaw_strlen(&buffer);
+    SvREFCNT_dec(encoder);
 
-    /* per perlapi newSVpvn copies the string */
-    SV *data_to_decode = sv_2mortal(newSVpvn((char *)buffer, frozen_data_size));
-    HV *data_hash = thaw_data_hash(data_to_decode);
+    args->data_index_offset = args->offset;
+    freeze_to_file(args, &data_count, sizeof(uint64_t));
+    freeze_to_file(args, offsets, sizeof(uint64_t) * data_count);
+    free(offsets);
+}
 
-    hv_iterinit(data_hash);
-    char *key;
-    I32 keylen;
-    SV *value;
-    while (NULL != (value = hv_iternextsv(data_hash, &key, &keylen))) {
-        set_stored_data_in_tree(tree, key, value);
-    }
+/* The networks are written in ascending order of their start address, so
+ * each one is stored as the (varint) difference from the previous start
+ * address followed by the prefix length and the (varint) data ID. For IPv4
+ * trees the addresses are 32-bit integers, so no delta takes more than five
+ * bytes. */
+static void freeze_network_stream(freeze_args_s *args,
+                                  MMDBW_tree_s *tree,
+                                  uint64_t network_count) {
+    freeze_varint(args, network_count);
 
-    SvREFCNT_dec((SV *)data_hash);
+    if (tree->root_record.type == MMDBW_RECORD_TYPE_DATA) {
+        croak("A tree that only contains a data record for /0 cannot be "
+              "frozen");
+    }
 
-    return tree;
-}
+    if (tree->root_record.type != MMDBW_RECORD_TYPE_NODE &&
+        tree->root_record.type != MMDBW_RECORD_TYPE_FIXED_NODE) {
+        croak("Unexected root record type when freezing tree: %s",
+              record_type_name(tree->root_record.type));
+    }
 
-static uint8_t thaw_uint8(uint8_t **buffer) {
-    uint8_t value;
-    memcpy(&value, *buffer, 1);
-    *buffer += 1;
-    return value;
+    /* Iterating depth first visits a node after its left subtree and before
+     * its right subtree, which gives us the data records in address order. */
+    start_iteration(tree, true, (void *)args, &freeze_stream_node);
+}
+
+static void freeze_stream_node(MMDBW_tree_s *tree,
+                               MMDBW_node_s *node,
+                               uint128_t network,
+                               uint8_t depth,
+                               void *void_args) {
+    freeze_args_s *args = (freeze_args_s *)void_args;
+
+    const uint8_t next_depth = depth + 1;
+
+    if (node->left_record.type == MMDBW_RECORD_TYPE_DATA) {
+        freeze_stream_record(
+            args, network, next_depth, node->left_record.value.key);
+    }
+
+    if (node->right_record.type == MMDBW_RECORD_TYPE_DATA) {
+        freeze_stream_record(args,
+                             flip_network_bit(tree, network, depth),
+                             next_depth,
+                             node->right_record.value.key);
+    }
+}
+
+static void freeze_stream_record(freeze_args_s *args,
+                                 uint128_t network,
+                                 uint8_t depth,
+                                 const char *key) {
+    if (args->network_count % NETWORK_INDEX_BLOCK_SIZE == 0) {
+        add_frozen_network_block(&args->network_blocks, network, args->offset);
+    }
+    args->network_count++;
+
+    freeze_varint(args, network - args->previous_network);
+    freeze_to_file(args, &depth, 1);
+    freeze_varint(args, frozen_data_id(args, key));
+
+    args->previous_network = network;
+}
+
+/* The network index follows the network stream. It is the number of blocks
+ * followed by each block's start address and offset. The offset of the index
+ * itself comes right before the data index offset at the end of the file. */
+static void freeze_network_index(freeze_args_s *args) {
+    uint64_t index_offset = args->offset;
+    uint64_t block_count = args->network_blocks.count;
+
+    freeze_to_file(args, &block_count, sizeof(uint64_t));
+    for (size_t i = 0; i < args->network_blocks.count; i++) {
+        frozen_network_block_s *block = &args->network_blocks.items[i];
+        freeze_to_file(args, &block->start, sizeof(uint128_t));
+        freeze_to_file(args, &block->offset, sizeof(uint64_t));
+    }
+    freeze_to_file(args, &index_offset, sizeof(uint64_t));
+
+    free(args->network_blocks.items);
+}
+
+/* A node dump is the tree's records in pre-order. Each record is written as
+ * its type byte, followed by the data ID for data records or by the position
+ * of the target node in the dump for alias records. Nodes are followed by
+ * their left and then their right record.
+ *
+ * Alias records always come after the node they point to, as that node is
+ * on the all-zeros path of the IPv6 tree and pre-order visits it first. */
+static void freeze_node_dump(freeze_args_s *args, MMDBW_record_s *record) {
+    uint8_t type = record->type;
+    freeze_to_file(args, &type, 1);
+
+    switch (record->type) {
+        case MMDBW_RECORD_TYPE_EMPTY:
+        case MMDBW_RECORD_TYPE_FIXED_EMPTY:
+            break;
+        case MMDBW_RECORD_TYPE_DATA:
+            freeze_varint(args, frozen_data_id(args, record->value.key));
+            break;
+        case MMDBW_RECORD_TYPE_NODE:
+        case MMDBW_RECORD_TYPE_FIXED_NODE: {
+            MMDBW_node_s *node = record->value.node;
+            uint64_t index = args->node_index++;
+            if (record->type == MMDBW_RECORD_TYPE_FIXED_NODE) {
+                add_frozen_fixed_node(&args->fixed_nodes, node, index);
+            }
+            freeze_node_dump(args, &node->left_record);
+            freeze_node_dump(args, &node->right_record);
+            break;
+        }
+        case MMDBW_RECORD_TYPE_ALIAS: {
+            frozen_fixed_nodes_s *fixed_nodes = &args->fixed_nodes;
+            size_t i;
+            for (i = 0; i < fixed_nodes->count; i++) {
+                if (fixed_nodes->items[i].node == record->value.node) {
+                    break;
+                }
+            }
+            if (i == fixed_nodes->count) {
+                croak("Found an alias record before the node it points to "
+                      "when freezing the tree");
+            }
+            freeze_varint(args, fixed_nodes->items[i].index);
+            break;
+        }
+    }
+}
+
+/* Unsigned LEB128: seven bits per byte, least significant group first, with
+ * the high bit set on every byte except the last. */
+static void freeze_varint(freeze_args_s *args, uint128_t value) {
+    uint8_t bytes[VARINT_MAX_LENGTH];
+    freeze_to_file(args, bytes, encode_varint(value, bytes));
+}
+
+static size_t encode_varint(uint128_t value, uint8_t *bytes) {
+    size_t size = 0;
+    do {
+        bytes[size] = value & 0x7f;
+        value >>= 7;
+        if (value) {
+            bytes[size] |= 0x80;
+        }
+        size++;
+    } while (value);
+
+    return size;
+}
+
+static uint32_t frozen_data_id(freeze_args_s *args, const char *key) {
+    freeze_data_id_s *data_id = NULL;
+    HASH_FIND(hh, args->data_ids, key, SHA1_KEY_LENGTH, data_id);
+    if (NULL == data_id) {
+        croak("No data ID for key - %s", key);
+    }
+
+    return data_id->id;
+}
+
+static void add_frozen_fixed_node(frozen_fixed_nodes_s *fixed_nodes,
+                                  MMDBW_node_s *node,
+                                  uint64_t index) {
+    if (fixed_nodes->count == fixed_nodes->capacity) {
+        fixed_nodes->capacity =
+            fixed_nodes->capacity ? fixed_nodes->capacity * 2 : 256;
+        fixed_nodes->items =
+            realloc(fixed_nodes->items,
+                    sizeof(frozen_fixed_node_s) * fixed_nodes->capacity);
+        if (!fixed_nodes->items) {
+            abort();
+        }
+    }
+
+    fixed_nodes->items[fixed_nodes->count].node = node;
+    fixed_nodes->items[fixed_nodes->count].index = index;
+    fixed_nodes->count++;
+}
+
+static void add_frozen_network_block(frozen_network_blocks_s *blocks,
+                                     uint128_t start,
+                                     uint64_t offset) {
+    if (blocks->count == blocks->capacity) {
+        blocks->capacity = blocks->capacity ? blocks->capacity * 2 : 256;
+        blocks->items = realloc(
+            blocks->items, sizeof(frozen_network_block_s) * blocks->capacity);
+        if (!blocks->items) {
+            abort();
+        }
+    }
+
+    blocks->items[blocks->count].start = start;
+    blocks->items[blocks->count].offset = offset;
+    blocks->count++;
+}
+
+static void free_data_ids(freeze_args_s *args) {
+    freeze_data_id_s *data_id, *tmp;
+    HASH_ITER(hh, args->data_ids, data_id, tmp) {
+        HASH_DEL(args->data_ids, data_id);
+        free(data_id);
+    }
+}
+
+static SV *new_sereal_object(const char *class) {
+    dSP;
+    ENTER;
+    SAVETMPS;
+
+    PUSHMARK(SP);
+    EXTEND(SP, 1);
+    PUSHs(sv_2mortal(newSVpv(class, 0)));
+    PUTBACK;
+
+    int count = call_method("new", G_SCALAR);
+
+    SPAGAIN;
+
+    if (count != 1) {
+        croak("Expected 1 item back from %s->new() call", class);
+    }
+
+    SV *object = POPs;
+    SvREFCNT_inc_simple_void_NN(object);
+
+    PUTBACK;
+    FREETMPS;
+    LEAVE;
+
+    return object;
+}
+
+static SV *sereal_encode(SV *encoder, SV *data) {
+    dSP;
+    ENTER;
+    SAVETMPS;
+
+    PUSHMARK(SP);
+    EXTEND(SP, 2);
+    PUSHs(encoder);
+    PUSHs(data);
+    PUTBACK;
+
+    int count =
+        call_pv("Sereal::Encoder::sereal_encode_with_object", G_SCALAR);
+
+    SPAGAIN;
+
+    if (count != 1) {
+        croak("Expected 1 item back from "
+              "Sereal::Encoder::sereal_encode_with_object call");
+    }
+
+    SV *frozen = POPs;
+    if (!SvPOK(frozen)) {
+        croak("The Sereal::Encoder::sereal_encode_with_object sub returned an "
+              "SV which is not SvPOK!");
+    }
+
+    SvREFCNT_inc_simple_void_NN(frozen);
+
+    PUTBACK;
+    FREETMPS;
+    LEAVE;
+
+    return frozen;
+}
+
+static SV *sereal_decode(SV *decoder, SV *frozen) {
+    dSP;
+    ENTER;
+    SAVETMPS;
+
+    PUSHMARK(SP);
+    EXTEND(SP, 2);
+    PUSHs(decoder);
+    PUSHs(frozen);
+    PUTBACK;
+
+    int count =
+        call_pv("Sereal::Decoder::sereal_decode_with_object", G_SCALAR);
+
+    SPAGAIN;
+
+    if (count != 1) {
+        croak("Expected 1 item back from "
+              "Sereal::Decoder::sereal_decode_with_object call");
+    }
+
+    /* We copy the value as the returned SV may be reused by the decoder. */
+    SV *thawed = newSVsv(POPs);
+
+    PUTBACK;
+    FREETMPS;
+    LEAVE;
+
+    return thawed;
+}
+
+MMDBW_tree_s *thaw_tree(char *filename,
+                        uint32_t initial_offset,
+                        uint8_t format,
+                        uint8_t ip_version,
+                        uint8_t record_size,
+                        MMDBW_merge_strategy merge_strategy,
+                        const bool alias_ipv6,
+                        const bool remove_reserved_networks,
+                        AV *only_networks,
+                        uint32_t workers) {
+    if (format < 1 || format > 3) {
+        croak("Unknown freeze format: %" PRIu8, format);
+    }
+
+    if (NULL != only_networks && format != 2) {
+        croak("Only trees frozen with format 2 can be partially thawed");
+    }
+
+    if (workers > 1 && (format != 2 || NULL != only_networks)) {
+        croak("Only whole trees frozen with format 2 can be thawed with "
+              "several workers");
+    }
+
+#ifdef WIN32
+    int fd = open(filename, O_RDONLY);
+#else
+    int fd = open(filename, O_RDONLY, 0);
+#endif
+    if (fd == -1) {
+        croak("Could not open file %s: %s", filename, strerror(errno));
+    }
+
+    struct stat fileinfo;
+    if (fstat(fd, &fileinfo) == -1) {
+        close(fd);
+        croak("Could not stat file: %s: %s", filename, strerror(errno));
+    }
+
+    uint8_t *map =
+        (uint8_t *)mmap(NULL, fileinfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        croak("Could not mmap file %s: %s", filename, strerror(errno));
+    }
+
+    ENTER;
+    SAVETMPS;
+
+    /* The mapping is unmapped when we LEAVE, including when we croak part
+     * way through thawing. */
+    frozen_mapping_s *mapping = checked_malloc(sizeof(frozen_mapping_s));
+    mapping->address = map;
+    mapping->size = fileinfo.st_size;
+    SAVEDESTRUCTOR_X(unmap_frozen_tree, mapping);
+
+    if ((uint64_t)fileinfo.st_size < initial_offset) {
+        croak("Unexpected end of frozen tree (corrupt file?)");
+    }
+
+    /* A node dump already contains the alias and reserved network records. */
+    const bool is_node_dump = format == 3;
+    MMDBW_tree_s *tree = new_tree(ip_version,
+                                  record_size,
+                                  merge_strategy,
+                                  alias_ipv6 && !is_node_dump,
+                                  remove_reserved_networks && !is_node_dump);
+
+    thaw_args_s args = {
+        .tree = tree,
+        .map = map,
+        .buffer = map + initial_offset,
+        .end = map + fileinfo.st_size,
+        .released = map,
+        .frozen_sv = new_frozen_bytes_sv(),
+        .decoder = NULL,
+        .data_table = NULL,
+        .data_index = NULL,
+        .keys = NULL,
+        .data_count = 0,
+        .node_index = 0,
+        .fixed_nodes = {.items = NULL, .count = 0, .capacity = 0},
+    };
+
+    if (is_node_dump) {
+        thaw_tree_v3(&args);
+    } else if (format == 2) {
+        thaw_tree_v2(&args, only_networks, workers);
+    } else {
+        thaw_tree_v1(&args);
+    }
+
+    FREETMPS;
+    LEAVE;
+
+    return tree;
+}
+
+static void unmap_frozen_tree(pTHX_ void *void_mapping) {
+    frozen_mapping_s *mapping = (frozen_mapping_s *)void_mapping;
+    munmap(mapping->address, mapping->size);
+    free(mapping);
+}
+
+/* Rather than copying each Sereal document out of the mapping, we decode it
+ * in place. This SV is pointed at each document in turn. Its SvLEN is 0 so
+ * Perl never tries to free the mapping. */
+static SV *new_frozen_bytes_sv(void) {
+    SV *sv = sv_2mortal(newSV_type(SVt_PV));
+    SvPV_set(sv, NULL);
+    SvLEN_set(sv, 0);
+    SvCUR_set(sv, 0);
+    SvPOK_only(sv);
+    SvREADONLY_on(sv);
+    return sv;
+}
+
+static SV *frozen_bytes_sv(thaw_args_s *args, uint8_t *bytes, STRLEN size) {
+    SvPV_set(args->frozen_sv, (char *)bytes);
+    SvCUR_set(args->frozen_sv, size);
+    return args->frozen_sv;
+}
+
+/* Once we have read past part of the mapping, we tell the kernel that it can
+ * drop those pages. They are clean pages of a read-only file mapping, so
+ * this only lowers our resident memory. We do this at most once a megabyte
+ * to keep the number of syscalls down. */
+static void release_consumed_pages(thaw_args_s *args) {
+#ifdef MADV_DONTNEED
+    static uintptr_t page_size = 0;
+    if (!page_size) {
+        page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+    }
+
+    uint8_t *release_to =
+        (uint8_t *)((uintptr_t)args->buffer & ~(page_size - 1));
+    if (release_to - args->released < THAW_RELEASE_SIZE) {
+        return;
+    }
+
+    madvise(args->released, release_to - args->released, MADV_DONTNEED);
+    args->released = release_to;
+#else
+    PERL_UNUSED_ARG(args);
+#endif
+}
+
+static void thaw_tree_v1(thaw_args_s *args) {
+    MMDBW_tree_s *tree = args->tree;
+
+    thawed_network_s *thawed;
+    while (NULL != (thawed = thaw_network(tree, &args->buffer))) {
+        // We should never need to merge when thawing a tree.
+        MMDBW_status status =
+            insert_record_for_network(tree,
+                                      thawed->network,
+                                      thawed->record,
+                                      MMDBW_MERGE_STRATEGY_NONE,
+                                      true);
+        free_network(thawed->network);
+        free(thawed->network);
+        if (thawed->record->type == MMDBW_RECORD_TYPE_DATA) {
+            free((char *)thawed->record->value.key);
+        }
+        free(thawed->record);
+        free(thawed);
+        if (status != MMDBW_SUCCESS) {
+            croak("Could not thaw tree: %s", status_error_message(status));
+        }
+        release_consumed_pages(args);
+    }
+
+    /* The data is in one or more batches, which run to the end of the
+     * file. */
+    do {
+        thaw_check_bounds(args->buffer, args->end, sizeof(STRLEN));
+        STRLEN frozen_data_size = thaw_strlen(&args->buffer);
+        thaw_check_bounds(args->buffer, args->end, frozen_data_size);
+
+        HV *data_hash = thaw_data_hash(
+            frozen_bytes_sv(args, args->buffer, frozen_data_size));
+        args->buffer += frozen_data_size;
+
+        hv_iterinit(data_hash);
+        char *key;
+        I32 keylen;
+        SV *value;
+        while (NULL != (value = hv_iternextsv(data_hash, &key, &keylen))) {
+            set_stored_data_in_tree(tree, key, value);
+        }
+
+        SvREFCNT_dec((SV *)data_hash);
+        release_consumed_pages(args);
+    } while (args->buffer < args->end);
+}
+
+/* With only_networks, we use the network index to find the part of the
+ * network stream for each requested network, and we only decode the data
+ * records that those networks use. */
+static void
+thaw_tree_v2(thaw_args_s *args, AV *only_networks, uint32_t workers) {
+    if (NULL == only_networks) {
+        thaw_data_table(args);
+    } else {
+        thaw_data_index(args);
+    }
+
+    thaw_check_bounds(args->buffer, args->end, sizeof(uint64_t));
+    args->end -= sizeof(uint64_t);
+    uint64_t network_index_offset;
+    memcpy(&network_index_offset, args->end, sizeof(uint64_t));
+
+    // As with the data index, the offset is checked before it is added to the
+    // map.
+    if (network_index_offset < (uint64_t)(args->buffer - args->map) ||
+        network_index_offset > (uint64_t)(args->end - args->map)) {
+        croak("Unexpected end of frozen tree (corrupt file?)");
+    }
+    uint8_t *network_index = args->map + network_index_offset;
+
+    uint64_t network_count =
+        (uint64_t)thaw_varint(&args->buffer, network_index);
+    uint8_t *stream_end = network_index;
+
+    MMDBW_status status = MMDBW_SUCCESS;
+    if (NULL == only_networks && workers > 1) {
+        status = thaw_network_stream_in_parallel(
+            args, stream_end, network_count, workers);
+    } else if (NULL == only_networks) {
+        status =
+            thaw_network_stream(args, stream_end, network_count, 0, NULL);
+    } else {
+        status = thaw_only_networks(
+            args, stream_end, network_count, network_index, only_networks);
+    }
+
+    release_thawed_data(args);
+
+    if (status != MMDBW_SUCCESS) {
+        croak("Could not thaw tree: %s", status_error_message(status));
+    }
+}
+
+/* Thaws up to count networks from the stream, starting at args->buffer.
+ * previous_network is the address the first network's delta is relative to.
+ * If only is set, we stop after the last network that can overlap it, skip
+ * the networks before it, and trim any network that contains it down to the
+ * requested network. */
+static MMDBW_status thaw_network_stream(thaw_args_s *args,
+                                        uint8_t *stream_end,
+                                        uint64_t count,
+                                        uint128_t previous_network,
+                                        thaw_only_network_s *only) {
+    MMDBW_tree_s *tree = args->tree;
+
+    uint128_t network = previous_network;
+    for (uint64_t i = 0; i < count; i++) {
+        network += thaw_varint(&args->buffer, stream_end);
+        thaw_check_bounds(args->buffer, stream_end, 1);
+        uint8_t prefix_length = *args->buffer;
+        args->buffer++;
+        uint128_t id = thaw_varint(&args->buffer, stream_end);
+        if (id >= args->data_count) {
+            release_thawed_data(args);
+            croak("Invalid data ID in frozen tree (corrupt file?)");
+        }
+
+        uint128_t insert_network = network;
+        uint8_t insert_prefix_length = prefix_length;
+        if (NULL != only) {
+            if (network > only->last) {
+                break;
+            }
+            if (last_address_in_network(tree, network, prefix_length) <
+                only->first) {
+                continue;
+            }
+            if (prefix_length < only->prefix_length) {
+                insert_network = only->first;
+                insert_prefix_length = only->prefix_length;
+            }
+        }
+
+        if (NULL == args->keys[id]) {
+            thaw_data_record(args, (uint32_t)id);
+        }
+
+        MMDBW_status status = insert_thawed_network(
+            args, insert_network, insert_prefix_length, (uint32_t)id);
+        if (status != MMDBW_SUCCESS) {
+            return status;
+        }
+
+        if (NULL == only) {
+            release_consumed_pages(args);
+        }
+    }
+
+    return MMDBW_SUCCESS;
+}
+
+static MMDBW_status insert_thawed_network(thaw_args_s *args,
+                                          uint128_t network,
+                                          uint8_t prefix_length,
+                                          uint32_t id) {
+    MMDBW_tree_s *tree = args->tree;
+
+    uint8_t bytes[tree->ip_version == 6 ? 16 : 4];
+    integer_to_ip_bytes(tree->ip_version, network, bytes);
+    MMDBW_network_s thawed_network = {
+        .bytes = bytes,
+        .prefix_length = prefix_length,
+    };
+    MMDBW_record_s record = {
+        .type = MMDBW_RECORD_TYPE_DATA,
+        .value = {.key = args->keys[id]},
+    };
+
+    // We should never need to merge when thawing a tree.
+    return insert_record_for_network(
+        tree, &thawed_network, &record, MMDBW_MERGE_STRATEGY_NONE, true);
+}
+
+/* Thaws the network stream on several threads. Each network belongs to a
+ * slot, the subtree THAW_SLOT_BITS below the first empty record on its path
+ * in the new tree. This keeps the slots clear of the alias and reserved
+ * network records that the tree starts with. The workers build the slots
+ * without touching the data table, counting the references they make to
+ * each data record. The main thread then adds those references, inserts the
+ * networks that are not in any slot, and trims the nodes above the slots. */
+static MMDBW_status thaw_network_stream_in_parallel(thaw_args_s *args,
+                                                    uint8_t *stream_end,
+                                                    uint64_t count,
+                                                    uint32_t workers) {
+    MMDBW_tree_s *tree = args->tree;
+
+    thaw_parallel_s *state = checked_malloc(sizeof(thaw_parallel_s));
+    *state = (thaw_parallel_s){
+        .slots = NULL,
+        .slot_count = 0,
+        .slot_capacity = 0,
+        .unslotted = NULL,
+        .unslotted_count = 0,
+        .unslotted_capacity = 0,
+        .workers = NULL,
+        .worker_count = 0,
+    };
+    SAVEDESTRUCTOR_X(free_thaw_parallel, state);
+
+    find_thaw_slots(args, stream_end, count, state);
+
+    for (size_t i = 0; i < state->slot_count; i++) {
+        state->slots[i].record = expand_to_thaw_slot(tree, &state->slots[i]);
+    }
+
+    run_thaw_workers(args, stream_end, state, workers);
+
+    for (uint32_t id = 0; id < args->data_count; id++) {
+        uint32_t references = 0;
+        for (uint32_t i = 0; i < state->worker_count; i++) {
+            references += state->workers[i].reference_counts[id];
+        }
+        if (references == 0) {
+            continue;
+        }
+
+        MMDBW_data_hash_s *data = NULL;
+        HASH_FIND(hh,
+                  tree->data_table->entries,
+                  args->keys[id],
+                  SHA1_KEY_LENGTH,
+                  data);
+        data->reference_count += references;
+    }
+
+    for (size_t i = 0; i < state->unslotted_count; i++) {
+        thaw_stream_entry_s *entry = &state->unslotted[i];
+        MMDBW_status status = insert_thawed_network(
+            args, entry->network, entry->prefix_length, entry->id);
+        if (status != MMDBW_SUCCESS) {
+            return status;
+        }
+    }
+
+    trim_thawed_slots(tree,
+                      &tree->root_record,
+                      0,
+                      0,
+                      state->slots,
+                      state->slot_count);
+
+    release_consumed_pages(args);
+
+    return MMDBW_SUCCESS;
+}
+
+/* Reads the whole network stream, sorting the networks into slots. The
+ * workers trust the stream once this is done, so this also checks that the
+ * networks are in order and do not overlap. Any network that contains
+ * records the tree starts with, or that is too short to fit in a slot, is
+ * inserted by the main thread instead. */
+static void find_thaw_slots(thaw_args_s *args,
+                            uint8_t *stream_end,
+                            uint64_t count,
+                            thaw_parallel_s *state) {
+    MMDBW_tree_s *tree = args->tree;
+
+    uint128_t max_address = last_address_in_network(tree, 0, 0);
+    uint128_t network = 0;
+    uint128_t previous_last = 0;
+    uint128_t slot_last = 0;
+    bool in_slot = false;
+    for (uint64_t i = 0; i < count; i++) {
+        uint8_t *entry_start = args->buffer;
+        uint128_t previous_network = network;
+
+        uint128_t delta = thaw_varint(&args->buffer, stream_end);
+        thaw_check_bounds(args->buffer, stream_end, 1);
+        uint8_t prefix_length = *args->buffer;
+        args->buffer++;
+        uint128_t id = thaw_varint(&args->buffer, stream_end);
+        if (id >= args->data_count) {
+            release_thawed_data(args);
+            croak("Invalid data ID in frozen tree (corrupt file?)");
+        }
+
+        network += delta;
+        if (network < previous_network || network > max_address ||
+            prefix_length > tree_depth0(tree) + 1 ||
+            (i > 0 && network <= previous_last) ||
+            (network & last_address_in_network(tree, 0, prefix_length))) {
+            release_thawed_data(args);
+            croak("Invalid network in frozen tree (corrupt file?)");
+        }
+        previous_last = last_address_in_network(tree, network, prefix_length);
+
+        if (in_slot && network <= slot_last) {
+            state->slots[state->slot_count - 1].count++;
+            continue;
+        }
+
+        thaw_stream_entry_s entry = {
+            .network = network,
+            .prefix_length = prefix_length,
+            .id = (uint32_t)id,
+        };
+
+        thaw_slot_s slot;
+        in_slot = find_thaw_slot(tree, &entry, &slot);
+        if (in_slot) {
+            if (state->slot_count == state->slot_capacity) {
+                state->slot_capacity =
+                    state->slot_capacity ? state->slot_capacity * 2 : 256;
+                state->slots =
+                    realloc(state->slots,
+                            state->slot_capacity * sizeof(thaw_slot_s));
+                if (!state->slots) {
+                    abort();
+                }
+            }
+            slot.buffer = entry_start;
+            slot.count = 1;
+            slot.previous_network = previous_network;
+            state->slots[state->slot_count++] = slot;
+            slot_last =
+                last_address_in_network(tree, slot.network, slot.prefix_length);
+            continue;
+        }
+
+        if (state->unslotted_count == state->unslotted_capacity) {
+            state->unslotted_capacity =
+                state->unslotted_capacity ? state->unslotted_capacity * 2
+                                          : 256;
+            state->unslotted = realloc(
+                state->unslotted,
+                state->unslotted_capacity * sizeof(thaw_stream_entry_s));
+            if (!state->unslotted) {
+                abort();
+            }
+        }
+        state->unslotted[state->unslotted_count++] = entry;
+    }
+}
+
+/* The slot for a network starts THAW_SLOT_BITS below the first empty record
+ * on its path. We return false if the path reaches an alias, fixed empty, or
+ * data record first, or if the network is too short for the slot. */
+static bool find_thaw_slot(MMDBW_tree_s *tree,
+                           thaw_stream_entry_s *entry,
+                           thaw_slot_s *slot) {
+    MMDBW_record_s *record = &tree->root_record;
+    for (int depth = 0;; depth++) {
+        if (record->type == MMDBW_RECORD_TYPE_EMPTY) {
+            if (entry->prefix_length < depth + THAW_SLOT_BITS) {
+                return false;
+            }
+            slot->prefix_length = depth + THAW_SLOT_BITS;
+            slot->network =
+                entry->network &
+                ~last_address_in_network(tree, 0, slot->prefix_length);
+            return true;
+        }
+
+        if ((record->type != MMDBW_RECORD_TYPE_NODE &&
+             record->type != MMDBW_RECORD_TYPE_FIXED_NODE) ||
+            depth >= entry->prefix_length) {
+            return false;
+        }
+
+        bool is_right = (entry->network >> (tree_depth0(tree) - depth)) & 1;
+        record = is_right ? &record->value.node->right_record
+                          : &record->value.node->left_record;
+    }
+}
+
+/* Creates the nodes between the empty record a slot was found under and the
+ * slot itself. We return the slot's record, which is still empty. */
+static MMDBW_record_s *expand_to_thaw_slot(MMDBW_tree_s *tree,
+                                           thaw_slot_s *slot) {
+    MMDBW_record_s *record = &tree->root_record;
+    for (int depth = 0; depth < slot->prefix_length; depth++) {
+        if (record->type == MMDBW_RECORD_TYPE_EMPTY) {
+            record->type = MMDBW_RECORD_TYPE_NODE;
+            record->value.node = new_node();
+        }
+
+        bool is_right = (slot->network >> (tree_depth0(tree) - depth)) & 1;
+        record = is_right ? &record->value.node->right_record
+                          : &record->value.node->left_record;
+    }
+
+    return record;
+}
+
+/* Each worker gets a contiguous run of slots with about the same number of
+ * networks. The main thread works on the first run itself. If a thread
+ * cannot be started, its run is thawed on the main thread too. */
+static void run_thaw_workers(thaw_args_s *args,
+                             uint8_t *stream_end,
+                             thaw_parallel_s *state,
+                             uint32_t workers) {
+    if (state->slot_count == 0) {
+        return;
+    }
+    if (workers > state->slot_count) {
+        workers = (uint32_t)state->slot_count;
+    }
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < state->slot_count; i++) {
+        total += state->slots[i].count;
+    }
+
+    state->workers = checked_malloc(sizeof(thaw_worker_s) * workers);
+    state->worker_count = 0;
+
+    size_t next_slot = 0;
+    uint64_t assigned = 0;
+    for (uint32_t i = 0; i < workers; i++) {
+        thaw_worker_s *worker = &state->workers[i];
+        worker->args = args;
+        worker->stream_end = stream_end;
+        worker->slots = &state->slots[next_slot];
+        worker->slot_count = 0;
+        worker->reference_counts =
+            checked_calloc(args->data_count + 1, sizeof(uint32_t));
+        state->worker_count++;
+
+        uint64_t target = total * (i + 1) / workers;
+        while (next_slot < state->slot_count &&
+               (assigned < target || i == workers - 1)) {
+            assigned += state->slots[next_slot].count;
+            worker->slot_count++;
+            next_slot++;
+        }
+    }
+
+    pthread_t threads[workers];
+    bool started[workers];
+    for (uint32_t i = 1; i < workers; i++) {
+        started[i] = pthread_create(&threads[i],
+                                    NULL,
+                                    run_thaw_worker,
+                                    &state->workers[i]) == 0;
+    }
+
+    run_thaw_worker(&state->workers[0]);
+
+    for (uint32_t i = 1; i < workers; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            run_thaw_worker(&state->workers[i]);
+        }
+    }
+}
+
+static void *run_thaw_worker(void *void_worker) {
+    thaw_worker_s *worker = (thaw_worker_s *)void_worker;
+
+    for (size_t i = 0; i < worker->slot_count; i++) {
+        thaw_slot_s *slot = &worker->slots[i];
+
+        worker->buffer = slot->buffer;
+        worker->remaining = slot->count;
+        worker->entry.network = slot->previous_network;
+        next_thaw_worker_entry(worker);
+
+        thaw_built_record_s built =
+            build_thaw_slot(worker, slot->prefix_length, slot->network);
+        set_thawed_record(worker, slot->record, &built);
+    }
+
+    return NULL;
+}
+
+/* find_thaw_slots() already checked these entries, so this cannot croak. */
+static void next_thaw_worker_entry(thaw_worker_s *worker) {
+    worker->has_entry = worker->remaining > 0;
+    if (!worker->has_entry) {
+        return;
+    }
+    worker->remaining--;
+
+    worker->entry.network +=
+        thaw_varint(&worker->buffer, worker->stream_end);
+    worker->entry.prefix_length = *worker->buffer;
+    worker->buffer++;
+    worker->entry.id =
+        (uint32_t)thaw_varint(&worker->buffer, worker->stream_end);
+}
+
+/* Builds the record for the network starting at first with the given prefix
+ * length from the worker's next networks. Identical sibling records are
+ * merged as they would be when inserting the networks one at a time. */
+static thaw_built_record_s
+build_thaw_slot(thaw_worker_s *worker, uint8_t depth, uint128_t first) {
+    MMDBW_tree_s *tree = worker->args->tree;
+
+    thaw_built_record_s built = {
+        .type = MMDBW_RECORD_TYPE_EMPTY,
+        .id = 0,
+        .node = NULL,
+    };
+    if (!worker->has_entry ||
+        worker->entry.network > last_address_in_network(tree, first, depth)) {
+        return built;
+    }
+
+    if (worker->entry.prefix_length == depth) {
+        built.type = MMDBW_RECORD_TYPE_DATA;
+        built.id = worker->entry.id;
+        worker->reference_counts[built.id]++;
+        next_thaw_worker_entry(worker);
+        return built;
+    }
+
+    thaw_built_record_s left = build_thaw_slot(worker, depth + 1, first);
+    thaw_built_record_s right = build_thaw_slot(
+        worker,
+        depth + 1,
+        first | ((uint128_t)1 << (tree_depth0(tree) - depth)));
+
+    if (left.type == right.type &&
+        (left.type == MMDBW_RECORD_TYPE_EMPTY ||
+         (left.type == MMDBW_RECORD_TYPE_DATA && left.id == right.id))) {
+        if (left.type == MMDBW_RECORD_TYPE_DATA) {
+            worker->reference_counts[left.id]--;
+        }
+        return left;
+    }
+
+    built.type = MMDBW_RECORD_TYPE_NODE;
+    built.node = new_node();
+    set_thawed_record(worker, &built.node->left_record, &left);
+    set_thawed_record(worker, &built.node->right_record, &right);
+
+    return built;
+}
+
+static void set_thawed_record(thaw_worker_s *worker,
+                              MMDBW_record_s *record,
+                              thaw_built_record_s *built) {
+    record->type = built->type;
+    if (built->type == MMDBW_RECORD_TYPE_DATA) {
+        record->value.key = worker->args->keys[built->id];
+    } else if (built->type == MMDBW_RECORD_TYPE_NODE) {
+        record->value.node = built->node;
+    }
+}
+
+/* Trims the nodes on the paths from the root to the slots, from the bottom
+ * up, as inserting the slots' networks one at a time would have. */
+static void trim_thawed_slots(MMDBW_tree_s *tree,
+                              MMDBW_record_s *record,
+                              uint8_t depth,
+                              uint128_t first,
+                              thaw_slot_s *slots,
+                              size_t slot_count) {
+    if (slot_count == 0 || slots[0].prefix_length == depth ||
+        (record->type != MMDBW_RECORD_TYPE_NODE &&
+         record->type != MMDBW_RECORD_TYPE_FIXED_NODE)) {
+        return;
+    }
+
+    uint128_t right_first =
+        first | ((uint128_t)1 << (tree_depth0(tree) - depth));
+    size_t left_count = 0;
+    size_t right_count = slot_count;
+    while (left_count < right_count) {
+        size_t middle = left_count + (right_count - left_count) / 2;
+        if (slots[middle].network < right_first) {
+            left_count = middle + 1;
+        } else {
+            right_count = middle;
+        }
+    }
+
+    MMDBW_node_s *node = record->value.node;
+    trim_thawed_slots(
+        tree, &node->left_record, depth + 1, first, slots, left_count);
+    trim_thawed_slots(tree,
+                      &node->right_record,
+                      depth + 1,
+                      right_first,
+                      slots + left_count,
+                      slot_count - left_count);
+
+    trim_identical_records(tree, record);
+}
+
+static void free_thaw_parallel(pTHX_ void *void_state) {
+    thaw_parallel_s *state = (thaw_parallel_s *)void_state;
+    for (uint32_t i = 0; i < state->worker_count; i++) {
+        free(state->workers[i].reference_counts);
+    }
+    free(state->workers);
+    free(state->slots);
+    free(state->unslotted);
+    free(state);
+}
+
+static MMDBW_status thaw_only_networks(thaw_args_s *args,
+                                       uint8_t *stream_end,
+                                       uint64_t network_count,
+                                       uint8_t *network_index,
+                                       AV *only_networks) {
+    uint64_t block_count;
+    thaw_check_bounds(network_index, args->end, sizeof(uint64_t));
+    memcpy(&block_count, network_index, sizeof(uint64_t));
+    network_index += sizeof(uint64_t);
+
+    const size_t block_size = sizeof(uint128_t) + sizeof(uint64_t);
+    thaw_check_bounds(network_index, args->end, block_size * block_count);
+    if (block_count * NETWORK_INDEX_BLOCK_SIZE < network_count) {
+        croak("The frozen network index is too short (corrupt file?)");
+    }
+
+    size_t only_count;
+    thaw_only_network_s *only =
+        resolve_only_networks(args->tree, only_networks, &only_count);
+
+    MMDBW_status status = MMDBW_SUCCESS;
+    for (size_t i = 0; i < only_count && block_count; i++) {
+        /* We want the last block that starts at or before the requested
+         * network. Any network that contains the start of the requested
+         * network is in that block. */
+        uint64_t low = 0;
+        uint64_t high = block_count;
+        while (high - low > 1) {
+            uint64_t middle = low + (high - low) / 2;
+            uint128_t start;
+            memcpy(&start, network_index + block_size * middle, sizeof(start));
+            if (start <= only[i].first) {
+                low = middle;
+            } else {
+                high = middle;
+            }
+        }
+
+        uint128_t start;
+        uint64_t offset;
+        uint8_t *block = network_index + block_size * low;
+        memcpy(&start, block, sizeof(uint128_t));
+        memcpy(&offset, block + sizeof(uint128_t), sizeof(uint64_t));
+
+        args->buffer = args->map + offset;
+        if (args->buffer < args->map || args->buffer >= stream_end) {
+            free(only);
+            croak("Invalid network offset in frozen tree (corrupt file?)");
+        }
+
+        /* The index has the first network's address rather than the address
+         * its delta is relative to, so we work that out from the delta. */
+        uint8_t *first_delta = args->buffer;
+        uint128_t previous_network =
+            start - thaw_varint(&first_delta, stream_end);
+
+        status = thaw_network_stream(args,
+                                     stream_end,
+                                     network_count -
+                                         low * NETWORK_INDEX_BLOCK_SIZE,
+                                     previous_network,
+                                     &only[i]);
+        if (status != MMDBW_SUCCESS) {
+            break;
+        }
+    }
+
+    free(only);
+
+    return status;
+}
+
+/* only_networks is a list of alternating IP addresses and prefix lengths.
+ * We return the networks sorted by address, leaving out any network that is
+ * inside another one, so that no part of the frozen tree is thawed twice. */
+static thaw_only_network_s *resolve_only_networks(MMDBW_tree_s *tree,
+                                                  AV *only_networks,
+                                                  size_t *count) {
+    SSize_t length = av_len(only_networks) + 1;
+    if (length % 2) {
+        croak("only_networks must contain an address and prefix length for "
+              "each network");
+    }
+
+    thaw_only_network_s *only =
+        checked_malloc(sizeof(thaw_only_network_s) * (length / 2 + 1));
+    for (SSize_t i = 0; i < length / 2; i++) {
+        SV **address = av_fetch(only_networks, i * 2, 0);
+        SV **prefix_length = av_fetch(only_networks, i * 2 + 1, 0);
+        if (NULL == address || NULL == prefix_length) {
+            free(only);
+            croak("only_networks contains an undefined value");
+        }
+
+        const char *ipstr = SvPV_nolen(*address);
+        verify_ip(tree, ipstr);
+        MMDBW_network_s network =
+            resolve_network(tree, ipstr, (uint8_t)SvUV(*prefix_length));
+        uint128_t host_mask =
+            last_address_in_network(tree, 0, network.prefix_length);
+
+        uint8_t *bytes = (uint8_t *)network.bytes;
+        only[i].first =
+            (uint128_t)ip_bytes_to_integer(bytes, tree->ip_version) &
+            ~host_mask;
+        only[i].last = only[i].first | host_mask;
+        only[i].prefix_length = network.prefix_length;
+
+        free_network(&network);
+    }
+
+    qsort(only,
+          length / 2,
+          sizeof(thaw_only_network_s),
+          &compare_only_networks);
+
+    size_t kept = 0;
+    for (SSize_t i = 0; i < length / 2; i++) {
+        if (kept && only[i].last <= only[kept - 1].last) {
+            continue;
+        }
+        only[kept++] = only[i];
+    }
+    *count = kept;
+
+    return only;
+}
+
+static int compare_only_networks(const void *a, const void *b) {
+    const thaw_only_network_s *network_a = (const thaw_only_network_s *)a;
+    const thaw_only_network_s *network_b = (const thaw_only_network_s *)b;
+
+    if (network_a->first != network_b->first) {
+        return network_a->first < network_b->first ? -1 : 1;
+    }
+
+    /* The larger network comes first so that the smaller one is dropped. */
+    if (network_a->prefix_length != network_b->prefix_length) {
+        return network_a->prefix_length < network_b->prefix_length ? -1 : 1;
+    }
+
+    return 0;
+}
+
+static uint128_t last_address_in_network(MMDBW_tree_s *tree,
+                                         uint128_t network,
+                                         uint8_t prefix_length) {
+    uint8_t host_bits = (tree->ip_version == 6 ? 128 : 32) - prefix_length;
+    if (host_bits == 128) {
+        return ~(uint128_t)0;
+    }
+
+    return network | (((uint128_t)1 << host_bits) - 1);
+}
+
+static void thaw_tree_v3(thaw_args_s *args) {
+    thaw_data_table(args);
+
+    thaw_node_dump(args, &args->tree->root_record, 0);
+
+    free(args->fixed_nodes.items);
+    release_thawed_data(args);
+}
+
+/* We store each data record in the tree before inserting any networks, so
+ * the networks can refer to the table's own copy of the key. Storing the
+ * data gives each record a reference count of 1, which release_thawed_data
+ * drops once the tree is built. */
+static void thaw_data_table(thaw_args_s *args) {
+    thaw_data_index(args);
+
+    uint8_t *tree_section = args->buffer;
+    for (uint32_t id = 0; id < args->data_count; id++) {
+        args->buffer = thaw_data_record(args, id);
+        release_consumed_pages(args);
+    }
+    args->buffer = tree_section;
+}
+
+/* The data table is found through the record offset index. The offset of
+ * the index is the last thing in the file, and the search tree starts right
+ * after the index. This leaves args->buffer at the start of the search tree
+ * and args->end at the start of the footer. */
+static void thaw_data_index(thaw_args_s *args) {
+    uint8_t *table = args->buffer;
+
+    thaw_check_bounds(table, args->end, sizeof(uint64_t));
+    args->end -= sizeof(uint64_t);
+    uint64_t index_offset;
+    memcpy(&index_offset, args->end, sizeof(uint64_t));
+
+    // The offset comes from the file, so we check it before adding it to the
+    // map. A pointer outside of the mapping is undefined.
+    if (index_offset < (uint64_t)(table - args->map) ||
+        index_offset > (uint64_t)(args->end - args->map)) {
+        croak("Unexpected end of frozen tree (corrupt file?)");
+    }
+    uint8_t *index = args->map + index_offset;
+
+    uint64_t data_count;
+    thaw_check_bounds(index, args->end, sizeof(uint64_t));
+    memcpy(&data_count, index, sizeof(uint64_t));
+    index += sizeof(uint64_t);
+
+    if (data_count > UINT32_MAX) {
+        croak("The frozen tree has too many data records (corrupt file?)");
+    }
+    thaw_check_bounds(index, args->end, sizeof(uint64_t) * data_count);
+
+    args->data_table = table;
+    args->data_index = index;
+    args->data_count = (uint32_t)data_count;
+    args->keys = checked_calloc(data_count + 1, sizeof(char *));
+    args->decoder = sv_2mortal(new_sereal_object("Sereal::Decoder"));
+
+    args->buffer = index + sizeof(uint64_t) * data_count;
+}
+
+/* Decodes one data record directly from the mapping and stores it in the
+ * tree. We return the end of the record. */
+static uint8_t *thaw_data_record(thaw_args_s *args, uint32_t id) {
+    uint64_t offset;
+    memcpy(&offset, args->data_index + sizeof(uint64_t) * id, sizeof(offset));
+
+    // The record must start in the data table, which ends where the index
+    // starts.
+    uint8_t *table_end = args->data_index - sizeof(uint64_t);
+    if (offset < (uint64_t)(args->data_table - args->map) ||
+        offset > (uint64_t)(table_end - args->map)) {
+        release_thawed_data(args);
+        croak("Invalid data record offset in frozen tree (corrupt file?)");
+    }
+    uint8_t *record = args->map + offset;
+
+    char key[SHA1_KEY_LENGTH + 1];
+    thaw_check_bounds(record, table_end, SHA1_KEY_LENGTH);
+    memcpy(key, record, SHA1_KEY_LENGTH);
+    key[SHA1_KEY_LENGTH] = '\0';
+    record += SHA1_KEY_LENGTH;
+
+    uint128_t frozen_size = thaw_varint(&record, table_end);
+    thaw_check_bounds(record, table_end, frozen_size);
+
+    SV *data_sv = sereal_decode(
+        args->decoder, frozen_bytes_sv(args, record, (STRLEN)frozen_size));
+    args->keys[id] = store_data_in_tree(args->tree, key, data_sv);
+    SvREFCNT_dec(data_sv);
+
+    return record + frozen_size;
+}
+
+static void release_thawed_data(thaw_args_s *args) {
+    for (uint32_t id = 0; id < args->data_count; id++) {
+        if (NULL != args->keys[id]) {
+            decrement_data_reference_count(args->tree, args->keys[id]);
+        }
+    }
+    free(args->keys);
+    args->keys = NULL;
+    args->data_count = 0;
+}
+
+static void
+thaw_node_dump(thaw_args_s *args, MMDBW_record_s *record, uint8_t depth) {
+    if (depth > tree_depth0(args->tree) + 1) {
+        croak("The frozen tree is deeper than the IP version allows (corrupt "
+              "file?)");
+    }
+
+    thaw_check_bounds(args->buffer, args->end, 1);
+    MMDBW_record_type type = *args->buffer;
+    args->buffer++;
+
+    switch (type) {
+        case MMDBW_RECORD_TYPE_EMPTY:
+        case MMDBW_RECORD_TYPE_FIXED_EMPTY:
+            record->type = type;
+            record->value.key = NULL;
+            break;
+        case MMDBW_RECORD_TYPE_DATA: {
+            uint128_t id = thaw_varint(&args->buffer, args->end);
+            if (id >= args->data_count) {
+                croak("Invalid data ID in frozen tree (corrupt file?)");
+            }
+            record->type = type;
+            record->value.key =
+                increment_data_reference_count(args->tree, args->keys[id]);
+            break;
+        }
+        case MMDBW_RECORD_TYPE_NODE:
+        case MMDBW_RECORD_TYPE_FIXED_NODE: {
+            MMDBW_node_s *node = new_node();
+            uint64_t index = args->node_index++;
+            if (type == MMDBW_RECORD_TYPE_FIXED_NODE) {
+                add_frozen_fixed_node(&args->fixed_nodes, node, index);
+            }
+
+            record->type = type;
+            record->value.node = node;
+
+            thaw_node_dump(args, &node->left_record, depth + 1);
+            thaw_node_dump(args, &node->right_record, depth + 1);
+            break;
+        }
+        case MMDBW_RECORD_TYPE_ALIAS: {
+            uint128_t index = thaw_varint(&args->buffer, args->end);
+            MMDBW_node_s *node = NULL;
+            for (size_t i = 0; i < args->fixed_nodes.count; i++) {
+                if (args->fixed_nodes.items[i].index == index) {
+                    node = args->fixed_nodes.items[i].node;
+                    break;
+                }
+            }
+            if (NULL == node) {
+                croak("Alias record refers to an unknown node (corrupt "
+                      "file?)");
+            }
+            record->type = type;
+            record->value.node = node;
+            break;
+        }
+        default:
+            croak("Unknown record type in frozen tree: %d (corrupt file?)",
+                  type);
+    }
+}
+
+static uint128_t thaw_varint(uint8_t **buffer, uint8_t *end) {
+    uint128_t value = 0;
+    for (int shift = 0; shift < 128; shift += 7) {
+        thaw_check_bounds(*buffer, end, 1);
+        uint8_t byte = **buffer;
+        *buffer += 1;
+
+        value |= (uint128_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+
+    croak("Invalid varint in frozen tree (corrupt file?)");
+}
+
+static void thaw_check_bounds(uint8_t *buffer, uint8_t *end, uint128_t size) {
+    if (size > (uint128_t)(end - buffer)) {
+        croak("Unexpected end of frozen tree (corrupt file?)");
+    }
+}
+
+static uint8_t thaw_uint8(uint8_t **buffer) {
+    uint8_t value;
+    memcpy(&value, *buffer, 1);
+    *buffer += 1;
+    return value;
 }
 
 static thawed_network_s *thaw_network(MMDBW_tree_s *tree, uint8_t **buffer) {
     uint128_t start_ip = thaw_uint128(buffer);
     uint8_t prefix_length = thaw_uint8(buffer);
 
-    if (start_ip == 0 && prefix_length == 0) {
-        uint8_t *maybe_separator = thaw_bytes(buffer, FREEZE_SEPARATOR_LENGTH);
-        if (memcmp(maybe_separator,
-                   FREEZE_SEPARATOR,
-                   FREEZE_SEPARATOR_LENGTH) == 0) {
+    if (start_ip == 0 && prefix_length == 0) {
+        uint8_t *maybe_separator = thaw_bytes(buffer, FREEZE_SEPARATOR_LENGTH);
+        if (memcmp(maybe_separator,
+                   FREEZE_SEPARATOR,
+                   FREEZE_SEPARATOR_LENGTH) == 0) {
+
+            free(maybe_separator);
+            return NULL;
+        }
+
+        croak("Found a ::0/0 network but that should never happen!");
+    }
+
+    uint8_t *start_ip_bytes = (uint8_t *)&start_ip;
+    uint8_t temp;
+    for (int i = 0; i < 8; i++) {
+        temp = start_ip_bytes[i];
+        start_ip_bytes[i] = start_ip_bytes[15 - i];
+        start_ip_bytes[15 - i] = temp;
+    }
+
+    thawed_network_s *thawed = checked_malloc(sizeof(thawed_network_s));
+
+    uint8_t *bytes;
+    if (tree->ip_version == 4) {
+        bytes = checked_malloc(4);
+        memcpy(bytes, start_ip_bytes + 12, 4);
+    } else {
+        bytes = checked_malloc(16);
+        memcpy(bytes, &start_ip, 16);
+    }
+
+    MMDBW_network_s network = {
+        .bytes = bytes,
+        .prefix_length = prefix_length,
+    };
+
+    thawed->network = checked_malloc(sizeof(MMDBW_network_s));
+    memcpy(thawed->network, &network, sizeof(MMDBW_network_s));
+
+    MMDBW_record_s *record = checked_malloc(sizeof(MMDBW_record_s));
+    record->type = MMDBW_RECORD_TYPE_DATA;
+
+    record->value.key = thaw_data_key(buffer);
+
+    thawed->record = record;
+
+    return thawed;
+}
+
+static uint8_t *thaw_bytes(uint8_t **buffer, size_t size) {
+    uint8_t *value = checked_malloc(size);
+    memcpy(value, *buffer, size);
+    *buffer += size;
+    return value;
+}
+
+static uint128_t thaw_uint128(uint8_t **buffer) {
+    uint128_t value;
+    memcpy(&value, *buffer, 16);
+    *buffer += 16;
+    return value;
+}
+
+static STRLEN thaw_strlen(uint8_t **buffer) {
+    STRLEN value;
+    memcpy(&value, *buffer, sizeof(STRLEN));
+    *buffer += sizeof(STRLEN);
+    return value;
+}
+
+static const char *thaw_data_key(uint8_t **buffer) {
+    char *value = checked_malloc(SHA1_KEY_LENGTH + 1);
+    memcpy(value, *buffer, SHA1_KEY_LENGTH);
+    *buffer += SHA1_KEY_LENGTH;
+    value[SHA1_KEY_LENGTH] = '\0';
+    return (const char *)value;
+}
+
+static HV *thaw_data_hash(SV *data_to_decode) {
+    dSP;
+    ENTER;
+    SAVETMPS;
+
+    PUSHMARK(SP);
+    EXTEND(SP, 1);
+    PUSHs(data_to_decode);
+    PUTBACK;
+
+    int count = call_pv("Sereal::Decoder::decode_sereal", G_SCALAR);
+
+    SPAGAIN;
+
+    if (count != 1) {
+        croak("Expected 1 item back from Sereal::Decoder::decode_sereal call");
+    }
+
+    SV *thawed = POPs;
+    if (!SvROK(thawed)) {
+        croak("The Sereal::Decoder::decode_sereal sub returned an SV which is "
+              "not SvROK!");
+    }
+
+    SV *data_hash = SvREFCNT_inc_simple_NN(SvRV(thawed));
+
+    PUTBACK;
+    FREETMPS;
+    LEAVE;
+
+    return (HV *)data_hash;
+}
+
+/* Starts appending each insert and removal made on the tree to the journal
+ * at filename. The token identifies the frozen tree the journal belongs to.
+ * A new journal is created unless append is true and the file exists. */
+void start_journal(MMDBW_tree_s *tree,
+                   char *filename,
+                   const char *token,
+                   STRLEN token_size,
+                   bool append) {
+    if (token_size != JOURNAL_TOKEN_LENGTH) {
+        croak("The journal token must be %d bytes", JOURNAL_TOKEN_LENGTH);
+    }
+
+    stop_journal(tree);
+
+    FILE *file = fopen(filename, append ? "ab" : "wb");
+    if (!file) {
+        croak("Could not open file %s: %s", filename, strerror(errno));
+    }
+
+    MMDBW_journal_s *journal = checked_malloc(sizeof(MMDBW_journal_s));
+    journal->file = file;
+    journal->filename = checked_malloc(strlen(filename) + 1);
+    strcpy(journal->filename, filename);
+    journal->encoder = NULL;
+    tree->journal = journal;
+
+    if (fseek(file, 0, SEEK_END) != 0 || ftell(file) == 0) {
+        uint8_t header[JOURNAL_HEADER_LENGTH];
+        memcpy(header, JOURNAL_MAGIC, JOURNAL_MAGIC_LENGTH);
+        header[JOURNAL_MAGIC_LENGTH] = JOURNAL_VERSION;
+        header[JOURNAL_MAGIC_LENGTH + 1] = tree->ip_version;
+        memcpy(header + JOURNAL_MAGIC_LENGTH + 2, token, JOURNAL_TOKEN_LENGTH);
+        journal_write(journal, header, JOURNAL_HEADER_LENGTH);
+    }
+}
+
+/* Writes any buffered journal entries to the file and asks the OS to write
+ * them to disk. */
+void sync_journal(MMDBW_tree_s *tree) {
+    MMDBW_journal_s *journal = tree->journal;
+    if (NULL == journal) {
+        croak("This tree does not have a journal");
+    }
+
+    if (fflush(journal->file) != 0) {
+        croak("Could not flush journal %s: %s",
+              journal->filename,
+              strerror(errno));
+    }
+#ifndef WIN32
+    if (fsync(fileno(journal->file)) != 0) {
+        croak("Could not sync journal %s: %s",
+              journal->filename,
+              strerror(errno));
+    }
+#endif
+}
+
+void stop_journal(MMDBW_tree_s *tree) {
+    MMDBW_journal_s *journal = tree->journal;
+    if (NULL == journal) {
+        return;
+    }
+    tree->journal = NULL;
+
+    int result = fclose(journal->file);
+    if (NULL != journal->encoder) {
+        SvREFCNT_dec(journal->encoder);
+    }
+
+    char filename[strlen(journal->filename) + 1];
+    strcpy(filename, journal->filename);
+    free(journal->filename);
+    free(journal);
+
+    if (result != 0) {
+        croak("Could not close file %s: %s", filename, strerror(errno));
+    }
+}
+
+/* Each entry is the operation byte followed by the resolved network. For a
+ * network that is its address and prefix length, and for a range it is the
+ * first and last addresses. Inserts then have the merge strategy used, the
+ * data key, and a byte saying whether the data itself follows as a
+ * length-prefixed Sereal document.
+ *
+ * The data is only written when it was not already in the tree. Replaying
+ * the journal on the frozen tree goes through the same states, so any other
+ * data is already in the tree by the time its entry is replayed. */
+static void journal_insert(MMDBW_tree_s *tree,
+                           journal_operation operation,
+                           uint8_t *bytes,
+                           uint8_t *end_bytes,
+                           uint8_t prefix_length,
+                           MMDBW_merge_strategy merge_strategy,
+                           const char *key,
+                           SV *data_sv) {
+    MMDBW_journal_s *journal = tree->journal;
+    const size_t address_size = tree->ip_version == 6 ? 16 : 4;
+
+    uint8_t entry[1 + 16 * 2 + 2 + SHA1_KEY_LENGTH + 1];
+    size_t size = 0;
+
+    entry[size++] = operation;
+    memcpy(entry + size, bytes, address_size);
+    size += address_size;
+    if (operation == JOURNAL_INSERT_RANGE) {
+        memcpy(entry + size, end_bytes, address_size);
+        size += address_size;
+    } else {
+        entry[size++] = prefix_length;
+    }
+
+    if (operation == JOURNAL_REMOVE_NETWORK) {
+        journal_write(journal, entry, size);
+        return;
+    }
+
+    entry[size++] = merge_strategy == MMDBW_MERGE_STRATEGY_UNKNOWN
+                        ? tree->merge_strategy
+                        : merge_strategy;
+    memcpy(entry + size, key, SHA1_KEY_LENGTH);
+    size += SHA1_KEY_LENGTH;
+    entry[size++] = NULL != data_sv;
+    journal_write(journal, entry, size);
+
+    if (NULL == data_sv) {
+        return;
+    }
+
+    if (NULL == journal->encoder) {
+        journal->encoder = new_sereal_object("Sereal::Encoder");
+    }
+
+    SV *frozen = sereal_encode(journal->encoder, data_sv);
+    STRLEN frozen_size;
+    char *frozen_chars = SvPV(frozen, frozen_size);
+
+    uint8_t varint[VARINT_MAX_LENGTH];
+    journal_write(journal, varint, encode_varint(frozen_size, varint));
+    journal_write(journal, frozen_chars, frozen_size);
+
+    SvREFCNT_dec(frozen);
+}
+
+static void
+journal_write(MMDBW_journal_s *journal, void *buffer, size_t count) {
+    size_t result = fwrite(buffer, 1, count, journal->file);
+    if (result != count) {
+        croak("Write to %s did not write the expected amount of data (wrote "
+              "%zu instead of %zu): %s",
+              journal->filename,
+              result,
+              count,
+              strerror(errno));
+    }
+}
+
+/* Replays the journal at filename on the tree. If the journal does not
+ * belong to the frozen tree with the given token, nothing is replayed and we
+ * return 0. Otherwise we return the size of the journal up to the end of the
+ * last complete entry. An entry may be incomplete if the process writing the
+ * journal died, and it is ignored. */
+uint64_t replay_journal(MMDBW_tree_s *tree,
+                        char *filename,
+                        const char *token,
+                        STRLEN token_size) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        croak("Could not open file %s: %s", filename, strerror(errno));
+    }
+
+    struct stat fileinfo;
+    if (fstat(fileno(file), &fileinfo) == -1) {
+        fclose(file);
+        croak("Could not stat file: %s: %s", filename, strerror(errno));
+    }
+
+    if (fileinfo.st_size < JOURNAL_HEADER_LENGTH) {
+        fclose(file);
+        return 0;
+    }
+
+    ENTER;
+    SAVETMPS;
+
+    uint8_t *journal;
+    Newx(journal, fileinfo.st_size, uint8_t);
+    SAVEFREEPV(journal);
+
+    size_t read = fread(journal, 1, fileinfo.st_size, file);
+    fclose(file);
+    if (read != (size_t)fileinfo.st_size) {
+        croak("Could not read journal %s", filename);
+    }
+
+    if (memcmp(journal, JOURNAL_MAGIC, JOURNAL_MAGIC_LENGTH) != 0 ||
+        journal[JOURNAL_MAGIC_LENGTH] != JOURNAL_VERSION) {
+        croak("%s is not an insert journal", filename);
+    }
+
+    if (journal[JOURNAL_MAGIC_LENGTH + 1] != tree->ip_version) {
+        croak("The journal %s is for an IPv%d tree",
+              filename,
+              journal[JOURNAL_MAGIC_LENGTH + 1]);
+    }
+
+    uint64_t replayed = 0;
+    if (token_size == JOURNAL_TOKEN_LENGTH &&
+        memcmp(journal + JOURNAL_MAGIC_LENGTH + 2,
+               token,
+               JOURNAL_TOKEN_LENGTH) == 0) {
+        uint8_t *buffer = journal + JOURNAL_HEADER_LENGTH;
+        uint8_t *end = journal + fileinfo.st_size;
+        SV *decoder = NULL;
+
+        journal_entry_s entry;
+        while (read_journal_entry(tree, &buffer, end, &entry)) {
+            apply_journal_entry(tree, &entry, &decoder);
+        }
+
+        replayed = buffer - journal;
+    }
+
+    FREETMPS;
+    LEAVE;
+
+    return replayed;
+}
+
+/* We return false, leaving the buffer at the start of the entry, if there is
+ * no complete entry left. */
+static bool read_journal_entry(MMDBW_tree_s *tree,
+                               uint8_t **buffer,
+                               uint8_t *end,
+                               journal_entry_s *entry) {
+    const size_t address_size = tree->ip_version == 6 ? 16 : 4;
+    uint8_t *current = *buffer;
+    uint8_t *byte;
+
+    if (!read_journal_bytes(&current, end, &byte, 1)) {
+        return false;
+    }
+    entry->operation = *byte;
+    if (entry->operation != JOURNAL_INSERT_NETWORK &&
+        entry->operation != JOURNAL_INSERT_RANGE &&
+        entry->operation != JOURNAL_REMOVE_NETWORK) {
+        croak("Unknown journal entry type %d (corrupt journal?)", *byte);
+    }
+
+    if (!read_journal_bytes(&current, end, &entry->bytes, address_size)) {
+        return false;
+    }
+    if (entry->operation == JOURNAL_INSERT_RANGE) {
+        if (!read_journal_bytes(
+                &current, end, &entry->end_bytes, address_size)) {
+            return false;
+        }
+    } else {
+        if (!read_journal_bytes(&current, end, &byte, 1)) {
+            return false;
+        }
+        entry->prefix_length = *byte;
+    }
+
+    entry->data = NULL;
+    if (entry->operation != JOURNAL_REMOVE_NETWORK) {
+        uint8_t *key;
+        if (!read_journal_bytes(&current, end, &byte, 1) ||
+            !read_journal_bytes(&current, end, &key, SHA1_KEY_LENGTH)) {
+            return false;
+        }
+        entry->merge_strategy = *byte;
+        memcpy(entry->key, key, SHA1_KEY_LENGTH);
+        entry->key[SHA1_KEY_LENGTH] = '\0';
+
+        if (!read_journal_bytes(&current, end, &byte, 1)) {
+            return false;
+        }
+        if (*byte) {
+            uint128_t data_size;
+            if (!read_journal_varint(&current, end, &data_size) ||
+                !read_journal_bytes(&current, end, &entry->data, data_size)) {
+                return false;
+            }
+            entry->data_size = data_size;
+        }
+    }
+
+    *buffer = current;
+    return true;
+}
+
+static bool read_journal_bytes(uint8_t **buffer,
+                               uint8_t *end,
+                               uint8_t **bytes,
+                               size_t size) {
+    if (*buffer > end || (size_t)(end - *buffer) < size) {
+        return false;
+    }
+
+    *bytes = *buffer;
+    *buffer += size;
+    return true;
+}
+
+static bool
+read_journal_varint(uint8_t **buffer, uint8_t *end, uint128_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 128; shift += 7) {
+        if (*buffer >= end) {
+            return false;
+        }
+        uint8_t byte = **buffer;
+        *buffer += 1;
+
+        *value |= (uint128_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+
+    croak("Invalid varint in journal (corrupt journal?)");
+}
+
+/* This does what insert_network, insert_range, and remove_network do, but
+ * with the network already resolved. */
+static void
+apply_journal_entry(MMDBW_tree_s *tree, journal_entry_s *entry, SV **decoder) {
+    MMDBW_status status;
+
+    if (entry->operation == JOURNAL_REMOVE_NETWORK) {
+        MMDBW_network_s network = {
+            .bytes = entry->bytes,
+            .prefix_length = entry->prefix_length,
+        };
+        MMDBW_record_s new_record = {.type = MMDBW_RECORD_TYPE_EMPTY};
+
+        status = insert_record_for_network(
+            tree, &network, &new_record, MMDBW_MERGE_STRATEGY_NONE, false);
+        if (status != MMDBW_SUCCESS) {
+            croak("Unable to replay journal: %s",
+                  status_error_message(status));
+        }
+        return;
+    }
+
+    const char *key;
+    if (NULL != entry->data) {
+        if (NULL == *decoder) {
+            *decoder = sv_2mortal(new_sereal_object("Sereal::Decoder"));
+        }
+        SV *frozen = sv_2mortal(
+            newSVpvn((char *)entry->data, entry->data_size));
+        SV *data_sv = sereal_decode(*decoder, frozen);
+        key = store_data_in_tree(tree, entry->key, data_sv);
+        SvREFCNT_dec(data_sv);
+    } else {
+        if (!data_is_in_tree(tree, entry->key)) {
+            croak("The journal refers to data that is not in the tree "
+                  "(corrupt journal?)");
+        }
+        key = increment_data_reference_count(tree, entry->key);
+    }
+
+    if (entry->operation == JOURNAL_INSERT_RANGE) {
+        status = insert_record_for_range(
+            tree,
+            (uint128_t)ip_bytes_to_integer(entry->bytes, tree->ip_version),
+            (uint128_t)ip_bytes_to_integer(entry->end_bytes, tree->ip_version),
+            key,
+            entry->merge_strategy);
+    } else {
+        MMDBW_network_s network = {
+            .bytes = entry->bytes,
+            .prefix_length = entry->prefix_length,
+        };
+        MMDBW_record_s new_record = {.type = MMDBW_RECORD_TYPE_DATA,
+                                     .value = {.key = key}};
+
+        status = insert_record_for_network(
+            tree, &network, &new_record, entry->merge_strategy, false);
+    }
+
+    decrement_data_reference_count(tree, key);
+
+    if (status != MMDBW_SUCCESS) {
+        croak("Unable to replay journal: %s", status_error_message(status));
+    }
+}
+
+// Write the search tree and return the number of nodes written. If
+// ipv4_only is true and this is an IPv6 tree, only the IPv4 subtree at
+// ::0.0.0.0/96 is written, as the search tree of an IPv4 database.
+uint32_t write_search_tree(MMDBW_tree_s *tree,
+                           SV *output,
+                           SV *root_data_type,
+                           SV *serializer,
+                           SV *data_positions,
+                           bool ipv4_only) {
+    MMDBW_record_s *root = search_tree_root(tree, ipv4_only);
+
+    tree->node_count = 0;
+    start_iteration_at(tree, root, 0, 0, false, NULL, &assign_node_number);
+
+    /* This is a gross way to get around the fact that with C function
+     * pointers we can't easily pass different params to different
+     * callbacks. */
+    encode_args_s args = {.output_io = IoOFP(sv_2io(output)),
+                          .root_data_type = root_data_type,
+                          .serializer = serializer,
+                          .data_pointer_cache = newHV(),
+                          .data_positions = NULL,
+                          .projected_data = NULL,
+                          .node_count = tree->node_count,
+                          .record_size = tree->record_size,
+                          .outputs = NULL,
+                          .output_count = 0};
+
+    args.data_positions = data_positions_hash(data_positions);
+
+    start_iteration_at(tree, root, 0, 0, false, (void *)&args, &encode_node);
+
+    /* When the hash is _freed_, Perl decrements the ref count for each value
+     * so we don't need to mess with them. */
+    SvREFCNT_dec((SV *)args.data_pointer_cache);
+
+    return tree->node_count;
+}
+
+/* When the data section was already encoded (by the parallel encoder), we are
+ * given the position of each data record and never call the serializer. */
+static HV *data_positions_hash(SV *data_positions) {
+    if (!SvOK(data_positions)) {
+        return NULL;
+    }
+
+    if (!SvROK(data_positions) || SvTYPE(SvRV(data_positions)) != SVt_PVHV) {
+        croak("The data positions passed to write_search_tree must be a "
+              "hash reference");
+    }
+
+    return (HV *)SvRV(data_positions);
+}
+
+// Write the search tree to several outputs in one pass. Each output is an
+// array reference of a filehandle, a record size, and whether to write alias
+// records. The node numbers and data positions are the same for every
+// output, so each record's value is worked out once and then packed for each
+// output's record size. Returns the number of nodes written.
+uint32_t write_search_trees(MMDBW_tree_s *tree,
+                            AV *outputs,
+                            SV *root_data_type,
+                            SV *serializer,
+                            SV *data_positions) {
+    size_t output_count = av_len(outputs) + 1;
+    if (output_count == 0) {
+        croak("No outputs were passed to write_search_trees");
+    }
+
+    // These are mortal so that they are freed if we croak part way through.
+    SV *outputs_sv =
+        sv_2mortal(newSV(output_count * sizeof(search_tree_output_s)));
+    search_tree_output_s *search_tree_outputs =
+        (search_tree_output_s *)SvPVX(outputs_sv);
+
+    uint8_t smallest_record_size = 32;
+    for (size_t i = 0; i < output_count; i++) {
+        SV **output = av_fetch(outputs, i, 0);
+        if (NULL == output || !SvROK(*output) ||
+            SvTYPE(SvRV(*output)) != SVt_PVAV ||
+            av_len((AV *)SvRV(*output)) != 2) {
+            croak("Each output passed to write_search_trees must be an array "
+                  "reference of a filehandle, record size, and alias flag");
+        }
+        SV **values = AvARRAY((AV *)SvRV(*output));
+
+        uint8_t record_size = (uint8_t)SvUV(values[1]);
+        if (record_size != 24 && record_size != 28 && record_size != 32) {
+            croak("Only record sizes of 24, 28, and 32 are supported. "
+                  "Received %u.",
+                  record_size);
+        }
+        if (record_size < smallest_record_size) {
+            smallest_record_size = record_size;
+        }
+
+        search_tree_outputs[i] = (search_tree_output_s){
+            .output_io = IoOFP(sv_2io(values[0])),
+            .record_size = record_size,
+            .aliases = SvTRUE(values[2]),
+            .buffer = SvPVX(sv_2mortal(newSV(SEARCH_TREE_BUFFER_SIZE))),
+            .buffer_used = 0,
+        };
+    }
+
+    assign_node_numbers(tree);
+
+    encode_args_s args = {
+        .output_io = NULL,
+        .root_data_type = root_data_type,
+        .serializer = serializer,
+        .data_pointer_cache = (HV *)sv_2mortal((SV *)newHV()),
+        .data_positions = data_positions_hash(data_positions),
+        .projected_data = NULL,
+        .node_count = tree->node_count,
+        .record_size = smallest_record_size,
+        .outputs = search_tree_outputs,
+        .output_count = output_count,
+    };
+
+    start_iteration(tree, false, (void *)&args, &encode_node_for_outputs);
+
+    for (size_t i = 0; i < output_count; i++) {
+        flush_search_tree_output(&search_tree_outputs[i]);
+    }
+
+    return tree->node_count;
+}
+
+static void encode_node_for_outputs(MMDBW_tree_s *tree,
+                                    MMDBW_node_s *node,
+                                    uint128_t UNUSED(network),
+                                    uint8_t UNUSED(depth),
+                                    void *void_args) {
+    encode_args_s *args = (encode_args_s *)void_args;
+
+    check_record_sanity(node, &(node->left_record), "left");
+    check_record_sanity(node, &(node->right_record), "right");
+
+    uint32_t left = record_value_as_number(tree, &(node->left_record), args);
+    uint32_t right = record_value_as_number(tree, &(node->right_record), args);
+
+    for (size_t i = 0; i < args->output_count; i++) {
+        search_tree_output_s *output = &args->outputs[i];
+
+        uint32_t output_left = left;
+        uint32_t output_right = right;
+        if (!output->aliases) {
+            if (node->left_record.type == MMDBW_RECORD_TYPE_ALIAS) {
+                output_left = args->node_count;
+            }
+            if (node->right_record.type == MMDBW_RECORD_TYPE_ALIAS) {
+                output_right = args->node_count;
+            }
+        }
+
+        uint8_t bytes[8];
+        size_t size =
+            pack_node(output->record_size, output_left, output_right, bytes);
+        write_search_tree_output(output, bytes, size);
+    }
+}
+
+// Pack the values of a node's records into bytes, which must have room for
+// 8 bytes. Returns the number of bytes used.
+static size_t
+pack_node(uint8_t record_size, uint32_t left, uint32_t right, uint8_t *bytes) {
+    if (record_size == 24) {
+        bytes[0] = (left >> 16) & 0xff;
+        bytes[1] = (left >> 8) & 0xff;
+        bytes[2] = left & 0xff;
+        bytes[3] = (right >> 16) & 0xff;
+        bytes[4] = (right >> 8) & 0xff;
+        bytes[5] = right & 0xff;
+        return 6;
+    }
+
+    if (record_size == 28) {
+        bytes[0] = (left >> 16) & 0xff;
+        bytes[1] = (left >> 8) & 0xff;
+        bytes[2] = left & 0xff;
+        bytes[3] = ((left >> 20) & 0xf0) | ((right >> 24) & 0x0f);
+        bytes[4] = (right >> 16) & 0xff;
+        bytes[5] = (right >> 8) & 0xff;
+        bytes[6] = right & 0xff;
+        return 7;
+    }
+
+    uint32_t left_be = htonl(left);
+    uint32_t right_be = htonl(right);
+    memcpy(bytes, &left_be, 4);
+    memcpy(bytes + 4, &right_be, 4);
+    return 8;
+}
+
+static void write_search_tree_output(search_tree_output_s *output,
+                                     const uint8_t *bytes,
+                                     size_t length) {
+    if (output->buffer_used + length > SEARCH_TREE_BUFFER_SIZE) {
+        flush_search_tree_output(output);
+    }
+
+    memcpy(output->buffer + output->buffer_used, bytes, length);
+    output->buffer_used += length;
+}
+
+static void flush_search_tree_output(search_tree_output_s *output) {
+    if (output->buffer_used == 0) {
+        return;
+    }
+
+    check_perlio_result(
+        PerlIO_write(output->output_io, output->buffer, output->buffer_used),
+        output->buffer_used,
+        "PerlIO_write");
+    output->buffer_used = 0;
+}
+
+// Write the search tree with the data of each distinct data key replaced by
+// the result of the projection, which is called with the data and key and
+// returns the new data's key and the new data, or nothing to remove it. The
+// projection is called once per key. Nodes whose records end up with the
+// same data, or are both empty, are written as that record rather than as a
+// node, in the same way as they would be trimmed in a tree built with the new
+// data. The tree itself is not changed, other than the node numbers that
+// every write assigns. Returns the number of nodes written.
+uint32_t write_projected_search_tree(MMDBW_tree_s *tree,
+                                     SV *output,
+                                     SV *root_data_type,
+                                     SV *serializer,
+                                     SV *projection,
+                                     bool ipv4_only) {
+    MMDBW_record_s *tree_root = search_tree_root(tree, ipv4_only);
+
+    // These are mortal so that they are freed if the projection dies.
+    projection_args_s projection_args = {
+        .projection = projection,
+        .projected_keys = (HV *)sv_2mortal((SV *)newHV()),
+        .projected_data = (HV *)sv_2mortal((SV *)newHV()),
+        .merged_nodes = (HV *)sv_2mortal((SV *)newHV()),
+        .node_count = 0,
+    };
+
+    MMDBW_record_s root = project_record(tree, &projection_args, tree_root);
+    if (root.type != MMDBW_RECORD_TYPE_NODE &&
+        root.type != MMDBW_RECORD_TYPE_FIXED_NODE) {
+        croak("The projected tree has no nodes");
+    }
+
+    number_projected_nodes(&projection_args, tree_root);
+
+    encode_args_s args = {
+        .output_io = IoOFP(sv_2io(output)),
+        .root_data_type = root_data_type,
+        .serializer = serializer,
+        .data_pointer_cache = (HV *)sv_2mortal((SV *)newHV()),
+        .data_positions = NULL,
+        .projected_data = projection_args.projected_data,
+        .node_count = projection_args.node_count,
+        .record_size = tree->record_size,
+        .outputs = NULL,
+        .output_count = 0,
+    };
+
+    encode_projected_nodes(tree, &projection_args, &args, tree_root);
+
+    return projection_args.node_count;
+}
+
+// Returns the record that the search tree is written from. For an IPv4
+// database written from an IPv6 tree, this is the record for ::0.0.0.0/96,
+// which is where the IPv4 networks are. Its subtree is numbered from 0 and
+// written as if it were the whole tree.
+static MMDBW_record_s *search_tree_root(MMDBW_tree_s *tree, bool ipv4_only) {
+    MMDBW_record_s *record = &tree->root_record;
+    if (!ipv4_only || tree->ip_version == 4) {
+        if (record->type != MMDBW_RECORD_TYPE_NODE &&
+            record->type != MMDBW_RECORD_TYPE_FIXED_NODE) {
+            croak("Iteration is not currently allowed in trees with no "
+                  "nodes. Record type: %s",
+                  record_type_name(record->type));
+        }
+        return record;
+    }
+
+    for (int depth = 0; depth < 96; depth++) {
+        if (record->type != MMDBW_RECORD_TYPE_NODE &&
+            record->type != MMDBW_RECORD_TYPE_FIXED_NODE) {
+            break;
+        }
+        record = &record->value.node->left_record;
+    }
+
+    if (record->type != MMDBW_RECORD_TYPE_NODE &&
+        record->type != MMDBW_RECORD_TYPE_FIXED_NODE) {
+        croak("Cannot write an IPv4 database from a tree without nodes in "
+              "::0.0.0.0/96. Record type: %s",
+              record_type_name(record->type));
+    }
+
+    return record;
+}
+
+// Returns the record as it is written after the projection, and remembers
+// the nodes that are written as a single record.
+static MMDBW_record_s project_record(MMDBW_tree_s *tree,
+                                     projection_args_s *args,
+                                     MMDBW_record_s *record) {
+    switch (record->type) {
+        case MMDBW_RECORD_TYPE_EMPTY:
+        case MMDBW_RECORD_TYPE_FIXED_EMPTY:
+        case MMDBW_RECORD_TYPE_ALIAS:
+            return *record;
+        case MMDBW_RECORD_TYPE_DATA: {
+            const char *key = projected_key(tree, args, record->value.key);
+            if (NULL == key) {
+                return (MMDBW_record_s){.type = MMDBW_RECORD_TYPE_EMPTY};
+            }
+            return (MMDBW_record_s){.type = MMDBW_RECORD_TYPE_DATA,
+                                    .value.key = key};
+        }
+        case MMDBW_RECORD_TYPE_NODE:
+        case MMDBW_RECORD_TYPE_FIXED_NODE:
+            break;
+    }
+
+    MMDBW_node_s *node = record->value.node;
+    MMDBW_record_s left = project_record(tree, args, &node->left_record);
+    MMDBW_record_s right = project_record(tree, args, &node->right_record);
+
+    // As in trim_identical_records(), we never merge fixed nodes.
+    if (record->type != MMDBW_RECORD_TYPE_NODE || left.type != right.type) {
+        return *record;
+    }
+
+    SV *merged;
+    if (left.type == MMDBW_RECORD_TYPE_EMPTY) {
+        merged = newSV(0);
+    } else if (left.type == MMDBW_RECORD_TYPE_DATA &&
+               strcmp(left.value.key, right.value.key) == 0) {
+        merged = newSVpv(left.value.key, 0);
+    } else {
+        return *record;
+    }
+
+    (void)hv_store(
+        args->merged_nodes, (char *)&node, sizeof(MMDBW_node_s *), merged, 0);
+
+    return left;
+}
+
+static const char *projected_key(MMDBW_tree_s *tree,
+                                 projection_args_s *args,
+                                 const char *const key) {
+    SV **cached = hv_fetch(args->projected_keys, key, SHA1_KEY_LENGTH, 0);
+    if (NULL != cached) {
+        return SvOK(*cached) ? SvPV_nolen(*cached) : NULL;
+    }
+
+    SV *new_key = newSV(0);
+    (void)hv_store(args->projected_keys, key, SHA1_KEY_LENGTH, new_key, 0);
 
-            free(maybe_separator);
-            return NULL;
+    dSP;
+    ENTER;
+    SAVETMPS;
+
+    PUSHMARK(SP);
+    EXTEND(SP, 2);
+    PUSHs(data_for_key(tree, key));
+    mPUSHp(key, SHA1_KEY_LENGTH);
+    PUTBACK;
+
+    int count = call_sv(args->projection, G_ARRAY);
+
+    SPAGAIN;
+
+    if (count == 2) {
+        SV *data = POPs;
+        sv_setsv(new_key, POPs);
+        if (!SvPOK(new_key) || SvCUR(new_key) != SHA1_KEY_LENGTH) {
+            croak("The projection returned a key that is not %d bytes long",
+                  SHA1_KEY_LENGTH);
+        }
+        if (!hv_exists(args->projected_data, SvPVX(new_key), SHA1_KEY_LENGTH)) {
+            (void)hv_store(args->projected_data,
+                           SvPVX(new_key),
+                           SHA1_KEY_LENGTH,
+                           newSVsv(data),
+                           0);
         }
+    } else if (count != 0) {
+        croak("Expected 0 or 2 items back from the projection but got %d",
+              count);
+    }
 
-        croak("Found a ::0/0 network but that should never happen!");
+    PUTBACK;
+    FREETMPS;
+    LEAVE;
+
+    return SvOK(new_key) ? SvPVX(new_key) : NULL;
+}
+
+// Returns the record to write for a record in a node that is written.
+static MMDBW_record_s projected_record(projection_args_s *args,
+                                       MMDBW_record_s *record) {
+    if (record->type == MMDBW_RECORD_TYPE_DATA) {
+        SV **key = hv_fetch(
+            args->projected_keys, record->value.key, SHA1_KEY_LENGTH, 0);
+        if (NULL == key || !SvOK(*key)) {
+            return (MMDBW_record_s){.type = MMDBW_RECORD_TYPE_EMPTY};
+        }
+        return (MMDBW_record_s){.type = MMDBW_RECORD_TYPE_DATA,
+                                .value.key = SvPVX(*key)};
     }
 
-    uint8_t *start_ip_bytes = (uint8_t *)&start_ip;
-    uint8_t temp;
-    for (int i = 0; i < 8; i++) {
-        temp = start_ip_bytes[i];
-        start_ip_bytes[i] = start_ip_bytes[15 - i];
-        start_ip_bytes[15 - i] = temp;
+    if (record->type != MMDBW_RECORD_TYPE_NODE) {
+        return *record;
     }
 
-    thawed_network_s *thawed = checked_malloc(sizeof(thawed_network_s));
+    SV **merged = hv_fetch(args->merged_nodes,
+                           (char *)&record->value.node,
+                           sizeof(MMDBW_node_s *),
+                           0);
+    if (NULL == merged) {
+        return *record;
+    }
+    if (!SvOK(*merged)) {
+        return (MMDBW_record_s){.type = MMDBW_RECORD_TYPE_EMPTY};
+    }
+    return (MMDBW_record_s){.type = MMDBW_RECORD_TYPE_DATA,
+                            .value.key = SvPVX(*merged)};
+}
 
-    uint8_t *bytes;
-    if (tree->ip_version == 4) {
-        bytes = checked_malloc(4);
-        memcpy(bytes, start_ip_bytes + 12, 4);
+// Number the nodes that are written in the same order as
+// assign_node_numbers().
+static void number_projected_nodes(projection_args_s *args,
+                                   MMDBW_record_s *record) {
+    MMDBW_record_s projected = projected_record(args, record);
+    if (projected.type != MMDBW_RECORD_TYPE_NODE &&
+        projected.type != MMDBW_RECORD_TYPE_FIXED_NODE) {
+        return;
+    }
+
+    MMDBW_node_s *node = record->value.node;
+    node->number = args->node_count++;
+    number_projected_nodes(args, &node->left_record);
+    number_projected_nodes(args, &node->right_record);
+}
+
+static void encode_projected_nodes(MMDBW_tree_s *tree,
+                                   projection_args_s *projection_args,
+                                   encode_args_s *args,
+                                   MMDBW_record_s *record) {
+    MMDBW_record_s projected = projected_record(projection_args, record);
+    if (projected.type != MMDBW_RECORD_TYPE_NODE &&
+        projected.type != MMDBW_RECORD_TYPE_FIXED_NODE) {
+        return;
+    }
+
+    MMDBW_node_s *node = record->value.node;
+    MMDBW_record_s left = projected_record(projection_args, &node->left_record);
+    MMDBW_record_s right =
+        projected_record(projection_args, &node->right_record);
+    encode_records(tree, node, &left, &right, args);
+
+    encode_projected_nodes(tree, projection_args, args, &node->left_record);
+    encode_projected_nodes(tree, projection_args, args, &node->right_record);
+}
+
+static void encode_node(MMDBW_tree_s *tree,
+                        MMDBW_node_s *node,
+                        uint128_t UNUSED(network),
+                        uint8_t UNUSED(depth),
+                        void *void_args) {
+    encode_records(tree,
+                   node,
+                   &node->left_record,
+                   &node->right_record,
+                   (encode_args_s *)void_args);
+}
+
+static void encode_records(MMDBW_tree_s *tree,
+                           MMDBW_node_s *node,
+                           MMDBW_record_s *left_record,
+                           MMDBW_record_s *right_record,
+                           encode_args_s *args) {
+    check_record_sanity(node, left_record, "left");
+    check_record_sanity(node, right_record, "right");
+
+    uint32_t left = record_value_as_number(tree, left_record, args);
+    uint32_t right = record_value_as_number(tree, right_record, args);
+
+    uint8_t bytes[8];
+    size_t size = pack_node(tree->record_size, left, right, bytes);
+    check_perlio_result(
+        PerlIO_write(args->output_io, bytes, size), size, "PerlIO_write");
+}
+
+/* Note that for data records, we will ensure that the key they contain does
+ * match a data record in the record_value_as_number() subroutine. */
+static void
+check_record_sanity(MMDBW_node_s *node, MMDBW_record_s *record, char *side) {
+    if (record->type == MMDBW_RECORD_TYPE_NODE ||
+        record->type == MMDBW_RECORD_TYPE_FIXED_NODE) {
+        if (record->value.node->number == node->number) {
+            croak("%s record of node %" PRIu32 " points to the same node",
+                  side,
+                  node->number);
+        }
+
+        if (record->value.node->number < node->number) {
+            croak("%s record of node %" PRIu32
+                  " points to a node number (%" PRIu32 ")",
+                  side,
+                  node->number,
+                  record->value.node->number);
+        }
+    }
+
+    // This is a simple check that we aren't pointing at the tree root.
+    if (record->type == MMDBW_RECORD_TYPE_ALIAS) {
+        if (record->value.node->number == 0) {
+            croak("%s record of node %" PRIu32 " is an alias to node 0",
+                  side,
+                  node->number);
+        }
+    }
+}
+
+static uint32_t record_value_as_number(MMDBW_tree_s *tree,
+                                       MMDBW_record_s *record,
+                                       encode_args_s *args) {
+    uint32_t record_value = 0;
+
+    switch (record->type) {
+        case MMDBW_RECORD_TYPE_FIXED_EMPTY:
+        case MMDBW_RECORD_TYPE_EMPTY: {
+            // Say that the IP isn't here.
+            record_value = args->node_count;
+            break;
+        }
+        case MMDBW_RECORD_TYPE_NODE:
+        case MMDBW_RECORD_TYPE_ALIAS:
+        case MMDBW_RECORD_TYPE_FIXED_NODE: {
+            record_value = record->value.node->number;
+            break;
+        }
+        case MMDBW_RECORD_TYPE_DATA: {
+            SV **cache_record = hv_fetch(args->data_pointer_cache,
+                                         record->value.key,
+                                         SHA1_KEY_LENGTH,
+                                         0);
+            if (cache_record) {
+                /* It is ok to return this without the size check below as it
+                   would have already croaked when it was inserted if it was too
+                   big. */
+                return SvIV(*cache_record);
+            }
+
+            uint32_t position =
+                data_position_for_key(tree, record->value.key, args);
+
+            record_value =
+                position + args->node_count + DATA_SECTION_SEPARATOR_SIZE;
+
+            SV *value = newSViv(record_value);
+            (void)hv_store(args->data_pointer_cache,
+                           record->value.key,
+                           SHA1_KEY_LENGTH,
+                           value,
+                           0);
+            break;
+        }
+    }
+
+    if (record_value > max_value_for_record_size(args->record_size)) {
+        croak("Node value of %" PRIu32 " exceeds the record size of %" PRIu8
+              " bits",
+              record_value,
+              args->record_size);
+    }
+
+    return record_value;
+}
+
+static uint32_t data_position_for_key(MMDBW_tree_s *tree,
+                                      const char *const key,
+                                      encode_args_s *args) {
+    if (NULL != args->data_positions) {
+        SV **position =
+            hv_fetch(args->data_positions, key, SHA1_KEY_LENGTH, 0);
+        if (NULL == position) {
+            croak("No data section position for key - %s", key);
+        }
+        return (uint32_t)SvUV(*position);
+    }
+
+    SV *data = NULL;
+    if (NULL != args->projected_data) {
+        SV **projected =
+            hv_fetch(args->projected_data, key, SHA1_KEY_LENGTH, 0);
+        data = newSVsv(NULL == projected ? &PL_sv_undef : *projected);
     } else {
-        bytes = checked_malloc(16);
-        memcpy(bytes, &start_ip, 16);
+        data = newSVsv(data_for_key(tree, key));
+    }
+    if (!SvOK(data)) {
+        croak("No data associated with key - %s", key);
     }
 
-    MMDBW_network_s network = {
-        .bytes = bytes,
-        .prefix_length = prefix_length,
+    dSP;
+    ENTER;
+    SAVETMPS;
+
+    PUSHMARK(SP);
+    EXTEND(SP, 5);
+    PUSHs(args->serializer);
+    PUSHs(args->root_data_type);
+    mPUSHs(data);
+    PUSHs(&PL_sv_undef);
+    mPUSHp(key, strlen(key));
+    PUTBACK;
+
+    int count = call_method("store_data", G_SCALAR);
+
+    SPAGAIN;
+
+    if (count != 1) {
+        croak("Expected 1 item back from ->store_data() call");
+    }
+
+    SV *rval = POPs;
+    if (!(SvIOK(rval) || SvUOK(rval))) {
+        croak("The serializer's store_data() method returned an SV "
+              "which is not SvIOK or SvUOK!");
+    }
+    uint32_t position = (uint32_t)SvUV(rval);
+
+    PUTBACK;
+    FREETMPS;
+    LEAVE;
+
+    return position;
+}
+
+// Collect each distinct data record in the order that write_search_tree()
+// would hand it to the serializer. The parallel data section encoder uses
+// this so that its output is laid out the same way for the same tree.
+void collect_data_in_write_order(MMDBW_tree_s *tree,
+                                 AV *keys,
+                                 AV *data,
+                                 bool ipv4_only) {
+    MMDBW_record_s *root = search_tree_root(tree, ipv4_only);
+
+    write_order_args_s args = {
+        .keys = keys,
+        .data = data,
+        .seen = newHV(),
     };
 
-    thawed->network = checked_malloc(sizeof(MMDBW_network_s));
-    memcpy(thawed->network, &network, sizeof(MMDBW_network_s));
+    start_iteration_at(
+        tree, root, 0, 0, false, (void *)&args, &collect_node_data);
 
-    MMDBW_record_s *record = checked_malloc(sizeof(MMDBW_record_s));
-    record->type = MMDBW_RECORD_TYPE_DATA;
+    SvREFCNT_dec((SV *)args.seen);
+}
 
-    record->value.key = thaw_data_key(buffer);
+static void collect_node_data(MMDBW_tree_s *tree,
+                              MMDBW_node_s *node,
+                              uint128_t UNUSED(network),
+                              uint8_t UNUSED(depth),
+                              void *void_args) {
+    write_order_args_s *args = (write_order_args_s *)void_args;
 
-    thawed->record = record;
+    collect_record_data(tree, &(node->left_record), args);
+    collect_record_data(tree, &(node->right_record), args);
+}
 
-    return thawed;
+static void collect_record_data(MMDBW_tree_s *tree,
+                                MMDBW_record_s *record,
+                                write_order_args_s *args) {
+    if (record->type != MMDBW_RECORD_TYPE_DATA ||
+        hv_exists(args->seen, record->value.key, SHA1_KEY_LENGTH)) {
+        return;
+    }
+
+    (void)hv_store(
+        args->seen, record->value.key, SHA1_KEY_LENGTH, &PL_sv_yes, 0);
+
+    SV *data = data_for_key(tree, record->value.key);
+    if (!SvOK(data)) {
+        croak("No data associated with key - %s", record->value.key);
+    }
+
+    av_push(args->keys, newSVpvn(record->value.key, SHA1_KEY_LENGTH));
+    av_push(args->data, newSVsv(data));
 }
 
-static uint8_t *thaw_bytes(uint8_t **buffer, size_t size) {
-    uint8_t *value = checked_malloc(size);
-    memcpy(value, *buffer, size);
-    *buffer += size;
-    return value;
+// Point every relocated pointer in an encoded data section at its final
+// position. The relocations are packed as pairs of big-endian 32-bit
+// integers: the offset of the pointer's 4-byte payload and the position it
+// should point to.
+void relocate_data_pointers(SV *buffer, SV *relocations) {
+    STRLEN buffer_size;
+    uint8_t *bytes = (uint8_t *)SvPV_force(buffer, buffer_size);
+
+    STRLEN relocations_size;
+    const uint8_t *packed =
+        (const uint8_t *)SvPV(relocations, relocations_size);
+
+    if (relocations_size % 8 != 0) {
+        croak("The packed relocations must be a sequence of 8 byte pairs");
+    }
+
+    for (STRLEN i = 0; i < relocations_size; i += 8) {
+        uint32_t offset;
+        memcpy(&offset, packed + i, 4);
+        offset = ntohl(offset);
+
+        if ((STRLEN)offset + 4 > buffer_size) {
+            croak("Pointer relocation at offset %" PRIu32
+                  " is past the end of the data section",
+                  offset);
+        }
+
+        // The target is already big-endian, which is what the pointer
+        // payload needs.
+        memcpy(bytes + offset, packed + i + 4, 4);
+    }
+}
+
+uint32_t max_record_value(MMDBW_tree_s *tree) {
+    return max_value_for_record_size(tree->record_size);
+}
+
+static uint32_t max_value_for_record_size(uint8_t record_size) {
+    return record_size == 32 ? UINT32_MAX : (uint32_t)(1 << record_size) - 1;
+}
+
+void start_iteration(MMDBW_tree_s *tree,
+                     bool depth_first,
+                     void *args,
+                     MMDBW_iterator_callback callback) {
+    uint128_t network = 0;
+    uint8_t depth = 0;
+
+    // We disallow this as the callback is based on nodes rather than records,
+    // and changing that is a rabbit hole that I don't want to go down
+    // currently. (I stuck my head in and regretted it.)
+    if (MMDBW_RECORD_TYPE_NODE != tree->root_record.type &&
+        MMDBW_RECORD_TYPE_FIXED_NODE != tree->root_record.type) {
+        croak("Iteration is not currently allowed in trees with no nodes. "
+              "Record type: %s",
+              record_type_name(tree->root_record.type));
+    }
+
+    iterate_tree(
+        tree, &tree->root_record, network, depth, depth_first, args, callback);
+
+    return;
+}
+
+// Call the callback with batches of up to batch_size records, in the same
+// order as iterate().
+//
+// Each batch is a hash reference of parallel arrays: the packed network
+// addresses, prefix lengths, record types, numbers of the nodes holding the
+// records, data keys, and data. The data is a new reference to the data in
+// the tree rather than a copy. If types is not NULL, only records of the
+// named types are included.
+void iterate_batches(MMDBW_tree_s *tree,
+                     SV *callback,
+                     uint32_t batch_size,
+                     AV *types) {
+    batch_iterator_args_s args = {
+        .callback = callback,
+        .batch_size = batch_size,
+        .count = 0,
+        .networks = NULL,
+    };
+
+    // These are mortal so that they are freed if the callback dies.
+    for (int type = 0; type <= MMDBW_RECORD_TYPE_ALIAS; type++) {
+        args.type_names[type] =
+            sv_2mortal(newSVpv(record_type_name(type), 0));
+        SvREADONLY_on(args.type_names[type]);
+    }
+    for (int depth = 0; depth <= tree_depth0(tree) + 1; depth++) {
+        args.prefix_length_values[depth] = sv_2mortal(newSVuv(depth));
+        SvREADONLY_on(args.prefix_length_values[depth]);
+    }
+
+    args.type_mask = record_type_mask(types);
+
+    assign_node_numbers(tree);
+    start_iteration(tree, true, &args, &add_batch_records);
+    flush_record_batch(&args);
+}
+
+static void add_batch_records(MMDBW_tree_s *tree,
+                              MMDBW_node_s *node,
+                              uint128_t network,
+                              uint8_t depth,
+                              void *void_args) {
+    batch_iterator_args_s *args = (batch_iterator_args_s *)void_args;
+
+    add_batch_record(
+        tree, args, node, &node->left_record, network, depth + 1);
+    add_batch_record(tree,
+                     args,
+                     node,
+                     &node->right_record,
+                     flip_network_bit(tree, network, depth),
+                     depth + 1);
 }
 
-static uint128_t thaw_uint128(uint8_t **buffer) {
-    uint128_t value;
-    memcpy(&value, *buffer, 16);
-    *buffer += 16;
-    return value;
+static void add_batch_record(MMDBW_tree_s *tree,
+                             batch_iterator_args_s *args,
+                             MMDBW_node_s *node,
+                             MMDBW_record_s *record,
+                             uint128_t network,
+                             uint8_t depth) {
+    if (!(args->type_mask & ((uint32_t)1 << record->type))) {
+        return;
+    }
+
+    // We start new arrays after each call so that the callback can keep the
+    // batch it was given.
+    if (NULL == args->networks) {
+        AV **columns[] = {&args->networks,
+                          &args->prefix_lengths,
+                          &args->types,
+                          &args->node_numbers,
+                          &args->keys,
+                          &args->data};
+        SSize_t size = args->batch_size < 65536 ? args->batch_size : 65536;
+        for (size_t i = 0; i < sizeof(columns) / sizeof(columns[0]); i++) {
+            *columns[i] = newAV();
+            av_extend(*columns[i], size - 1);
+        }
+    }
+
+    uint8_t bytes[16];
+    integer_to_ip_bytes(tree->ip_version, network, bytes);
+    av_push(args->networks,
+            newSVpvn((char *)bytes, tree->ip_version == 6 ? 16 : 4));
+    av_push(args->prefix_lengths,
+            SvREFCNT_inc_simple_NN(args->prefix_length_values[depth]));
+    av_push(args->types,
+            SvREFCNT_inc_simple_NN(args->type_names[record->type]));
+    av_push(args->node_numbers, newSVuv(node->number));
+
+    if (MMDBW_RECORD_TYPE_DATA == record->type) {
+        av_push(args->keys, newSVpv(record->value.key, 0));
+        av_push(args->data, newSVsv(data_for_key(tree, record->value.key)));
+    } else {
+        av_push(args->keys, newSV(0));
+        av_push(args->data, newSV(0));
+    }
+
+    if (++args->count >= args->batch_size) {
+        flush_record_batch(args);
+    }
 }
 
-static STRLEN thaw_strlen(uint8_t **buffer) {
-    STRLEN value;
-    memcpy(&value, *buffer, sizeof(STRLEN));
-    *buffer += sizeof(STRLEN);
-    return value;
-}
+static void flush_record_batch(batch_iterator_args_s *args) {
+    if (NULL == args->networks) {
+        return;
+    }
 
-static const char *thaw_data_key(uint8_t **buffer) {
-    char *value = checked_malloc(SHA1_KEY_LENGTH + 1);
-    memcpy(value, *buffer, SHA1_KEY_LENGTH);
-    *buffer += SHA1_KEY_LENGTH;
-    value[SHA1_KEY_LENGTH] = '\0';
-    return (const char *)value;
-}
+    HV *batch = newHV();
+    hv_stores(batch, "networks", newRV_noinc((SV *)args->networks));
+    hv_stores(
+        batch, "prefix_lengths", newRV_noinc((SV *)args->prefix_lengths));
+    hv_stores(batch, "types", newRV_noinc((SV *)args->types));
+    hv_stores(batch, "node_numbers", newRV_noinc((SV *)args->node_numbers));
+    hv_stores(batch, "keys", newRV_noinc((SV *)args->keys));
+    hv_stores(batch, "data", newRV_noinc((SV *)args->data));
+    args->networks = NULL;
+    args->count = 0;
 
-static HV *thaw_data_hash(SV *data_to_decode) {
     dSP;
     ENTER;
     SAVETMPS;
 
     PUSHMARK(SP);
     EXTEND(SP, 1);
-    PUSHs(data_to_decode);
+    mPUSHs(newRV_noinc((SV *)batch));
     PUTBACK;
 
-    int count = call_pv("Sereal::Decoder::decode_sereal", G_SCALAR);
+    call_sv(args->callback, G_VOID | G_DISCARD);
 
-    SPAGAIN;
+    FREETMPS;
+    LEAVE;
+}
 
-    if (count != 1) {
-        croak("Expected 1 item back from Sereal::Decoder::decode_sereal call");
+// Iterate over the subtree below a record, given the record's network. If
+// the record is an alias, the subtree it points to is iterated. Nothing is
+// iterated if the record is not a node or an alias.
+void start_iteration_at(MMDBW_tree_s *tree,
+                        MMDBW_record_s *record,
+                        uint128_t network,
+                        uint8_t depth,
+                        bool depth_first,
+                        void *args,
+                        MMDBW_iterator_callback callback) {
+    MMDBW_record_s start = *record;
+    if (start.type == MMDBW_RECORD_TYPE_ALIAS) {
+        start.type = MMDBW_RECORD_TYPE_FIXED_NODE;
     }
 
-    SV *thawed = POPs;
-    if (!SvROK(thawed)) {
-        croak("The Sereal::Decoder::decode_sereal sub returned an SV which is "
-              "not SvROK!");
-    }
+    iterate_tree(tree, &start, network, depth, depth_first, args, callback);
+}
 
-    SV *data_hash = SvREFCNT_inc_simple_NN(SvRV(thawed));
+// Returns a mask with a bit set for each of the named record types, or all
+// types if types is NULL.
+static uint32_t record_type_mask(AV *types) {
+    if (NULL == types) {
+        return ~(uint32_t)0;
+    }
 
-    PUTBACK;
-    FREETMPS;
-    LEAVE;
+    uint32_t type_mask = 0;
+    for (SSize_t i = 0; i <= av_len(types); i++) {
+        SV **name = av_fetch(types, i, 0);
+        const char *type_name = NULL == name ? "" : SvPV_nolen(*name);
+        int type = 0;
+        for (; type <= MMDBW_RECORD_TYPE_ALIAS; type++) {
+            if (strcmp(type_name, record_type_name(type)) == 0) {
+                break;
+            }
+        }
+        if (type > MMDBW_RECORD_TYPE_ALIAS) {
+            croak("Unknown record type: %s", type_name);
+        }
+        type_mask |= (uint32_t)1 << type;
+    }
 
-    return (HV *)data_hash;
+    return type_mask;
 }
 
-void write_search_tree(MMDBW_tree_s *tree,
-                       SV *output,
-                       SV *root_data_type,
-                       SV *serializer) {
-    assign_node_numbers(tree);
-
-    /* This is a gross way to get around the fact that with C function
-     * pointers we can't easily pass different params to different
-     * callbacks. */
-    encode_args_s args = {.output_io = IoOFP(sv_2io(output)),
-                          .root_data_type = root_data_type,
-                          .serializer = serializer,
-                          .data_pointer_cache = newHV()};
+// Create a cursor over the records of a snapshot of the tree.
+//
+// In pre-order, each record is visited before the records in its subtree. In
+// in-order, a node's records are visited after its left subtree and before
+// its right subtree, which is the order used by iterate().
+MMDBW_cursor_s *new_cursor(MMDBW_tree_s *tree, bool preorder, AV *types) {
+    uint32_t type_mask = record_type_mask(types);
+
+    MMDBW_cursor_s *cursor = checked_malloc(sizeof(MMDBW_cursor_s));
+    cursor->tree = snapshot_tree(tree);
+    cursor->preorder = preorder;
+    cursor->type_mask = type_mask;
+    cursor->frame_count = 0;
+
+    cursor->network = newSV(0);
+    cursor->prefix_length = newSV(0);
+    cursor->key = newSV(0);
+    cursor->data = newSV(0);
+    for (int type = 0; type <= MMDBW_RECORD_TYPE_ALIAS; type++) {
+        cursor->type_names[type] = newSVpv(record_type_name(type), 0);
+        SvREADONLY_on(cursor->type_names[type]);
+    }
+    cursor->type = cursor->type_names[MMDBW_RECORD_TYPE_EMPTY];
+
+    MMDBW_record_s *root = &cursor->tree->root_record;
+    if (root->type == MMDBW_RECORD_TYPE_NODE ||
+        root->type == MMDBW_RECORD_TYPE_FIXED_NODE) {
+        cursor->frames[0] = (MMDBW_cursor_frame_s){
+            .node = root->value.node, .network = 0, .depth = 0, .step = 0};
+        cursor->frame_count = 1;
+    }
 
-    start_iteration(tree, false, (void *)&args, &encode_node);
+    return cursor;
+}
 
-    /* When the hash is _freed_, Perl decrements the ref count for each value
-     * so we don't need to mess with them. */
-    SvREFCNT_dec((SV *)args.data_pointer_cache);
+// Move the cursor to its next record. This returns false when there are no
+// more records.
+bool cursor_next(MMDBW_cursor_s *cursor) {
+    static const cursor_step_t preorder_steps[] = {
+        CURSOR_VISIT_LEFT,
+        CURSOR_DESCEND_LEFT,
+        CURSOR_VISIT_RIGHT,
+        CURSOR_DESCEND_RIGHT,
+    };
+    static const cursor_step_t inorder_steps[] = {
+        CURSOR_DESCEND_LEFT,
+        CURSOR_VISIT_LEFT,
+        CURSOR_VISIT_RIGHT,
+        CURSOR_DESCEND_RIGHT,
+    };
+    const cursor_step_t *steps =
+        cursor->preorder ? preorder_steps : inorder_steps;
+
+    while (cursor->frame_count > 0) {
+        MMDBW_cursor_frame_s *frame = &cursor->frames[cursor->frame_count - 1];
+        cursor_step_t step = steps[frame->step++];
+
+        bool is_right =
+            step == CURSOR_VISIT_RIGHT || step == CURSOR_DESCEND_RIGHT;
+        MMDBW_record_s *record = is_right ? &frame->node->right_record
+                                          : &frame->node->left_record;
+        uint128_t network = frame->network;
+        if (is_right) {
+            network = flip_network_bit(cursor->tree, network, frame->depth);
+        }
+        uint8_t depth = frame->depth + 1;
 
-    return;
-}
+        // The right subtree is always the last step, so its frame replaces
+        // the node's frame.
+        if (frame->step == 4) {
+            cursor->frame_count--;
+        }
 
-static void encode_node(MMDBW_tree_s *tree,
-                        MMDBW_node_s *node,
-                        uint128_t UNUSED(network),
-                        uint8_t UNUSED(depth),
-                        void *void_args) {
-    encode_args_s *args = (encode_args_s *)void_args;
+        if (step == CURSOR_VISIT_LEFT || step == CURSOR_VISIT_RIGHT) {
+            if (cursor->type_mask & ((uint32_t)1 << record->type)) {
+                set_cursor_record(cursor, record, network, depth);
+                return true;
+            }
+        } else if (record->type == MMDBW_RECORD_TYPE_NODE ||
+                   record->type == MMDBW_RECORD_TYPE_FIXED_NODE) {
+            cursor->frames[cursor->frame_count++] =
+                (MMDBW_cursor_frame_s){.node = record->value.node,
+                                       .network = network,
+                                       .depth = depth,
+                                       .step = 0};
+        }
+    }
 
-    check_record_sanity(node, &(node->left_record), "left");
-    check_record_sanity(node, &(node->right_record), "right");
+    return false;
+}
 
-    uint32_t left =
-        htonl(record_value_as_number(tree, &(node->left_record), args));
-    uint32_t right =
-        htonl(record_value_as_number(tree, &(node->right_record), args));
-
-    uint8_t *left_bytes = (uint8_t *)&left;
-    uint8_t *right_bytes = (uint8_t *)&right;
-
-    if (tree->record_size == 24) {
-        check_perlio_result(PerlIO_printf(args->output_io,
-                                          "%c%c%c%c%c%c",
-                                          left_bytes[1],
-                                          left_bytes[2],
-                                          left_bytes[3],
-                                          right_bytes[1],
-                                          right_bytes[2],
-                                          right_bytes[3]),
-                            6,
-                            "PerlIO_printf");
-    } else if (tree->record_size == 28) {
-        check_perlio_result(
-            PerlIO_printf(args->output_io,
-                          "%c%c%c%c%c%c%c",
-                          left_bytes[1],
-                          left_bytes[2],
-                          left_bytes[3],
-                          (left_bytes[0] << 4) | (right_bytes[0] & 15),
-                          right_bytes[1],
-                          right_bytes[2],
-                          right_bytes[3]),
-            7,
-            "PerlIO_printf");
+static void set_cursor_record(MMDBW_cursor_s *cursor,
+                              MMDBW_record_s *record,
+                              uint128_t network,
+                              uint8_t depth) {
+    MMDBW_tree_s *tree = cursor->tree;
+
+    uint8_t bytes[16];
+    integer_to_ip_bytes(tree->ip_version, network, bytes);
+    sv_setpvn(
+        cursor->network, (char *)bytes, tree->ip_version == 6 ? 16 : 4);
+    sv_setuv(cursor->prefix_length, depth);
+    cursor->type = cursor->type_names[record->type];
+
+    if (MMDBW_RECORD_TYPE_DATA == record->type) {
+        sv_setpv(cursor->key, record->value.key);
+        // This copies the reference, not the data it refers to.
+        sv_setsv(cursor->data, data_for_key(tree, record->value.key));
     } else {
-        check_perlio_result(PerlIO_printf(args->output_io,
-                                          "%c%c%c%c%c%c%c%c",
-                                          left_bytes[0],
-                                          left_bytes[1],
-                                          left_bytes[2],
-                                          left_bytes[3],
-                                          right_bytes[0],
-                                          right_bytes[1],
-                                          right_bytes[2],
-                                          right_bytes[3]),
-                            8,
-                            "PerlIO_printf");
+        sv_setsv(cursor->key, &PL_sv_undef);
+        sv_setsv(cursor->data, &PL_sv_undef);
     }
 }
 
-/* Note that for data records, we will ensure that the key they contain does
- * match a data record in the record_value_as_number() subroutine. */
-static void
-check_record_sanity(MMDBW_node_s *node, MMDBW_record_s *record, char *side) {
-    if (record->type == MMDBW_RECORD_TYPE_NODE ||
-        record->type == MMDBW_RECORD_TYPE_FIXED_NODE) {
-        if (record->value.node->number == node->number) {
-            croak("%s record of node %" PRIu32 " points to the same node",
-                  side,
-                  node->number);
-        }
+void free_cursor(MMDBW_cursor_s *cursor) {
+    free_tree(cursor->tree);
 
-        if (record->value.node->number < node->number) {
-            croak("%s record of node %" PRIu32
-                  " points to a node number (%" PRIu32 ")",
-                  side,
-                  node->number,
-                  record->value.node->number);
-        }
+    SvREFCNT_dec(cursor->network);
+    SvREFCNT_dec(cursor->prefix_length);
+    SvREFCNT_dec(cursor->key);
+    SvREFCNT_dec(cursor->data);
+    for (int type = 0; type <= MMDBW_RECORD_TYPE_ALIAS; type++) {
+        SvREFCNT_dec(cursor->type_names[type]);
     }
 
-    // This is a simple check that we aren't pointing at the tree root.
-    if (record->type == MMDBW_RECORD_TYPE_ALIAS) {
-        if (record->value.node->number == 0) {
-            croak("%s record of node %" PRIu32 " is an alias to node 0",
-                  side,
-                  node->number);
-        }
-    }
+    free(cursor);
 }
 
-static uint32_t record_value_as_number(MMDBW_tree_s *tree,
-                                       MMDBW_record_s *record,
-                                       encode_args_s *args) {
-    uint32_t record_value = 0;
+// Write the tree's data records to the output as ranges of addresses, in
+// network order. Adjacent records with the same key are written as a single
+// range. Each key's data is encoded by calling the data encoder, and is only
+// written with the first range for the key.
+//
+// The output is CSV unless jsonl is true, in which case each range is a JSON
+// object on its own line.
+void export_ranges(MMDBW_tree_s *tree,
+                   SV *output,
+                   bool jsonl,
+                   SV *data_encoder) {
+    // These are mortal so that they are freed if the encoder dies.
+    SV *buffer = sv_2mortal(newSV(EXPORT_BUFFER_SIZE));
+    HV *exported_keys = (HV *)sv_2mortal((SV *)newHV());
+
+    export_args_s args = {
+        .tree = tree,
+        .output_io = IoOFP(sv_2io(output)),
+        .jsonl = jsonl,
+        .data_encoder = data_encoder,
+        .exported_keys = exported_keys,
+        .has_range = false,
+        .buffer = SvPVX(buffer),
+        .buffer_used = 0,
+    };
+
+    if (!jsonl) {
+        static const char header[] = "start_ip,end_ip,key,data\n";
+        write_export(&args, header, sizeof(header) - 1);
+    }
+
+    export_record(&args, &tree->root_record, 0, 0);
+    write_export_range(&args);
+    flush_export_buffer(&args);
+}
 
+static void export_record(export_args_s *args,
+                          MMDBW_record_s *record,
+                          uint128_t network,
+                          uint8_t depth) {
     switch (record->type) {
+        case MMDBW_RECORD_TYPE_EMPTY:
         case MMDBW_RECORD_TYPE_FIXED_EMPTY:
-        case MMDBW_RECORD_TYPE_EMPTY: {
-            // Say that the IP isn't here.
-            record_value = tree->node_count;
-            break;
-        }
-        case MMDBW_RECORD_TYPE_NODE:
+        // As with iterate(), the networks an alias points at are only
+        // exported once, in the IPv4 subtree.
         case MMDBW_RECORD_TYPE_ALIAS:
-        case MMDBW_RECORD_TYPE_FIXED_NODE: {
-            record_value = record->value.node->number;
+            return;
+        case MMDBW_RECORD_TYPE_NODE:
+        case MMDBW_RECORD_TYPE_FIXED_NODE:
+            export_record(
+                args, &record->value.node->left_record, network, depth + 1);
+            export_record(args,
+                          &record->value.node->right_record,
+                          flip_network_bit(args->tree, network, depth),
+                          depth + 1);
+            return;
+        case MMDBW_RECORD_TYPE_DATA:
             break;
-        }
-        case MMDBW_RECORD_TYPE_DATA: {
-            SV **cache_record = hv_fetch(args->data_pointer_cache,
-                                         record->value.key,
-                                         SHA1_KEY_LENGTH,
-                                         0);
-            if (cache_record) {
-                /* It is ok to return this without the size check below as it
-                   would have already croaked when it was inserted if it was too
-                   big. */
-                return SvIV(*cache_record);
-            }
+    }
 
-            SV *data = newSVsv(data_for_key(tree, record->value.key));
-            if (!SvOK(data)) {
-                croak("No data associated with key - %s", record->value.key);
-            }
+    const char *key = record->value.key;
+    if (args->has_range && args->range_end + 1 == network &&
+        (args->range_key == key || strcmp(args->range_key, key) == 0)) {
+        args->range_end = last_address_in_network(args->tree, network, depth);
+        return;
+    }
 
-            dSP;
-            ENTER;
-            SAVETMPS;
+    write_export_range(args);
 
-            PUSHMARK(SP);
-            EXTEND(SP, 5);
-            PUSHs(args->serializer);
-            PUSHs(args->root_data_type);
-            mPUSHs(data);
-            PUSHs(&PL_sv_undef);
-            mPUSHp(record->value.key, strlen(record->value.key));
-            PUTBACK;
+    args->has_range = true;
+    args->range_start = network;
+    args->range_end = last_address_in_network(args->tree, network, depth);
+    args->range_key = key;
+}
 
-            int count = call_method("store_data", G_SCALAR);
+static void write_export_range(export_args_s *args) {
+    if (!args->has_range) {
+        return;
+    }
+    args->has_range = false;
 
-            SPAGAIN;
+    char start[INET6_ADDRSTRLEN];
+    char end[INET6_ADDRSTRLEN];
+    size_t start_length = format_address(args->tree, args->range_start, start);
+    size_t end_length = format_address(args->tree, args->range_end, end);
 
-            if (count != 1) {
-                croak("Expected 1 item back from ->store_data() call");
-            }
+    const char *key = args->range_key;
+    size_t key_length = strlen(key);
 
-            SV *rval = POPs;
-            if (!(SvIOK(rval) || SvUOK(rval))) {
-                croak("The serializer's store_data() method returned an SV "
-                      "which is not SvIOK or SvUOK!");
-            }
-            uint32_t position = (uint32_t)SvUV(rval);
+    SV *encoded = NULL;
+    if (!hv_exists(args->exported_keys, key, key_length)) {
+        (void)hv_store(args->exported_keys, key, key_length, newSV(0), 0);
 
-            PUTBACK;
-            FREETMPS;
-            LEAVE;
+        dSP;
+        ENTER;
+        SAVETMPS;
 
-            record_value =
-                position + tree->node_count + DATA_SECTION_SEPARATOR_SIZE;
+        PUSHMARK(SP);
+        EXTEND(SP, 1);
+        PUSHs(data_for_key(args->tree, key));
+        PUTBACK;
 
-            SV *value = newSViv(record_value);
-            (void)hv_store(args->data_pointer_cache,
-                           record->value.key,
-                           SHA1_KEY_LENGTH,
-                           value,
-                           0);
+        int count = call_sv(args->data_encoder, G_SCALAR);
+
+        SPAGAIN;
+
+        if (count != 1) {
+            croak("Expected 1 item back from the data encoder but got %d",
+                  count);
+        }
+
+        encoded = newSVsv(POPs);
+
+        PUTBACK;
+        FREETMPS;
+        LEAVE;
+
+        sv_2mortal(encoded);
+    }
+
+    STRLEN encoded_length = 0;
+    const char *encoded_data =
+        NULL == encoded ? NULL : SvPV(encoded, encoded_length);
+
+    if (args->jsonl) {
+        write_export(args, "{\"start\":\"", 10);
+        write_export(args, start, start_length);
+        write_export(args, "\",\"end\":\"", 9);
+        write_export(args, end, end_length);
+        write_export(args, "\",\"key\":", 8);
+        write_export_json_string(args, key);
+        if (NULL != encoded_data) {
+            write_export(args, ",\"data\":", 8);
+            write_export(args, encoded_data, encoded_length);
+        }
+        write_export(args, "}\n", 2);
+    } else {
+        write_export(args, start, start_length);
+        write_export(args, ",", 1);
+        write_export(args, end, end_length);
+        write_export(args, ",", 1);
+        write_export_csv_field(args, key, key_length);
+        write_export(args, ",", 1);
+        if (NULL != encoded_data) {
+            write_export_csv_field(args, encoded_data, encoded_length);
+        }
+        write_export(args, "\n", 1);
+    }
+}
+
+static void
+write_export(export_args_s *args, const char *bytes, size_t length) {
+    if (args->buffer_used + length > EXPORT_BUFFER_SIZE) {
+        flush_export_buffer(args);
+    }
+
+    if (length > EXPORT_BUFFER_SIZE) {
+        check_perlio_result(PerlIO_write(args->output_io, bytes, length),
+                            length,
+                            "PerlIO_write");
+        return;
+    }
+
+    memcpy(args->buffer + args->buffer_used, bytes, length);
+    args->buffer_used += length;
+}
+
+static void write_export_json_string(export_args_s *args, const char *string) {
+    write_export(args, "\"", 1);
+    for (const char *c = string; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            char escaped[2] = {'\\', *c};
+            write_export(args, escaped, 2);
+        } else if ((unsigned char)*c < 0x20) {
+            char escaped[7];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)*c);
+            write_export(args, escaped, 6);
+        } else {
+            write_export(args, c, 1);
+        }
+    }
+    write_export(args, "\"", 1);
+}
+
+static void
+write_export_csv_field(export_args_s *args, const char *field, size_t length) {
+    bool needs_quotes = false;
+    for (size_t i = 0; i < length; i++) {
+        if (field[i] == ',' || field[i] == '"' || field[i] == '\n' ||
+            field[i] == '\r') {
+            needs_quotes = true;
             break;
         }
     }
 
-    if (record_value > max_record_value(tree)) {
-        croak("Node value of %" PRIu32 " exceeds the record size of %" PRIu8
-              " bits",
-              record_value,
-              tree->record_size);
+    if (!needs_quotes) {
+        write_export(args, field, length);
+        return;
     }
 
-    return record_value;
+    write_export(args, "\"", 1);
+    size_t start = 0;
+    for (size_t i = 0; i < length; i++) {
+        // A quote is escaped by doubling it.
+        if (field[i] == '"') {
+            write_export(args, field + start, i - start + 1);
+            start = i;
+        }
+    }
+    write_export(args, field + start, length - start);
+    write_export(args, "\"", 1);
 }
 
-uint32_t max_record_value(MMDBW_tree_s *tree) {
-    uint8_t record_size = tree->record_size;
-    return record_size == 32 ? UINT32_MAX : (uint32_t)(1 << record_size) - 1;
+static void flush_export_buffer(export_args_s *args) {
+    if (args->buffer_used == 0) {
+        return;
+    }
+
+    check_perlio_result(
+        PerlIO_write(args->output_io, args->buffer, args->buffer_used),
+        args->buffer_used,
+        "PerlIO_write");
+    args->buffer_used = 0;
 }
 
-void start_iteration(MMDBW_tree_s *tree,
-                     bool depth_first,
-                     void *args,
-                     MMDBW_iterator_callback callback) {
-    uint128_t network = 0;
-    uint8_t depth = 0;
+// These write the same strings as inet_ntop() without the conversion to
+// bytes and the checks of the address family and destination size. dst must
+// have room for INET6_ADDRSTRLEN characters. They return the length of the
+// string, which is not NUL-terminated.
+static size_t format_address(MMDBW_tree_s *tree, uint128_t ip, char *dst) {
+    return tree->ip_version == 6 ? format_ipv6(ip, dst)
+                                 : format_ipv4((uint32_t)ip, dst);
+}
 
-    // We disallow this as the callback is based on nodes rather than records,
-    // and changing that is a rabbit hole that I don't want to go down
-    // currently. (I stuck my head in and regretted it.)
-    if (MMDBW_RECORD_TYPE_NODE != tree->root_record.type &&
-        MMDBW_RECORD_TYPE_FIXED_NODE != tree->root_record.type) {
-        croak("Iteration is not currently allowed in trees with no nodes. "
-              "Record type: %s",
-              record_type_name(tree->root_record.type));
+static size_t format_ipv4(uint32_t ip, char *dst) {
+    char *p = dst;
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        unsigned int octet = (ip >> shift) & 0xFF;
+        if (octet >= 100) {
+            *p++ = '0' + octet / 100;
+        }
+        if (octet >= 10) {
+            *p++ = '0' + octet / 10 % 10;
+        }
+        *p++ = '0' + octet % 10;
+        if (shift > 0) {
+            *p++ = '.';
+        }
     }
+    return p - dst;
+}
 
-    iterate_tree(
-        tree, &tree->root_record, network, depth, depth_first, args, callback);
+static size_t format_ipv6(uint128_t ip, char *dst) {
+    static const char hex_digits[] = "0123456789abcdef";
 
-    return;
+    uint16_t words[8];
+    for (int i = 7; i >= 0; i--) {
+        words[i] = ip & 0xFFFF;
+        ip >>= 16;
+    }
+
+    // The longest run of two or more zero words is replaced with "::".
+    int best_base = -1, best_length = 0;
+    for (int i = 0; i < 8;) {
+        if (words[i] != 0) {
+            i++;
+            continue;
+        }
+        int length = 0;
+        while (i + length < 8 && words[i + length] == 0) {
+            length++;
+        }
+        if (length > best_length) {
+            best_base = i;
+            best_length = length;
+        }
+        i += length;
+    }
+    if (best_length < 2) {
+        best_base = -1;
+    }
+
+    char *p = dst;
+    for (int i = 0; i < 8; i++) {
+        if (best_base != -1 && i >= best_base && i < best_base + best_length) {
+            if (i == best_base) {
+                *p++ = ':';
+            }
+            continue;
+        }
+        if (i != 0) {
+            *p++ = ':';
+        }
+        // Like inet_ntop(), we write IPv4-compatible and IPv4-mapped
+        // addresses with their last 32 bits as an IPv4 address.
+        if (i == 6 && best_base == 0 &&
+            (best_length == 6 || (best_length == 5 && words[5] == 0xFFFF))) {
+            p += format_ipv4(((uint32_t)words[6] << 16) | words[7], p);
+            return p - dst;
+        }
+        bool started = false;
+        for (int shift = 12; shift >= 0; shift -= 4) {
+            int digit = (words[i] >> shift) & 0xF;
+            if (started || digit != 0 || shift == 0) {
+                *p++ = hex_digits[digit];
+                started = true;
+            }
+        }
+    }
+    if (best_base != -1 && best_base + best_length == 8) {
+        *p++ = ':';
+    }
+
+    return p - dst;
 }
 
 static void iterate_tree(MMDBW_tree_s *tree,
@@ -2070,7 +7007,7 @@ static SV *key_for_data(SV *data) {
 
 SV *data_for_key(MMDBW_tree_s *tree, const char *const key) {
     MMDBW_data_hash_s *data = NULL;
-    HASH_FIND(hh, tree->data_table, key, strlen(key), data);
+    HASH_FIND(hh, tree->data_table->entries, key, strlen(key), data);
 
     if (NULL != data) {
         return data->data_sv;
@@ -2091,7 +7028,11 @@ static const char *merge_cache_lookup(MMDBW_tree_s *tree,
     // We have to check that the value has not been removed from the data
     // table
     MMDBW_data_hash_s *data = NULL;
-    HASH_FIND(hh, tree->data_table, cache->value, SHA1_KEY_LENGTH, data);
+    HASH_FIND(hh,
+              tree->data_table->entries,
+              cache->value,
+              SHA1_KEY_LENGTH,
+              data);
     if (data != NULL) {
         return cache->value;
     }
@@ -2115,16 +7056,27 @@ static void store_in_merge_cache(MMDBW_tree_s *tree,
 }
 
 void free_tree(MMDBW_tree_s *tree) {
+    stop_journal(tree);
+
     free_record_value(tree, &tree->root_record, true);
     free_merge_cache(tree);
+    free_key_index(tree->key_index);
+
+    MMDBW_data_table_s *data_table = tree->data_table;
+    free(tree);
 
-    int hash_count = HASH_COUNT(tree->data_table);
+    // Snapshots of the tree share its data table.
+    data_table->tree_count--;
+    if (data_table->tree_count > 0) {
+        return;
+    }
+
+    int hash_count = HASH_COUNT(data_table->entries);
+    free(data_table);
     if (0 != hash_count) {
         croak("%d elements left in data table after freeing all nodes!",
               hash_count);
     }
-
-    free(tree);
 }
 
 void free_merge_cache(MMDBW_tree_s *tree) {
@@ -2146,6 +7098,15 @@ static void *checked_malloc(size_t size) {
     return ptr;
 }
 
+static void *checked_calloc(size_t count, size_t size) {
+    void *ptr = calloc(count, size);
+    if (!ptr) {
+        abort();
+    }
+
+    return ptr;
+}
+
 static void
 checked_fwrite(FILE *file, char *filename, void *buffer, size_t count) {
     size_t result = fwrite(buffer, 1, count, file);
@@ -2193,6 +7154,9 @@ static char *status_error_message(MMDBW_status status) {
             return "Attempted to overwrite a fixed node.";
         case MMDBW_RESOLVING_IP_ERROR:
             return "Failed to resolve IP address.";
+        case MMDBW_SHARD_OVERLAP_ERROR:
+            return "The shard has networks that overlap networks already in "
+                   "the tree.";
     }
     // We should get a compile time warning if an enum is missing
     return "Unknown error";
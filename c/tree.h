@@ -60,6 +60,7 @@ typedef enum {
     MMDBW_ALIAS_OVERWRITE_ATTEMPT_ERROR,
     MMDBW_FIXED_NODE_OVERWRITE_ATTEMPT_ERROR,
     MMDBW_RESOLVING_IP_ERROR,
+    MMDBW_SHARD_OVERLAP_ERROR,
 } MMDBW_status;
 
 typedef enum {
@@ -105,6 +106,14 @@ typedef struct MMDBW_node_s {
     MMDBW_record_s left_record;
     MMDBW_record_s right_record;
     uint32_t number;
+    // The number of records pointing at this node. This is only more than 1
+    // when the node is shared by a tree and its snapshots. Alias records do
+    // not count.
+    uint32_t reference_count;
+    // A hash of the data keys and structure of the node's subtree, used to
+    // skip identical subtrees when diffing trees. This is 0 if it has not
+    // been computed since the node was last changed.
+    uint64_t hash;
 } MMDBW_node_s;
 
 typedef struct MMDBW_data_hash_s {
@@ -114,20 +123,61 @@ typedef struct MMDBW_data_hash_s {
     UT_hash_handle hh;
 } MMDBW_data_hash_s;
 
+typedef struct MMDBW_data_table_s {
+    MMDBW_data_hash_s *entries;
+    // The number of trees sharing this table. A tree shares its data table
+    // with its snapshots.
+    uint32_t tree_count;
+} MMDBW_data_table_s;
+
 typedef struct MMDBW_merge_cache_s {
     const char *key;
     const char *value;
     UT_hash_handle hh;
 } MMDBW_merge_cache_s;
 
+typedef struct MMDBW_indexed_network_s {
+    uint128_t network;
+    uint8_t prefix_length;
+} MMDBW_indexed_network_s;
+
+typedef struct MMDBW_key_index_entry_s {
+    const char *key;
+    MMDBW_indexed_network_s *networks;
+    size_t network_count;
+    size_t network_capacity;
+    uint128_t address_count;
+    UT_hash_handle hh;
+} MMDBW_key_index_entry_s;
+
+// The networks for each data key. This is built when it is first needed, and
+// it is rebuilt when the hash of the tree's root record no longer matches the
+// hash when it was built.
+typedef struct MMDBW_key_index_s {
+    MMDBW_key_index_entry_s *entries;
+    uint64_t root_hash;
+} MMDBW_key_index_s;
+
+typedef struct MMDBW_journal_s {
+    FILE *file;
+    char *filename;
+    SV *encoder;
+} MMDBW_journal_s;
+
 typedef struct MMDBW_tree_s {
     uint8_t ip_version;
     uint8_t record_size;
     MMDBW_merge_strategy merge_strategy;
-    MMDBW_data_hash_s *data_table;
+    MMDBW_data_table_s *data_table;
     MMDBW_merge_cache_s *merge_cache;
+    MMDBW_key_index_s *key_index;
     MMDBW_record_s root_record;
     uint32_t node_count;
+    MMDBW_journal_s *journal;
+    // A tree built as a shard can only have networks in the shard's network.
+    // The prefix length is 0 for other trees.
+    uint128_t shard_first_ip;
+    uint8_t shard_prefix_length;
 } MMDBW_tree_s;
 
 typedef struct MMDBW_network_s {
@@ -135,6 +185,45 @@ typedef struct MMDBW_network_s {
     const uint8_t prefix_length;
 } MMDBW_network_s;
 
+typedef struct MMDBW_cursor_frame_s {
+    MMDBW_node_s *node;
+    uint128_t network;
+    uint8_t depth;
+    // How many of the node's records and subtrees have been visited.
+    uint8_t step;
+} MMDBW_cursor_frame_s;
+
+// A cursor walks a snapshot of a tree with an explicit stack, so the tree can
+// change while the cursor is in use. The current record is stored in the
+// cursor's scalars, which are reused for each record.
+typedef struct MMDBW_cursor_s {
+    MMDBW_tree_s *tree;
+    bool preorder;
+    uint32_t type_mask;
+    int frame_count;
+    MMDBW_cursor_frame_s frames[128];
+    SV *network;
+    SV *prefix_length;
+    SV *key;
+    SV *data;
+    SV *type_names[MMDBW_RECORD_TYPE_ALIAS + 1];
+    SV *type;
+} MMDBW_cursor_s;
+
+// The record for a network, as found by record_for_network().
+typedef struct MMDBW_network_record_s {
+    // The first address and prefix length of the network in the tree.
+    uint128_t network;
+    uint8_t prefix_length;
+    // If the network is inside a larger record, this is that record, and its
+    // depth is less than the network's prefix length.
+    MMDBW_record_s *record;
+    uint8_t depth;
+    // The node holding the record, or NULL for the root record.
+    MMDBW_node_s *node;
+    uint128_t node_network;
+} MMDBW_network_record_s;
+
 typedef void(MMDBW_iterator_callback)(MMDBW_tree_s *tree,
                                       MMDBW_node_s *node,
                                       uint128_t network,
@@ -146,6 +235,8 @@ extern MMDBW_tree_s *new_tree(const uint8_t ip_version,
                               MMDBW_merge_strategy merge_strategy,
                               const bool alias_ipv6,
                               const bool remove_reserved_networks);
+extern MMDBW_tree_s *clone_tree(MMDBW_tree_s *tree);
+extern MMDBW_tree_s *snapshot_tree(MMDBW_tree_s *tree);
 extern void insert_network(MMDBW_tree_s *tree,
                            const char *ipstr,
                            const uint8_t prefix_length,
@@ -161,34 +252,114 @@ extern void insert_range(MMDBW_tree_s *tree,
 extern void remove_network(MMDBW_tree_s *tree,
                            const char *ipstr,
                            const uint8_t prefix_length);
+extern uint64_t replace_data(MMDBW_tree_s *tree,
+                             const char *const old_key,
+                             const char *const new_key,
+                             SV *new_data);
+extern uint64_t remove_data_records(MMDBW_tree_s *tree,
+                                    HV *keys,
+                                    SV *predicate);
+extern void merge_tree(MMDBW_tree_s *tree,
+                       MMDBW_tree_s *other,
+                       MMDBW_merge_strategy merge_strategy);
+extern void subtract_tree(MMDBW_tree_s *tree, MMDBW_tree_s *other);
+extern void set_shard(MMDBW_tree_s *tree,
+                      const char *ipstr,
+                      const uint8_t prefix_length);
+extern void stitch_shard(MMDBW_tree_s *tree, MMDBW_tree_s *shard);
+extern void diff_tree(MMDBW_tree_s *tree,
+                      MMDBW_tree_s *other,
+                      SV *callback,
+                      uint32_t batch_size);
+extern void intersect_tree(MMDBW_tree_s *tree, MMDBW_tree_s *other);
 extern SV *merge_hashes_for_keys(MMDBW_tree_s *tree,
                                  const char *const key_from,
                                  const char *const key_into,
                                  MMDBW_network_s *network,
                                  MMDBW_merge_strategy merge_strategy);
 extern SV *lookup_ip_address(MMDBW_tree_s *tree, const char *const ipstr);
+extern MMDBW_network_record_s record_for_network(MMDBW_tree_s *tree,
+                                                 const char *ipstr,
+                                                 uint8_t prefix_length);
+extern AV *networks_within(MMDBW_tree_s *tree,
+                           const char *ipstr,
+                           uint8_t prefix_length);
+extern AV *networks_for_data_key(MMDBW_tree_s *tree, const char *const key);
+extern MMDBW_key_index_s *current_key_index(MMDBW_tree_s *tree);
 extern MMDBW_node_s *new_node();
 extern void assign_node_numbers(MMDBW_tree_s *tree);
 extern void freeze_tree(MMDBW_tree_s *tree,
                         char *filename,
                         char *frozen_params,
-                        size_t frozen_params_size);
+                        size_t frozen_params_size,
+                        uint8_t format);
 extern MMDBW_tree_s *thaw_tree(char *filename,
                                uint32_t initial_offset,
+                               uint8_t format,
                                uint8_t ip_version,
                                uint8_t record_size,
                                MMDBW_merge_strategy merge_strategy,
                                const bool alias_ipv6,
-                               const bool remove_reserved_networks);
-extern void write_search_tree(MMDBW_tree_s *tree,
-                              SV *output,
-                              SV *root_data_type,
-                              SV *serializer);
+                               const bool remove_reserved_networks,
+                               AV *only_networks,
+                               uint32_t workers);
+extern void start_journal(MMDBW_tree_s *tree,
+                          char *filename,
+                          const char *token,
+                          STRLEN token_size,
+                          bool append);
+extern void sync_journal(MMDBW_tree_s *tree);
+extern void stop_journal(MMDBW_tree_s *tree);
+extern uint64_t replay_journal(MMDBW_tree_s *tree,
+                               char *filename,
+                               const char *token,
+                               STRLEN token_size);
+extern uint32_t write_search_tree(MMDBW_tree_s *tree,
+                                  SV *output,
+                                  SV *root_data_type,
+                                  SV *serializer,
+                                  SV *data_positions,
+                                  bool ipv4_only);
+extern uint32_t write_search_trees(MMDBW_tree_s *tree,
+                                   AV *outputs,
+                                   SV *root_data_type,
+                                   SV *serializer,
+                                   SV *data_positions);
+extern uint32_t write_projected_search_tree(MMDBW_tree_s *tree,
+                                            SV *output,
+                                            SV *root_data_type,
+                                            SV *serializer,
+                                            SV *projection,
+                                            bool ipv4_only);
+extern void export_ranges(MMDBW_tree_s *tree,
+                          SV *output,
+                          bool jsonl,
+                          SV *data_encoder);
+extern void collect_data_in_write_order(MMDBW_tree_s *tree,
+                                        AV *keys,
+                                        AV *data,
+                                        bool ipv4_only);
+extern void relocate_data_pointers(SV *buffer, SV *relocations);
 extern uint32_t max_record_value(MMDBW_tree_s *tree);
 extern void start_iteration(MMDBW_tree_s *tree,
                             bool depth_first,
                             void *args,
                             MMDBW_iterator_callback callback);
+extern void iterate_batches(MMDBW_tree_s *tree,
+                            SV *callback,
+                            uint32_t batch_size,
+                            AV *types);
+extern void start_iteration_at(MMDBW_tree_s *tree,
+                               MMDBW_record_s *record,
+                               uint128_t network,
+                               uint8_t depth,
+                               bool depth_first,
+                               void *args,
+                               MMDBW_iterator_callback callback);
+extern MMDBW_cursor_s *
+new_cursor(MMDBW_tree_s *tree, bool preorder, AV *types);
+extern bool cursor_next(MMDBW_cursor_s *cursor);
+extern void free_cursor(MMDBW_cursor_s *cursor);
 extern uint128_t
 flip_network_bit(MMDBW_tree_s *tree, uint128_t network, uint8_t depth);
 extern SV *data_for_key(MMDBW_tree_s *tree, const char *const key);
@@ -33,6 +33,7 @@ my $mb = Module::Build->new(
 );
 
 $mb->extra_compiler_flags( _cc_flags($mb) );
+$mb->extra_linker_flags( @{ $mb->extra_linker_flags || [] }, '-lpthread' );
 
 $mb->create_build_script();
 
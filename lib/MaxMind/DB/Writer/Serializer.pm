@@ -60,6 +60,27 @@ has _deduplicate_data => (
     default => 1,
 );
 
+# When this is true, every pointer is written in its 4-byte form and its
+# location is recorded in relocations(). This lets the parallel data section
+# encoder move the buffer to a different offset and then point each pointer at
+# the canonical copy of its data.
+has relocatable => (
+    is      => 'ro',
+    isa     => 'Bool',
+    default => 0,
+);
+
+# This is a flat list of pairs. The first element of each pair is the offset
+# of a pointer's 4-byte payload and the second is the cache key of the data it
+# points to.
+has relocations => (
+    is       => 'ro',
+    isa      => 'ArrayRef',
+    init_arg => undef,
+    lazy     => 1,
+    default  => sub { [] },
+);
+
 has _cache => (
     traits   => ['Hash'],
     is       => 'ro',
@@ -70,6 +91,23 @@ has _cache => (
     handles  => {
         _save_position     => 'set',
         _position_for_data => 'get',
+        cached_positions   => 'elements',
+    },
+);
+
+# When relocatable() is true, this maps the cache key of each data item stored
+# in the buffer to the offset just past its encoding, so that a duplicate copy
+# can be cut out of the buffer.
+has _cache_ends => (
+    traits   => ['Hash'],
+    is       => 'ro',
+    isa      => 'HashRef',
+    init_arg => undef,
+    lazy     => 1,
+    default  => sub { {} },
+    handles  => {
+        _save_end   => 'set',
+        cached_ends => 'elements',
     },
 );
 
@@ -114,7 +152,13 @@ sub store_data {
             $self->_debug_string( 'Storing pointer to',     $position );
         }
 
-        return $self->_store_data( pointer => $position );
+        my $pointer_position = $self->_store_data( pointer => $position );
+
+        # The pointer's payload comes right after its control byte.
+        push @{ $self->relocations() }, $pointer_position + 1, $key_for_data
+            if $self->relocatable();
+
+        return $pointer_position;
     }
     else {
         my $stored_position
@@ -122,6 +166,8 @@ sub store_data {
         $self->_debug_string( 'Stored data at position', $stored_position )
             if DEBUG;
         $self->_save_position( $key_for_data => $stored_position );
+        $self->_save_end( $key_for_data => bytes::length ${ $self->buffer() } )
+            if $self->relocatable();
 
         return $stored_position;
     }
@@ -247,6 +293,16 @@ sub _encode_pointer {
     my $ctrl_byte
         = ord( $self->_control_bytes( $TypeNameToNum{pointer}, 0 ) );
 
+    # A relocatable pointer must be rewritable in place once we know where
+    # its data ends up, so it always uses the largest form.
+    if ( $self->relocatable() ) {
+        $self->_write_encoded_data(
+            pack( 'C', $ctrl_byte | ( 3 << 3 ) ),
+            $self->_pack_4_byte_pointer($value),
+        );
+        return;
+    }
+
     my @value_bytes;
     for my $n ( 0 .. 3 ) {
         if ( $value < $pointer_thresholds[$n]{cutoff} ) {
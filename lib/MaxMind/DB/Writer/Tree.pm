@@ -7,7 +7,10 @@ use autodie;
 
 our $VERSION = '0.300005';
 
+use File::Temp qw( tempdir );
 use IO::Handle;
+use JSON::PP ();
+use Math::BigInt ();
 use Math::Int64 0.51;
 use Math::Int128 0.21 qw( uint128 );
 use MaxMind::DB::Common 0.031003 qw(
@@ -16,10 +19,14 @@ use MaxMind::DB::Common 0.031003 qw(
 );
 use MaxMind::DB::Metadata;
 use MaxMind::DB::Writer::Serializer;
+use MaxMind::DB::Writer::Tree::AsyncWrite;
+use MaxMind::DB::Writer::Tree::Cursor;
 use MaxMind::DB::Writer::Util qw( key_for_data );
 use MooseX::Params::Validate qw( validated_list );
+use POSIX ();
 use Sereal::Decoder qw( decode_sereal );
 use Sereal::Encoder qw( encode_sereal );
+use Time::HiRes ();
 
 use Moose;
 use Moose::Util::TypeConstraints;
@@ -119,6 +126,21 @@ has alias_ipv6_to_ipv4 => (
     default => 0,
 );
 
+has shard => (
+    is  => 'ro',
+    isa => 'Str',
+);
+
+# This is set when the tree is journaling its changes. It has the filename and
+# freeze format of the frozen tree that the journal belongs to.
+has _journal => (
+    is        => 'ro',
+    isa       => 'HashRef',
+    init_arg  => undef,
+    writer    => '_set_journal',
+    predicate => '_has_journal',
+);
+
 has _serializer => (
     is       => 'ro',
     isa      => 'MaxMind::DB::Writer::Serializer',
@@ -169,7 +191,14 @@ around BUILDARGS => sub {
 
 # The XS code expects $self->{_tree} to be populated.
 sub BUILD {
-    $_[0]->_tree();
+    my $self = shift;
+
+    $self->_tree();
+
+    $self->_set_shard( _split_network( $self->shard() ) )
+        if defined $self->shard();
+
+    return;
 }
 
 sub _build_tree {
@@ -237,6 +266,202 @@ sub insert_range {
     return;
 }
 
+sub replace_data {
+    my $self     = shift;
+    my $old_key  = shift;
+    my $new_data = shift;
+
+    return $self->_replace_data( $old_key, key_for_data($new_data),
+        $new_data );
+}
+
+sub remove_where {
+    my $self      = shift;
+    my $predicate = shift;
+
+    die 'remove_where() requires a callback'
+        unless ref $predicate eq 'CODE';
+
+    return $self->_remove_data_records( {}, $predicate );
+}
+
+sub remove_data_keys {
+    my $self = shift;
+
+    return $self->_remove_data_records( { map { $_ => 1 } @_ }, undef );
+}
+
+sub merge_tree {
+    my $self  = shift;
+    my $other = shift;
+    my $args  = shift // {};
+
+    $self->_check_other_tree( $other, 'merge_tree' );
+
+    my $merge_strategy = %{$args} ? $self->_merge_strategy($args) : q{};
+
+    $self->_merge_tree( $other, $merge_strategy // q{} );
+
+    return;
+}
+
+sub subtract_tree {
+    my $self  = shift;
+    my $other = shift;
+
+    $self->_check_other_tree( $other, 'subtract_tree' );
+    $self->_subtract_tree($other);
+
+    return;
+}
+
+sub intersect_tree {
+    my $self  = shift;
+    my $other = shift;
+
+    $self->_check_other_tree( $other, 'intersect_tree' );
+    $self->_intersect_tree($other);
+
+    return;
+}
+
+sub diff_tree {
+    my $self     = shift;
+    my $other    = shift;
+    my $callback = shift;
+    my $args     = shift // {};
+
+    $self->_check_other_tree( $other, 'diff_tree' );
+    die 'diff_tree() requires a callback'
+        unless ref $callback eq 'CODE';
+
+    my $batch_size = $args->{batch_size} // 1024;
+    die 'batch_size must be a positive integer'
+        unless $batch_size =~ /^[0-9]+$/ && $batch_size > 0;
+
+    $self->_diff_tree( $other, $callback, $batch_size );
+
+    return;
+}
+
+sub iterate_network {
+    my $self    = shift;
+    my $network = shift;
+    my $object  = shift;
+
+    $self->_iterate_network( _split_network($network), $object );
+
+    return;
+}
+
+sub networks_within {
+    my $self    = shift;
+    my $network = shift;
+
+    return @{ $self->_networks_within( _split_network($network) ) };
+}
+
+sub networks_for_data_key {
+    my $self = shift;
+    my $key  = shift;
+
+    return @{ $self->_networks_for_data_key($key) };
+}
+
+sub iterate_batches {
+    my $self     = shift;
+    my $callback = shift;
+    my $args     = shift // {};
+
+    die 'iterate_batches() requires a callback'
+        unless ref $callback eq 'CODE';
+
+    my $batch_size = $args->{batch_size} // 1024;
+    die 'batch_size must be a positive integer'
+        unless $batch_size =~ /^[0-9]+$/ && $batch_size > 0;
+
+    my $types = $args->{types};
+    die 'types must be an array reference'
+        if defined $types && ref $types ne 'ARRAY';
+
+    $self->_iterate_batches( $callback, $batch_size, $types );
+
+    return;
+}
+
+sub cursor {
+    my $self = shift;
+    my ( $order, $types ) = validated_list(
+        \@_,
+        order => { isa => 'Str',           optional => 1 },
+        types => { isa => 'ArrayRef[Str]', optional => 1 },
+    );
+
+    $order //= 'inorder';
+    die 'order must be preorder or inorder'
+        unless $order eq 'preorder' || $order eq 'inorder';
+
+    return MaxMind::DB::Writer::Tree::Cursor->new(
+        cursor => $self->_new_cursor( $order eq 'preorder', $types ) );
+}
+
+sub export_ranges {
+    my $self = shift;
+    my $fh   = shift;
+    my ($format) = validated_list(
+        \@_,
+        format => { isa => 'Str', optional => 1 },
+    );
+
+    $format //= 'csv';
+    die 'format must be csv or jsonl'
+        unless $format eq 'csv' || $format eq 'jsonl';
+
+    my $json = JSON::PP->new()->utf8()->canonical()->allow_bignum();
+
+    $self->_export_ranges(
+        $fh,
+        $format eq 'jsonl',
+        sub { $json->encode( _with_json_numbers( $_[0] ) ) },
+    );
+
+    return;
+}
+
+# JSON::PP dies on the Math::Int64 and Math::Int128 objects that data can
+# contain, so this returns a copy of the data with each of them replaced by a
+# Math::BigInt, which allow_bignum() encodes as a plain number.
+sub _with_json_numbers {
+    my $data = shift;
+
+    if ( ref $data eq 'HASH' ) {
+        return {
+            map { $_ => _with_json_numbers( $data->{$_} ) } keys %{$data}
+        };
+    }
+    if ( ref $data eq 'ARRAY' ) {
+        return [ map { _with_json_numbers($_) } @{$data} ];
+    }
+    if ( blessed $data
+        && grep { $data->isa($_) }
+        qw( Math::Int64 Math::UInt64 Math::Int128 Math::UInt128 ) ) {
+        return Math::BigInt->new("$data");
+    }
+
+    return $data;
+}
+
+sub _check_other_tree {
+    my $self   = shift;
+    my $other  = shift;
+    my $method = shift;
+
+    die "$method() requires a MaxMind::DB::Writer::Tree"
+        unless blessed $other && $other->isa(__PACKAGE__);
+
+    return;
+}
+
 sub _merge_strategy {
     my $self = shift;
     my $args = shift;
@@ -292,21 +517,470 @@ sub _build_serializer {
 sub write_tree {
     my $self   = shift;
     my $output = shift;
+    my $args   = shift // {};
+
+    my $workers = _data_section_workers($args);
+
+    my $ip_version = $args->{ip_version} // $self->ip_version();
+    die 'ip_version must be 4 or 6' unless $ip_version =~ /^[46]$/;
+    die 'You cannot write an IPv6 database from an IPv4 tree'
+        if $ip_version > $self->ip_version();
+
+    my $ipv4_only = $ip_version != $self->ip_version();
+
+    if ( my $projection = $self->_projection($args) ) {
+        die 'data_section_workers cannot be used with transform or only_keys'
+            if $workers > 1;
+
+        # The projected data is not the tree's data, so we do not want it in
+        # the tree's serializer.
+        my $serializer = $self->_build_serializer();
+        my $node_count = $self->_write_projected_search_tree(
+            $output,
+            $self->_root_data_type(),
+            $serializer,
+            $projection,
+            $ipv4_only,
+        );
 
-    $self->_write_search_tree(
+        $output->print(
+            DATA_SECTION_SEPARATOR,
+            ${ $serializer->buffer() },
+            METADATA_MARKER,
+            $self->_encoded_metadata(
+                ip_version => $ip_version,
+                node_count => $node_count,
+            ),
+        );
+        return;
+    }
+
+    my ( $data_positions, $data_section );
+    ( $data_positions, $data_section )
+        = $self->_encode_data_section_in_parallel( $workers, $ipv4_only )
+        if $workers > 1;
+
+    # The tree's serializer may already have data for IPv6 networks from an
+    # earlier write, and an IPv4 database should only have its own data.
+    my $serializer
+        = $ipv4_only ? $self->_build_serializer() : $self->_serializer();
+
+    my $node_count = $self->_write_search_tree(
         $output,
         $self->_root_data_type(),
-        $self->_serializer(),
+        $serializer,
+        $data_positions,
+        $ipv4_only,
     );
 
     $output->print(
         DATA_SECTION_SEPARATOR,
-        ${ $self->_serializer()->buffer() },
+        ${ $data_section // $serializer->buffer() },
         METADATA_MARKER,
-        $self->_encoded_metadata(),
+        $self->_encoded_metadata(
+            ip_version => $ip_version,
+            node_count => $node_count,
+        ),
     );
 }
 
+sub write_trees {
+    my $self    = shift;
+    my $outputs = shift;
+    my $args    = shift // {};
+
+    die 'write_trees() requires an array reference of outputs'
+        unless ref $outputs eq 'ARRAY' && @{$outputs};
+
+    my @outputs;
+    for my $output ( @{$outputs} ) {
+        die 'Each output passed to write_trees() must be a hash reference'
+            . ' with an fh'
+            unless ref $output eq 'HASH' && $output->{fh};
+
+        my $record_size = $output->{record_size} // $self->record_size();
+        die 'Only record sizes of 24, 28, and 32 are supported.'
+            . " Received $record_size."
+            unless $record_size =~ /^(?:24|28|32)$/;
+
+        push @outputs, [
+            $output->{fh},
+            $record_size,
+            $output->{alias_ipv6_to_ipv4} // 1,
+        ];
+    }
+
+    my $workers = _data_section_workers($args);
+
+    my ( $data_positions, $data_section );
+    ( $data_positions, $data_section )
+        = $self->_encode_data_section_in_parallel( $workers, 0 )
+        if $workers > 1;
+
+    my $node_count = $self->_write_search_trees(
+        \@outputs,
+        $self->_root_data_type(),
+        $self->_serializer(),
+        $data_positions,
+    );
+
+    $data_section //= $self->_serializer()->buffer();
+    for my $output (@outputs) {
+        $output->[0]->print(
+            DATA_SECTION_SEPARATOR,
+            ${$data_section},
+            METADATA_MARKER,
+            $self->_encoded_metadata(
+                node_count  => $node_count,
+                record_size => $output->[1],
+            ),
+        );
+    }
+
+    return;
+}
+
+sub _data_section_workers {
+    my $args = shift;
+
+    my $workers = $args->{data_section_workers} // 1;
+    die 'data_section_workers must be a positive integer'
+        unless $workers =~ /^[0-9]+$/ && $workers > 0;
+
+    return $workers;
+}
+
+# Returns a callback for _write_projected_search_tree(), which calls it once
+# for each data key in the tree. It returns the key and data to write instead,
+# or nothing if the networks with that data should not be written.
+sub _projection {
+    my $self = shift;
+    my $args = shift;
+
+    my $transform = $args->{transform};
+    if ( defined( my $keys = $args->{only_keys} ) ) {
+        die 'You cannot pass both transform and only_keys to write_tree()'
+            if defined $transform;
+        die 'only_keys must be an array reference'
+            unless ref $keys eq 'ARRAY';
+
+        my @keys = @{$keys};
+        $transform = sub {
+            my $data = shift;
+            return $data unless ref $data eq 'HASH';
+            return {
+                map { exists $data->{$_} ? ( $_ => $data->{$_} ) : () }
+                    @keys
+            };
+        };
+    }
+
+    return unless defined $transform;
+
+    die 'transform must be a callback' unless ref $transform eq 'CODE';
+
+    return sub {
+        my $data = $transform->(@_);
+        return unless defined $data;
+        return ( key_for_data($data), $data );
+    };
+}
+
+# The child writes from its copy-on-write view of the parent's memory, so the
+# parent can keep changing the tree. The child writes to a temporary file and
+# renames it once the database is complete.
+sub write_tree_async {
+    my $self = shift;
+    my $path = shift;
+    my $args = shift;
+
+    my $dir = File::Temp->newdir();
+
+    my $started_at = Time::HiRes::time();
+    my $pid = fork() // die "Could not fork to write the tree: $!";
+    if ( !$pid ) {
+        my $ok = eval {
+            my $temp_path = "$path.tmp-$$";
+            open my $fh, '>:raw', $temp_path;
+            $self->write_tree( $fh, $args );
+            close $fh;
+            rename $temp_path, $path;
+            1;
+        };
+        my $error = $@;
+
+        # There is nothing more we can do if these fail. The parent will
+        # still see our exit status.
+        eval {
+            if ( !$ok ) {
+                unlink "$path.tmp-$$" if -e "$path.tmp-$$";
+                open my $fh, '>:encoding(UTF-8)', "$dir/error";
+                print {$fh} $error or die $!;
+                close $fh;
+            }
+            open my $fh, '>:encoding(UTF-8)', "$dir/finished";
+            print {$fh} Time::HiRes::time() or die $!;
+            close $fh;
+        };
+
+        # We skip global destruction so that the child does not free the
+        # tree or flush output buffers that it shares with the parent.
+        POSIX::_exit( $ok ? 0 : 1 );
+    }
+
+    return MaxMind::DB::Writer::Tree::AsyncWrite->new(
+        pid        => $pid,
+        path       => $path,
+        started_at => $started_at,
+        dir        => $dir,
+    );
+}
+
+# This is a 4-byte pointer whose target is filled in by relocation.
+my $PointerPlaceholder = pack( 'CN', 0x38, 0 );
+
+# Each worker is a forked child that encodes a contiguous batch of the
+# distinct data records with its own serializer, and therefore its own
+# deduplication cache. The batches are then concatenated in order. Any data
+# cached by more than one worker keeps only the copy from the earliest batch.
+# The later copies are replaced by pointers to it, and every pointer is
+# rewritten to point at the copy that is kept. This makes the output depend
+# only on the tree and the number of workers.
+sub _encode_data_section_in_parallel {
+    my $self      = shift;
+    my $workers   = shift;
+    my $ipv4_only = shift;
+
+    my ( $keys, $data ) = $self->_data_in_write_order($ipv4_only);
+
+    my $batch_size = int( ( @{$keys} + $workers - 1 ) / $workers ) || 1;
+
+    my @batches;
+    my $start = 0;
+    while ( $start < @{$keys} ) {
+        my $end = $start + $batch_size - 1;
+        $end = $#{$keys} if $end > $#{$keys};
+        push @batches, [ $start, $end ];
+        $start = $end + 1;
+    }
+
+    my $dir = tempdir( CLEANUP => 1 );
+
+    my @pids;
+    for my $i ( 0 .. $#batches ) {
+        my $pid = fork() // die "Could not fork a data section worker: $!";
+        if ( !$pid ) {
+            my $ok = eval {
+                my @range = $batches[$i][0] .. $batches[$i][1];
+                $self->_encode_data_batch(
+                    "$dir/batch-$i",
+                    [ @{$keys}[@range] ],
+                    [ @{$data}[@range] ],
+                );
+                1;
+            };
+            if ( !$ok ) {
+                my $error = $@;
+
+                # There is nothing more we can do if this fails. The parent
+                # will still see our exit status.
+                eval {
+                    open my $fh, '>:encoding(UTF-8)', "$dir/error-$i";
+                    print {$fh} $error or die $!;
+                    close $fh;
+                };
+            }
+
+            # We skip global destruction so that the child does not free the
+            # tree or flush output buffers that it shares with the parent.
+            POSIX::_exit( $ok ? 0 : 1 );
+        }
+        push @pids, $pid;
+    }
+
+    my @failed;
+    for my $i ( 0 .. $#pids ) {
+        waitpid( $pids[$i], 0 );
+        push @failed, $i if $?;
+    }
+
+    if (@failed) {
+        my $error = q{};
+        if ( -e "$dir/error-$failed[0]" ) {
+            open my $fh, '<:encoding(UTF-8)', "$dir/error-$failed[0]";
+            $error = do { local $/ = undef; <$fh> };
+            close $fh;
+        }
+        die "Data section worker $failed[0] failed: $error";
+    }
+
+    my %canonical;
+    my %positions;
+    my @buffers;
+    my $relocations = q{};
+    my $base        = 0;
+    for my $i ( 0 .. $#batches ) {
+        open my $fh, '<:raw', "$dir/batch-$i";
+        my $result = decode_sereal( do { local $/ = undef; <$fh> } );
+        close $fh;
+
+        my %cached = @{ $result->{cached_positions} };
+        my %ends   = @{ $result->{cached_ends} };
+
+        # Data that an earlier batch already stored is replaced by a pointer
+        # to that copy, unless the pointer would not be any shorter. Anything
+        # nested inside it was stored by that batch as well, so only the
+        # outermost copies need to be replaced.
+        my @copies;
+        my @replaced;
+        for my $key (
+            sort { $cached{$a} <=> $cached{$b} }
+            grep { defined $canonical{$_} } keys %cached
+            ) {
+            next if @copies && $cached{$key} < $copies[-1][1];
+            push @copies, [ $cached{$key}, $ends{$key}, $key ];
+            push @replaced, $copies[-1]
+                if $ends{$key} - $cached{$key} > length $PointerPlaceholder;
+        }
+
+        my ( $buffer, $new_position ) = _replace_ranges(
+            \$result->{buffer},
+            [ map { [ @{$_}[ 0, 1 ], $PointerPlaceholder ] } @replaced ],
+        );
+
+        for my $key ( sort keys %cached ) {
+            next if defined $canonical{$key};
+
+            my $position = $new_position->( $cached{$key} );
+            die "The data for $key was replaced in data section batch $i"
+                unless defined $position;
+            $canonical{$key} = $base + $position;
+        }
+
+        for my $copy (@replaced) {
+            $relocations .= pack(
+                'NN',
+                $base + $new_position->( $copy->[0] ) + 1,
+                $canonical{ $copy->[2] },
+            );
+        }
+
+        my $relocation = $result->{relocations};
+        for my $j ( 0 .. @{$relocation} / 2 - 1 ) {
+            my $position = $new_position->( $relocation->[ $j * 2 ] );
+            next unless defined $position;
+
+            $relocations .= pack(
+                'NN',
+                $base + $position,
+                $canonical{ $relocation->[ $j * 2 + 1 ] },
+            );
+        }
+
+        my $positions = $result->{positions};
+        for my $j ( 0 .. $#{$positions} ) {
+            my $key = $keys->[ $batches[$i][0] + $j ];
+            $positions{$key} = $canonical{$key}
+                // $base + $new_position->( $positions->[$j] );
+        }
+
+        $base += length ${$buffer};
+        push @buffers, ${$buffer};
+    }
+
+    die 'The data section is too large to be addressed by 32-bit pointers'
+        if $base > 2**32 - 1;
+
+    my $buffer = join q{}, @buffers;
+    _relocate_data_pointers( \$buffer, $relocations );
+
+    return ( \%positions, \$buffer );
+}
+
+# Takes a buffer and a sorted list of non-overlapping [ start, end,
+# replacement ] ranges. Returns the buffer with each range replaced and a
+# subroutine which maps an offset in the original buffer to its offset in the
+# new one. The subroutine returns undef for an offset inside a replaced range,
+# other than its start.
+sub _replace_ranges {
+    my $buffer = shift;
+    my $ranges = shift;
+
+    my $kept    = q{};
+    my $start   = 0;
+    my $removed = 0;
+    my @removed_before;
+    for my $range ( @{$ranges} ) {
+        $kept .= substr( ${$buffer}, $start, $range->[0] - $start );
+        $kept .= $range->[2];
+        $start = $range->[1];
+        $removed += $range->[1] - $range->[0] - length $range->[2];
+        push @removed_before, $removed;
+    }
+    $kept .= substr( ${$buffer}, $start );
+
+    my $new_position = sub {
+        my $position = shift;
+
+        # This finds the last range that starts at or before the position.
+        my ( $low, $high ) = ( 0, scalar @{$ranges} );
+        while ( $low < $high ) {
+            my $middle = int( ( $low + $high ) / 2 );
+            if ( $ranges->[$middle][0] <= $position ) {
+                $low = $middle + 1;
+            }
+            else {
+                $high = $middle;
+            }
+        }
+
+        return $position unless $low;
+
+        my $range = $ranges->[ $low - 1 ];
+        return $position - ( $low > 1 ? $removed_before[ $low - 2 ] : 0 )
+            if $position == $range->[0];
+        return undef if $position < $range->[1];
+        return $position - $removed_before[ $low - 1 ];
+    };
+
+    return ( \$kept, $new_position );
+}
+
+sub _encode_data_batch {
+    my $self = shift;
+    my $file = shift;
+    my $keys = shift;
+    my $data = shift;
+
+    my $serializer = MaxMind::DB::Writer::Serializer->new(
+        map_key_type_callback => $self->map_key_type_callback(),
+        relocatable           => 1,
+    );
+
+    my @positions = map {
+        $serializer->store_data(
+            $self->_root_data_type(),
+            $data->[$_],
+            undef,
+            $keys->[$_],
+        )
+    } 0 .. $#{$keys};
+
+    open my $fh, '>:raw', $file;
+    print {$fh} encode_sereal(
+        {
+            buffer           => ${ $serializer->buffer() },
+            cached_positions => [ $serializer->cached_positions() ],
+            cached_ends      => [ $serializer->cached_ends() ],
+            positions        => \@positions,
+            relocations      => $serializer->relocations(),
+        }
+    ) or die "Could not write to $file: $!";
+    close $fh;
+
+    return;
+}
+
 {
     my %key_types = (
         binary_format_major_version => 'uint16',
@@ -324,8 +998,15 @@ sub write_tree {
         return $key_types{ $_[0] } || 'utf8_string';
     };
 
+    # The arguments override the tree's own values, for databases that are not
+    # written from the whole tree as it is.
     sub _encoded_metadata {
         my $self = shift;
+        my %args = @_;
+
+        my $ip_version  = $args{ip_version}  // $self->ip_version();
+        my $node_count  = $args{node_count}  // $self->node_count();
+        my $record_size = $args{record_size} // $self->record_size();
 
         my $metadata = MaxMind::DB::Metadata->new(
             binary_format_major_version => 2,
@@ -333,10 +1014,10 @@ sub write_tree {
             build_epoch                 => uint128( $self->_build_epoch() ),
             database_type               => $self->database_type(),
             description                 => $self->description(),
-            ip_version                  => $self->ip_version(),
+            ip_version                  => $ip_version,
             languages                   => $self->languages(),
-            node_count                  => $self->node_count(),
-            record_size                 => $self->record_size(),
+            node_count                  => $node_count,
+            record_size                 => $record_size,
         );
 
         my $serializer = MaxMind::DB::Writer::Serializer->new(
@@ -358,28 +1039,123 @@ sub write_tree {
     sub freeze_tree {
         my $self     = shift;
         my $filename = shift;
+        my $args     = shift // {};
 
-        my %constructor_params;
-        for my $attr ( $self->meta()->get_all_attributes() ) {
-            next unless $attr->init_arg();
-            next if $do_not_freeze{ $attr->name() };
+        my $format = $args->{format} // 1;
+        die "Unknown freeze format: $format"
+            unless $format =~ /^[123]$/;
 
-            my $reader = $attr->get_read_method();
-            $constructor_params{ $attr->init_arg() } = $self->$reader();
-        }
+        my $journal_token
+            = $args->{journal} ? _new_journal_token() : undef;
+
+        my %constructor_params
+            = $self->_constructor_params( keys %do_not_freeze );
+
+        # This is not a constructor parameter. new_from_frozen_tree() removes
+        # it before calling new().
+        $constructor_params{freeze_format} = $format if $format > 1;
+        $constructor_params{journal_token} = $journal_token
+            if defined $journal_token;
 
         my $frozen = encode_sereal( \%constructor_params );
-        $self->_freeze_tree( $filename, $frozen, length $frozen );
+
+        unless ( defined $journal_token ) {
+            $self->_freeze_tree( $filename, $frozen, length $frozen, $format );
+            return;
+        }
+
+        # The new frozen tree replaces the old one in one step. Until the new
+        # journal is started, the old journal is still there, but its token
+        # no longer matches the frozen tree, so it will not be replayed.
+        my $tmp = "$filename.tmp.$$";
+        $self->_freeze_tree( $tmp, $frozen, length $frozen, $format );
+        rename $tmp, $filename;
+
+        $self->_start_journal( "$filename.journal", $journal_token, 0 );
+        $self->_set_journal(
+            {
+                filename => $filename,
+                format   => $format,
+            }
+        );
 
         return;
     }
 }
 
+sub _constructor_params {
+    my $self = shift;
+    my %skip = map { $_ => 1 } @_;
+
+    my %constructor_params;
+    for my $attr ( $self->meta()->get_all_attributes() ) {
+        next unless $attr->init_arg();
+        next if $skip{ $attr->name() };
+
+        my $reader = $attr->get_read_method();
+        my $value  = $self->$reader();
+        next unless defined $value;
+
+        $constructor_params{ $attr->init_arg() } = $value;
+    }
+
+    return %constructor_params;
+}
+
+sub clone {
+    my $self = shift;
+
+    return ( ref $self )->new(
+        $self->_constructor_params('_tree'),
+        _tree => $self->_clone_tree(),
+    );
+}
+
+sub snapshot {
+    my $self = shift;
+
+    return ( ref $self )->new(
+        $self->_constructor_params('_tree'),
+        _tree => $self->_snapshot_tree(),
+    );
+}
+
+sub _new_journal_token {
+    return pack( 'N4', time(), $$, map { int rand 2**32 } 1 .. 2 );
+}
+
+sub sync_journal {
+    my $self = shift;
+
+    die 'This tree does not have a journal' unless $self->_has_journal();
+
+    $self->_sync_journal();
+
+    return;
+}
+
+sub compact_journal {
+    my $self = shift;
+
+    die 'This tree does not have a journal' unless $self->_has_journal();
+
+    my $journal = $self->_journal();
+    $self->freeze_tree(
+        $journal->{filename},
+        {
+            format  => $journal->{format},
+            journal => 1,
+        }
+    );
+
+    return;
+}
+
 sub new_from_frozen_tree {
     my $class = shift;
     my (
         $filename, $callback, $database_type, $description, $merge_strategy,
-        $record_size
+        $record_size, $only_networks, $journal, $thaw_workers
         )
         = validated_list(
         \@_,
@@ -389,6 +1165,9 @@ sub new_from_frozen_tree {
         description           => { isa => 'HashRef[Str]', optional => 1 },
         merge_strategy        => { isa => $MergeStrategyEnum, optional => 1 },
         record_size           => { isa => $RecordSizeType, optional => 1 },
+        only_networks         => { isa => 'ArrayRef[Str]', optional => 1 },
+        journal               => { isa => 'Bool', optional => 1 },
+        thaw_workers          => { isa => 'Int', optional => 1 },
         );
 
     ## no critic (InputOutput::RequireBriefOpen)
@@ -406,6 +1185,31 @@ sub new_from_frozen_tree {
     close $fh or die $!;
 
     my $params = decode_sereal($frozen_params);
+    my $format        = delete $params->{freeze_format} // 1;
+    my $journal_token = delete $params->{journal_token};
+
+    die 'journal can only be used with a tree frozen with a journal'
+        if $journal && !defined $journal_token;
+
+    my $only;
+    if ($only_networks) {
+        die 'only_networks can only be used with a tree frozen with format 2'
+            unless $format == 2;
+        die 'only_networks cannot be used with journal'
+            if $journal;
+
+        $only = [ map { _split_network($_) } @{$only_networks} ];
+    }
+
+    $thaw_workers //= 1;
+    die 'thaw_workers must be a positive integer'
+        unless $thaw_workers > 0;
+    if ( $thaw_workers > 1 ) {
+        die 'thaw_workers can only be used with a tree frozen with format 2'
+            unless $format == 2;
+        die 'thaw_workers cannot be used with only_networks'
+            if $only_networks;
+    }
 
     $params->{database_type} = $database_type if defined $database_type;
     $params->{description}   = $description   if defined $description;
@@ -424,6 +1228,7 @@ sub new_from_frozen_tree {
     my $tree = _thaw_tree(
         $filename,
         $params_size + 4,
+        $format,
         @{$params}{
             qw(
                 ip_version
@@ -433,13 +1238,91 @@ sub new_from_frozen_tree {
                 remove_reserved_networks
                 )
         },
+        $only,
+        $thaw_workers,
     );
 
-    return $class->new(
+    my $self = $class->new(
         %{$params},
         map_key_type_callback => $callback,
         _tree                 => $tree,
     );
+
+    return $self unless defined $journal_token && !$only_networks;
+
+    my $journal_file = "$filename.journal";
+    my $replayed
+        = -e $journal_file
+        ? $self->_replay_journal( $journal_file, $journal_token )
+        : 0;
+
+    if ($journal) {
+
+        # Anything after the last complete entry was cut off when the process
+        # writing the journal died, so we remove it before appending more.
+        truncate $journal_file, $replayed if $replayed;
+        $self->_start_journal( $journal_file, $journal_token, !!$replayed );
+        $self->_set_journal(
+            {
+                filename => $filename,
+                format   => $format,
+            }
+        );
+    }
+
+    return $self;
+}
+
+# Each shard is thawed and stitched in turn, so we only ever hold the
+# stitched tree and a single shard in memory.
+sub new_from_frozen_shards {
+    my $class = shift;
+    my ( $filenames, $callback ) = validated_list(
+        \@_,
+        filenames             => { isa => 'ArrayRef[Str]' },
+        map_key_type_callback => { isa => 'CodeRef' },
+    );
+
+    die 'filenames must contain at least one frozen shard'
+        unless @{$filenames};
+
+    my $self;
+    for my $filename ( @{$filenames} ) {
+        my $shard = $class->new_from_frozen_tree(
+            filename              => $filename,
+            map_key_type_callback => $callback,
+        );
+
+        die "$filename is not a frozen shard"
+            unless defined $shard->shard();
+
+        $self //= $class->new( $shard->_constructor_params(qw( _tree shard )) );
+
+        die "The shard in $filename has a different ip_version"
+            if $shard->ip_version() != $self->ip_version();
+        for my $attr (qw( alias_ipv6_to_ipv4 remove_reserved_networks )) {
+            die "The shard in $filename has a different $attr"
+                if $shard->$attr() xor $self->$attr();
+        }
+
+        $self->_stitch_shard($shard);
+    }
+
+    return $self;
+}
+
+sub _split_network {
+    my $network = shift;
+
+    my ( $ip_address, $prefix_length ) = split qr{/}, $network, 2;
+
+    if (  !defined $prefix_length
+        || $prefix_length !~ /^[0-9]+$/
+        || $prefix_length > 128 ) {
+        die "Invalid network: $network";
+    }
+
+    return ( $ip_address, $prefix_length );
 }
 
 sub DEMOLISH {
@@ -709,6 +1592,18 @@ Teredo, may still be added.
 
 This parameter is optional. It defaults to true.
 
+=item * shard
+
+A network in CIDR notation, such as C<2000::/4> or C<10.0.0.0/8>. If this is
+set, the tree is a shard of a larger tree, and inserting any network or range
+that is not entirely within this network throws an exception.
+
+Shards can be built separately, for example in different processes, frozen
+with C<freeze_tree()>, and then stitched together with
+C<< MaxMind::DB::Writer::Tree->new_from_frozen_shards() >>.
+
+This parameter is optional.
+
 =back
 
 =head2 $tree->insert_network( $network, $data, $additional_args )
@@ -779,11 +1674,228 @@ are additional arguments, as outlined for C<insert_network()>.
 This method removes the network from the database. It takes one parameter, the
 network in CIDR notation.
 
-=head2 $tree->write_tree($fh)
+=head2 $tree->replace_data( $old_key, $new_data )
+
+This method replaces the data of every network whose data has the key
+C<$old_key> with C<$new_data>. Keys are the same as those returned by
+C<key_for_data()> in L<MaxMind::DB::Writer::Util>. This is much faster than
+inserting each network again. The tree is walked once, and only the nodes above
+the records with the old data are changed. No merge strategy is applied; the
+new data replaces the old data.
+
+If the tree already has networks with C<$new_data>, the changed networks share
+its data, and networks next to each other with the same data are merged.
+
+This method returns the number of networks that were changed. You cannot call
+it on a tree that has a journal.
+
+=head2 $tree->remove_where( $predicate )
+
+This method removes every network whose data matches C<$predicate>. The
+predicate is a subroutine reference. It is called with the data and its key,
+and it should return true if the networks with that data should be removed.
+It is only called once for each distinct data key in the tree, no matter how
+many networks have that data.
+
+The networks are removed in one pass over the tree, which is much faster than
+calling C<remove_network()> for each of them. This method returns the number of
+networks that were removed. If the predicate dies, the networks removed before
+it died stay removed.
+
+You cannot call this method on a tree that has a journal.
+
+=head2 $tree->remove_data_keys(@keys)
+
+This method removes every network whose data has one of the given keys. Keys
+are the same as those returned by C<key_for_data()> in
+L<MaxMind::DB::Writer::Util>. It works like C<remove_where()> without calling
+back into Perl, and it returns the number of networks that were removed.
+
+=head2 $tree->merge_tree( $other_tree, $additional_args )
+
+This method merges another tree into this one. The result is the same as
+inserting each network in the other tree into this tree with its data, but
+the merge is done by walking both trees at once. Where this tree has no data,
+the other tree's whole subtree is copied, and data is only merged where both
+trees have data for a network. The other tree is not changed.
+
+Aliased networks are treated the same way as they are by C<insert_network()>.
+If this tree aliases IPv6 networks to the IPv4 subtree and the other tree has
+data in or exactly at one of those networks, the merge dies with the same
+error that inserting that network would. The other tree's networks that
+contain an aliased network are merged everywhere except the aliased network.
+When the merge dies, the networks merged before the error stay in this tree.
+
+Both trees must have the same IP version. You cannot merge into a tree that
+has a journal.
+
+C<$additional_args> is an optional hash reference. It accepts
+C<merge_strategy>, which overrides the tree's merge strategy for this merge,
+as with C<insert_network()>.
+
+=head2 $tree->subtract_tree($other_tree)
+
+This method removes every network covered by the other tree from this tree,
+as if C<remove_network()> were called for each network in the other tree.
+Networks covered through an alias in the other tree are removed too. Reserved
+networks and aliases in this tree are never changed.
+
+Both trees must have the same IP version, and this tree cannot have a
+journal. The other tree is not changed.
+
+=head2 $tree->intersect_tree($other_tree)
+
+This method removes every network that is I<not> covered by the other tree
+from this tree. The data for the remaining networks is this tree's data. The
+same restrictions apply as for C<subtract_tree()>.
+
+=head2 $tree->diff_tree( $other_tree, $callback, $additional_args )
+
+This method finds every network whose data differs between this tree and the
+other tree, in network order. Each node caches a hash of its subtree, so
+subtrees that are the same in both trees are skipped without being walked.
+The hashes are computed when they are first needed and again after a subtree
+changes.
+
+The changes are passed to C<$callback> in batches. Each call gets an array
+reference of changes, and each change is an array reference of the network in
+CIDR notation, the key for the network's data in this tree, and the key for
+its data in the other tree. A key is C<undef> if that tree has no data for the
+network. Keys are the same as those returned by C<key_for_data()> in
+L<MaxMind::DB::Writer::Util>.
+
+Networks found through aliases are not reported separately from the networks
+they point at. Both trees must have the same IP version.
+
+C<$additional_args> is an optional hash reference. It accepts C<batch_size>,
+the largest number of changes passed to the callback at once. This defaults to
+1,024.
+
+=head2 $tree->write_tree( $fh, $additional_args )
 
 Given a filehandle, this method writes the contents of the tree as a MaxMind
 DB database to that filehandle.
 
+C<$additional_args> is an optional hash reference. The following arguments are
+supported:
+
+=over 4
+
+=item * C<data_section_workers>
+
+The number of processes used to encode the data section. When this is greater
+than 1, the distinct data records are split into that many batches, and each
+batch is encoded by a forked child process. The batches are then stitched
+together. Data that more than one batch stored is kept only in the earliest
+of those batches, and every pointer to it is rewritten to point at that copy.
+
+The output is a valid database that is identical for a given tree and number
+of workers, but it is not byte-for-byte identical to the output with a single
+worker. Pointers are always written in their 4-byte form, so the data section
+is usually a little larger than with a single worker.
+
+This defaults to 1, which encodes the data section in the current process.
+
+=item * C<transform>
+
+A subroutine reference which is called with the data and key of each distinct
+data key in the tree, and returns the data to write instead. It is called once
+per key, no matter how many networks have that data. If it returns C<undef>,
+the networks with that data are not written.
+
+Networks next to each other that end up with the same data are written as a
+single network, so the database is as small as one built from a tree with the
+transformed data. The tree itself is not changed or copied. The transform
+should not change the data it is given, as that is the tree's data.
+
+This cannot be used with C<data_section_workers>.
+
+=item * C<only_keys>
+
+An array reference of map keys. This is a shortcut for a C<transform> that
+removes every other key from the top level of each data record, e.g. to write
+a smaller edition of a database from the same tree. Data that is not a hash
+is written as it is.
+
+This cannot be used with C<transform> or C<data_section_workers>.
+
+=item * C<ip_version>
+
+The IP version of the database to write. This defaults to the tree's
+C<ip_version>. Passing C<4> for an IPv6 tree writes the tree's IPv4 subtree,
+C<::0.0.0.0/96>, as a standalone IPv4 database, with its own node numbering and
+a data section with only the data for IPv4 networks. Nothing outside that
+subtree is written, and the tree is not changed. The tree must have networks
+in the IPv4 subtree, e.g. because it has C<alias_ipv6_to_ipv4> set.
+
+This can be combined with the other arguments.
+
+=back
+
+=head2 $tree->write_trees( \@outputs, $additional_args )
+
+This method writes the tree as several MaxMind DB databases at once, e.g. with
+different record sizes. This is faster than calling C<write_tree()> for each
+of them, as the nodes are numbered, the tree is walked, and the data section
+is encoded once for all of them.
+
+Each output is a hash reference with the following keys:
+
+=over 4
+
+=item * C<fh>
+
+The filehandle to write the database to. This is required.
+
+=item * C<record_size>
+
+The record size for this database. This defaults to the tree's
+C<record_size>.
+
+=item * C<alias_ipv6_to_ipv4>
+
+If this is false, the tree's alias records are written as empty records, so
+that the IPv4 networks can only be looked up under C<::0.0.0.0/96>. This
+defaults to true, and has no effect for a tree without aliases.
+
+=back
+
+C<$additional_args> is an optional hash reference which accepts the
+C<data_section_workers> argument of C<write_tree()>.
+
+=head2 $tree->write_tree_async( $path, $additional_args )
+
+This method forks a child process which writes the tree as a MaxMind DB
+database to the given path, and returns immediately. The child sees the tree
+as it was when this method was called, so you can keep changing the tree while
+the database is being written.
+
+The database is written to a temporary file next to C<$path>, which is renamed
+to C<$path> once it is complete. C<$additional_args> accepts the same
+arguments as C<write_tree()>.
+
+This method returns a L<MaxMind::DB::Writer::Tree::AsyncWrite> object. Call
+C<wait()> on it to wait for the database to be written. It also has
+C<status()>, C<started_at()>, C<finished_at()>, and C<elapsed()> methods.
+
+=head2 $tree->export_ranges( $fh, format => $format )
+
+This method writes the tree's networks with data to a filehandle as ranges of
+addresses, in network order. Adjacent networks with the same data are written
+as a single range, and networks reached through aliases are not written.
+
+Each range has its first and last address, and the key for its data. Keys are
+the same as those returned by C<key_for_data()> in
+L<MaxMind::DB::Writer::Util>. The data for each key is encoded as JSON and is
+only written with the first range for that key.
+
+The C<format> parameter is either C<csv>, which is the default, or C<jsonl>.
+A CSV export starts with a C<start_ip,end_ip,key,data> header line. A JSONL
+export has a JSON object with C<start>, C<end>, C<key>, and (for the first
+range of a key) C<data> keys on each line. The output is UTF-8, so C<$fh>
+should not have an encoding layer. C<uint64> and C<uint128> values are written
+as JSON numbers.
+
 =head2 $tree->iterate($object)
 
 This method iterates over the tree by calling methods on the passed
@@ -835,7 +1947,142 @@ node that this record points to.
 
 For empty records, there are no additional arguments.
 
-=head2 $tree->freeze_tree($filename)
+=head2 $tree->iterate_network( $network, $object )
+
+This method is like C<iterate()>, but it only visits the records for
+C<$network> and the networks inside it. The tree is descended directly to the
+record for C<$network>, so the rest of the tree is not walked. The network
+numbers passed to the methods are the same as those passed by C<iterate()>.
+
+If C<$network> is reached through an alias, such as C<::ffff:1.2.0.0/112>, the
+subtree the alias points to is visited, and the network numbers are within
+C<$network>.
+
+If C<$network> is inside a larger network with a single record, no methods are
+called. Use C<networks_within()> to get the data for such a network.
+
+=head2 $tree->networks_within($network)
+
+This method returns the networks inside C<$network> that have data, in network
+order. Each network is returned as an array reference of the network in CIDR
+notation and its data. As with C<iterate_network()>, only the record for
+C<$network> and the records below it are visited.
+
+If C<$network> is inside a larger network with data, C<$network> itself is
+returned with that data.
+
+=head2 $tree->networks_for_data_key($key)
+
+This method returns the networks whose data has the given key, in CIDR
+notation and in network order. Keys are the same as those returned by
+C<key_for_data()> in L<MaxMind::DB::Writer::Util>. Networks reached through
+aliases are not returned separately from the networks they point at.
+
+The networks come from an index of every data key in the tree. The index is
+built the first time it is needed, and is rebuilt when it is next needed after
+the tree has changed. The index is not updated as the tree changes. Any
+change, even inserting a single network, means that the next call walks the
+whole tree and indexes every network again, so interleaving changes and calls
+to this method costs a full walk of the tree for each call. Make all the
+changes first if you can.
+
+=head2 $tree->coverage_by_key()
+
+This method returns a hash reference with an entry for each data key in the
+tree. Each entry is a hash reference with a C<networks> key, the number of
+networks with that key's data, and an C<addresses> key, the number of
+addresses in those networks. For an IPv6 tree, the number of addresses is a
+L<Math::UInt128> object.
+
+This uses the same index as C<networks_for_data_key()>, so the first call after
+any change to the tree walks the whole tree.
+
+=head2 $tree->iterate_batches( $callback, $additional_args )
+
+This method visits the same records in the same order as C<iterate()>, but it
+calls C<$callback> once for each batch of records rather than once for each
+record.
+
+Each call gets a hash reference of parallel array references. The I<n>th
+element of each array describes the same record:
+
+=over 4
+
+=item * C<networks>
+
+The first address in the record's network, packed as 4 bytes for an IPv4 tree
+and 16 bytes for an IPv6 tree. Use C<inet_ntop()> from L<Socket> to turn it
+into a string.
+
+=item * C<prefix_lengths>
+
+The prefix length of the record's network.
+
+=item * C<types>
+
+The record's type. This is one of C<empty>, C<fixed_empty>, C<data>, C<node>,
+C<fixed_node>, or C<alias>.
+
+=item * C<node_numbers>
+
+The number of the node that holds the record.
+
+=item * C<keys>
+
+The key for the record's data, or C<undef> if the record is not a data record.
+
+=item * C<data>
+
+The record's data, or C<undef> if the record is not a data record. This is a
+reference to the data in the tree rather than a copy, so it must not be
+modified.
+
+=back
+
+The prefix lengths and types are read-only values shared between records.
+
+C<$additional_args> is an optional hash reference. The following arguments are
+supported:
+
+=over 4
+
+=item * C<batch_size>
+
+The largest number of records passed to the callback at once. This defaults to
+1,024.
+
+=item * C<types>
+
+An array reference of the record types to include, such as C<['data']>. By
+default, all records are included.
+
+=back
+
+=head2 $tree->cursor( order => $order, types => $types )
+
+This method returns a L<MaxMind::DB::Writer::Tree::Cursor>. Call C<next()> on
+it to get the tree's records one at a time. Unlike C<iterate()>, this lets you
+stop at any point or interleave the traversal with other work. The cursor
+walks a snapshot of the tree, so changing the tree does not affect it.
+
+This method accepts the following named parameters:
+
+=over 4
+
+=item * order
+
+Either C<inorder> or C<preorder>. In C<inorder>, which is the default, the
+records are returned in the same order as C<iterate()>. In C<preorder>, each
+record is returned before the records below it.
+
+=item * types
+
+An array reference of the record types to return, such as C<['data']>. By
+default, all records are returned.
+
+=back
+
+=head2 $tree->freeze_tree( $filename, $additional_args )
 
 Given a file name, this method freezes the tree to that file. Unlike the
 C<write_tree()> method, this method does write out a MaxMind DB file. Instead,
@@ -843,6 +2090,89 @@ it writes out something that can be quickly thawed via the C<<
 MaxMind::DB::Writer::Tree->new_from_frozen_tree >> constructor. This is useful if
 you want to pass the in-memory representation of the tree between processes.
 
+The optional second argument is a hashref which accepts the following keys:
+
+=over 4
+
+=item * format
+
+The freeze format to use. Format C<1>, the default, stores each network as a
+16 byte address, a prefix length, and the 27 byte key of its data, followed by
+the data as a series of Sereal documents, each holding up to 1,024 records.
+
+Format C<2> is much more compact. Each distinct data record is stored once in
+a table of length-prefixed Sereal documents, and networks refer to their data
+by its position in that table. The networks are sorted and each start address
+is stored as a variable-length difference from the previous one. The networks
+are also indexed, which allows part of the tree to be thawed. See the
+C<only_networks> parameter of C<new_from_frozen_tree()>.
+
+Format C<3> uses the same data table, but instead of a list of networks it
+stores the tree's records in pre-order. Thawing this format builds the nodes
+directly rather than inserting each network, so it is much faster to thaw.
+The file is larger than with format C<2> as every node is included.
+
+Formats C<2> and C<3> end with an index of the offset of each data record.
+When thawing these formats, each record is decoded directly from the mapped
+file rather than being copied into memory first, and the pages that have
+already been read are released as thawing goes on.
+
+C<new_from_frozen_tree()> reads any of these formats.
+
+=item * journal
+
+If this is true, the tree starts journaling its changes once it is frozen.
+Every successful C<insert_network()>, C<insert_range()>, and
+C<remove_network()> call is appended to a journal file named after the frozen
+tree with C<.journal> added. Each data record is written to the journal the
+first time it is added to the tree. C<new_from_frozen_tree()> thaws the frozen
+tree and then replays its journal.
+
+This lets a long-running process checkpoint its tree by calling
+C<sync_journal()> instead of freezing the whole tree again. See also
+C<compact_journal()>.
+
+The frozen tree is written to a temporary file and then renamed, so the old
+frozen tree and journal are still usable if the process dies while freezing.
+
+=back
+
+=head2 $tree->sync_journal()
+
+Writes any buffered journal entries to the journal file and asks the
+operating system to write them to disk. This dies if the tree is not
+journaling its changes.
+
+=head2 $tree->compact_journal()
+
+Freezes the tree again, with the same format, to the frozen tree its journal
+belongs to, and starts a new, empty journal. This dies if the tree is not
+journaling its changes.
+
+=head2 $tree->clone()
+
+This method returns a copy of the tree. The copy can be changed without
+affecting the original tree, and vice versa.
+
+The copy is made by walking the tree's nodes once. Data records are not
+copied. Instead, the two trees share the same data, so cloning a large tree is
+much faster than freezing and thawing it, and uses much less memory.
+
+The copy does not continue the original tree's journal, if it has one.
+
+=head2 $tree->snapshot()
+
+This method returns a snapshot of the tree. Like a clone, the snapshot can be
+changed without affecting the original tree, and vice versa.
+
+Taking a snapshot does not copy anything, so it is cheap regardless of the
+tree's size. The snapshot and the tree share their nodes, and a node is only
+copied when one of them changes it. This makes it practical to keep a snapshot
+of the tree as it was when you started writing it out, and then continue
+inserting into the tree.
+
+The snapshot does not continue the original tree's journal, if it has one.
+
 =head2 $tree->ip_version()
 
 Returns the tree's IP version, as passed to the constructor.
@@ -929,6 +2259,74 @@ Override the C<<merge_strategy>> setting for the frozen tree.
 
 This parameter is optional.
 
+=item * only_networks
+
+An arrayref of networks, such as C<< [ '1.0.0.0/8', '2001:db8::/32' ] >>. If
+this is given, only these parts of the frozen tree are thawed. Any network in
+the frozen tree that contains one of these networks is thawed as that network.
+Only the data records used by the thawed networks are decoded.
+
+This uses an index of the frozen network list, so it requires a tree frozen
+with C<< format => 2 >>. It dies if the tree was frozen with another format.
+
+The tree's journal, if it has one, is not replayed when this is given.
+
+This parameter is optional.
+
+=item * thaw_workers
+
+The number of threads used to build the thawed tree. The frozen networks are
+split up by the first few bits of their addresses, and each thread builds the
+subtrees for its share of them. The data records are still decoded by the
+main thread, which also inserts any networks that contain the alias or
+reserved network records the tree starts with. The thawed tree is the same as
+the one thawed with a single thread.
+
+This requires a tree frozen with C<< format => 2 >>, and it cannot be combined
+with C<only_networks>. It defaults to 1.
+
+This parameter is optional.
+
+=item * journal
+
+If the tree was frozen with a journal, the journal is always replayed. If this
+is true, the thawed tree also continues appending its changes to that
+journal. An incomplete entry at the end of the journal, which is left if the
+process writing it died, is ignored and removed.
+
+This dies if the tree was not frozen with a journal.
+
+This parameter is optional.
+
+=back
+
+=head2 MaxMind::DB::Writer::Tree->new_from_frozen_shards()
+
+This method thaws several frozen shards and stitches them together into a
+single tree. The shards' subtrees are copied into the new tree in a single
+pass over each shard, and data used by several shards is only stored once.
+
+The new tree has the parameters of the first shard, except that it is not
+itself a shard. All of the shards must have the same C<ip_version>,
+C<alias_ipv6_to_ipv4>, and C<remove_reserved_networks>, and none of their
+networks may overlap.
+
+This method accepts the following named parameters:
+
+=over 4
+
+=item * filenames
+
+An array reference of frozen shard files.
+
+This parameter is required.
+
+=item * map_key_type_callback
+
+See the constructor documentation for details.
+
+This parameter is required.
+
 =back
 
 =head2 Caveat for Freeze/Thaw
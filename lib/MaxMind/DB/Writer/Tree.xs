@@ -24,6 +24,11 @@ MMDBW_tree_s *tree_from_self(SV *self) {
         *(hv_fetchs((HV *)SvRV(self), "_tree", 0)));
 }
 
+MMDBW_cursor_s *cursor_from_self(SV *self) {
+    return *(MMDBW_cursor_s **)SvPV_nolen(
+        *(hv_fetchs((HV *)SvRV(self), "_cursor", 0)));
+}
+
 void call_iteration_method(MMDBW_tree_s *tree,
                            perl_iterator_args_s *args,
                            SV *method,
@@ -139,6 +144,27 @@ void call_perl_object(MMDBW_tree_s *tree,
     return;
 }
 
+/* This visits the record for a network and the subtree below it in the same
+ * order as iterate(), where a node's records are visited after its left
+ * subtree and before its right subtree. */
+void iterate_network_record(MMDBW_tree_s *tree,
+                            perl_iterator_args_s *args,
+                            MMDBW_network_record_s *found) {
+    MMDBW_node_s *node = found->node;
+    SV *method = NULL == node ? NULL : method_for_record_type(args, found->record->type);
+    bool is_right = NULL != node && found->record == &(node->right_record);
+
+    if (NULL != method && is_right) {
+        call_iteration_method(tree, args, method, node->number, found->record, found->node_network, found->depth - 1, found->network, found->depth, true);
+    }
+
+    start_iteration_at(tree, found->record, found->network, found->depth, true, (void *)args, &call_perl_object);
+
+    if (NULL != method && !is_right) {
+        call_iteration_method(tree, args, method, node->number, found->record, found->node_network, found->depth - 1, found->network, found->depth, false);
+    }
+}
+
 /* It'd be nice to return the CV instead but there's no exposed API for
  * calling a CV directly. */
 SV *maybe_method(HV *package, const char *const method) {
@@ -153,6 +179,37 @@ SV *maybe_method(HV *package, const char *const method) {
     return NULL;
 }
 
+perl_iterator_args_s iterator_args_for_object(SV *object,
+                                               const char *const method) {
+    HV *package;
+    /* It's a blessed object */
+    if (sv_isobject(object)) {
+        package = SvSTASH(SvRV(object));
+    /* It's a package name */
+    } else if (SvPOK(object) && !SvROK(object)) {
+        package = gv_stashsv(object, 0);
+    } else {
+        croak("The argument passed to %s (%s) is not an object or class name", method, SvPV_nolen(object));
+    }
+
+    perl_iterator_args_s args = {
+        .empty_method = maybe_method(package, "process_empty_record"),
+        .node_method = maybe_method(package, "process_node_record"),
+        .data_method = maybe_method(package, "process_data_record"),
+        .receiver = object
+    };
+    if (!(NULL != args.empty_method
+          || NULL != args.node_method
+          || NULL != args.data_method)) {
+
+        croak("The object or class passed to %s must implement "
+              "at least one method of process_empty_record, "
+              "process_node_record, or process_data_record", method);
+    }
+
+    return args;
+}
+
 // clang-format off
 /* XXX - it'd be nice to find a way to get the tree from the XS code so we
  * don't have to pass it in all over place - it'd also let us remove at least
@@ -179,6 +236,26 @@ _create_tree(ip_version, record_size, merge_strategy, alias_ipv6, remove_reserve
     OUTPUT:
         RETVAL
 
+MMDBW_tree_s *
+_clone_tree(self)
+    SV *self;
+
+    CODE:
+        RETVAL = clone_tree(tree_from_self(self));
+
+    OUTPUT:
+        RETVAL
+
+MMDBW_tree_s *
+_snapshot_tree(self)
+    SV *self;
+
+    CODE:
+        RETVAL = snapshot_tree(tree_from_self(self));
+
+    OUTPUT:
+        RETVAL
+
 void
 _insert_network(self, ip_address, prefix_length, key, data, merge_strategy)
     SV *self;
@@ -213,15 +290,190 @@ _remove_network(self, ip_address, prefix_length)
     CODE:
         remove_network(tree_from_self(self), ip_address, prefix_length);
 
+UV
+_replace_data(self, old_key, new_key, new_data)
+    SV *self;
+    char *old_key;
+    char *new_key;
+    SV *new_data;
+
+    CODE:
+        RETVAL = replace_data(tree_from_self(self), old_key, new_key, new_data);
+
+    OUTPUT:
+        RETVAL
+
+UV
+_remove_data_records(self, keys, predicate)
+    SV *self;
+    HV *keys;
+    SV *predicate;
+
+    CODE:
+        RETVAL = remove_data_records(tree_from_self(self), keys, SvOK(predicate) ? predicate : NULL);
+
+    OUTPUT:
+        RETVAL
+
 void
-_write_search_tree(self, output, root_data_type, serializer)
+_merge_tree(self, other, merge_strategy)
+    SV *self;
+    SV *other;
+    MMDBW_merge_strategy merge_strategy;
+
+    CODE:
+        merge_tree(tree_from_self(self), tree_from_self(other), merge_strategy);
+
+void
+_set_shard(self, ip_address, prefix_length)
+    SV *self;
+    char *ip_address;
+    uint8_t prefix_length;
+
+    CODE:
+        set_shard(tree_from_self(self), ip_address, prefix_length);
+
+void
+_stitch_shard(self, shard)
+    SV *self;
+    SV *shard;
+
+    CODE:
+        stitch_shard(tree_from_self(self), tree_from_self(shard));
+
+void
+_diff_tree(self, other, callback, batch_size)
+    SV *self;
+    SV *other;
+    SV *callback;
+    uint32_t batch_size;
+
+    CODE:
+        diff_tree(tree_from_self(self), tree_from_self(other), callback, batch_size);
+
+void
+_subtract_tree(self, other)
+    SV *self;
+    SV *other;
+
+    CODE:
+        subtract_tree(tree_from_self(self), tree_from_self(other));
+
+void
+_intersect_tree(self, other)
+    SV *self;
+    SV *other;
+
+    CODE:
+        intersect_tree(tree_from_self(self), tree_from_self(other));
+
+uint32_t
+_write_search_tree(self, output, root_data_type, serializer, data_positions, ipv4_only)
     SV *self;
     SV *output;
     SV *root_data_type;
     SV *serializer;
+    SV *data_positions;
+    bool ipv4_only;
 
     CODE:
-        write_search_tree(tree_from_self(self), output, root_data_type, serializer);
+        RETVAL = write_search_tree(tree_from_self(self), output, root_data_type, serializer, data_positions, ipv4_only);
+
+    OUTPUT:
+        RETVAL
+
+uint32_t
+_write_search_trees(self, outputs, root_data_type, serializer, data_positions)
+    SV *self;
+    AV *outputs;
+    SV *root_data_type;
+    SV *serializer;
+    SV *data_positions;
+
+    CODE:
+        RETVAL = write_search_trees(tree_from_self(self), outputs, root_data_type, serializer, data_positions);
+
+    OUTPUT:
+        RETVAL
+
+uint32_t
+_write_projected_search_tree(self, output, root_data_type, serializer, projection, ipv4_only)
+    SV *self;
+    SV *output;
+    SV *root_data_type;
+    SV *serializer;
+    SV *projection;
+    bool ipv4_only;
+
+    CODE:
+        RETVAL = write_projected_search_tree(tree_from_self(self), output, root_data_type, serializer, projection, ipv4_only);
+
+    OUTPUT:
+        RETVAL
+
+SV *
+_networks_for_data_key(self, key)
+    SV *self;
+    char *key;
+
+    CODE:
+        RETVAL = newRV_noinc((SV *)networks_for_data_key(tree_from_self(self), key));
+
+    OUTPUT:
+        RETVAL
+
+SV *
+coverage_by_key(self)
+    SV *self;
+
+    CODE:
+        MMDBW_tree_s *tree = tree_from_self(self);
+        HV *coverage = newHV();
+        MMDBW_key_index_entry_s *entry, *tmp;
+        HASH_ITER(hh, current_key_index(tree)->entries, entry, tmp) {
+            HV *summary = newHV();
+            hv_stores(summary, "networks", newSVuv(entry->network_count));
+            hv_stores(summary, "addresses", tree->ip_version == 6 ? newSVu128(entry->address_count) : newSVuv((UV)entry->address_count));
+            (void)hv_store(coverage, entry->key, strlen(entry->key), newRV_noinc((SV *)summary), 0);
+        }
+        RETVAL = newRV_noinc((SV *)coverage);
+
+    OUTPUT:
+        RETVAL
+
+void
+_export_ranges(self, output, jsonl, data_encoder)
+    SV *self;
+    SV *output;
+    bool jsonl;
+    SV *data_encoder;
+
+    CODE:
+        export_ranges(tree_from_self(self), output, jsonl, data_encoder);
+
+void
+_data_in_write_order(self, ipv4_only)
+    SV *self;
+    bool ipv4_only;
+
+    PPCODE:
+        AV *keys = newAV();
+        AV *data = newAV();
+        collect_data_in_write_order(tree_from_self(self), keys, data, ipv4_only);
+        EXTEND(SP, 2);
+        mPUSHs(newRV_noinc((SV *)keys));
+        mPUSHs(newRV_noinc((SV *)data));
+
+void
+_relocate_data_pointers(buffer, relocations)
+    SV *buffer;
+    SV *relocations;
+
+    CODE:
+        if (!SvROK(buffer)) {
+            croak("The buffer passed to _relocate_data_pointers must be a scalar reference");
+        }
+        relocate_data_pointers(SvRV(buffer), relocations);
 
 uint32_t
 node_count(self)
@@ -247,33 +499,61 @@ iterate(self, object)
     CODE:
         MMDBW_tree_s *tree = tree_from_self(self);
         assign_node_numbers(tree);
-        HV *package;
-        /* It's a blessed object */
-        if (sv_isobject(object)) {
-            package = SvSTASH(SvRV(object));
-        /* It's a package name */
-        } else if (SvPOK(object) && !SvROK(object)) {
-            package = gv_stashsv(object, 0);
-        } else {
-            croak("The argument passed to iterate (%s) is not an object or class name", SvPV_nolen(object));
-        }
+        perl_iterator_args_s args = iterator_args_for_object(object, "iterate");
 
-        perl_iterator_args_s args = {
-            .empty_method = maybe_method(package, "process_empty_record"),
-            .node_method = maybe_method(package, "process_node_record"),
-            .data_method = maybe_method(package, "process_data_record"),
-            .receiver = object
-        };
-        if (!(NULL != args.empty_method
-              || NULL != args.node_method
-              || NULL != args.data_method)) {
-
-            croak("The object or class passed to iterate must implement "
-                  "at least one method of process_empty_record, "
-                  "process_node_record, or process_data_record");
+        start_iteration(tree, true, (void *)&args, &call_perl_object);
+
+void
+_iterate_network(self, ip_address, prefix_length, object)
+    SV *self;
+    char *ip_address;
+    uint8_t prefix_length;
+    SV *object;
+
+    CODE:
+        MMDBW_tree_s *tree = tree_from_self(self);
+        assign_node_numbers(tree);
+        perl_iterator_args_s args = iterator_args_for_object(object, "iterate_network");
+
+        MMDBW_network_record_s found = record_for_network(tree, ip_address, prefix_length);
+        /* Records for larger networks containing this one are not visited. */
+        if (found.depth == found.prefix_length) {
+            iterate_network_record(tree, &args, &found);
         }
 
-        start_iteration(tree, true, (void *)&args, &call_perl_object);
+SV *
+_networks_within(self, ip_address, prefix_length)
+    SV *self;
+    char *ip_address;
+    uint8_t prefix_length;
+
+    CODE:
+        RETVAL = newRV_noinc((SV *)networks_within(tree_from_self(self), ip_address, prefix_length));
+
+    OUTPUT:
+        RETVAL
+
+void
+_iterate_batches(self, callback, batch_size, types)
+    SV *self;
+    SV *callback;
+    uint32_t batch_size;
+    SV *types;
+
+    CODE:
+        iterate_batches(tree_from_self(self), callback, batch_size, SvROK(types) ? (AV *)SvRV(types) : NULL);
+
+MMDBW_cursor_s *
+_new_cursor(self, preorder, types)
+    SV *self;
+    bool preorder;
+    SV *types;
+
+    CODE:
+        RETVAL = new_cursor(tree_from_self(self), preorder, SvROK(types) ? (AV *)SvRV(types) : NULL);
+
+    OUTPUT:
+        RETVAL
 
 SV *
 lookup_ip_address(self, address)
@@ -287,27 +567,78 @@ lookup_ip_address(self, address)
         RETVAL
 
 void
-_freeze_tree(self, filename, frozen_params, frozen_params_size)
+_freeze_tree(self, filename, frozen_params, frozen_params_size, format)
     SV *self;
     char *filename;
     char *frozen_params;
     int frozen_params_size;
+    int format;
 
     CODE:
-        freeze_tree(tree_from_self(self), filename, frozen_params, frozen_params_size);
+        freeze_tree(tree_from_self(self), filename, frozen_params, frozen_params_size, format);
 
 MMDBW_tree_s *
-_thaw_tree(filename, initial_offset, ip_version, record_size, merge_strategy, alias_ipv6, remove_reserved_networks)
+_thaw_tree(filename, initial_offset, format, ip_version, record_size, merge_strategy, alias_ipv6, remove_reserved_networks, only_networks, workers)
     char *filename;
     int initial_offset;
+    int format;
     int ip_version;
     int record_size;
     MMDBW_merge_strategy merge_strategy;
     bool alias_ipv6;
     bool remove_reserved_networks;
+    SV *only_networks;
+    uint32_t workers;
 
     CODE:
-        RETVAL = thaw_tree(filename, initial_offset, ip_version, record_size, merge_strategy, alias_ipv6, remove_reserved_networks);
+        AV *only = NULL;
+        if (SvOK(only_networks)) {
+            if (!SvROK(only_networks) || SvTYPE(SvRV(only_networks)) != SVt_PVAV) {
+                croak("only_networks must be an array reference");
+            }
+            only = (AV *)SvRV(only_networks);
+        }
+        RETVAL = thaw_tree(filename, initial_offset, format, ip_version, record_size, merge_strategy, alias_ipv6, remove_reserved_networks, only, workers);
+
+    OUTPUT:
+        RETVAL
+
+void
+_start_journal(self, filename, token, append)
+    SV *self;
+    char *filename;
+    SV *token;
+    bool append;
+
+    CODE:
+        STRLEN token_size;
+        const char *token_bytes = SvPVbyte(token, token_size);
+        start_journal(tree_from_self(self), filename, token_bytes, token_size, append);
+
+void
+_sync_journal(self)
+    SV *self;
+
+    CODE:
+        sync_journal(tree_from_self(self));
+
+void
+_stop_journal(self)
+    SV *self;
+
+    CODE:
+        stop_journal(tree_from_self(self));
+
+UV
+_replay_journal(self, filename, token)
+    SV *self;
+    char *filename;
+    SV *token;
+
+    CODE:
+        STRLEN token_size;
+        const char *token_bytes = SvPVbyte(token, token_size);
+        RETVAL = replay_journal(tree_from_self(self), filename, token_bytes, token_size);
 
     OUTPUT:
         RETVAL
@@ -318,3 +649,27 @@ _free_tree(self)
 
     CODE:
         free_tree(tree_from_self(self));
+
+MODULE = MaxMind::DB::Writer::Tree    PACKAGE = MaxMind::DB::Writer::Tree::Cursor
+
+void
+next(self)
+    SV *self;
+
+    PPCODE:
+        MMDBW_cursor_s *cursor = cursor_from_self(self);
+        if (cursor_next(cursor)) {
+            EXTEND(SP, 5);
+            PUSHs(cursor->network);
+            PUSHs(cursor->prefix_length);
+            PUSHs(cursor->type);
+            PUSHs(cursor->key);
+            PUSHs(cursor->data);
+        }
+
+void
+_free_cursor(self)
+    SV *self;
+
+    CODE:
+        free_cursor(cursor_from_self(self));
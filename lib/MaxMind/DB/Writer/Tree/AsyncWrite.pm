@@ -0,0 +1,200 @@
+package MaxMind::DB::Writer::Tree::AsyncWrite;
+
+use strict;
+use warnings;
+use namespace::autoclean;
+use autodie;
+
+our $VERSION = '0.300005';
+
+use POSIX qw( WNOHANG );
+use Time::HiRes ();
+
+use Moose;
+
+has pid => (
+    is       => 'ro',
+    isa      => 'Int',
+    required => 1,
+);
+
+has path => (
+    is       => 'ro',
+    isa      => 'Str',
+    required => 1,
+);
+
+has started_at => (
+    is       => 'ro',
+    isa      => 'Num',
+    required => 1,
+);
+
+has finished_at => (
+    is       => 'ro',
+    isa      => 'Num',
+    init_arg => undef,
+    writer   => '_set_finished_at',
+);
+
+has error => (
+    is       => 'ro',
+    isa      => 'Str',
+    init_arg => undef,
+    writer   => '_set_error',
+);
+
+# The child writes its error and the time it finished to files in this
+# directory. The directory is removed along with this object.
+has _dir => (
+    is       => 'ro',
+    isa      => 'File::Temp::Dir',
+    init_arg => 'dir',
+    required => 1,
+);
+
+has _exit_status => (
+    is        => 'ro',
+    isa       => 'Int',
+    init_arg  => undef,
+    writer    => '_set_exit_status',
+    predicate => '_has_exit_status',
+);
+
+sub status {
+    my $self = shift;
+
+    $self->_reap(WNOHANG) unless $self->_has_exit_status();
+
+    return 'running' unless $self->_has_exit_status();
+    return $self->_exit_status() == 0 ? 'succeeded' : 'failed';
+}
+
+sub wait {    ## no critic (Subroutines::ProhibitBuiltinHomonyms)
+    my $self = shift;
+
+    $self->_reap(0) unless $self->_has_exit_status();
+
+    die 'Writing the tree to ' . $self->path() . ' failed: ' . $self->error()
+        if $self->_exit_status() != 0;
+
+    return 1;
+}
+
+sub elapsed {
+    my $self = shift;
+
+    $self->status();
+
+    return ( $self->finished_at() // Time::HiRes::time() )
+        - $self->started_at();
+}
+
+sub _reap {
+    my $self  = shift;
+    my $flags = shift;
+
+    my $pid = waitpid( $self->pid(), $flags );
+    return if $pid == 0;
+
+    $self->_set_exit_status( $pid == $self->pid() ? $? : -1 );
+
+    my $dir = $self->_dir()->dirname();
+    $self->_set_finished_at( _slurp("$dir/finished") // Time::HiRes::time() );
+
+    if ( $self->_exit_status() != 0 ) {
+        $self->_set_error( _slurp("$dir/error")
+                // 'the child process exited with status '
+                . $self->_exit_status() );
+    }
+
+    return;
+}
+
+sub _slurp {
+    my $file = shift;
+
+    return undef unless -e $file;
+
+    open my $fh, '<:encoding(UTF-8)', $file;
+    my $content = do { local $/ = undef; <$fh> };
+    close $fh;
+
+    return $content;
+}
+
+# We don't want to leave a zombie process behind, or to remove the directory
+# before the child is done with it.
+sub DEMOLISH {
+    my $self = shift;
+
+    $self->_reap(0) unless $self->_has_exit_status();
+
+    return;
+}
+
+__PACKAGE__->meta()->make_immutable();
+
+1;
+
+# ABSTRACT: A handle for a tree being written by a forked process
+
+__END__
+
+=pod
+
+=head1 SYNOPSIS
+
+    my $write = $tree->write_tree_async('/path/to/file.mmdb');
+
+    # Keep inserting into $tree. The database being written is not affected.
+    ...
+
+    $write->wait();
+    printf "Wrote the database in %.1f seconds\n", $write->elapsed();
+
+=head1 DESCRIPTION
+
+Objects of this class are returned by
+L<MaxMind::DB::Writer::Tree/write_tree_async>. Each one represents a child
+process that is writing a database.
+
+=head1 API
+
+=head2 $write->wait()
+
+Waits for the child to finish. This returns true if the database was written,
+and dies with the child's error otherwise.
+
+=head2 $write->status()
+
+Returns C<running>, C<succeeded>, or C<failed>. This does not block.
+
+=head2 $write->error()
+
+Returns the child's error if it failed, or C<undef> otherwise.
+
+=head2 $write->pid()
+
+Returns the child's process ID.
+
+=head2 $write->path()
+
+Returns the path the database is written to.
+
+=head2 $write->started_at()
+
+Returns the time at which the child was forked, in fractional seconds since
+the epoch.
+
+=head2 $write->finished_at()
+
+Returns the time at which the child finished, in fractional seconds since the
+epoch. This is C<undef> while the child is running.
+
+=head2 $write->elapsed()
+
+Returns the number of seconds the child took to write the database. While the
+child is running, this is the number of seconds since it was started.
+
+=cut
@@ -0,0 +1,91 @@
+package MaxMind::DB::Writer::Tree::Cursor;
+
+use strict;
+use warnings;
+use namespace::autoclean;
+
+our $VERSION = '0.300005';
+
+use Moose;
+
+# The next() and _free_cursor() methods are implemented in Tree.xs, which
+# expects $self->{_cursor} to be populated.
+has _cursor => (
+    is       => 'ro',
+    init_arg => 'cursor',
+    required => 1,
+);
+
+sub DEMOLISH {
+    my $self = shift;
+
+    $self->_free_cursor();
+
+    return;
+}
+
+__PACKAGE__->meta()->make_immutable();
+
+1;
+
+# ABSTRACT: A cursor over the records in a tree
+
+__END__
+
+=pod
+
+=head1 SYNOPSIS
+
+    my $cursor = $tree->cursor( types => ['data'] );
+
+    while ( my ( $network, $prefix_length, $type, $key, $data )
+        = $cursor->next() ) {
+        ...
+    }
+
+=head1 DESCRIPTION
+
+Objects of this class are returned by L<MaxMind::DB::Writer::Tree/cursor>.
+Each one walks the records of a snapshot of the tree, one record per call to
+C<next()>. The tree can be changed while the cursor is in use without
+affecting the records the cursor returns.
+
+=head1 API
+
+=head2 $cursor->next()
+
+Returns the next record as a list of five values, or an empty list when there
+are no more records:
+
+=over 4
+
+=item
+
+The first address in the record's network, packed as 4 bytes for an IPv4 tree
+and 16 bytes for an IPv6 tree.
+
+=item
+
+The prefix length of the record's network.
+
+=item
+
+The record's type. This is one of C<empty>, C<fixed_empty>, C<data>, C<node>,
+C<fixed_node>, or C<alias>.
+
+=item
+
+The key for the record's data, or C<undef> if the record is not a data record.
+
+=item
+
+The record's data, or C<undef> if the record is not a data record. This is a
+reference to the data in the tree rather than a copy, so it must not be
+modified.
+
+=back
+
+The returned scalars are reused for each record, so copy them rather than
+keeping references to them.
+
+=cut
@@ -0,0 +1,94 @@
+use strict;
+use warnings;
+use autodie;
+
+use lib 't/lib';
+
+use MaxMind::DB::Writer::Tree;
+use Test::MaxMind::DB::Writer qw( make_tree_from_pairs tree_output );
+use Test::More;
+
+my %tree_args = (
+    ip_version            => 6,
+    alias_ipv6_to_ipv4    => 1,
+    merge_strategy        => 'recurse',
+    map_key_type_callback => sub {'utf8_string'},
+);
+
+{
+    my $tree = _inserted_tree( 1 .. 20 );
+
+    my $clone = $tree->clone();
+    isa_ok( $clone, 'MaxMind::DB::Writer::Tree', 'clone' );
+
+    is(
+        tree_output( $tree->clone() ),
+        tree_output( _inserted_tree( 1 .. 20 ) ),
+        'clone writes the same database as the original'
+    );
+
+    is_deeply(
+        $clone->lookup_ip_address('::ffff:2.3.0.1'),
+        { value => 'value 3' },
+        'lookup through an alias in the clone'
+    );
+
+    _insert( $clone, 21 .. 30 );
+    $clone->remove_network('2.4.0.0/16');
+    $clone->insert_network( '2.5.0.0/16', { other => 'merged' } );
+
+    is(
+        tree_output($tree),
+        tree_output( _inserted_tree( 1 .. 20 ) ),
+        'changing the clone does not change the original'
+    );
+
+    my $expected = _inserted_tree( 1 .. 30 );
+    $expected->remove_network('2.4.0.0/16');
+    $expected->insert_network( '2.5.0.0/16', { other => 'merged' } );
+
+    _insert( $tree, 31 .. 35 );
+    undef $tree;
+
+    is(
+        tree_output($clone),
+        tree_output($expected),
+        'clone is independent of the original, which has been freed'
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs(
+        'network',
+        [ [ '1.1.1.0/24', { value => 'foo' } ] ],
+        { record_size => 28, map_key_type_callback => sub {'utf8_string'} },
+    );
+
+    my $clone = $tree->clone();
+    is( $clone->record_size(), 28, 'clone has the same record size' );
+    is( $clone->ip_version(),  4,  'clone has the same IP version' );
+    is_deeply(
+        $clone->lookup_ip_address('1.1.1.1'),
+        { value => 'foo' },
+        'lookup in the clone of an IPv4 tree'
+    );
+}
+
+done_testing();
+
+sub _inserted_tree {
+    my $tree = make_tree_from_pairs( 'network', [], \%tree_args );
+    _insert( $tree, @_ );
+    return $tree;
+}
+
+sub _insert {
+    my $tree = shift;
+
+    for my $i (@_) {
+        $tree->insert_network( "2.$i.0.0/16", { value => 'value ' . $i % 5 } );
+        $tree->insert_network( "2a02:$i\::/32", { value => "ipv6 $i" } );
+    }
+
+    return;
+}
@@ -0,0 +1,143 @@
+use strict;
+use warnings;
+
+use lib 't/lib';
+
+use MaxMind::DB::Writer::Tree;
+use Socket qw( AF_INET inet_ntop );
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( make_tree_from_pairs );
+use Test::More;
+
+my @ipv4_pairs
+    = map { [ "2.$_.0.0/16", { value => 'value ' . $_ % 5 } ] } 1 .. 10;
+my @ipv6_pairs = (
+    @ipv4_pairs,
+    map { [ "2a02:$_\::/32", { value => "ipv6 $_" } ] } 1 .. 10,
+);
+
+my %ipv4_args = ( map_key_type_callback => sub {'utf8_string'} );
+my %ipv6_args = ( %ipv4_args, ip_version => 6, alias_ipv6_to_ipv4 => 1 );
+
+{
+    my $tree = make_tree_from_pairs( 'network', \@ipv6_pairs, \%ipv6_args );
+
+    my @expected;
+    $tree->iterate_batches(
+        sub {
+            my $batch = shift;
+            for my $i ( 0 .. $#{ $batch->{networks} } ) {
+                push @expected,
+                    [ map { $batch->{$_}[$i] }
+                        qw( networks prefix_lengths types keys data ) ];
+            }
+        }
+    );
+
+    is_deeply(
+        _records( $tree->cursor() ),
+        \@expected,
+        'an in-order cursor returns the same records as iterate_batches()'
+    );
+
+    my $preorder = _records( $tree->cursor( order => 'preorder' ) );
+    is(
+        scalar @{$preorder}, scalar @expected,
+        'a pre-order cursor returns every record'
+    );
+
+    my %seen;
+    my $parents_first = 1;
+    for my $record ( @{$preorder} ) {
+        my ( $network, $prefix_length ) = @{$record};
+        $seen{ _parent( $network, $prefix_length ) . "/$prefix_length" } = 1;
+        $parents_first = 0
+            if $prefix_length > 1
+            && !$seen{ _parent( $network, $prefix_length - 1 ) . '/'
+                . ( $prefix_length - 1 ) };
+    }
+    ok( $parents_first, 'pre-order returns each record before its subtree' );
+
+    is_deeply(
+        [ grep { $_->[2] eq 'data' } @{$preorder} ],
+        [ grep { $_->[2] eq 'data' } @expected ],
+        'data records are in network order in both orders'
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs( 'network', \@ipv4_pairs, \%ipv4_args );
+
+    my $cursor = $tree->cursor( types => ['data'] );
+    my ( $network, $prefix_length, $type, $key, $data ) = $cursor->next();
+    is(
+        inet_ntop( AF_INET, $network ) . "/$prefix_length", '2.1.0.0/16',
+        'first data record'
+    );
+    is( $type, 'data', 'record type' );
+    is_deeply( $data, { value => 'value 1' }, 'record data' );
+
+    $tree->insert_network( '2.2.0.0/16', { value => 'changed' } );
+    $tree->remove_network('2.3.0.0/16');
+    $tree->insert_network( '3.0.0.0/8', { value => 'new' } );
+    undef $tree;
+
+    my @networks;
+    while ( my ( $network, $prefix_length, undef, undef, $data )
+        = $cursor->next() ) {
+        push @networks, inet_ntop( AF_INET, $network ) . "/$prefix_length";
+        is( $data->{value}, 'value 2', 'data from before the change' )
+            if $networks[-1] eq '2.2.0.0/16';
+    }
+
+    is_deeply(
+        \@networks,
+        [ map {"2.$_.0.0/16"} 2 .. 10 ],
+        'the cursor sees the tree as it was when it was created'
+    );
+    is_deeply( [ $cursor->next() ], [], 'next() keeps returning nothing' );
+}
+
+{
+    my $tree = make_tree_from_pairs( 'network', \@ipv4_pairs, \%ipv4_args );
+
+    my $records = _records( $tree->cursor( types => [ 'empty', 'node' ] ) );
+    ok( scalar @{$records}, 'records of the given types are returned' );
+    is(
+        scalar( grep { $_->[2] ne 'empty' && $_->[2] ne 'node' } @{$records} ),
+        0,
+        'no records of other types are returned'
+    );
+
+    like(
+        exception { $tree->cursor( order => 'postorder' ) },
+        qr/order must be preorder or inorder/,
+        'unknown order'
+    );
+    like(
+        exception { $tree->cursor( types => ['bogus'] ) },
+        qr/Unknown record type: bogus/,
+        'unknown record type'
+    );
+}
+
+done_testing();
+
+sub _records {
+    my $cursor = shift;
+
+    my @records;
+    while ( my @record = $cursor->next() ) {
+        push @records, \@record;
+    }
+
+    return \@records;
+}
+
+# Returns the first address of the network's prefix, as a bit string.
+sub _parent {
+    my $network       = shift;
+    my $prefix_length = shift;
+
+    return substr( unpack( 'B*', $network ), 0, $prefix_length );
+}
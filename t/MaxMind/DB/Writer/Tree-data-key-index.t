@@ -0,0 +1,108 @@
+use strict;
+use warnings;
+
+use lib 't/lib';
+
+use MaxMind::DB::Writer::Tree;
+use MaxMind::DB::Writer::Util qw( key_for_data );
+use Test::MaxMind::DB::Writer qw( make_tree_from_pairs );
+use Test::More;
+
+my %data = (
+    a => { value => 'a' },
+    b => { value => 'b' },
+);
+my %key = map { $_ => key_for_data( $data{$_} ) } keys %data;
+
+{
+    my $tree = make_tree_from_pairs(
+        'network',
+        [
+            [ '1.0.0.0/25',   $data{a} ],
+            [ '1.0.0.128/25', $data{a} ],
+            [ '1.0.2.0/24',   $data{a} ],
+            [ '2.0.0.0/8',    $data{b} ],
+        ],
+        { map_key_type_callback => sub {'utf8_string'} },
+    );
+
+    is_deeply(
+        [ $tree->networks_for_data_key( $key{a} ) ],
+        [ '1.0.0.0/24', '1.0.2.0/24' ],
+        'networks for a key, after adjacent networks were merged'
+    );
+    is_deeply(
+        $tree->coverage_by_key(),
+        {
+            $key{a} => { networks => 2, addresses => 512 },
+            $key{b} => { networks => 1, addresses => 2**24 },
+        },
+        'coverage by key'
+    );
+    is_deeply(
+        [ $tree->networks_for_data_key('no such key') ],
+        [],
+        'no networks for an unknown key'
+    );
+
+    my $snapshot = $tree->snapshot();
+
+    $tree->insert_network( '1.0.4.0/24', $data{a} );
+    $tree->remove_network('1.0.0.0/25');
+    $tree->insert_network( '2.1.0.0/16', $data{a} );
+
+    is_deeply(
+        [ $tree->networks_for_data_key( $key{a} ) ],
+        [ '1.0.0.128/25', '1.0.2.0/24', '1.0.4.0/24', '2.1.0.0/16' ],
+        'the index is rebuilt after the tree changes'
+    );
+    is_deeply(
+        $tree->coverage_by_key(),
+        {
+            $key{a} => { networks => 4, addresses => 128 + 256 * 2 + 2**16 },
+            $key{b} => { networks => 8, addresses => 2**24 - 2**16 },
+        },
+        'coverage after the tree changes'
+    );
+    is_deeply(
+        [ $snapshot->networks_for_data_key( $key{a} ) ],
+        [ '1.0.0.0/24', '1.0.2.0/24' ],
+        'a snapshot has its own index'
+    );
+
+    $tree->remove_network('2.0.0.0/8');
+    $tree->insert_network( '2.0.0.0/8', $data{b} );
+    is_deeply(
+        [ $tree->networks_for_data_key( $key{b} ) ],
+        ['2.0.0.0/8'],
+        'networks after removing and inserting the same data again'
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs(
+        'network',
+        [ [ '1.0.0.0/24', $data{a} ], [ '2a02:1::/32', $data{a} ] ],
+        {
+            ip_version            => 6,
+            alias_ipv6_to_ipv4    => 1,
+            map_key_type_callback => sub {'utf8_string'},
+        },
+    );
+
+    is_deeply(
+        [ $tree->networks_for_data_key( $key{a} ) ],
+        [ '::1.0.0.0/120', '2a02:1::/32' ],
+        'networks for a key in an IPv6 tree are not repeated for aliases'
+    );
+
+    my $coverage = $tree->coverage_by_key();
+    is( $coverage->{ $key{a} }{networks}, 2, 'network count in an IPv6 tree' );
+    is(
+        "$coverage->{ $key{a} }{addresses}",
+        '79228162514264337593543950592',
+        'address count in an IPv6 tree'
+    );
+}
+
+done_testing();
@@ -0,0 +1,157 @@
+use strict;
+use warnings;
+
+use lib 't/lib';
+
+use MaxMind::DB::Writer::Tree;
+use MaxMind::DB::Writer::Util qw( key_for_data );
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( make_tree_from_pairs );
+use Test::More;
+
+my %value = map { $_ => { value => "value $_" } } 0 .. 4;
+my @pairs = map { [ "1.$_.0.0/16", $value{ $_ % 5 } ] } 1 .. 50;
+
+my %ipv4_args = ( map_key_type_callback => sub {'utf8_string'} );
+my %ipv6_args = ( %ipv4_args, ip_version => 6, alias_ipv6_to_ipv4 => 1 );
+
+my @expected = (
+    [ '1.7.0.0/16',    key_for_data( $value{2} ), key_for_data('changed') ],
+    [ '1.9.0.0/16',    key_for_data( $value{4} ), undef ],
+    [ '1.10.128.0/17', key_for_data( $value{0} ), key_for_data('half') ],
+    [ '2.0.0.0/24',    undef,                     key_for_data('new') ],
+);
+
+{
+    my $yesterday = make_tree_from_pairs( 'network', \@pairs, \%ipv4_args );
+    my $today     = make_tree_from_pairs( 'network', \@pairs, \%ipv4_args );
+    _change($today);
+
+    is_deeply(
+        _diff( $yesterday, $today ),
+        \@expected,
+        'diff of two trees built separately'
+    );
+    is_deeply(
+        _diff(
+            $yesterday,
+            make_tree_from_pairs( 'network', \@pairs, \%ipv4_args )
+        ),
+        [],
+        'no changes between identical trees built separately'
+    );
+
+    is_deeply(
+        _diff( $today, $yesterday ),
+        [ map { [ $_->[0], $_->[2], $_->[1] ] } @expected ],
+        'diff in the other direction'
+    );
+
+    my @batches;
+    $yesterday->diff_tree(
+        $today,
+        sub { push @batches, scalar @{ $_[0] } },
+        { batch_size => 3 },
+    );
+    is_deeply( \@batches, [ 3, 1 ], 'changes are passed in batches' );
+}
+
+{
+    my $yesterday = make_tree_from_pairs( 'network', \@pairs, \%ipv4_args );
+    my $today     = $yesterday->snapshot();
+
+    is_deeply( _diff( $yesterday, $today ), [], 'no changes to a snapshot' );
+
+    _change($today);
+    is_deeply(
+        _diff( $yesterday, $today ),
+        \@expected,
+        'diff against a changed snapshot'
+    );
+
+    $today->insert_network( '1.20.0.0/16', 'later' );
+    is_deeply(
+        _diff( $yesterday, $today ),
+        [
+            @expected[ 0 .. 2 ],
+            [
+                '1.20.0.0/16', key_for_data( $value{0} ),
+                key_for_data('later')
+            ],
+            $expected[3],
+        ],
+        'hashes are recomputed after the tree changes'
+    );
+}
+
+{
+    my $yesterday = make_tree_from_pairs( 'network', \@pairs, \%ipv6_args );
+    my $today     = make_tree_from_pairs( 'network', \@pairs, \%ipv6_args );
+    _change($today);
+    $today->insert_network( '2a02:1::/32', 'ipv6' );
+
+    is_deeply(
+        _diff( $yesterday, $today ),
+        [
+            ( map { [ _ipv6_network( $_->[0] ), @{$_}[ 1, 2 ] ] } @expected ),
+            [ '2a02:1::/32', undef, key_for_data('ipv6') ],
+        ],
+        'diff of IPv6 trees with aliases'
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs( 'network', \@pairs, \%ipv4_args );
+
+    like(
+        exception {
+            $tree->diff_tree(
+                make_tree_from_pairs( 'network', \@pairs, \%ipv6_args ),
+                sub { }
+            );
+        },
+        qr/You cannot diff an IPv4 tree against an IPv6 tree/,
+        'trees must have the same IP version'
+    );
+    like(
+        exception { $tree->diff_tree($tree) },
+        qr/diff_tree\(\) requires a callback/,
+        'diff_tree requires a callback'
+    );
+    like(
+        exception {
+            $tree->diff_tree( $tree, sub { }, { batch_size => 0 } )
+        },
+        qr/batch_size must be a positive integer/,
+        'batch_size must be positive'
+    );
+}
+
+done_testing();
+
+sub _change {
+    my $tree = shift;
+
+    $tree->insert_network( '1.7.0.0/16',    'changed' );
+    $tree->insert_network( '1.10.128.0/17', 'half' );
+    $tree->insert_network( '2.0.0.0/24',    'new' );
+    $tree->remove_network('1.9.0.0/16');
+
+    return;
+}
+
+sub _ipv6_network {
+    my ( $address, $prefix_length ) = split qr{/}, shift;
+
+    return "::$address/" . ( $prefix_length + 96 );
+}
+
+sub _diff {
+    my $tree  = shift;
+    my $other = shift;
+
+    my @changes;
+    $tree->diff_tree( $other, sub { push @changes, @{ $_[0] } } );
+
+    return \@changes;
+}
@@ -0,0 +1,199 @@
+use strict;
+use warnings;
+use autodie;
+
+use lib 't/lib';
+
+use JSON::PP;
+use Math::Int64 qw( uint64 );
+use Math::Int128 qw( uint128 );
+use MaxMind::DB::Writer::Tree;
+use MaxMind::DB::Writer::Util qw( key_for_data );
+use Socket qw( AF_INET6 inet_ntop inet_pton );
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( make_tree_from_pairs );
+use Test::More;
+
+my $json = JSON::PP->new()->canonical();
+
+my %tree_args = (
+    remove_reserved_networks => 0,
+    map_key_type_callback    => sub {'utf8_string'},
+);
+
+{
+    my %data = (
+        a => { value => 'a' },
+        b => { value => 'b, "quoted"' },
+    );
+    my $tree = make_tree_from_pairs(
+        'network',
+        [
+            [ '1.0.0.0/24', $data{a} ],
+            [ '1.0.1.0/24', $data{a} ],
+            [ '1.0.2.0/24', $data{a} ],
+            [ '1.0.3.0/24', $data{b} ],
+            [ '1.0.5.0/24', $data{a} ],
+            [ '1.0.6.0/23', $data{a} ],
+        ],
+        \%tree_args,
+    );
+
+    my %key = map { $_ => key_for_data( $data{$_} ) } keys %data;
+    ( my $b_json = $json->encode( $data{b} ) ) =~ s/"/""/g;
+
+    is(
+        _export( $tree, 'csv' ),
+        join(
+            q{},
+            "start_ip,end_ip,key,data\n",
+            qq{1.0.0.0,1.0.2.255,$key{a},"{""value"":""a""}"\n},
+            qq{1.0.3.0,1.0.3.255,$key{b},"$b_json"\n},
+            qq{1.0.5.0,1.0.7.255,$key{a},\n},
+        ),
+        'CSV export coalesces adjacent networks and writes data once per key'
+    );
+
+    is(
+        _export( $tree, 'csv' ),
+        _export($tree),
+        'CSV is the default format'
+    );
+
+    is_deeply(
+        [ map { decode_json($_) } split /\n/, _export( $tree, 'jsonl' ) ],
+        [
+            {
+                start => '1.0.0.0',
+                end   => '1.0.2.255',
+                key   => $key{a},
+                data  => $data{a},
+            },
+            {
+                start => '1.0.3.0',
+                end   => '1.0.3.255',
+                key   => $key{b},
+                data  => $data{b},
+            },
+            {
+                start => '1.0.5.0',
+                end   => '1.0.7.255',
+                key   => $key{a},
+            },
+        ],
+        'JSONL export'
+    );
+
+    like(
+        exception { $tree->export_ranges( \*STDOUT, format => 'xml' ) },
+        qr/format must be csv or jsonl/,
+        'unknown format'
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs(
+        'network',
+        [
+            [ '2.1.0.0/16',    { value => 'ipv4' } ],
+            [ '2a02:1::/32',   { value => 'ipv6' } ],
+            [ '2a02:2::/32',   { value => 'ipv6' } ],
+            [ 'abcd::1:0/112', { value => 'ipv6 small' } ],
+        ],
+        { %tree_args, ip_version => 6, alias_ipv6_to_ipv4 => 1 },
+    );
+
+    my @ranges = map { decode_json($_) } split /\n/,
+        _export( $tree, 'jsonl' );
+
+    is_deeply(
+        [ map { [ $_->{start}, $_->{end} ] } @ranges ],
+        [
+            [ '::2.1.0.0', '::2.1.255.255' ],
+            [ '2a02:1::',  '2a02:2:ffff:ffff:ffff:ffff:ffff:ffff' ],
+            [ 'abcd::1:0', 'abcd::1:ffff' ],
+        ],
+        'IPv6 export skips aliases and coalesces ranges'
+    );
+}
+
+{
+    my @networks = (
+        '::1.2.3.0/120',
+        '::ffff:1.2.4.0/120',
+        '::1:0:0/96',
+        '1::/64',
+        '1:0:0:1::/64',
+        '2001:db9:0:1::/64',
+        'fe80::/10',
+        '1:0:1::/48',
+    );
+    my $tree = make_tree_from_pairs(
+        'network',
+        [ map { [ $_, { value => $_ } ] } @networks ],
+        \%tree_args,
+    );
+
+    my @addresses = map { @{$_}{qw( start end )} }
+        map { decode_json($_) } split /\n/, _export( $tree, 'jsonl' );
+
+    is( scalar @addresses, 2 * @networks, 'each network is a range' );
+    for my $address (@addresses) {
+        is(
+            $address,
+            inet_ntop( AF_INET6, inet_pton( AF_INET6, $address ) ),
+            "$address is formatted the same way as inet_ntop()"
+        );
+    }
+}
+
+{
+    my %types = (
+        big    => 'uint128',
+        medium => 'uint64',
+        list   => [ 'array', 'uint128' ],
+    );
+    my $tree = make_tree_from_pairs(
+        'network',
+        [
+            [
+                '1.0.0.0/24',
+                {
+                    big    => uint128(2) << 120,
+                    medium => uint64(2)**63,
+                    list   => [ uint128(1), uint128(2)**100 ],
+                },
+            ],
+        ],
+        { %tree_args, map_key_type_callback => sub { $types{ $_[0] } } },
+    );
+
+    my $expected = '{"big":2658455991569831745807614120560689152,'
+        . '"list":[1,1267650600228229401496703205376],'
+        . '"medium":9223372036854775808}';
+    ( my $csv_expected = $expected ) =~ s/"/""/g;
+
+    like(
+        _export( $tree, 'jsonl' ),
+        qr/"data":\Q$expected\E/,
+        'uint64 and uint128 values are exported as JSON numbers'
+    );
+    like(
+        _export( $tree, 'csv' ),
+        qr/,"\Q$csv_expected\E"$/m,
+        'uint64 and uint128 values are exported as JSON numbers in CSV'
+    );
+}
+
+done_testing();
+
+sub _export {
+    my $tree = shift;
+
+    my $buffer;
+    open my $fh, '>:raw', \$buffer;
+    $tree->export_ranges( $fh, @_ ? ( format => shift ) : () );
+    close $fh;
+
+    return $buffer;
+}
@@ -0,0 +1,130 @@
+use strict;
+use warnings;
+use autodie;
+
+use lib 't/lib';
+
+use File::Temp qw( tempdir );
+use MaxMind::DB::Writer::Tree;
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( make_tree_from_pairs tree_output );
+use Test::More;
+
+my $dir = tempdir( CLEANUP => 1 );
+
+my %tree_args = (
+    ip_version            => 6,
+    alias_ipv6_to_ipv4    => 1,
+    merge_strategy        => 'recurse',
+    map_key_type_callback => sub {'utf8_string'},
+);
+
+for my $format ( 1 .. 3 ) {
+    subtest(
+        "format $format",
+        sub {
+            my $file = "$dir/format-$format.frozen";
+
+            my $tree = _changed_tree( 1 .. 10 );
+            $tree->freeze_tree(
+                $file,
+                { format => $format, journal => 1 }
+            );
+            _change_tree( $tree, 11 .. 30 );
+            $tree->sync_journal();
+
+            is(
+                tree_output( _thaw($file) ),
+                tree_output( _changed_tree( 1 .. 30 ) ),
+                'thawed tree includes the changes in the journal'
+            );
+
+            # This is what is left when a process dies part way through
+            # writing an entry.
+            open my $fh, '>>:raw', "$file.journal";
+            print {$fh} "\x01\x00\x00" or die $!;
+            close $fh;
+
+            my $continued = _thaw( $file, journal => 1 );
+            _change_tree( $continued, 31 .. 40 );
+            $continued->sync_journal();
+
+            is(
+                tree_output( _thaw($file) ),
+                tree_output( _changed_tree( 1 .. 40 ) ),
+                'a thawed tree can append to its journal'
+            );
+
+            my $journal_size = -s "$file.journal";
+            $continued->compact_journal();
+            ok(
+                -s "$file.journal" < $journal_size,
+                'compact_journal() starts a new journal'
+            );
+
+            _change_tree( $continued, 41 .. 45 );
+            $continued->sync_journal();
+
+            is(
+                tree_output( _thaw($file) ),
+                tree_output( _changed_tree( 1 .. 45 ) ),
+                'changes after compact_journal() are journaled'
+            );
+        }
+    );
+}
+
+{
+    my $file = "$dir/no-journal.frozen";
+    my $tree = _changed_tree(1);
+    $tree->freeze_tree($file);
+
+    like(
+        exception { _thaw( $file, journal => 1 ) },
+        qr/journal can only be used with a tree frozen with a journal/,
+        'journal requires a tree frozen with a journal'
+    );
+
+    like(
+        exception { $tree->sync_journal() },
+        qr/This tree does not have a journal/,
+        'sync_journal() requires a journal'
+    );
+}
+
+done_testing();
+
+sub _changed_tree {
+    my $tree = make_tree_from_pairs( 'network', [], \%tree_args );
+    _change_tree( $tree, @_ );
+    return $tree;
+}
+
+sub _change_tree {
+    my $tree = shift;
+
+    for my $i (@_) {
+        $tree->insert_network( "2.$i.0.0/16", { value => 'value ' . $i % 5 } );
+        $tree->insert_range( "3.0.$i.5", "3.0.$i.200", { range => $i } );
+        $tree->insert_network( "2.$i.0.0/24", { merged => 'yes' } )
+            if $i % 3 == 0;
+        $tree->remove_network("2.$i.128.0/17") if $i % 4 == 0;
+        $tree->insert_network(
+            "2.$i.0.0/16",
+            { value => 'replaced' },
+            { merge_strategy => 'none' },
+        ) if $i % 7 == 0;
+    }
+
+    return;
+}
+
+sub _thaw {
+    my $file = shift;
+
+    return MaxMind::DB::Writer::Tree->new_from_frozen_tree(
+        filename              => $file,
+        map_key_type_callback => sub {'utf8_string'},
+        @_,
+    );
+}
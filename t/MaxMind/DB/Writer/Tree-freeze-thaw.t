@@ -15,6 +15,7 @@ use Test::MaxMind::DB::Writer qw(
     test_freeze_thaw
     test_freeze_thaw_optional_params
 );
+use Test::Fatal;
 use Test::More;
 
 use File::Temp qw( tempdir );
@@ -25,93 +26,122 @@ use MaxMind::DB::Writer::Tree ();
 use Net::Works::Network       ();
 
 # The record size really has nothing to do with the freeze/thaw code, but it
-# doesn't really hurt to test this either.
-for my $record_size ( 24, 28, 32 ) {
-    {
-        my $tree = MaxMind::DB::Writer::Tree->new(
-            ip_version            => 4,
-            record_size           => $record_size,
-            database_type         => 'Test',
-            languages             => [ 'en', 'fr' ],
-            description           => { en => 'Test tree' },
-            merge_strategy        => 'toplevel',
-            map_key_type_callback => sub { 'uint32' },
-
-            # Below we try to insert into reserved space, which fails if we
-            # flag them as fixed empty.
-            remove_reserved_networks => 0,
-        );
-
-        my $count = 2**8;
+# doesn't really hurt to test this either. We build new trees for each freeze
+# format because test_freeze_thaw() writes out the tree it is given, and a tree
+# should only be written once.
+for my $format ( 1 .. 3 ) {
+    for my $record_size ( 24, 28, 32 ) {
+        {
+            my $tree = MaxMind::DB::Writer::Tree->new(
+                ip_version            => 4,
+                record_size           => $record_size,
+                database_type         => 'Test',
+                languages             => [ 'en', 'fr' ],
+                description           => { en => 'Test tree' },
+                merge_strategy        => 'toplevel',
+                map_key_type_callback => sub { 'uint32' },
 
-        for my $i ( 1 .. $count ) {
-            my $ipv4 = Net::Works::Network->new_from_integer(
-                integer       => $i,
-                prefix_length => 32,
-                version       => 4,
+                # Below we try to insert into reserved space, which fails if we
+                # flag them as fixed empty.
+                remove_reserved_networks => 0,
             );
-            $tree->insert_network( $ipv4, { i => $i } );
-        }
 
-        subtest(
-            "Tree with $count networks - IPv4 only - $record_size-bit records",
-            sub {
-                test_freeze_thaw($tree);
-                test_freeze_thaw_optional_params($tree);
+            my $count = 2**8;
+
+            for my $i ( 1 .. $count ) {
+                my $ipv4 = Net::Works::Network->new_from_integer(
+                    integer       => $i,
+                    prefix_length => 32,
+                    version       => 4,
+                );
+                $tree->insert_network( $ipv4, { i => $i } );
             }
-        );
-    }
 
-    {
-        my $cb = sub {
-            my $key = $_[0];
-            $key =~ s/X$//;
-            return $key eq 'array' ? [ 'array', 'uint32' ] : $key;
-        };
-
-        my $tree = MaxMind::DB::Writer::Tree->new(
-            ip_version            => 6,
-            record_size           => 24,
-            database_type         => 'Test',
-            languages             => ['en'],
-            description           => { en => 'Test tree' },
-            merge_strategy        => 'toplevel',
-            map_key_type_callback => $cb,
-
-            # Below we try to insert into reserved space, which fails if we
-            # flag them as fixed empty.
-            remove_reserved_networks => 0,
-        );
+            subtest(
+                "Tree with $count networks - IPv4 only - $record_size-bit records - format $format",
+                sub {
+                    test_freeze_thaw( $tree, { format => $format } );
+                    test_freeze_thaw_optional_params(
+                        $tree,
+                        { format => $format }
+                    );
+                }
+            );
+        }
 
-        my $count       = 2**14;
-        my $ipv6_offset = uint128(2)**34;
+        {
+            my $cb = sub {
+                my $key = $_[0];
+                $key =~ s/X$//;
+                return $key eq 'array' ? [ 'array', 'uint32' ] : $key;
+            };
 
-        for my $i ( 1 .. $count ) {
-            my $ipv4 = Net::Works::Network->new_from_integer(
-                integer       => $i,
-                prefix_length => 128,
-                version       => 6
-            );
-            $tree->insert_network( $ipv4, _data_record( $i % 16 ) );
+            my $tree = MaxMind::DB::Writer::Tree->new(
+                ip_version            => 6,
+                record_size           => 24,
+                database_type         => 'Test',
+                languages             => ['en'],
+                description           => { en => 'Test tree' },
+                merge_strategy        => 'toplevel',
+                map_key_type_callback => $cb,
 
-            my $ipv6 = Net::Works::Network->new_from_integer(
-                integer       => $i + $ipv6_offset,
-                prefix_length => 128,
-                version       => 6
+                # Below we try to insert into reserved space, which fails if we
+                # flag them as fixed empty.
+                remove_reserved_networks => 0,
             );
-            $tree->insert_network( $ipv6, _data_record( $i % 16 ) );
-        }
 
-        subtest(
-            "Tree with $count networks - mixed IPv4 and IPv6 - $record_size-bit records",
-            sub {
-                test_freeze_thaw( $tree, $cb );
+            my $count       = 2**14;
+            my $ipv6_offset = uint128(2)**34;
+
+            for my $i ( 1 .. $count ) {
+                my $ipv4 = Net::Works::Network->new_from_integer(
+                    integer       => $i,
+                    prefix_length => 128,
+                    version       => 6
+                );
+                $tree->insert_network( $ipv4, _data_record( $i % 16 ) );
+
+                my $ipv6 = Net::Works::Network->new_from_integer(
+                    integer       => $i + $ipv6_offset,
+                    prefix_length => 128,
+                    version       => 6
+                );
+                $tree->insert_network( $ipv6, _data_record( $i % 16 ) );
             }
-        );
+
+            subtest(
+                "Tree with $count networks - mixed IPv4 and IPv6 - $record_size-bit records - format $format",
+                sub {
+                    test_freeze_thaw( $tree, { format => $format } );
+                }
+            );
+        }
     }
 }
 
+# Format 1 freezes its data in batches of 1,024 records, so this tree has
+# several batches.
 {
+    my @pairs;
+    for my $i ( 0 .. 11 ) {
+        for my $j ( 0 .. 255 ) {
+            push @pairs, [ "1.$i.$j.0/24" => { i => $i * 256 + $j } ];
+        }
+    }
+
+    my $tree = make_tree_from_pairs(
+        'network',
+        \@pairs,
+        { map_key_type_callback => sub {'uint32'} },
+    );
+
+    subtest(
+        'Tree with more data records than fit in one batch - format 1',
+        sub { test_freeze_thaw($tree) }
+    );
+}
+
+for my $format ( 1 .. 3 ) {
     open my $fh, '<', 't/test-data/geolite2-sample.json' or die $!;
     my $geolite2_data = do { local $/ = undef; <$fh> };
     my $records = JSON->new->decode($geolite2_data);
@@ -127,10 +157,11 @@ for my $record_size ( 24, 28, 32 ) {
     );
 
     subtest(
-        'Tree made from GeoLite2 sample data',
+        "Tree made from GeoLite2 sample data - format $format",
         sub {
             my %trees;
-            @trees{ 'pre-thaw', 'post-thaw' } = test_freeze_thaw($tree);
+            @trees{ 'pre-thaw', 'post-thaw' }
+                = test_freeze_thaw( $tree, { format => $format } );
 
             my $dir = tempdir( CLEANUP => 1 );
 
@@ -167,7 +198,7 @@ for my $record_size ( 24, 28, 32 ) {
     );
 }
 
-{
+for my $format ( 1 .. 3 ) {
     my $tree = MaxMind::DB::Writer::Tree->new(
         ip_version            => 6,
         record_size           => 24,
@@ -189,14 +220,119 @@ for my $record_size ( 24, 28, 32 ) {
     );
 
     subtest(
-        'Tree with only one network - ::0/1',
+        "Tree with only one network - ::0/1 - format $format",
         sub {
-            test_freeze_thaw($tree);
-            test_freeze_thaw_optional_params($tree);
+            test_freeze_thaw( $tree, { format => $format } );
+            test_freeze_thaw_optional_params(
+                $tree,
+                { format => $format }
+            );
         }
     );
 }
 
+{
+    my $tree = make_tree_from_pairs(
+        'network',
+        [ map { [ "1.1.$_.0/24" => { value => $_ % 3 } ] } 0 .. 255 ],
+    );
+
+    my $dir = tempdir( CLEANUP => 1 );
+    $tree->freeze_tree( "$dir/format-$_", { format => $_ } ) for 1, 2;
+
+    cmp_ok(
+        -s "$dir/format-2", '<', ( -s "$dir/format-1" ) / 2,
+        'format 2 frozen tree is less than half the size of format 1'
+    );
+
+    like(
+        exception { $tree->freeze_tree( "$dir/format-4", { format => 4 } ) },
+        qr/Unknown freeze format: 4/,
+        'freeze_tree dies on an unknown format'
+    );
+}
+
+{
+    my @trees = map {
+        make_tree_from_pairs(
+            'network',
+            [ map { [ "1.1.$_.0/24" => { value => $_ } ] } 0 .. 255 ],
+            {
+                ip_version               => 6,
+                alias_ipv6_to_ipv4       => 1,
+                remove_reserved_networks => 1,
+            },
+        )
+    } 1 .. 2;
+
+    my $dir = tempdir( CLEANUP => 1 );
+    $trees[1]->freeze_tree( "$dir/node-dump", { format => 3 } );
+    $trees[1] = MaxMind::DB::Writer::Tree->new_from_frozen_tree(
+        filename              => "$dir/node-dump",
+        map_key_type_callback => $trees[1]->map_key_type_callback(),
+    );
+
+    my @output;
+    for my $tree (@trees) {
+        $tree->insert_network( '10.0.0.0/8',  { value => 'reserved' } );
+        $tree->insert_network( '1.1.0.0/23',  { value => 'replaced' } );
+        $tree->insert_network( '2.0.0.0/8',   { value => 'new' } );
+        $tree->remove_network('1.1.128.0/17');
+
+        like(
+            exception {
+                $tree->insert_network(
+                    '::ffff:1.2.3.0/120',
+                    { value => 'alias' }
+                );
+            },
+            qr/Attempted to insert into an aliased network/,
+            'cannot insert into an aliased network'
+        );
+
+        $tree->_set_build_epoch(1);
+        my $buffer;
+        open my $fh, '>:raw', \$buffer;
+        $tree->write_tree($fh);
+        close $fh;
+        push @output, $buffer;
+    }
+
+    ok(
+        $output[0] eq $output[1],
+        'a tree thawed from a node dump can be modified like the original'
+    );
+}
+
+{
+    my $dir = tempdir( CLEANUP => 1 );
+
+    for my $format ( 1 .. 3 ) {
+        my $tree = make_tree_from_pairs(
+            'network',
+            [
+                map { [ "1.1.$_.0/24" => { value => "record $_" } ] } 0 .. 9
+            ],
+            { map_key_type_callback => sub {'utf8_string'} },
+        );
+
+        my $file = "$dir/truncated-$format.frozen";
+        $tree->freeze_tree( $file, { format => $format } );
+        truncate $file, ( -s $file ) - 20;
+
+        like(
+            exception {
+                MaxMind::DB::Writer::Tree->new_from_frozen_tree(
+                    filename              => $file,
+                    map_key_type_callback => sub {'utf8_string'},
+                );
+            },
+            qr/corrupt file|Could not thaw tree/,
+            "thawing a truncated tree dies - format $format"
+        );
+    }
+}
+
 done_testing();
 
 sub _data_record {
@@ -0,0 +1,219 @@
+use strict;
+use warnings;
+
+use lib 't/lib';
+
+use List::Util qw( all );
+use Math::BigInt;
+use MaxMind::DB::Writer::Tree;
+use MaxMind::DB::Writer::Util qw( key_for_data );
+use Scalar::Util qw( refaddr );
+use Socket qw( AF_INET inet_ntop );
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( make_tree_from_pairs );
+use Test::More;
+
+my @ipv4_pairs
+    = map { [ "2.$_.0.0/16", { value => 'value ' . $_ % 5 } ] } 1 .. 10;
+my @ipv6_pairs = (
+    @ipv4_pairs,
+    map { [ "2a02:$_\::/32", { value => "ipv6 $_" } ] } 1 .. 10,
+);
+
+my %ipv4_args = ( map_key_type_callback => sub {'utf8_string'} );
+my %ipv6_args = ( %ipv4_args, ip_version => 6, alias_ipv6_to_ipv4 => 1 );
+
+## no critic (Modules::ProhibitMultiplePackages)
+{
+    package RecordCollector;
+
+    sub new { return bless { records => [] }, shift }
+
+    sub process_empty_record { shift->_add( 'empty', @_ ) }
+    sub process_node_record  { shift->_add( 'node',  @_ ) }
+    sub process_data_record  { shift->_add( 'data',  @_ ) }
+
+    sub _add {
+        my $self = shift;
+        my $kind = shift;
+        my ( $node_number, undef, undef, undef, $ip_num, $prefix_length,
+            $value )
+            = @_;
+
+        push @{ $self->{records} }, [
+            "$node_number", "$ip_num", $prefix_length, $kind,
+            $kind eq 'data' ? $value : undef,
+        ];
+
+        return;
+    }
+}
+
+{
+    my $tree = make_tree_from_pairs( 'network', \@ipv6_pairs, \%ipv6_args );
+
+    my $collector = RecordCollector->new();
+    $tree->iterate($collector);
+
+    my @records;
+    my @sizes;
+    $tree->iterate_batches(
+        sub {
+            my $batch = shift;
+
+            push @sizes, scalar @{ $batch->{networks} };
+            for my $i ( 0 .. $#{ $batch->{networks} } ) {
+                my $type = $batch->{types}[$i];
+                push @records, [
+                    $batch->{node_numbers}[$i],
+                    _ip_num( $batch->{networks}[$i] ),
+                    $batch->{prefix_lengths}[$i],
+                    _kind($type),
+                    $batch->{data}[$i],
+                ];
+            }
+        },
+        { batch_size => 7 },
+    );
+
+    is_deeply(
+        \@records,
+        $collector->{records},
+        'iterate_batches() sees the same records in the same order as iterate()'
+    );
+
+    ok(
+        ( all { $_ == 7 } @sizes[ 0 .. $#sizes - 1 ] ) && $sizes[-1] <= 7,
+        'each batch is full except for the last one'
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs( 'network', \@ipv6_pairs, \%ipv6_args );
+
+    my @networks;
+    my @keys;
+    my %data_for_key;
+    my $refs_shared = 1;
+    $tree->iterate_batches(
+        sub {
+            my $batch = shift;
+
+            for my $i ( 0 .. $#{ $batch->{networks} } ) {
+                is(
+                    $batch->{types}[$i], 'data',
+                    'only data records are included'
+                ) or next;
+
+                my $ip_num = _ip_num( $batch->{networks}[$i] );
+                my $prefix_length = $batch->{prefix_lengths}[$i];
+                next unless $ip_num < 2**32 && $prefix_length >= 96;
+
+                push @networks,
+                    inet_ntop( AF_INET, substr( $batch->{networks}[$i], 12 ) )
+                    . '/'
+                    . ( $prefix_length - 96 );
+
+                my $key  = $batch->{keys}[$i];
+                my $data = $batch->{data}[$i];
+                push @keys, $key;
+                is( $key, key_for_data($data), "key for $networks[-1]" );
+
+                $data_for_key{$key} //= $data;
+                $refs_shared = 0
+                    unless refaddr $data_for_key{$key} == refaddr $data;
+            }
+        },
+        { types => ['data'] },
+    );
+
+    is_deeply(
+        \@networks,
+        [ map { "2.$_.0.0/16" } 1 .. 10 ],
+        'IPv4 data networks in order'
+    );
+    is(
+        scalar keys %data_for_key, 5,
+        'networks with the same data have the same key'
+    );
+    ok(
+        $refs_shared,
+        'records with the same key refer to the same data structure'
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs( 'network', \@ipv4_pairs, \%ipv4_args );
+
+    my @networks;
+    my $empty_count = 0;
+    $tree->iterate_batches(
+        sub {
+            my $batch = shift;
+
+            for my $i ( 0 .. $#{ $batch->{networks} } ) {
+                is(
+                    length $batch->{networks}[$i], 4,
+                    'IPv4 networks are packed as 4 bytes'
+                );
+                if ( $batch->{types}[$i] eq 'data' ) {
+                    push @networks,
+                        inet_ntop( AF_INET, $batch->{networks}[$i] ) . '/'
+                        . $batch->{prefix_lengths}[$i];
+                }
+                else {
+                    $empty_count++;
+                }
+            }
+        },
+        { types => [ 'data', 'empty' ], batch_size => 1 },
+    );
+
+    is_deeply(
+        \@networks,
+        [ map { "2.$_.0.0/16" } 1 .. 10 ],
+        'data networks in an IPv4 tree'
+    );
+    ok( $empty_count, 'empty records are included when asked for' );
+}
+
+{
+    my $tree = make_tree_from_pairs( 'network', \@ipv4_pairs, \%ipv4_args );
+
+    like(
+        exception { $tree->iterate_batches( sub { }, { types => ['bogus'] } ) },
+        qr/Unknown record type: bogus/,
+        'unknown record types are rejected'
+    );
+    like(
+        exception { $tree->iterate_batches('not code') },
+        qr/iterate_batches\(\) requires a callback/,
+        'the callback must be a code reference'
+    );
+    like(
+        exception { $tree->iterate_batches( sub { }, { batch_size => 0 } ) },
+        qr/batch_size must be a positive integer/,
+        'batch_size must be positive'
+    );
+    like(
+        exception {
+            $tree->iterate_batches( sub { die "stop\n" } );
+        },
+        qr/^stop$/,
+        'exceptions from the callback are propagated'
+    );
+}
+
+done_testing();
+
+sub _ip_num {
+    return Math::BigInt->from_hex( unpack 'H*', shift )->bstr();
+}
+
+sub _kind {
+    my $type = shift;
+
+    return 'empty' if $type eq 'empty' || $type eq 'fixed_empty';
+    return 'data' if $type eq 'data';
+    return 'node';
+}
@@ -0,0 +1,189 @@
+use strict;
+use warnings;
+
+use lib 't/lib';
+
+use Math::BigInt;
+use MaxMind::DB::Writer::Tree;
+use Socket qw( AF_INET6 inet_pton );
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( make_tree_from_pairs );
+use Test::More;
+
+my @pairs = map {
+    (
+        [ "2.$_.0.0/16"   => { value => 'value ' . $_ % 5 } ],
+        [ "2a02:$_\::/32" => { value => "ipv6 $_" } ],
+    )
+} 1 .. 10;
+
+my %tree_args = (
+    ip_version            => 6,
+    alias_ipv6_to_ipv4    => 1,
+    map_key_type_callback => sub {'utf8_string'},
+);
+
+## no critic (Modules::ProhibitMultiplePackages)
+{
+    package RecordCollector;
+
+    sub new { return bless { records => [] }, shift }
+
+    sub process_empty_record { shift->_add( 'empty', @_ ) }
+    sub process_node_record  { shift->_add( 'node',  @_ ) }
+    sub process_data_record  { shift->_add( 'data',  @_ ) }
+
+    sub _add {
+        my $self = shift;
+        my $kind = shift;
+
+        push @{ $self->{records} },
+            [ $kind, map { ref $_ eq 'HASH' ? $_ : "$_" } @_ ];
+
+        return;
+    }
+}
+
+{
+    my $tree = make_tree_from_pairs( 'network', \@pairs, \%tree_args );
+
+    my $collector = RecordCollector->new();
+    $tree->iterate($collector);
+    my @all = @{ $collector->{records} };
+
+    for my $network (
+        '::2.0.0.0/104', '::2.3.0.0/112', '::2.3.0.0/113', '2a02::/16',
+        '::/0'
+    ) {
+        my $collector = RecordCollector->new();
+        $tree->iterate_network( $network, $collector );
+
+        is_deeply(
+            $collector->{records},
+            [ grep { _is_within( $_, $network ) } @all ],
+            "iterate_network($network) visits the same records as iterate()"
+        );
+    }
+
+    my $collector_in_record = RecordCollector->new();
+    $tree->iterate_network( '2.3.4.0/24', $collector_in_record );
+    is_deeply(
+        $collector_in_record->{records}, [],
+        'a network inside a larger record has no records to visit'
+    );
+
+    my $ipv4_collector = RecordCollector->new();
+    $tree->iterate_network( '2.3.0.0/16', $ipv4_collector );
+    is_deeply(
+        [ map { [ @{$_}[ 0, 5, 6, 7 ] ] } @{ $ipv4_collector->{records} } ],
+        [
+            [
+                'data', _ip_num('::2.3.0.0'), 112,
+                { value => 'value 3' }
+            ]
+        ],
+        'an IPv4 network in an IPv6 tree'
+    );
+
+    my $alias_collector = RecordCollector->new();
+    $tree->iterate_network( '::ffff:2.0.0.0/104', $alias_collector );
+    my @data = grep { $_->[0] eq 'data' } @{ $alias_collector->{records} };
+    is_deeply(
+        [ map { [ $_->[5], $_->[6] ] } @data ],
+        [ map { [ _ip_num("::ffff:2.$_.0.0"), 112 ] } 1 .. 10 ],
+        'networks reached through an alias have absolute network numbers'
+    );
+
+    like(
+        exception { $tree->iterate_network( '2.0.0.0/8', [] ) },
+        qr/\QThe argument passed to iterate_network (ARRAY(\E/,
+        'iterate_network() requires an object or class'
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs( 'network', \@pairs, \%tree_args );
+
+    is_deeply(
+        [ $tree->networks_within('2.0.0.0/8') ],
+        [
+            map { [ "::2.$_.0.0/112", { value => 'value ' . $_ % 5 } ] }
+                1 .. 10
+        ],
+        'networks_within() for an IPv4 network'
+    );
+    is_deeply(
+        [ $tree->networks_within('::ffff:2.0.0.0/104') ],
+        [
+            map { [ "::ffff:2.$_.0.0/112", { value => 'value ' . $_ % 5 } ] }
+                1 .. 10
+        ],
+        'networks_within() through an alias'
+    );
+    is_deeply(
+        [ $tree->networks_within('2a02::/16') ],
+        [ map { [ "2a02:$_\::/32", { value => "ipv6 $_" } ] } 1 .. 10 ],
+        'networks_within() for an IPv6 network'
+    );
+    is_deeply(
+        [ $tree->networks_within('2.3.4.0/24') ],
+        [ [ '::2.3.4.0/120', { value => 'value 3' } ] ],
+        'a network inside a larger record is returned with its data'
+    );
+    is_deeply(
+        [ $tree->networks_within('3.0.0.0/8') ],
+        [],
+        'no networks in an empty network'
+    );
+    is(
+        scalar( () = $tree->networks_within('::/0') ), 20,
+        'networks_within(::/0) returns every network once'
+    );
+
+    like(
+        exception { $tree->networks_within('2.0.0.0') },
+        qr/Invalid network: 2\.0\.0\.0/,
+        'networks_within() requires a prefix length'
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs(
+        'network',
+        [
+            [ '1.1.1.0/24', { value => 'foo' } ],
+            [ '1.1.2.0/24', { value => 'bar' } ],
+        ],
+        { map_key_type_callback => sub {'utf8_string'} },
+    );
+
+    is_deeply(
+        [ $tree->networks_within('1.1.0.0/16') ],
+        [
+            [ '1.1.1.0/24', { value => 'foo' } ],
+            [ '1.1.2.0/24', { value => 'bar' } ],
+        ],
+        'networks_within() in an IPv4 tree'
+    );
+}
+
+done_testing();
+
+sub _ip_num {
+    return Math::BigInt->from_hex( unpack 'H*', inet_pton( AF_INET6, shift ) )
+        ->bstr();
+}
+
+# The record's network is the sixth argument passed to the collector, and its
+# prefix length is the seventh.
+sub _is_within {
+    my $record  = shift;
+    my $network = shift;
+
+    my ( $address, $prefix_length ) = split qr{/}, $network;
+    return 0 if $record->[6] < $prefix_length;
+
+    my $shift = 128 - $prefix_length;
+    return Math::BigInt->new( $record->[5] )->brsft($shift)
+        == Math::BigInt->new( _ip_num($address) )->brsft($shift);
+}
@@ -0,0 +1,223 @@
+use strict;
+use warnings;
+use autodie;
+
+use lib 't/lib';
+
+use MaxMind::DB::Writer::Tree;
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( make_tree_from_pairs tree_output );
+use Test::More;
+
+my %tree_args = (
+    ip_version            => 6,
+    alias_ipv6_to_ipv4    => 1,
+    merge_strategy        => 'recurse',
+    map_key_type_callback => sub {'utf8_string'},
+);
+
+my @target_pairs = map {
+    (
+        [ "2.$_.0.0/16"   => { value => 'value ' . $_ % 5 } ],
+        [ "2a02:$_\::/32" => { value => "ipv6 $_" } ],
+    )
+} 1 .. 20;
+
+my @other_pairs = (
+    ( map { [ "2.$_.128.0/17" => { other => 'other ' . $_ % 3 } ] } 10 .. 30 ),
+    ( map { [ "3.$_.0.0/16"   => { value => "graft $_" } ] } 1 .. 20 ),
+    ( map { [ "2a02:$_\::/33" => { other => "ipv6 $_" } ] } 15 .. 25 ),
+    [ '4.0.0.0/8'     => { value => 'value 1' } ],
+    [ '2.1.0.0/24'    => { value => 'value 1' } ],
+    [ '2600::/16'     => { value => 'big' } ],
+    [ '2a02:1:1::/48' => { value => 'value 2' } ],
+);
+
+for my $strategy (qw( recurse toplevel none add-only-if-parent-exists )) {
+    subtest(
+        "merge with $strategy",
+        sub {
+            my $tree = make_tree_from_pairs(
+                'network', \@target_pairs,
+                \%tree_args
+            );
+            my $other = make_tree_from_pairs(
+                'network', \@other_pairs,
+                \%tree_args
+            );
+
+            $tree->merge_tree( $other, { merge_strategy => $strategy } );
+
+            my $expected = make_tree_from_pairs(
+                'network', \@target_pairs,
+                \%tree_args
+            );
+            $expected->insert_network(
+                @{$_},
+                { merge_strategy => $strategy }
+            ) for @other_pairs;
+
+            is(
+                tree_output($other),
+                tree_output(
+                    make_tree_from_pairs(
+                        'network', \@other_pairs,
+                        \%tree_args
+                    )
+                ),
+                'other tree is not changed by the merge'
+            );
+            undef $other;
+
+            is(
+                tree_output($tree),
+                tree_output($expected),
+                'merged tree matches inserting each network of the other tree'
+            );
+        }
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs( 'network', \@target_pairs, \%tree_args );
+    my $other = make_tree_from_pairs(
+        'network',
+        \@other_pairs,
+        { %tree_args, merge_strategy => 'toplevel' },
+    );
+
+    $tree->merge_tree($other);
+
+    is_deeply(
+        $tree->lookup_ip_address('::ffff:2.12.128.1'),
+        { value => 'value 2', other => 'other 0' },
+        'merge uses the merge strategy of the tree being merged into'
+    );
+    is_deeply(
+        $tree->lookup_ip_address('3.4.0.1'),
+        { value => 'graft 4' },
+        'lookup in a subtree copied from the other tree'
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs( 'network', \@target_pairs, \%tree_args );
+    my $snapshot = $tree->snapshot();
+
+    $tree->insert_network( @{$_} ) for @other_pairs;
+    $snapshot->merge_tree($tree);
+
+    my $expected
+        = make_tree_from_pairs( 'network', \@target_pairs, \%tree_args );
+    $expected->insert_network( @{$_} ) for @other_pairs;
+
+    undef $tree;
+
+    is(
+        tree_output($snapshot),
+        tree_output($expected),
+        'merging a tree into its snapshot'
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs( 'network', \@target_pairs, \%tree_args );
+    $tree->merge_tree($tree);
+
+    is(
+        tree_output($tree),
+        tree_output(
+            make_tree_from_pairs( 'network', \@target_pairs, \%tree_args )
+        ),
+        'merging a tree into itself does not change it'
+    );
+}
+
+{
+    # This IPv6 tree has data in the networks that the trees above alias to
+    # the IPv4 subtree.
+    my %unaliased_args = (
+        ip_version               => 6,
+        remove_reserved_networks => 0,
+        map_key_type_callback    => sub {'utf8_string'},
+    );
+
+    for my $test (
+        [
+            '::ffff:2.1.0.0/112',
+            qr/Attempted to insert into an aliased network/,
+            'inside'
+        ],
+        [
+            '::ffff:0:0/96',
+            qr/Attempted to overwrite an aliased network/,
+            'at'
+        ],
+        ) {
+        my ( $network, $error, $where ) = @{$test};
+
+        my $other = make_tree_from_pairs(
+            'network',
+            [ [ $network => { value => 'other' } ], @other_pairs ],
+            \%unaliased_args,
+        );
+
+        like(
+            exception {
+                make_tree_from_pairs( 'network', [], \%tree_args )
+                    ->insert_network( $network, {} )
+            },
+            $error,
+            "inserting data $where an aliased network dies"
+        );
+        like(
+            exception {
+                make_tree_from_pairs(
+                    'network', \@target_pairs,
+                    \%tree_args
+                )->merge_tree( $other, {} )
+            },
+            $error,
+            "merging a tree with data $where an aliased network dies"
+        );
+    }
+
+    my $other = make_tree_from_pairs(
+        'network',
+        [ [ '::/64' => { value => 'covers alias' } ] ],
+        \%unaliased_args,
+    );
+    my $tree = make_tree_from_pairs( 'network', \@target_pairs, \%tree_args );
+    $tree->merge_tree($other);
+
+    my $expected
+        = make_tree_from_pairs( 'network', \@target_pairs, \%tree_args );
+    $expected->insert_network( '::/64' => { value => 'covers alias' } );
+
+    is(
+        tree_output($tree),
+        tree_output($expected),
+        'merging a network that contains an aliased network skips the alias'
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs( 'network', [], \%tree_args );
+    my $ipv4 = make_tree_from_pairs(
+        'network', [],
+        { map_key_type_callback => sub {'utf8_string'} }
+    );
+
+    like(
+        exception { $tree->merge_tree($ipv4) },
+        qr/You cannot merge an IPv4 tree into an IPv6 tree/,
+        'trees must have the same IP version'
+    );
+    like(
+        exception { $tree->merge_tree( {} ) },
+        qr/merge_tree\(\) requires a MaxMind::DB::Writer::Tree/,
+        'merge_tree requires a tree'
+    );
+}
+
+done_testing();
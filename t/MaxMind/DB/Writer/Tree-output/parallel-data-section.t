@@ -0,0 +1,122 @@
+use strict;
+use warnings;
+use autodie;
+
+use lib 't/lib';
+
+use Test::Requires {
+    'MaxMind::DB::Reader' => 0.040000,
+};
+
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( make_tree_from_pairs );
+use Test::More;
+
+use File::Temp qw( tempdir );
+use MaxMind::DB::Reader;
+
+my %types = (
+    array  => [ 'array', 'utf8_string' ],
+    int    => 'uint32',
+    map    => 'map',
+    string => 'utf8_string',
+);
+my $type_cb = sub { $types{ $_[0] } };
+
+# Each record shares some of its sub-values with records that will end up in
+# other workers' batches, so the pointers to them have to be relocated.
+my @pairs = map {
+    [
+        "1.1.$_.0/24" => {
+            string => 'shared string value',
+            int    => $_,
+            map    => { string => 'shared map ' . ( $_ % 5 ) },
+            array  => [ 'shared array', 'item ' . ( $_ % 3 ) ],
+        },
+    ]
+} 0 .. 99;
+
+my $tree = make_tree_from_pairs(
+    'network',
+    \@pairs,
+    { map_key_type_callback => $type_cb },
+);
+$tree->_set_build_epoch( time() );
+
+my $dir = tempdir( CLEANUP => 1 );
+
+my %readers;
+for my $workers ( 1, 3, 7 ) {
+    my $file = "$dir/workers-$workers.mmdb";
+    open my $fh, '>:raw', $file;
+    $tree->write_tree( $fh, { data_section_workers => $workers } );
+    close $fh;
+
+    $readers{$workers} = MaxMind::DB::Reader->new( file => $file );
+}
+
+for my $workers ( 3, 7 ) {
+    my $ok = 1;
+    for my $i ( 0 .. 99 ) {
+        my $ip = "1.1.$i.1";
+        $ok &&= is_deeply(
+            $readers{$workers}->record_for_address($ip),
+            $readers{1}->record_for_address($ip),
+            "record for $ip matches sequential output - $workers workers"
+        );
+    }
+    ok( $ok, "all records match with $workers workers" );
+}
+
+{
+    my @output;
+    for ( 1 .. 2 ) {
+        my $buffer;
+        open my $fh, '>:raw', \$buffer;
+        $tree->write_tree( $fh, { data_section_workers => 3 } );
+        close $fh;
+        push @output, $buffer;
+    }
+
+    ok(
+        $output[0] eq $output[1],
+        'parallel data section output is deterministic'
+    );
+
+    for my $shared ( 'shared string value', 'shared map 3' ) {
+        is(
+            scalar( () = $output[0] =~ /\Q$shared/g ), 1,
+            "data shared between batches is stored once - $shared"
+        );
+    }
+}
+
+like(
+    exception {
+        my $buffer;
+        open my $fh, '>:raw', \$buffer;
+        $tree->write_tree( $fh, { data_section_workers => 0 } );
+    },
+    qr/data_section_workers must be a positive integer/,
+    'data_section_workers must be positive'
+);
+
+{
+    my $bad_tree = make_tree_from_pairs(
+        'network',
+        [ [ '1.1.1.0/24' => { foo => 'bar' } ] ],
+        { map_key_type_callback => sub { } },
+    );
+
+    like(
+        exception {
+            my $buffer;
+            open my $fh, '>:raw', \$buffer;
+            $bad_tree->write_tree( $fh, { data_section_workers => 2 } );
+        },
+        qr/Data section worker 0 failed: Could not determine the type for map key "foo"/,
+        'errors in a worker are reported by the parent'
+    );
+}
+
+done_testing();
@@ -0,0 +1,134 @@
+use strict;
+use warnings;
+use autodie;
+
+use lib 't/lib';
+
+use MaxMind::DB::Writer::Tree;
+use MaxMind::DB::Writer::Util qw( key_for_data );
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( make_tree_from_pairs tree_output );
+use Test::More;
+
+my %data = map { $_ => { value => $_, deprecated => $_ eq 'old' } }
+    qw( old new other );
+my %key = map { $_ => key_for_data( $data{$_} ) } keys %data;
+
+my @pairs = map {
+    [ "1.$_.0.0/16", $data{ (qw( old new other ))[ $_ % 3 ] } ]
+} 0 .. 29;
+
+my %tree_args = (
+    map_key_type_callback => sub {
+        $_[0] eq 'deprecated' ? 'boolean' : 'utf8_string';
+    },
+);
+
+{
+    my $tree     = make_tree_from_pairs( 'network', \@pairs, \%tree_args );
+    my $snapshot = $tree->snapshot();
+
+    my %calls;
+    is(
+        $tree->remove_where(
+            sub {
+                my $data = shift;
+                my $key  = shift;
+                $calls{$key}++;
+                return $data->{deprecated};
+            }
+        ),
+        10,
+        'remove_where() returns the number of networks removed'
+    );
+    is_deeply(
+        \%calls,
+        { map { $key{$_} => 1 } keys %data },
+        'the predicate is called once per data key'
+    );
+
+    is(
+        $tree->lookup_ip_address('1.0.0.1'), undef,
+        'a removed network is not in the tree'
+    );
+    is_deeply(
+        $tree->lookup_ip_address('1.1.0.1'), $data{new},
+        'other networks are still in the tree'
+    );
+
+    my $expected = make_tree_from_pairs(
+        'network',
+        [ grep { $_->[1]{value} ne 'old' } @pairs ],
+        \%tree_args,
+    );
+    is(
+        tree_output($tree), tree_output($expected),
+        'the tree is pruned the same way as a tree without the networks'
+    );
+
+    is(
+        scalar( () = $snapshot->networks_for_data_key( $key{old} ) ), 10,
+        'a snapshot is not changed'
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs( 'network', \@pairs, \%tree_args );
+    is(
+        $tree->remove_data_keys( $key{old}, $key{other}, 'no such key' ), 20,
+        'remove_data_keys() returns the number of networks removed'
+    );
+    is(
+        tree_output($tree),
+        tree_output(
+            make_tree_from_pairs(
+                'network',
+                [ grep { $_->[1]{value} eq 'new' } @pairs ],
+                \%tree_args,
+            )
+        ),
+        'networks with the given keys are removed'
+    );
+    is( $tree->remove_data_keys( $key{old} ), 0, 'nothing left to remove' );
+}
+
+{
+    my $tree = make_tree_from_pairs(
+        'network',
+        [ @pairs, [ '2a02:1::/32', $data{old} ] ],
+        { %tree_args, ip_version => 6, alias_ipv6_to_ipv4 => 1 },
+    );
+
+    is( $tree->remove_data_keys( $key{old} ), 11, 'IPv6 tree' );
+    is(
+        $tree->lookup_ip_address('::ffff:1.0.0.1'), undef,
+        'networks removed from the IPv4 subtree are not seen through an alias'
+    );
+    is_deeply(
+        $tree->lookup_ip_address('::ffff:1.1.0.1'), $data{new},
+        'other networks are still seen through an alias'
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs( 'network', \@pairs, \%tree_args );
+    like(
+        exception {
+            $tree->remove_where( sub { die "predicate died\n" } )
+        },
+        qr/^predicate died$/,
+        'an exception from the predicate is rethrown'
+    );
+    is_deeply(
+        $tree->lookup_ip_address('1.0.0.1'), $data{old},
+        'nothing is removed when the predicate dies on the first key'
+    );
+
+    like(
+        exception { $tree->remove_where( { value => 'old' } ) },
+        qr/remove_where\(\) requires a callback/,
+        'remove_where() requires a callback'
+    );
+}
+
+done_testing();
@@ -0,0 +1,125 @@
+use strict;
+use warnings;
+use autodie;
+
+use lib 't/lib';
+
+use File::Temp qw( tempdir );
+use MaxMind::DB::Writer::Tree;
+use MaxMind::DB::Writer::Util qw( key_for_data );
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( make_tree_from_pairs tree_output );
+use Test::More;
+
+my %data = (
+    a => { value => 'a' },
+    b => { value => 'b' },
+    c => { value => 'c' },
+);
+my %key = map { $_ => key_for_data( $data{$_} ) } keys %data;
+
+my %tree_args = ( map_key_type_callback => sub {'utf8_string'} );
+
+{
+    my $tree = make_tree_from_pairs(
+        'network',
+        [
+            [ '1.0.0.0/24', $data{a} ],
+            [ '1.0.1.0/24', $data{b} ],
+            [ '1.0.2.0/24', $data{a} ],
+            [ '2.0.0.0/8',  $data{c} ],
+        ],
+        \%tree_args,
+    );
+
+    my $snapshot = $tree->snapshot();
+
+    is(
+        $tree->replace_data( $key{a}, $data{b} ), 2,
+        'replace_data() returns the number of networks changed'
+    );
+
+    is_deeply(
+        $tree->lookup_ip_address('1.0.0.1'), $data{b},
+        'the network has the new data'
+    );
+    is_deeply(
+        [ $tree->networks_for_data_key( $key{b} ) ],
+        [ '1.0.0.0/23', '1.0.2.0/24' ],
+        'networks that now have the same data are merged'
+    );
+    is_deeply(
+        [ $tree->networks_for_data_key( $key{a} ) ],
+        [],
+        'no networks have the old data'
+    );
+
+    my $expected = make_tree_from_pairs(
+        'network',
+        [
+            [ '1.0.0.0/23', $data{b} ],
+            [ '1.0.2.0/24', $data{b} ],
+            [ '2.0.0.0/8',  $data{c} ],
+        ],
+        \%tree_args,
+    );
+    is(
+        tree_output($tree), tree_output($expected),
+        'the tree is written the same way as a tree built with the new data'
+    );
+
+    is_deeply(
+        [ $snapshot->networks_for_data_key( $key{a} ) ],
+        [ '1.0.0.0/24', '1.0.2.0/24' ],
+        'a snapshot is not changed'
+    );
+
+    is(
+        $tree->replace_data( $key{a}, $data{c} ), 0,
+        'replacing data that is not in the tree changes nothing'
+    );
+    is(
+        $tree->replace_data( $key{c}, $data{c} ), 0,
+        'replacing data with the same data changes nothing'
+    );
+    is(
+        $tree->replace_data( $key{c}, $data{a} ), 1,
+        'replacing data with new data'
+    );
+    is_deeply(
+        $tree->lookup_ip_address('2.1.2.3'), $data{a},
+        'the network has data that was not in the tree before'
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs(
+        'network',
+        [ [ '1.0.0.0/24', $data{a} ], [ '2a02:1::/32', $data{a} ] ],
+        { %tree_args, ip_version => 6, alias_ipv6_to_ipv4 => 1 },
+    );
+
+    is( $tree->replace_data( $key{a}, $data{b} ), 2, 'IPv6 tree' );
+    is_deeply(
+        $tree->lookup_ip_address('::ffff:1.0.0.1'), $data{b},
+        'the new data is seen through an alias'
+    );
+}
+
+{
+    my $dir  = tempdir( CLEANUP => 1 );
+    my $tree = make_tree_from_pairs(
+        'network',
+        [ [ '1.0.0.0/24', $data{a} ] ],
+        \%tree_args,
+    );
+    $tree->freeze_tree( "$dir/tree.frozen", { journal => 1 } );
+
+    like(
+        exception { $tree->replace_data( $key{a}, $data{b} ) },
+        qr/You cannot replace data in a tree that has a journal/,
+        'replace_data() cannot be used with a journal'
+    );
+}
+
+done_testing();
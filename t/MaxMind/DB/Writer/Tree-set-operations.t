@@ -0,0 +1,222 @@
+use strict;
+use warnings;
+use autodie;
+
+use lib 't/lib';
+
+use MaxMind::DB::Writer::Tree;
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( make_tree_from_pairs tree_output );
+use Test::More;
+
+my %tree_args = (
+    ip_version            => 6,
+    alias_ipv6_to_ipv4    => 1,
+    merge_strategy        => 'recurse',
+    map_key_type_callback => sub {'utf8_string'},
+);
+
+my @tree_pairs = (
+    (
+        map {
+            (
+                [ "2.$_.0.0/16"   => { value => 'value ' . $_ % 5 } ],
+                [ "2a02:$_\::/32" => { value => "ipv6 $_" } ],
+            )
+        } 1 .. 20
+    ),
+    [ '2600::/12' => { value => 'big' } ],
+);
+
+my @other_pairs = (
+    ( map { [ "2.$_.128.0/17" => { other => 'other ' . $_ % 3 } ] } 10 .. 30 ),
+    ( map { [ "2a02:$_\::/33" => { other => "ipv6 $_" } ] } 15 .. 25 ),
+    [ '2.1.0.0/24'  => { value => 'value 1' } ],
+    [ '2.2.0.0/15'  => { value => 'value 2' } ],
+    [ '2600::/16'   => { value => 'big' } ],
+    [ '4.0.0.0/8'   => { value => 'value 4' } ],
+    [ '2a02:1::/48' => { value => 'value 1' } ],
+);
+
+my @addresses = (
+    ( map { ( "2.$_.0.1", "2.$_.128.1", "2a02:$_\::1", "2a02:$_:8000::1" ) }
+            0 .. 31 ),
+    qw( 2.1.1.1 4.1.1.1 2600::1 2601::1 2a02:1:1::1 ),
+    map {"::ffff:2.$_.128.1"} 1 .. 20,
+);
+
+subtest(
+    'subtract_tree',
+    sub {
+        my $tree
+            = make_tree_from_pairs( 'network', \@tree_pairs, \%tree_args );
+        my $other
+            = make_tree_from_pairs( 'network', \@other_pairs, \%tree_args );
+
+        $tree->subtract_tree($other);
+
+        my $expected
+            = make_tree_from_pairs( 'network', \@tree_pairs, \%tree_args );
+        $expected->remove_network( $_->[0] ) for @other_pairs;
+
+        _check_lookups( $tree, $other, 0 );
+
+        is(
+            tree_output($other),
+            tree_output(
+                make_tree_from_pairs( 'network', \@other_pairs, \%tree_args )
+            ),
+            'other tree is not changed'
+        );
+        is(
+            tree_output($tree),
+            tree_output($expected),
+            'matches removing each network in the other tree'
+        );
+    }
+);
+
+subtest(
+    'intersect_tree',
+    sub {
+        my $tree
+            = make_tree_from_pairs( 'network', \@tree_pairs, \%tree_args );
+        my $other
+            = make_tree_from_pairs( 'network', \@other_pairs, \%tree_args );
+
+        $tree->intersect_tree($other);
+
+        _check_lookups( $tree, $other, 1 );
+    }
+);
+
+subtest(
+    'networks covered through an alias in the other tree',
+    sub {
+        my @pairs = map { [ "::ffff:2.$_.0.0/112" => { value => $_ } ] }
+            1 .. 20;
+
+        my %unaliased_args = ( %tree_args, alias_ipv6_to_ipv4 => 0 );
+        my $other
+            = make_tree_from_pairs( 'network', \@other_pairs, \%tree_args );
+
+        my $tree
+            = make_tree_from_pairs( 'network', \@pairs, \%unaliased_args );
+        $tree->subtract_tree($other);
+        is_deeply(
+            $tree->lookup_ip_address('::ffff:2.15.0.1'),
+            { value => 15 },
+            'network not covered by the alias is kept by subtract_tree'
+        );
+        is(
+            $tree->lookup_ip_address('::ffff:2.15.128.1'),
+            undef,
+            'network covered by the alias is removed by subtract_tree'
+        );
+
+        $tree = make_tree_from_pairs( 'network', \@pairs, \%unaliased_args );
+        $tree->intersect_tree($other);
+        is(
+            $tree->lookup_ip_address('::ffff:2.15.0.1'),
+            undef,
+            'network not covered by the alias is removed by intersect_tree'
+        );
+        is_deeply(
+            $tree->lookup_ip_address('::ffff:2.15.128.1'),
+            { value => 15 },
+            'network covered by the alias is kept by intersect_tree'
+        );
+    }
+);
+
+subtest(
+    'aliases and reserved networks are kept',
+    sub {
+        my $other = make_tree_from_pairs(
+            'network',
+            [ [ '::/0' => { value => 'everything' } ] ],
+            {
+                %tree_args,
+                alias_ipv6_to_ipv4       => 0,
+                remove_reserved_networks => 0,
+            },
+        );
+
+        my $tree
+            = make_tree_from_pairs( 'network', \@tree_pairs, \%tree_args );
+        $tree->subtract_tree($other);
+        is(
+            tree_output($tree),
+            tree_output( make_tree_from_pairs( 'network', [], \%tree_args ) ),
+            'subtracting a tree covering everything leaves an empty tree'
+        );
+
+        $tree = make_tree_from_pairs( 'network', \@tree_pairs, \%tree_args );
+        $tree->intersect_tree($other);
+        is(
+            tree_output($tree),
+            tree_output(
+                make_tree_from_pairs( 'network', \@tree_pairs, \%tree_args )
+            ),
+            'intersecting with a tree covering everything changes nothing'
+        );
+    }
+);
+
+subtest(
+    'trees sharing nodes',
+    sub {
+        my $tree
+            = make_tree_from_pairs( 'network', \@tree_pairs, \%tree_args );
+        my $snapshot = $tree->snapshot();
+        $tree->insert_network( @{$_} ) for @other_pairs;
+
+        my $copy = $tree->snapshot();
+        $copy->subtract_tree($snapshot);
+        _check_lookups( $copy, $snapshot, 0, $tree );
+
+        $copy = $tree->snapshot();
+        $copy->intersect_tree($snapshot);
+        _check_lookups( $copy, $snapshot, 1, $tree );
+    }
+);
+
+{
+    my $tree = make_tree_from_pairs( 'network', [], \%tree_args );
+    my $ipv4 = make_tree_from_pairs(
+        'network', [],
+        { map_key_type_callback => sub {'utf8_string'} }
+    );
+
+    like(
+        exception { $tree->subtract_tree($ipv4) },
+        qr/You cannot subtract trees with different IP versions/,
+        'trees must have the same IP version'
+    );
+    like(
+        exception { $tree->intersect_tree('foo') },
+        qr/intersect_tree\(\) requires a MaxMind::DB::Writer::Tree/,
+        'intersect_tree requires a tree'
+    );
+}
+
+done_testing();
+
+sub _check_lookups {
+    my $tree         = shift;
+    my $other        = shift;
+    my $keep_covered = shift;
+    my $original     = shift
+        // make_tree_from_pairs( 'network', \@tree_pairs, \%tree_args );
+
+    for my $address (@addresses) {
+        my $covered = defined $other->lookup_ip_address($address);
+        is_deeply(
+            $tree->lookup_ip_address($address),
+            ( $covered xor $keep_covered )
+            ? undef
+            : $original->lookup_ip_address($address),
+            "lookup of $address"
+        );
+    }
+}
@@ -0,0 +1,194 @@
+use strict;
+use warnings;
+use autodie;
+
+use lib 't/lib';
+
+use File::Temp qw( tempdir );
+use MaxMind::DB::Writer::Tree;
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( make_tree_from_pairs tree_output );
+use Test::More;
+
+my $dir = tempdir( CLEANUP => 1 );
+
+my %tree_args = (
+    ip_version            => 6,
+    alias_ipv6_to_ipv4    => 1,
+    merge_strategy        => 'recurse',
+    map_key_type_callback => sub {'utf8_string'},
+);
+
+my %shard_pairs = (
+    '::/4' => [
+        map {
+            (
+                [ "1.$_.0.0/16" => { value => 'value ' . $_ % 5 } ],
+                [ "2.$_.0.0/16" => { value => "ipv4 $_" } ],
+            )
+        } 1 .. 20
+    ],
+    '2000::/4' => [
+        ( map { [ "2a02:$_\::/32" => { value => 'value ' . $_ % 5 } ] } 1 .. 20 ),
+        [ '2600::/12' => { value => 'big' } ],
+        [ '2000::/16' => { value => 'first' } ],
+    ],
+    '4000::/3' => [
+        [ '4000::/16' => { value => 'value 1' } ],
+        [ '5fff::/16' => { value => 'last' } ],
+    ],
+);
+
+{
+    my @files;
+    for my $shard ( sort keys %shard_pairs ) {
+        my $tree = make_tree_from_pairs(
+            'network',
+            $shard_pairs{$shard},
+            { %tree_args, shard => $shard },
+        );
+        is( $tree->shard(), $shard, "shard() for $shard" );
+
+        ( my $name = $shard ) =~ s{[:/]}{_}g;
+        push @files, "$dir/$name.frozen";
+        $tree->freeze_tree( $files[-1] );
+    }
+
+    my $expected = tree_output(
+        make_tree_from_pairs(
+            'network',
+            [ map { @{ $shard_pairs{$_} } } sort keys %shard_pairs ],
+            \%tree_args,
+        )
+    );
+
+    my $stitched = MaxMind::DB::Writer::Tree->new_from_frozen_shards(
+        filenames             => \@files,
+        map_key_type_callback => sub {'utf8_string'},
+    );
+    is( $stitched->shard(), undef, 'stitched tree is not a shard' );
+    is_deeply(
+        $stitched->lookup_ip_address('::ffff:1.4.0.1'),
+        { value => 'value 4' },
+        'lookup through an alias in the stitched tree'
+    );
+    is(
+        tree_output($stitched),
+        $expected,
+        'stitched tree matches a tree built with all of the networks'
+    );
+
+    is(
+        tree_output(
+            MaxMind::DB::Writer::Tree->new_from_frozen_shards(
+                filenames             => [ reverse @files ],
+                map_key_type_callback => sub {'utf8_string'},
+            )
+        ),
+        $expected,
+        'shards can be stitched in any order'
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs(
+        'network', [],
+        { %tree_args, shard => '2000::/4' }
+    );
+
+    like(
+        exception { $tree->insert_network( '1.1.1.0/24', { value => 1 } ) },
+        qr{1\.1\.1\.0/24 is not in this tree's shard},
+        'cannot insert a network outside of the shard'
+    );
+    like(
+        exception { $tree->insert_network( '2000::/3', { value => 1 } ) },
+        qr{2000::/3 is not in this tree's shard},
+        'cannot insert a network containing the shard'
+    );
+    like(
+        exception {
+            $tree->insert_range( '2fff::', '3000::1', { value => 1 } )
+        },
+        qr{The range 2fff:: - 3000::1 is not in this tree's shard},
+        'cannot insert a range that is partly outside of the shard'
+    );
+    is(
+        exception { $tree->insert_network( '2000::/4', { value => 1 } ) },
+        undef,
+        'can insert the whole shard'
+    );
+}
+
+{
+    my @pairs = map { [ "$_.1.0.0/16" => { value => $_ % 3 } ] } 1 .. 9;
+
+    my @files;
+    for my $first ( 1 .. 9 ) {
+        push @files, "$dir/ipv4-$first.frozen";
+        make_tree_from_pairs(
+            'network',
+            [ $pairs[ $first - 1 ] ],
+            {
+                map_key_type_callback => sub {'utf8_string'},
+                shard                 => "$first.0.0.0/8",
+            },
+        )->freeze_tree( $files[-1], { format => 2 } );
+    }
+
+    is(
+        tree_output(
+            MaxMind::DB::Writer::Tree->new_from_frozen_shards(
+                filenames             => \@files,
+                map_key_type_callback => sub {'utf8_string'},
+            )
+        ),
+        tree_output(
+            make_tree_from_pairs(
+                'network', \@pairs,
+                { map_key_type_callback => sub {'utf8_string'} }
+            )
+        ),
+        'stitched IPv4 tree matches a tree built with all of the networks'
+    );
+}
+
+{
+    for my $test (
+        [ 'overlap-1',   '2000::/4', '2a02:1::/32', 'a' ],
+        [ 'overlap-2',   '2a00::/8', '2a02::/16',   'b' ],
+        [ 'not-a-shard', undef,      '2a02:1::/32', 'a' ],
+        ) {
+        my ( $name, $shard, $network, $value ) = @{$test};
+
+        make_tree_from_pairs(
+            'network',
+            [ [ $network => { value => $value } ] ],
+            { %tree_args, ( $shard ? ( shard => $shard ) : () ) },
+        )->freeze_tree("$dir/$name.frozen");
+    }
+
+    like(
+        exception {
+            MaxMind::DB::Writer::Tree->new_from_frozen_shards(
+                filenames => [ map {"$dir/overlap-$_.frozen"} 1, 2 ],
+                map_key_type_callback => sub {'utf8_string'},
+            );
+        },
+        qr/The shard has networks that overlap networks already in the tree/,
+        'shards cannot overlap'
+    );
+
+    like(
+        exception {
+            MaxMind::DB::Writer::Tree->new_from_frozen_shards(
+                filenames             => ["$dir/not-a-shard.frozen"],
+                map_key_type_callback => sub {'utf8_string'},
+            );
+        },
+        qr/not-a-shard\.frozen is not a frozen shard/,
+        'only shards can be stitched'
+    );
+}
+
+done_testing();
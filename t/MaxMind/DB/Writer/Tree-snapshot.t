@@ -0,0 +1,185 @@
+use strict;
+use warnings;
+use autodie;
+
+use lib 't/lib';
+
+use File::Temp qw( tempdir );
+use MaxMind::DB::Writer::Tree;
+use Test::MaxMind::DB::Writer qw( make_tree_from_pairs tree_output );
+use Test::More;
+
+my %tree_args = (
+    ip_version            => 6,
+    alias_ipv6_to_ipv4    => 1,
+    merge_strategy        => 'recurse',
+    map_key_type_callback => sub {'utf8_string'},
+);
+
+{
+    my $tree = _inserted_tree( 1 .. 20 );
+
+    my $snapshot = $tree->snapshot();
+    isa_ok( $snapshot, 'MaxMind::DB::Writer::Tree', 'snapshot' );
+
+    _change($tree);
+
+    is_deeply(
+        $snapshot->lookup_ip_address('::ffff:2.4.0.1'),
+        { value => 'value 4' },
+        'lookup through an alias in the snapshot after changing the tree'
+    );
+    is(
+        $tree->lookup_ip_address('::ffff:2.4.0.1'),
+        undef,
+        'lookup through an alias in the changed tree'
+    );
+    is_deeply(
+        $tree->lookup_ip_address('::ffff:2.5.0.1'),
+        { value => 'value 0', other => 'merged' },
+        'lookup through an alias sees data merged into the changed tree'
+    );
+
+    is(
+        tree_output($snapshot),
+        tree_output( _inserted_tree( 1 .. 20 ) ),
+        'changing the tree does not change the snapshot'
+    );
+    is(
+        tree_output($tree),
+        tree_output( _changed_tree() ),
+        'tree has its changes after they are made'
+    );
+}
+
+{
+    my $tree = _inserted_tree( 1 .. 20 );
+
+    my $snapshot = $tree->snapshot();
+    my $second   = $tree->snapshot();
+
+    _change($snapshot);
+    _insert( $tree, 31 .. 35 );
+    undef $tree;
+
+    is(
+        tree_output($snapshot),
+        tree_output( _changed_tree() ),
+        'snapshot can be changed after the tree it was taken from is freed'
+    );
+    is(
+        tree_output($second),
+        tree_output( _inserted_tree( 1 .. 20 ) ),
+        'changing one snapshot does not change another'
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs(
+        'network',
+        [ [ '1.1.1.0/24', { value => 'foo' } ] ],
+        { map_key_type_callback => sub {'utf8_string'} },
+    );
+
+    my $snapshot = $tree->snapshot();
+    $tree->insert_network( '1.1.1.0/25', { value => 'bar' } );
+
+    is_deeply(
+        $snapshot->lookup_ip_address('1.1.1.1'),
+        { value => 'foo' },
+        'snapshot of an IPv4 tree keeps the old data'
+    );
+    is_deeply(
+        $tree->lookup_ip_address('1.1.1.1'),
+        { value => 'bar' },
+        'IPv4 tree has the new data'
+    );
+}
+
+# A snapshot shares its data table with the tree it was taken from, and the
+# nodes that the tree copies on a change bump the reference counts of their
+# data. Freezing either of them has to use only the data it has itself.
+for my $format ( 2, 3 ) {
+    my $dir = tempdir( CLEANUP => 1 );
+
+    my $tree = _inserted_tree( 1 .. 20 );
+    my $snapshot = $tree->snapshot();
+    $tree->insert_network( '2.1.128.0/17', { value => 'only in the tree' } );
+
+    $snapshot->freeze_tree( "$dir/snapshot", { format => $format } );
+    $tree->freeze_tree( "$dir/tree", { format => $format } );
+
+    my $frozen = do {
+        local $/ = undef;
+        open my $fh, '<:raw', "$dir/snapshot";
+        <$fh>;
+    };
+    unlike(
+        $frozen,
+        qr/only in the tree/,
+        "a frozen snapshot does not have data only the tree uses - format $format"
+    );
+
+    is(
+        tree_output( _thaw("$dir/snapshot") ),
+        tree_output( _inserted_tree( 1 .. 20 ) ),
+        "a snapshot thaws to the tree it was taken from - format $format"
+    );
+
+    my $expected = _inserted_tree( 1 .. 20 );
+    $expected->insert_network(
+        '2.1.128.0/17',
+        { value => 'only in the tree' }
+    );
+    is(
+        tree_output( _thaw("$dir/tree") ),
+        tree_output($expected),
+        "a tree with a snapshot thaws to the same tree - format $format"
+    );
+}
+
+done_testing();
+
+sub _thaw {
+    my $filename = shift;
+
+    return MaxMind::DB::Writer::Tree->new_from_frozen_tree(
+        filename              => $filename,
+        map_key_type_callback => sub {'utf8_string'},
+        merge_strategy        => 'recurse',
+    );
+}
+
+sub _inserted_tree {
+    my $tree = make_tree_from_pairs( 'network', [], \%tree_args );
+    _insert( $tree, @_ );
+    return $tree;
+}
+
+sub _changed_tree {
+    my $tree = _inserted_tree( 1 .. 20 );
+    _change($tree);
+    return $tree;
+}
+
+sub _change {
+    my $tree = shift;
+
+    _insert( $tree, 21 .. 30 );
+    $tree->remove_network('2.4.0.0/16');
+    $tree->remove_network('2a02:7::/32');
+    $tree->insert_network( '2.5.0.0/16', { other => 'merged' } );
+
+    return;
+}
+
+sub _insert {
+    my $tree = shift;
+
+    for my $i (@_) {
+        $tree->insert_network( "2.$i.0.0/16", { value => 'value ' . $i % 5 } );
+        $tree->insert_network( "2a02:$i\::/32", { value => "ipv6 $i" } );
+    }
+
+    return;
+}
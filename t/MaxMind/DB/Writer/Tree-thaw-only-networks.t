@@ -0,0 +1,120 @@
+use strict;
+use warnings;
+use autodie;
+
+use lib 't/lib';
+
+use File::Temp qw( tempdir );
+use MaxMind::DB::Writer::Tree;
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( make_tree_from_pairs tree_output );
+use Test::More;
+
+my $dir = tempdir( CLEANUP => 1 );
+
+for my $ip_version ( 4, 6 ) {
+    subtest(
+        "IPv$ip_version tree",
+        sub {
+            # There are enough networks here that the frozen network index has
+            # several blocks.
+            my @pairs;
+            for my $first ( 1 .. 30 ) {
+                for my $second ( 0 .. 99 ) {
+                    push @pairs,
+                        [
+                        "$first.$second.0.0/16" =>
+                            { value => "value $first - " . ( $second % 7 ) }
+                        ];
+                }
+            }
+            push @pairs, [ '50.0.0.0/8'  => { value => 'big' } ];
+            push @pairs, [ '60.1.2.0/24' => { value => 'small' } ];
+
+            my %tree_args = (
+                ip_version            => $ip_version,
+                alias_ipv6_to_ipv4    => $ip_version == 6,
+                map_key_type_callback => sub {'utf8_string'},
+            );
+
+            my $tree
+                = make_tree_from_pairs( 'network', \@pairs, \%tree_args );
+            my $file = "$dir/ipv$ip_version.frozen";
+            $tree->freeze_tree( $file, { format => 2 } );
+
+            my $thawed = MaxMind::DB::Writer::Tree->new_from_frozen_tree(
+                filename              => $file,
+                map_key_type_callback => $tree->map_key_type_callback(),
+                only_networks         => [
+                    '3.0.0.0/8', '3.5.0.0/16', '17.50.0.0/15',
+                    '50.1.0.0/16', '60.0.0.0/8', '70.0.0.0/8',
+                ],
+            );
+
+            my $expected = make_tree_from_pairs(
+                'network',
+                [
+                    ( grep { $_->[0] =~ /^(?:3|17\.5[01]|60)\./ } @pairs ),
+                    [ '50.1.0.0/16' => { value => 'big' } ],
+                ],
+                \%tree_args,
+            );
+
+            is(
+                tree_output($thawed),
+                tree_output($expected),
+                'partially thawed tree has only the requested networks'
+            );
+
+            is_deeply(
+                $thawed->lookup_ip_address('50.1.2.3'),
+                { value => 'big' },
+                'a network containing a requested network is trimmed to it'
+            );
+
+            is(
+                $thawed->lookup_ip_address('50.2.0.1'),
+                undef,
+                'the rest of a trimmed network is not thawed'
+            );
+
+            my $all = MaxMind::DB::Writer::Tree->new_from_frozen_tree(
+                filename              => $file,
+                map_key_type_callback => $tree->map_key_type_callback(),
+                only_networks => [ $ip_version == 6 ? '::/0' : '0.0.0.0/0' ],
+            );
+
+            is(
+                tree_output($all),
+                tree_output(
+                    make_tree_from_pairs( 'network', \@pairs, \%tree_args )
+                ),
+                'thawing only /0 thaws the whole tree'
+            );
+        }
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs(
+        'network',
+        [ [ '1.1.1.0/24' => { value => 'foo' } ] ],
+        { map_key_type_callback => sub {'utf8_string'} },
+    );
+    my $file = "$dir/format-3.frozen";
+    $tree->freeze_tree( $file, { format => 3 } );
+
+    like(
+        exception {
+            MaxMind::DB::Writer::Tree->new_from_frozen_tree(
+                filename              => $file,
+                map_key_type_callback => $tree->map_key_type_callback(),
+                only_networks         => ['1.0.0.0/8'],
+            );
+        },
+        qr/only_networks can only be used with a tree frozen with format 2/,
+        'only_networks requires format 2'
+    );
+}
+
+done_testing();
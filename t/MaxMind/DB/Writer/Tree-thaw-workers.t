@@ -0,0 +1,131 @@
+use strict;
+use warnings;
+use autodie;
+
+use lib 't/lib';
+
+use File::Temp qw( tempdir );
+use MaxMind::DB::Writer::Tree;
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( make_tree_from_pairs tree_output );
+use Test::More;
+
+my $dir = tempdir( CLEANUP => 1 );
+
+my @ipv4_pairs;
+for my $first ( 1 .. 40 ) {
+    for my $second ( 0 .. 49 ) {
+        push @ipv4_pairs,
+            [
+            "$first.$second.0.0/16" =>
+                { value => "value $first - " . ( $second % 7 ) }
+            ];
+    }
+}
+push @ipv4_pairs,
+    [ '50.0.0.0/8'  => { value => 'big' } ],
+    [ '64.0.0.0/3'  => { value => 'bigger' } ],
+    [ '99.1.2.0/24' => { value => 'small' } ],
+    [ '99.1.3.7/32' => { value => 'value 1 - 1' } ];
+
+my @ipv6_pairs = (
+    @ipv4_pairs,
+    [ '2600::/12'      => { value => 'ipv6 big' } ],
+    [ '2a02:1::/32'    => { value => 'ipv6 small' } ],
+    [ '2a02:2::/32'    => { value => 'value 2 - 2' } ],
+    [ 'fe00::/7'       => { value => 'reserved' } ],
+    [ '4000::/2'       => { value => 'ipv6 bigger' } ],
+    [ '2001:db9::/32'  => { value => 'ipv6 small' } ],
+    [ 'abcd:1234::/64' => { value => 'ipv6 small' } ],
+);
+
+my @cases = (
+    [ 'IPv4 tree', { remove_reserved_networks => 1 }, \@ipv4_pairs ],
+    [
+        'IPv4 tree without reserved networks',
+        { remove_reserved_networks => 0 }, \@ipv4_pairs
+    ],
+    [
+        'IPv6 tree with aliases',
+        { ip_version => 6, alias_ipv6_to_ipv4 => 1 }, \@ipv6_pairs
+    ],
+    [
+        'IPv6 tree',
+        { ip_version => 6, alias_ipv6_to_ipv4 => 0 }, \@ipv6_pairs
+    ],
+);
+
+for my $case (@cases) {
+    my ( $name, $args, $pairs ) = @{$case};
+
+    my %tree_args
+        = ( map_key_type_callback => sub {'utf8_string'}, %{$args} );
+
+    subtest(
+        $name,
+        sub {
+            my $file = "$dir/tree.frozen";
+            make_tree_from_pairs( 'network', $pairs, \%tree_args )
+                ->freeze_tree( $file, { format => 2 } );
+
+            my $expected = tree_output(
+                make_tree_from_pairs( 'network', $pairs, \%tree_args ) );
+
+            for my $workers ( 1, 2, 3, 8 ) {
+                my $thawed = MaxMind::DB::Writer::Tree->new_from_frozen_tree(
+                    filename              => $file,
+                    map_key_type_callback => sub {'utf8_string'},
+                    thaw_workers          => $workers,
+                );
+
+                is(
+                    tree_output($thawed),
+                    $expected,
+                    "tree thawed with $workers workers matches the original"
+                );
+
+                is_deeply(
+                    $thawed->lookup_ip_address('50.1.2.3'),
+                    { value => 'big' },
+                    "lookup in tree thawed with $workers workers"
+                );
+            }
+        }
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs(
+        'network',
+        [ [ '1.1.1.0/24' => { value => 'foo' } ] ],
+        { map_key_type_callback => sub {'utf8_string'} },
+    );
+    my $file = "$dir/format-3.frozen";
+    $tree->freeze_tree( $file, { format => 3 } );
+
+    like(
+        exception {
+            MaxMind::DB::Writer::Tree->new_from_frozen_tree(
+                filename              => $file,
+                map_key_type_callback => sub {'utf8_string'},
+                thaw_workers          => 2,
+            );
+        },
+        qr/thaw_workers can only be used with a tree frozen with format 2/,
+        'thaw_workers requires format 2'
+    );
+
+    like(
+        exception {
+            MaxMind::DB::Writer::Tree->new_from_frozen_tree(
+                filename              => $file,
+                map_key_type_callback => sub {'utf8_string'},
+                thaw_workers          => 0,
+            );
+        },
+        qr/thaw_workers must be a positive integer/,
+        'thaw_workers must be positive'
+    );
+}
+
+done_testing();
@@ -0,0 +1,90 @@
+use strict;
+use warnings;
+use autodie;
+
+use lib 't/lib';
+
+use File::Temp qw( tempdir );
+use MaxMind::DB::Writer::Tree;
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( make_tree_from_pairs tree_output );
+use Test::More;
+
+my $dir = tempdir( CLEANUP => 1 );
+
+my %tree_args = ( map_key_type_callback => sub {'utf8_string'} );
+
+{
+    my $tree
+        = make_tree_from_pairs( 'network', _pairs( 1 .. 50 ), \%tree_args );
+    $tree->_set_build_epoch(1);
+
+    my $write = $tree->write_tree_async("$dir/async.mmdb");
+    isa_ok( $write, 'MaxMind::DB::Writer::Tree::AsyncWrite', 'handle' );
+    like(
+        $write->status(), qr/^(?:running|succeeded)$/,
+        'status right after the write starts'
+    );
+
+    $tree->insert_network( @{$_} ) for @{ _pairs( 51 .. 60 ) };
+    $tree->remove_network('1.2.0.0/16');
+
+    ok( $write->wait(), 'wait returns true' );
+    is( $write->status(), 'succeeded', 'status after waiting' );
+    is( $write->error(),  undef,       'no error' );
+    ok(
+        $write->finished_at() >= $write->started_at(),
+        'finished_at is not before started_at'
+    );
+    ok( $write->elapsed() >= 0, 'elapsed is not negative' );
+
+    is(
+        _slurp("$dir/async.mmdb"),
+        tree_output(
+            make_tree_from_pairs( 'network', _pairs( 1 .. 50 ), \%tree_args )
+        ),
+        'database written in the background has the tree as it was when'
+            . ' the write started'
+    );
+    ok( !-e "$dir/async.mmdb.tmp-" . $write->pid(), 'temporary file is gone' );
+
+    is_deeply(
+        $tree->lookup_ip_address('1.60.0.1'),
+        { value => 'value 60' },
+        'tree can still be changed and used in the parent'
+    );
+    is(
+        $tree->lookup_ip_address('1.2.0.1'),
+        undef,
+        'removal in the parent is visible in the parent'
+    );
+}
+
+{
+    my $tree  = make_tree_from_pairs( 'network', _pairs(1), \%tree_args );
+    my $write = $tree->write_tree_async("$dir/does/not/exist.mmdb");
+
+    like(
+        exception { $write->wait() },
+        qr/Writing the tree to \Q$dir\E.+ failed: .*does\/not\/exist/,
+        'wait dies with the error from the child'
+    );
+    is( $write->status(), 'failed', 'status of a failed write' );
+    like( $write->error(), qr/does\/not\/exist/, 'error of a failed write' );
+}
+
+done_testing();
+
+sub _pairs {
+    return [ map { [ "1.$_.0.0/16", { value => "value $_" } ] } @_ ];
+}
+
+sub _slurp {
+    my $file = shift;
+
+    open my $fh, '<:raw', $file;
+    my $content = do { local $/ = undef; <$fh> };
+    close $fh;
+
+    return $content;
+}
@@ -0,0 +1,93 @@
+use strict;
+use warnings;
+use autodie;
+
+use lib 't/lib';
+
+use MaxMind::DB::Writer::Tree;
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( make_tree_from_pairs tree_output );
+use Test::More;
+
+my @ipv4 = map { [ "1.$_.0.0/16", { value => "ipv4 $_" } ] } 0 .. 9;
+my @ipv6 = map { [ "2a02:$_\::/32", { value => "ipv6 $_" } ] } 1 .. 9;
+
+my %tree_args = ( map_key_type_callback => sub {'utf8_string'} );
+
+for my $remove_reserved_networks ( 0, 1 ) {
+    my %ipv4_args = (
+        %tree_args,
+        remove_reserved_networks => $remove_reserved_networks,
+    );
+    my %ipv6_args = (
+        %ipv4_args,
+        ip_version         => 6,
+        alias_ipv6_to_ipv4 => 1,
+    );
+
+    my $tree
+        = make_tree_from_pairs( 'network', [ @ipv4, @ipv6 ], \%ipv6_args );
+    my $expected = make_tree_from_pairs( 'network', \@ipv4, \%ipv4_args );
+
+    is(
+        tree_output( $tree, { ip_version => 4 } ),
+        tree_output($expected),
+        'the IPv4 subtree is written as an IPv4 database'
+            . " - remove_reserved_networks = $remove_reserved_networks"
+    );
+
+    is(
+        tree_output( $tree, { ip_version => 4, only_keys => ['value'] } ),
+        tree_output( $expected, { only_keys => ['value'] } ),
+        'an IPv4 database can be written with a projection'
+            . " - remove_reserved_networks = $remove_reserved_networks"
+    );
+
+    is(
+        tree_output( $tree, { ip_version => 4, data_section_workers => 2 } ),
+        tree_output( $expected, { data_section_workers => 2 } ),
+        'an IPv4 database can be written with data_section_workers'
+            . " - remove_reserved_networks = $remove_reserved_networks"
+    );
+
+    is(
+        tree_output($tree),
+        tree_output(
+            make_tree_from_pairs( 'network', [ @ipv4, @ipv6 ], \%ipv6_args )
+        ),
+        'the tree is not changed'
+            . " - remove_reserved_networks = $remove_reserved_networks"
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs( 'network', \@ipv4, \%tree_args );
+    is(
+        tree_output( $tree, { ip_version => 4 } ),
+        tree_output( make_tree_from_pairs( 'network', \@ipv4, \%tree_args ) ),
+        'ip_version => 4 for an IPv4 tree writes the whole tree'
+    );
+    like(
+        exception { tree_output( $tree, { ip_version => 6 } ) },
+        qr/You cannot write an IPv6 database from an IPv4 tree/,
+        'an IPv4 tree cannot be written as an IPv6 database'
+    );
+    like(
+        exception { tree_output( $tree, { ip_version => 5 } ) },
+        qr/ip_version must be 4 or 6/,
+        'unknown ip_version'
+    );
+
+    my $ipv6_only = make_tree_from_pairs(
+        'network',
+        \@ipv6,
+        { %tree_args, remove_reserved_networks => 0 },
+    );
+    like(
+        exception { tree_output( $ipv6_only, { ip_version => 4 } ) },
+        qr/Cannot write an IPv4 database from a tree without nodes/,
+        'a tree without IPv4 networks cannot be written as an IPv4 database'
+    );
+}
+
+done_testing();
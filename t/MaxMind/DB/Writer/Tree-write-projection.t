@@ -0,0 +1,171 @@
+use strict;
+use warnings;
+use autodie;
+
+use lib 't/lib';
+
+use MaxMind::DB::Writer::Tree;
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( make_tree_from_pairs tree_output );
+use Test::More;
+
+my @cities = map { { city => "city $_", country => "country " . $_ % 2 } }
+    0 .. 3;
+my @city_pairs = map { [ "1.$_.0.0/16", $cities[$_] ] } 0 .. 3;
+
+my %tree_args = ( map_key_type_callback => sub {'utf8_string'} );
+
+{
+    my $tree = make_tree_from_pairs( 'network', \@city_pairs, \%tree_args );
+
+    my %calls;
+    my $output = tree_output(
+        $tree,
+        {
+            transform => sub {
+                my $data = shift;
+                my $key  = shift;
+                $calls{$key}++;
+                return { country => $data->{country} };
+            },
+        }
+    );
+
+    is_deeply(
+        [ values %calls ], [ 1, 1, 1, 1 ],
+        'the transform is called once per data key'
+    );
+
+    my $expected = make_tree_from_pairs(
+        'network',
+        [
+            map { [ "1.$_.0.0/16", { country => 'country ' . $_ % 2 } ] }
+                0 .. 3
+        ],
+        \%tree_args,
+    );
+    is(
+        $output, tree_output($expected),
+        'the output is the same as for a tree built with the transformed data'
+    );
+
+    is(
+        tree_output( $tree, { only_keys => ['country'] } ),
+        $output,
+        'only_keys keeps the given keys'
+    );
+
+    my $merged = tree_output(
+        $tree,
+        { transform => sub { { continent => 'same' } } }
+    );
+    is(
+        $merged,
+        tree_output(
+            make_tree_from_pairs(
+                'network',
+                [ [ '1.0.0.0/14', { continent => 'same' } ] ],
+                \%tree_args,
+            )
+        ),
+        'networks whose data becomes identical are merged'
+    );
+    cmp_ok(
+        length $merged, '<', length $output,
+        'merging networks makes the database smaller'
+    );
+
+    is(
+        tree_output(
+            $tree,
+            {
+                transform =>
+                    sub { $_[0]{country} eq 'country 0' ? undef : $_[0] },
+            }
+        ),
+        tree_output(
+            make_tree_from_pairs(
+                'network', [ @city_pairs[ 1, 3 ] ],
+                \%tree_args
+            )
+        ),
+        'networks are not written when the transform returns undef'
+    );
+
+    is(
+        tree_output($tree),
+        tree_output(
+            make_tree_from_pairs( 'network', \@city_pairs, \%tree_args )
+        ),
+        'the tree is not changed'
+    );
+}
+
+{
+    my %ipv6_args = ( %tree_args, ip_version => 6, alias_ipv6_to_ipv4 => 1 );
+
+    my $tree = make_tree_from_pairs(
+        'network',
+        [
+            [ '1.0.0.0/16',  $cities[0] ],
+            [ '2a02:2::/32', $cities[1] ],
+            [ '2a02:3::/32', $cities[3] ],
+        ],
+        \%ipv6_args,
+    );
+
+    my $expected = make_tree_from_pairs(
+        'network',
+        [
+            [ '1.0.0.0/16',  { country => 'country 0' } ],
+            [ '2a02:2::/31', { country => 'country 1' } ],
+        ],
+        \%ipv6_args,
+    );
+    is(
+        tree_output( $tree, { only_keys => ['country'] } ),
+        tree_output($expected),
+        'IPv6 tree with aliases'
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs(
+        'network',
+        [ [ '1.0.0.0/16', $cities[0] ] ],
+        \%tree_args,
+    );
+
+    like(
+        exception {
+            tree_output(
+                $tree,
+                { transform => sub {1}, only_keys => ['city'] }
+            );
+        },
+        qr/You cannot pass both transform and only_keys/,
+        'transform and only_keys cannot be used together'
+    );
+    like(
+        exception { tree_output( $tree, { only_keys => 'city' } ) },
+        qr/only_keys must be an array reference/,
+        'only_keys must be an array reference'
+    );
+    like(
+        exception { tree_output( $tree, { transform => 'city' } ) },
+        qr/transform must be a callback/,
+        'transform must be a callback'
+    );
+    like(
+        exception {
+            tree_output(
+                $tree,
+                { only_keys => ['city'], data_section_workers => 2 }
+            )
+        },
+        qr/data_section_workers cannot be used with transform or only_keys/,
+        'data_section_workers cannot be used with a projection'
+    );
+}
+
+done_testing();
@@ -0,0 +1,170 @@
+use strict;
+use warnings;
+use autodie;
+
+use lib 't/lib';
+
+use MaxMind::DB::Writer::Tree;
+use Socket qw( AF_INET6 inet_pton );
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( make_tree_from_pairs tree_output );
+use Test::More;
+
+my @networks = (
+    ( map { [ "1.$_.0.0/16", { value => 'ipv4 ' . $_ % 3 } ] } 0 .. 9 ),
+    ( map { [ "2a02:$_\::/32", { value => "ipv6 $_" } ] } 1 .. 9 ),
+);
+
+# write_trees() output is compared with the output of write_tree(), so the
+# build epoch has to be the same.
+my %tree_args = (
+    ip_version            => 6,
+    alias_ipv6_to_ipv4    => 1,
+    map_key_type_callback => sub {'utf8_string'},
+    _build_epoch          => 1,
+);
+
+{
+    my $tree = make_tree_from_pairs( 'network', \@networks, \%tree_args );
+
+    my %buffers;
+    $tree->write_trees(
+        [
+            map { { fh => _fh( \$buffers{$_} ), record_size => $_ } }
+                24, 28, 32
+        ]
+    );
+
+    for my $record_size ( 24, 28, 32 ) {
+        is(
+            $buffers{$record_size},
+            tree_output(
+                make_tree_from_pairs(
+                    'network',
+                    \@networks,
+                    { %tree_args, record_size => $record_size },
+                )
+            ),
+            "output with $record_size bit records is the same as write_tree()"
+        );
+    }
+
+    my $buffer;
+    make_tree_from_pairs( 'network', \@networks, \%tree_args )
+        ->write_trees( [ { fh => _fh( \$buffer ) } ] );
+    is(
+        $buffer,
+        tree_output(
+            make_tree_from_pairs( 'network', \@networks, \%tree_args )
+        ),
+        'the record size defaults to the tree record size'
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs( 'network', \@networks, \%tree_args );
+
+    my %buffers;
+    $tree->write_trees(
+        [
+            map { { fh => _fh( \$buffers{$_} ), record_size => $_ } } 24, 32
+        ],
+        { data_section_workers => 2 },
+    );
+
+    is(
+        $buffers{32},
+        tree_output(
+            make_tree_from_pairs(
+                'network',
+                \@networks,
+                { %tree_args, record_size => 32 },
+            ),
+            { data_section_workers => 2 }
+        ),
+        'data_section_workers'
+    );
+}
+
+{
+    my $tree = make_tree_from_pairs( 'network', \@networks, \%tree_args );
+
+    my ( $with_aliases, $without_aliases );
+    $tree->write_trees(
+        [
+            { fh => _fh( \$with_aliases ) },
+            { fh => _fh( \$without_aliases ), alias_ipv6_to_ipv4 => 0 },
+        ]
+    );
+
+    my $node_count = $tree->node_count();
+    for my $address ( '::1.1.0.1', '::ffff:1.1.0.1', '2002:101:1::' ) {
+        cmp_ok(
+            _record_value( $with_aliases, $node_count, $address ),
+            '>', $node_count,
+            "$address has data with aliases"
+        );
+    }
+    cmp_ok(
+        _record_value( $without_aliases, $node_count, '::1.1.0.1' ),
+        '>', $node_count,
+        '::1.1.0.1 has data without aliases'
+    );
+    for my $address ( '::ffff:1.1.0.1', '2002:101:1::' ) {
+        is(
+            _record_value( $without_aliases, $node_count, $address ),
+            $node_count,
+            "$address has no data without aliases"
+        );
+    }
+}
+
+{
+    my $tree = make_tree_from_pairs( 'network', \@networks, \%tree_args );
+
+    like(
+        exception { $tree->write_trees( [] ) },
+        qr/write_trees\(\) requires an array reference of outputs/,
+        'at least one output is required'
+    );
+    like(
+        exception { $tree->write_trees( [ { record_size => 24 } ] ) },
+        qr/Each output passed to write_trees\(\) must be a hash reference/,
+        'each output needs a filehandle'
+    );
+    like(
+        exception {
+            my $buffer;
+            $tree->write_trees(
+                [ { fh => _fh( \$buffer ), record_size => 16 } ] );
+        },
+        qr/Only record sizes of 24, 28, and 32 are supported/,
+        'unsupported record size'
+    );
+}
+
+done_testing();
+
+sub _fh {
+    my $buffer = shift;
+
+    open my $fh, '>:raw', $buffer;
+    return $fh;
+}
+
+# Follows the bits of an address through a search tree with 24 bit records,
+# and returns the value of the record that ends the lookup.
+sub _record_value {
+    my $buffer     = shift;
+    my $node_count = shift;
+    my $address    = shift;
+
+    my $node = 0;
+    for my $bit ( split //, unpack 'B128', inet_pton( AF_INET6, $address ) ) {
+        my $record = substr $buffer, $node * 6 + ( $bit ? 3 : 0 ), 3;
+        $node = unpack 'N', "\0$record";
+        return $node if $node >= $node_count;
+    }
+
+    return $node;
+}
@@ -23,6 +23,7 @@ our @EXPORT_OK = qw(
     test_freeze_thaw
     test_freeze_thaw_optional_params
     test_tree
+    tree_output
 );
 
 sub test_tree {
@@ -62,8 +63,12 @@ sub make_tree_from_pairs {
     my $pairs = shift;
     my $args  = shift;
 
+    # The IP version can be passed in $args when there are no pairs to guess
+    # it from, or when IPv4 networks are inserted into an IPv6 tree.
+    my $ip_version = @{$pairs} && $pairs->[0][0] =~ /::/ ? 6 : 4;
+
     my $tree = MaxMind::DB::Writer::Tree->new(
-        ip_version            => ( $pairs->[0][0] =~ /::/ ? 6 : 4 ),
+        ip_version            => $ip_version,
         record_size           => 24,
         database_type         => 'Test',
         languages             => ['en'],
@@ -81,6 +86,22 @@ sub make_tree_from_pairs {
     return $tree;
 }
 
+# Returns the database written from the tree. The build epoch is fixed so that
+# the output of two trees can be compared.
+sub tree_output {
+    my $tree = shift;
+    my $args = shift;
+
+    $tree->_set_build_epoch(1);
+
+    my $buffer;
+    open my $fh, '>:raw', \$buffer or die $!;
+    $tree->write_tree( $fh, $args );
+    close $fh or die $!;
+
+    return $buffer;
+}
+
 sub insert_for_type {
     my $tree        = shift;
     my $type        = shift;
@@ -208,11 +229,12 @@ sub test_iterator_sanity {
 }
 
 sub test_freeze_thaw {
-    my $tree1 = shift;
+    my $tree1       = shift;
+    my $freeze_args = shift;
 
     my $dir  = tempdir( CLEANUP => 1 );
     my $file = "$dir/frozen-tree";
-    $tree1->freeze_tree($file);
+    $tree1->freeze_tree( $file, $freeze_args );
 
     my $tree2 = MaxMind::DB::Writer::Tree->new_from_frozen_tree(
         filename              => $file,
@@ -260,11 +282,12 @@ sub test_freeze_thaw {
 }
 
 sub test_freeze_thaw_optional_params {
-    my $tree1 = shift;
+    my $tree1       = shift;
+    my $freeze_args = shift;
 
     my $dir  = tempdir( CLEANUP => 1 );
     my $file = "$dir/frozen-tree-params";
-    $tree1->freeze_tree($file);
+    $tree1->freeze_tree( $file, $freeze_args );
 
     my $description    = { en => 'A tree in the forest' };
     my $type           = 'TreeDB';